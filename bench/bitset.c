@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitset.h"
+
+/*
+ * Compares the bitset functions with the bit at a time loops they
+ * replaced, on fields the size of a small, a large and a huge torrent.
+ */
+
+static volatile unsigned long m_sink;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+fill(uint8_t *bits, unsigned long nbits, int percent)
+{
+    clear_bits(bits, 0, nbits);
+    for (unsigned long i = 0; i < nbits; i++)
+        if (rand() % 100 < percent)
+            set_bit(bits, i);
+}
+
+static unsigned long
+count_slow(const uint8_t *bits, unsigned long nbits)
+{
+    unsigned long count = 0;
+    for (unsigned long i = 0; i < nbits; i++)
+        if (has_bit(bits, i))
+            count++;
+    return count;
+}
+
+static unsigned long
+foreach_slow(const uint8_t *bits, unsigned long nbits)
+{
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < nbits; i++)
+        if (has_bit(bits, i))
+            sum += i;
+    return sum;
+}
+
+static unsigned long
+foreach_fast(const uint8_t *bits, unsigned long nbits)
+{
+    unsigned long i, sum = 0;
+    BIT_FOREACH(i, bits, nbits)
+        sum += i;
+    return sum;
+}
+
+static unsigned long
+zero_slow(const uint8_t *bits, unsigned long nbits)
+{
+    unsigned long i;
+    for (i = 0; i < nbits; i++)
+        if (!has_bit(bits, i))
+            break;
+    return i;
+}
+
+static void
+clear_slow(uint8_t *bits, unsigned long nbits)
+{
+    for (unsigned long i = 0; i < nbits; i++)
+        clear_bit(bits, i);
+}
+
+static void
+andnot_slow(uint8_t *dst, const uint8_t *src, unsigned long nbits)
+{
+    for (unsigned long i = 0; i < nbits; i++)
+        if (has_bit(src, i))
+            clear_bit(dst, i);
+}
+
+enum op { COUNT, FOREACH, FOREACH_SPARSE, NEXT_ZERO, CLEAR, ANDNOT, NOPS };
+
+static const char *m_names[] = {
+    "count", "foreach 50%", "foreach 1%", "next zero", "clear", "and-not"
+};
+
+static double
+run(enum op op, int fast, uint8_t *a, const uint8_t *b, unsigned long nbits,
+    unsigned long iters)
+{
+    double start = now();
+    for (unsigned long k = 0; k < iters; k++) {
+        switch (op) {
+        case COUNT:
+            m_sink += fast ? count_bits(a, nbits) : count_slow(a, nbits);
+            break;
+        case FOREACH:
+        case FOREACH_SPARSE:
+            m_sink += fast ? foreach_fast(a, nbits) : foreach_slow(a, nbits);
+            break;
+        case NEXT_ZERO:
+            m_sink += fast ? next_zero_bit(a, nbits, 0) : zero_slow(a, nbits);
+            break;
+        case CLEAR:
+            if (fast)
+                clear_bits(a, 0, nbits);
+            else
+                clear_slow(a, nbits);
+            m_sink += a[k % (nbits / 8)];
+            break;
+        case ANDNOT:
+            if (fast)
+                andnot_bits(a, b, 0, nbits);
+            else
+                andnot_slow(a, b, nbits);
+            m_sink += a[k % (nbits / 8)];
+            break;
+        default:
+            abort();
+        }
+    }
+    return (now() - start) / iters;
+}
+
+int
+main(void)
+{
+    unsigned long sizes[] = { 1024, 16384, 262144 };
+
+    printf("%-12s %8s %14s %14s %8s\n",
+        "operation", "bits", "bit (ns/op)", "word (ns/op)", "speedup");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned long nbits = sizes[s];
+        unsigned long iters = (1UL << 26) / nbits;
+        uint8_t *a = malloc(nbits / 8), *b = malloc(nbits / 8);
+        if (a == NULL || b == NULL)
+            abort();
+        for (enum op op = 0; op < NOPS; op++) {
+            double slow, fast;
+            srand(s);
+            switch (op) {
+            case FOREACH_SPARSE:
+                fill(a, nbits, 1);
+                break;
+            case NEXT_ZERO:
+                // A torrent that's nearly done.
+                set_bits(a, 0, nbits);
+                clear_bit(a, nbits - 3);
+                break;
+            default:
+                fill(a, nbits, 50);
+                break;
+            }
+            fill(b, nbits, 50);
+            slow = run(op, 0, a, b, nbits, iters);
+            fast = run(op, 1, a, b, nbits, iters);
+            printf("%-12s %8lu %14.1f %14.1f %7.1fx\n",
+                m_names[op], nbits, slow, fast, slow / fast);
+        }
+        free(a);
+        free(b);
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1.h"
+
+/*
+ * Compares piece hashing with openssl, the SHA extensions and eight lane
+ * AVX2, on 256 KiB and 4 MiB pieces. Each round hashes eight pieces, one
+ * after the other or in lockstep.
+ */
+
+#define NPIECES 8
+#define TOTAL (512UL << 20)
+
+enum impl { OPENSSL, SHANI, AVX2, NIMPLS };
+
+static const char *m_names[] = { "openssl", "sha-ni", "avx2 x8" };
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+hash_pieces(enum impl impl, uint8_t *const pieces[], size_t len,
+    uint8_t *const hash[])
+{
+    struct sha1_mctx m;
+    switch (impl) {
+    case OPENSSL:
+        for (int i = 0; i < NPIECES; i++)
+            SHA1(pieces[i], len, hash[i]);
+        break;
+    case SHANI:
+        for (int i = 0; i < NPIECES; i++)
+            sha1(pieces[i], len, hash[i]);
+        break;
+    case AVX2:
+        sha1_minit(&m, NPIECES);
+        sha1_mupdate(&m, (const uint8_t *const *)pieces, len);
+        sha1_mfinal(&m, hash);
+        break;
+    default:
+        abort();
+    }
+}
+
+int
+main(void)
+{
+    size_t sizes[] = { 256 << 10, 4 << 20 };
+    int impls[] = { SHA1_IMPL_OPENSSL, SHA1_IMPL_SHANI, SHA1_IMPL_AVX2 };
+    uint8_t *pieces[NPIECES], *hash[NPIECES], *ref[NPIECES];
+
+    printf("%-8s %10s %10s\n", "impl", "piece", "MB/s");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        unsigned long rounds = TOTAL / (len * NPIECES);
+        for (int i = 0; i < NPIECES; i++) {
+            if ((pieces[i] = malloc(len)) == NULL
+                || (hash[i] = malloc(SHA_DIGEST_LENGTH)) == NULL
+                || (ref[i] = malloc(SHA_DIGEST_LENGTH)) == NULL)
+                abort();
+            for (size_t j = 0; j < len; j++)
+                pieces[i][j] = rand();
+            SHA1(pieces[i], len, ref[i]);
+        }
+        for (enum impl impl = 0; impl < NIMPLS; impl++) {
+            double start;
+            if (sha1_set_impl(impls[impl]) != 0) {
+                printf("%-8s %7zu KiB %10s\n", m_names[impl], len >> 10,
+                    "n/a");
+                continue;
+            }
+            start = now();
+            for (unsigned long r = 0; r < rounds; r++)
+                hash_pieces(impl, pieces, len, hash);
+            for (int i = 0; i < NPIECES; i++)
+                if (memcmp(hash[i], ref[i], SHA_DIGEST_LENGTH) != 0) {
+                    printf("%s got a bad hash\n", m_names[impl]);
+                    return 1;
+                }
+            printf("%-8s %7zu KiB %10.0f\n", m_names[impl], len >> 10,
+                rounds * len * NPIECES / ((now() - start) / 1e9) / 1e6);
+        }
+        for (int i = 0; i < NPIECES; i++) {
+            free(pieces[i]);
+            free(hash[i]);
+            free(ref[i]);
+        }
+    }
+    return 0;
+}
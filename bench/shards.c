@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Compares the two ways of ticking the torrents each second. Before, the
+ * main thread called each shard in turn and waited while it walked the
+ * whole torrent list for its own torrents. Now every shard walks a list
+ * of its own from its own heartbeat, and the main thread only walks that
+ * of shard 0. A round is timed on the main thread, from the heartbeat
+ * until it can go on with other work, with the other shards started at
+ * the same time as they would be by their own heartbeats.
+ *
+ * The shards are modeled by threads woken through a condition variable,
+ * and ticking a torrent by going over the counters of a few peers.
+ */
+
+#define NPEERS 8
+#define ROUNDS 200
+
+struct torrent {
+    unsigned shard;
+    struct torrent *next;           /* In the list of all */
+    struct torrent *sh_next;        /* In the list of its shard */
+    uint32_t peers[NPEERS];
+};
+
+struct shard {
+    unsigned num;
+    pthread_t td;
+    void (*fun)(struct shard *);
+    int busy;
+    struct torrent *torrents;
+};
+
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_cond = PTHREAD_COND_INITIALIZER;
+static struct torrent *m_torrents;
+static struct shard *m_shards;
+static volatile unsigned long m_sink;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+tick(struct torrent *tp)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < NPEERS; i++)
+        sum += tp->peers[i]++;
+    m_sink += sum;
+}
+
+static void
+walk_all(struct shard *sh)
+{
+    for (struct torrent *tp = m_torrents; tp != NULL; tp = tp->next)
+        if (tp->shard == sh->num)
+            tick(tp);
+}
+
+static void
+walk_own(struct shard *sh)
+{
+    for (struct torrent *tp = sh->torrents; tp != NULL; tp = tp->sh_next)
+        tick(tp);
+}
+
+static void
+post(struct shard *sh, void (*fun)(struct shard *))
+{
+    pthread_mutex_lock(&m_lock);
+    sh->fun = fun;
+    sh->busy = 1;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+}
+
+static void
+wait_done(struct shard *sh)
+{
+    pthread_mutex_lock(&m_lock);
+    while (sh->busy)
+        pthread_cond_wait(&m_cond, &m_lock);
+    pthread_mutex_unlock(&m_lock);
+}
+
+static void *
+shard_td(void *arg)
+{
+    struct shard *sh = arg;
+    void (*fun)(struct shard *);
+    pthread_mutex_lock(&m_lock);
+    for (;;) {
+        while (sh->fun == NULL)
+            pthread_cond_wait(&m_cond, &m_lock);
+        fun = sh->fun;
+        sh->fun = NULL;
+        pthread_mutex_unlock(&m_lock);
+        fun(sh);
+        pthread_mutex_lock(&m_lock);
+        sh->busy = 0;
+        pthread_cond_broadcast(&m_cond);
+    }
+    return NULL;
+}
+
+/* The old way: a shard_call of each shard in turn. */
+static double
+round_call(unsigned nshards)
+{
+    double start = now();
+    walk_all(&m_shards[0]);
+    for (unsigned i = 1; i < nshards; i++) {
+        post(&m_shards[i], walk_all);
+        wait_done(&m_shards[i]);
+    }
+    return now() - start;
+}
+
+/* The new way: each shard on its own. */
+static double
+round_own(unsigned nshards)
+{
+    double start, t;
+    start = now();
+    for (unsigned i = 1; i < nshards; i++)
+        post(&m_shards[i], walk_own);
+    walk_own(&m_shards[0]);
+    t = now() - start;
+    for (unsigned i = 1; i < nshards; i++)
+        wait_done(&m_shards[i]);
+    return t;
+}
+
+static void
+setup(unsigned nshards, unsigned ntorrents)
+{
+    struct torrent *tp;
+    m_torrents = NULL;
+    for (unsigned i = 0; i < nshards; i++)
+        m_shards[i].torrents = NULL;
+    for (unsigned i = 0; i < ntorrents; i++) {
+        if ((tp = calloc(1, sizeof(*tp))) == NULL)
+            abort();
+        tp->shard = i % nshards;
+        tp->next = m_torrents;
+        m_torrents = tp;
+        tp->sh_next = m_shards[tp->shard].torrents;
+        m_shards[tp->shard].torrents = tp;
+    }
+}
+
+static void
+teardown(void)
+{
+    struct torrent *tp;
+    while ((tp = m_torrents) != NULL) {
+        m_torrents = tp->next;
+        free(tp);
+    }
+}
+
+int
+main(void)
+{
+    unsigned shards[] = { 1, 2, 4, 8 };
+    unsigned torrents[] = { 100, 1000, 10000 };
+    unsigned maxshards = shards[sizeof(shards) / sizeof(shards[0]) - 1];
+
+    if ((m_shards = calloc(maxshards, sizeof(*m_shards))) == NULL)
+        abort();
+    for (unsigned i = 0; i < maxshards; i++) {
+        m_shards[i].num = i;
+        if (i > 0 && pthread_create(&m_shards[i].td, NULL, shard_td,
+                &m_shards[i]) != 0)
+            abort();
+    }
+    printf("%-7s %9s %15s %15s %8s\n",
+        "shards", "torrents", "called (us)", "own (us)", "speedup");
+    for (int s = 0; s < sizeof(shards) / sizeof(shards[0]); s++) {
+        for (int t = 0; t < sizeof(torrents) / sizeof(torrents[0]); t++) {
+            double called = 0, own = 0;
+            setup(shards[s], torrents[t]);
+            for (int r = 0; r < ROUNDS; r++) {
+                called += round_call(shards[s]);
+                own += round_own(shards[s]);
+            }
+            printf("%-7u %9u %15.1f %15.1f %7.1fx\n", shards[s], torrents[t],
+                called / ROUNDS / 1000, own / ROUNDS / 1000, called / own);
+            teardown();
+        }
+    }
+    return 0;
+}
@@ -4,6 +4,11 @@
 
 #include "timeheap.h"
 
+/*
+ * The binary heap evloop used for its timers before the timing wheel,
+ * kept for bench/timers.
+ */
+
 struct th_entry {
     struct timespec t;
     struct th_handle *h;
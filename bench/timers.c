@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timeheap.h"
+#include "timewheel.h"
+
+/*
+ * Compares the timing wheel with the binary heap it replaced. Each run
+ * adds n timers due within two minutes, moves random ones to a new time
+ * the way peer timeouts are pushed back on activity, lets ten seconds
+ * pass a millisecond at a time rearming every timer that expires, and
+ * finally removes them all.
+ */
+
+#define SPREAD 120000
+#define RUNTIME 10000
+
+struct timer {
+    struct th_handle th;
+    struct tw_handle tw;
+};
+
+static struct timer *m_timers;
+static uint32_t m_seed;
+
+static uint32_t
+rnd(void)
+{
+    m_seed = m_seed * 1103515245 + 12345;
+    return m_seed >> 8;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct timespec
+ms_ts(uint64_t ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    return ts;
+}
+
+static int
+ts_le(struct timespec a, struct timespec b)
+{
+    if (a.tv_sec == b.tv_sec)
+        return a.tv_nsec <= b.tv_nsec;
+    else
+        return a.tv_sec < b.tv_sec;
+}
+
+enum phase { INSERT, REARM, EXPIRE, REMOVE, NPHASES };
+
+static const char *m_names[] = { "insert", "rearm", "expire", "remove" };
+
+struct result {
+    double ns[NPHASES];
+    unsigned long expired;
+};
+
+static void
+run_heap(unsigned long n, struct result *res)
+{
+    double start;
+    unsigned long i, nrearm = n;
+    uint64_t clock = 0, end;
+    struct timespec t;
+
+    m_seed = n;
+    timeheap_init();
+    start = now();
+    for (i = 0; i < n; i++) {
+        m_timers[i].th.data = &m_timers[i];
+        t = ms_ts(1 + rnd() % SPREAD);
+        timeheap_insert(&m_timers[i].th, &t);
+    }
+    res->ns[INSERT] = (now() - start) / n;
+
+    start = now();
+    for (i = 0; i < nrearm; i++) {
+        t = ms_ts(1 + rnd() % SPREAD);
+        timeheap_change(&m_timers[rnd() % n].th, &t);
+    }
+    res->ns[REARM] = (now() - start) / nrearm;
+
+    res->expired = 0;
+    start = now();
+    for (end = clock + RUNTIME; clock < end; clock++) {
+        struct timespec cur = ms_ts(clock);
+        while (timeheap_size() > 0 && ts_le(timeheap_top(), cur)) {
+            struct timer *tm = timeheap_remove_top();
+            t = ms_ts(clock + 1 + rnd() % SPREAD);
+            timeheap_insert(&tm->th, &t);
+            res->expired++;
+        }
+    }
+    res->ns[EXPIRE] = (now() - start) / (res->expired ? res->expired : 1);
+
+    start = now();
+    for (i = 0; i < n; i++)
+        timeheap_remove(&m_timers[i].th);
+    res->ns[REMOVE] = (now() - start) / n;
+}
+
+static void
+run_wheel(unsigned long n, struct result *res)
+{
+    double start;
+    unsigned long i, nrearm = n;
+    uint64_t clock = 0, end;
+
+    m_seed = n;
+    timewheel_init(0);
+    start = now();
+    for (i = 0; i < n; i++) {
+        m_timers[i].tw.prev = NULL;
+        m_timers[i].tw.data = &m_timers[i];
+        timewheel_insert(&m_timers[i].tw, 1 + rnd() % SPREAD);
+    }
+    res->ns[INSERT] = (now() - start) / n;
+
+    start = now();
+    for (i = 0; i < nrearm; i++) {
+        uint64_t at = 1 + rnd() % SPREAD;
+        timewheel_insert(&m_timers[rnd() % n].tw, at);
+    }
+    res->ns[REARM] = (now() - start) / nrearm;
+
+    res->expired = 0;
+    start = now();
+    for (end = clock + RUNTIME; clock < end; clock++) {
+        struct timer *tm;
+        while ((tm = timewheel_expire(clock)) != NULL) {
+            timewheel_insert(&tm->tw, clock + 1 + rnd() % SPREAD);
+            res->expired++;
+        }
+    }
+    res->ns[EXPIRE] = (now() - start) / (res->expired ? res->expired : 1);
+
+    start = now();
+    for (i = 0; i < n; i++)
+        timewheel_remove(&m_timers[i].tw);
+    res->ns[REMOVE] = (now() - start) / n;
+}
+
+int
+main(void)
+{
+    unsigned long sizes[] = { 10000, 100000, 1000000 };
+
+    printf("%-8s %8s %14s %14s %8s\n",
+        "phase", "timers", "heap (ns/op)", "wheel (ns/op)", "speedup");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned long n = sizes[s];
+        struct result heap, wheel;
+        if ((m_timers = calloc(n, sizeof(*m_timers))) == NULL)
+            abort();
+        run_heap(n, &heap);
+        run_wheel(n, &wheel);
+        for (enum phase p = 0; p < NPHASES; p++)
+            printf("%-8s %8lu %14.1f %14.1f %7.1fx\n", m_names[p], n,
+                heap.ns[p], wheel.ns[p], heap.ns[p] / wheel.ns[p]);
+        free(m_timers);
+    }
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evloop.h"
+
+/*
+ * Moves piece messages over socket pairs with the uring event loop, once
+ * doing the reads and writes when the loop reports the sockets ready, as
+ * btpd did before, and once queueing them as uring operations. Counts the
+ * system calls each way takes. The loop's io_uring_enter calls are
+ * counted by linking with syscall wrapped.
+ */
+
+#define HDRLEN 13
+#define BLOCKLEN (16 << 10)
+#define MSGLEN (HDRLEN + BLOCKLEN)
+#define RBUFLEN (64 << 10)
+#define TOTAL (256UL << 20)
+
+struct conn {
+    int wsd, rsd;
+    struct fdev wev, rev;
+    size_t total, woff, roff;
+    struct iovec iov[EVLOOP_IOV_MAX];
+    int niov;
+    char rbuf[RBUFLEN];
+};
+
+static unsigned long m_nenter, m_nio;
+static int m_nconns, m_ndone, m_uring;
+static struct conn *m_conns;
+static char m_hdr[HDRLEN], m_block[BLOCKLEN];
+static double m_start;
+
+long __real_syscall(long nr, ...);
+
+long
+__wrap_syscall(long nr, ...)
+{
+    long a[6];
+    va_list ap;
+    va_start(ap, nr);
+    for (int i = 0; i < 6; i++)
+        a[i] = va_arg(ap, long);
+    va_end(ap);
+    if (nr == __NR_io_uring_enter)
+        m_nenter++;
+    return __real_syscall(nr, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+build_iov(struct conn *c)
+{
+    size_t off = c->woff;
+    c->niov = 0;
+    while (c->niov < EVLOOP_IOV_MAX && off < c->total) {
+        size_t m = off % MSGLEN, len;
+        struct iovec *iov = &c->iov[c->niov];
+        if (m < HDRLEN) {
+            iov->iov_base = m_hdr + m;
+            len = HDRLEN - m;
+        } else {
+            iov->iov_base = m_block + m - HDRLEN;
+            len = MSGLEN - m;
+        }
+        if (len > c->total - off)
+            len = c->total - off;
+        iov->iov_len = len;
+        off += len;
+        c->niov++;
+    }
+}
+
+static void
+conn_done(void)
+{
+    double secs;
+    if (++m_ndone < m_nconns)
+        return;
+    secs = (now() - m_start) / 1e9;
+    printf("%-14s %6d %10lu %10lu %10.1f %10.0f\n",
+        m_uring ? "uring ops" : "ready + call", m_nconns, m_nenter, m_nio,
+        (m_nenter + m_nio) / (TOTAL / 1048576.0), TOTAL / secs / 1e6);
+    fflush(stdout);
+    _exit(0);
+}
+
+static void
+io_cb(int sd, short type, int res, void *arg);
+
+static void
+do_write(struct conn *c)
+{
+    ssize_t n;
+    build_iov(c);
+    if (m_uring) {
+        if (fdev_writev(&c->wev, c->iov, c->niov, io_cb) != 0)
+            abort();
+        return;
+    }
+    m_nio++;
+    if ((n = writev(c->wsd, c->iov, c->niov)) < 0) {
+        if (errno != EAGAIN)
+            abort();
+        return;
+    }
+    c->woff += n;
+    if (c->woff == c->total)
+        fdev_disable(&c->wev, EV_WRITE);
+}
+
+static void
+do_read(struct conn *c)
+{
+    ssize_t n;
+    if (m_uring) {
+        struct iovec iov = { c->rbuf, RBUFLEN };
+        if (fdev_readv(&c->rev, &iov, 1, io_cb) != 0)
+            abort();
+        return;
+    }
+    m_nio++;
+    if ((n = read(c->rsd, c->rbuf, RBUFLEN)) < 0) {
+        if (errno != EAGAIN)
+            abort();
+        return;
+    }
+    if ((c->roff += n) == c->total) {
+        fdev_disable(&c->rev, EV_READ);
+        conn_done();
+    }
+}
+
+static void
+io_cb(int sd, short type, int res, void *arg)
+{
+    struct conn *c = arg;
+    if (res < 0)
+        abort();
+    if (type == EV_WRITE) {
+        if ((c->woff += res) < c->total)
+            do_write(c);
+    } else if ((c->roff += res) < c->total)
+        do_read(c);
+    else
+        conn_done();
+}
+
+static void
+ready_cb(int sd, short type, void *arg)
+{
+    if (type == EV_WRITE)
+        do_write(arg);
+    else
+        do_read(arg);
+}
+
+static void
+run(int nconns, int uring)
+{
+    int sv[2];
+    m_nconns = nconns;
+    m_uring = uring;
+    if (evloop_init() != 0)
+        abort();
+    if ((m_conns = calloc(nconns, sizeof(*m_conns))) == NULL)
+        abort();
+    for (int i = 0; i < nconns; i++) {
+        struct conn *c = &m_conns[i];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            abort();
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        fcntl(sv[1], F_SETFL, O_NONBLOCK);
+        c->wsd = sv[0];
+        c->rsd = sv[1];
+        c->total = TOTAL / nconns;
+        if (i == 0)
+            c->total += TOTAL % nconns;
+        if (uring) {
+            fdev_new(&c->wev, c->wsd, 0, ready_cb, c);
+            fdev_new(&c->rev, c->rsd, 0, ready_cb, c);
+            do_write(c);
+            do_read(c);
+        } else {
+            fdev_new(&c->wev, c->wsd, EV_WRITE, ready_cb, c);
+            fdev_new(&c->rev, c->rsd, EV_READ, ready_cb, c);
+        }
+    }
+    m_nenter = 0;
+    m_start = now();
+    evloop();
+    abort();
+}
+
+int
+main(void)
+{
+    int nconns[] = { 1, 16, 256 };
+
+    printf("%-14s %6s %10s %10s %10s %10s\n",
+        "mode", "conns", "enters", "rd/wr", "calls/MiB", "MB/s");
+    for (int n = 0; n < sizeof(nconns) / sizeof(nconns[0]); n++)
+        for (int uring = 0; uring < 2; uring++) {
+            int status;
+            pid_t pid;
+            fflush(stdout);
+            if ((pid = fork()) == 0)
+                run(nconns[n], uring);
+            if (pid < 0 || waitpid(pid, &status, 0) != pid
+                    || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                return 1;
+        }
+    return 0;
+}
@@ -0,0 +1,320 @@
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "utp.h"
+
+/*
+ * Sends over uTP through a relay on loopback that acts as a slow link,
+ * with a bottleneck of RATE bytes per second, a buffer of BUFDELAY ms in
+ * front of it and DELAY ms each way. Once the transfer runs alone, and
+ * once with a constant stream of other traffic wanting half the link
+ * from CROSSAT ms on. What gets through after WARMUP ms is counted.
+ * LEDBAT should keep the bottleneck's queue near its 100 ms target
+ * instead of filling the buffer, and leave the other traffic the
+ * bandwidth it wants.
+ */
+
+#define RATE (4 << 20)
+#define DELAY 20
+#define BUFDELAY 500
+#define RUNTIME 12000
+#define CROSSAT 4000
+#define WARMUP 6000
+#define CROSSLEN 1000
+#define QLEN 4096
+#define PKTMAX 1500
+
+struct pkt {
+    double t;
+    int sd, cross;
+    size_t len;
+    char buf[PKTMAX];
+};
+
+struct pktq {
+    struct pkt *pkts;
+    unsigned head, tail;
+    struct timeout timer;
+};
+
+static int m_ssd, m_rsd, m_cross;
+static struct sockaddr_in m_saddr, m_raddr;
+static struct utp_sock *m_us, *m_ur;
+static struct utp *m_snd, *m_rcv;
+static struct pktq m_fwd, m_rev;
+static struct timeout m_tick;
+static double m_start, m_link;
+static double m_qsum, m_qmax;
+static unsigned long m_nq, m_ndrop;
+static unsigned long long m_utp_bytes, m_cross_bytes;
+static char m_data[64 << 10];
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+measuring(double t)
+{
+    return t - m_start >= WARMUP;
+}
+
+static void
+pktq_arm(struct pktq *q)
+{
+    struct timespec ts = { 0, 0 };
+    double d;
+    evtimer_del(&q->timer);
+    if (q->head == q->tail)
+        return;
+    d = q->pkts[q->head % QLEN].t - now();
+    if (d > 0) {
+        ts.tv_sec = d / 1000;
+        ts.tv_nsec = (d - ts.tv_sec * 1000) * 1e6;
+    }
+    evtimer_add(&q->timer, &ts);
+}
+
+static void
+pktq_cb(int fd, short type, void *arg)
+{
+    struct pktq *q = arg;
+    struct pkt *pk;
+    double t = now();
+    while (q->head != q->tail && (pk = &q->pkts[q->head % QLEN])->t <= t) {
+        if (pk->cross) {
+            if (measuring(t))
+                m_cross_bytes += pk->len;
+        } else if (pk->sd == m_rsd)
+            sendto(m_rsd, pk->buf, pk->len, 0,
+                (struct sockaddr *)&m_raddr, sizeof(m_raddr));
+        else
+            sendto(m_ssd, pk->buf, pk->len, 0,
+                (struct sockaddr *)&m_saddr, sizeof(m_saddr));
+        q->head++;
+    }
+    pktq_arm(q);
+}
+
+static struct pkt *
+pktq_push(struct pktq *q, double t)
+{
+    struct pkt *pk;
+    if (q->tail - q->head == QLEN) {
+        m_ndrop++;
+        return NULL;
+    }
+    pk = &q->pkts[q->tail++ % QLEN];
+    pk->t = t;
+    if (q->tail - q->head == 1)
+        pktq_arm(q);
+    return pk;
+}
+
+/*
+ * Puts a packet through the bottleneck. It's dropped if it would have to
+ * wait longer than the buffer allows.
+ */
+static struct pkt *
+bottleneck(size_t len, int cross)
+{
+    struct pkt *pk;
+    double t = now(), start = m_link > t ? m_link : t;
+    double done = start + len * 1000.0 / RATE;
+    if (start - t > BUFDELAY) {
+        m_ndrop++;
+        return NULL;
+    }
+    if ((pk = pktq_push(&m_fwd, done + DELAY)) == NULL)
+        return NULL;
+    m_link = done;
+    pk->sd = m_rsd;
+    pk->cross = cross;
+    pk->len = len;
+    if (!cross && measuring(t)) {
+        m_qsum += start - t;
+        m_nq++;
+        if (start - t > m_qmax)
+            m_qmax = start - t;
+    }
+    return pk;
+}
+
+static void
+relay_cb(int sd, short type, void *arg)
+{
+    char buf[PKTMAX];
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    ssize_t nr;
+    struct pkt *pk;
+    while ((nr = recvfrom(sd, buf, sizeof(buf), 0,
+                (struct sockaddr *)&sa, &salen)) > 0) {
+        if (sd == m_ssd) {
+            m_saddr = sa;
+            pk = bottleneck(nr, 0);
+        } else if ((pk = pktq_push(&m_rev, now() + DELAY)) != NULL) {
+            pk->sd = m_ssd;
+            pk->cross = 0;
+            pk->len = nr;
+        }
+        if (pk != NULL)
+            memcpy(pk->buf, buf, nr);
+        salen = sizeof(sa);
+    }
+}
+
+static void
+print_result(void)
+{
+    double secs = (RUNTIME - WARMUP) / 1000.0;
+    printf("%-10s %10.2f %10.2f %10.1f %10.1f %8lu\n",
+        m_cross ? "cross" : "alone",
+        m_utp_bytes / secs / (1 << 20), m_cross_bytes / secs / (1 << 20),
+        m_nq > 0 ? m_qsum / m_nq : 0.0, m_qmax, m_ndrop);
+    fflush(stdout);
+    _exit(0);
+}
+
+/*
+ * Runs every millisecond. Ends the run, and adds the other traffic at
+ * half the link's rate.
+ */
+static void
+tick_cb(int fd, short type, void *arg)
+{
+    static double sent;
+    struct timespec ts = { 0, 1000000 };
+    double t = now();
+    if (t - m_start >= RUNTIME)
+        print_result();
+    if (m_cross && t - m_start >= CROSSAT) {
+        if (sent == 0)
+            sent = t * RATE / 2000;
+        while (sent < t * RATE / 2000) {
+            bottleneck(CROSSLEN, 1);
+            sent += CROSSLEN;
+        }
+    }
+    evtimer_add(&m_tick, &ts);
+}
+
+static void
+sender_cb(int fd, short type, void *arg)
+{
+    struct iovec iov = { m_data, sizeof(m_data) };
+    while (utp_writev(m_snd, &iov, 1) > 0)
+        ;
+}
+
+static void
+receiver_cb(int fd, short type, void *arg)
+{
+    char buf[64 << 10];
+    ssize_t nr;
+    while ((nr = utp_read(m_rcv, buf, sizeof(buf))) > 0)
+        if (measuring(now()))
+            m_utp_bytes += nr;
+    if (nr == 0 || (nr < 0 && errno != EAGAIN))
+        abort();
+}
+
+static void
+accept_cb(struct utp *u, void *arg)
+{
+    m_rcv = u;
+    utp_set_cb(u, receiver_cb, NULL);
+    utp_enable(u, EV_READ);
+}
+
+static int
+udp_socket(struct sockaddr_in *sa)
+{
+    socklen_t salen = sizeof(*sa);
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0)
+        abort();
+    bzero(sa, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sd, (struct sockaddr *)sa, salen) != 0
+            || getsockname(sd, (struct sockaddr *)sa, &salen) != 0)
+        abort();
+    fcntl(sd, F_SETFL, O_NONBLOCK);
+    return sd;
+}
+
+static void
+run(int cross)
+{
+    struct sockaddr_in sa;
+    struct fdev sev, rev;
+    struct timespec ts = { 0, 0 };
+    int sd;
+
+    m_cross = cross;
+    if (evloop_init() != 0)
+        abort();
+    m_fwd.pkts = calloc(QLEN, sizeof(struct pkt));
+    m_rev.pkts = calloc(QLEN, sizeof(struct pkt));
+    if (m_fwd.pkts == NULL || m_rev.pkts == NULL)
+        abort();
+    evtimer_init(&m_fwd.timer, pktq_cb, &m_fwd);
+    evtimer_init(&m_rev.timer, pktq_cb, &m_rev);
+    evtimer_init(&m_tick, tick_cb, NULL);
+
+    sd = udp_socket(&m_raddr);
+    if ((m_ur = utp_sock_new(sd, accept_cb, NULL)) == NULL)
+        abort();
+    sd = udp_socket(&sa);
+    if ((m_us = utp_sock_new(sd, NULL, NULL)) == NULL)
+        abort();
+    m_rsd = udp_socket(&sa);
+    m_ssd = udp_socket(&sa);
+    fdev_new(&sev, m_ssd, EV_READ, relay_cb, NULL);
+    fdev_new(&rev, m_rsd, EV_READ, relay_cb, NULL);
+
+    if ((m_snd = utp_connect(m_us, (struct sockaddr *)&sa, sizeof(sa)))
+            == NULL)
+        abort();
+    utp_set_cb(m_snd, sender_cb, NULL);
+    utp_enable(m_snd, EV_WRITE);
+
+    m_start = now();
+    evtimer_add(&m_tick, &ts);
+    evloop();
+    abort();
+}
+
+int
+main(void)
+{
+    printf("%-10s %10s %10s %10s %10s %8s\n",
+        "traffic", "utp MiB/s", "other", "queue ms", "max ms", "drops");
+    for (int cross = 0; cross < 2; cross++) {
+        int status;
+        pid_t pid;
+        fflush(stdout);
+        if ((pid = fork()) == 0)
+            run(cross);
+        if (pid < 0 || waitpid(pid, &status, 0) != pid
+                || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return 1;
+    }
+    return 0;
+}
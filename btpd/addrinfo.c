@@ -11,6 +11,7 @@ struct ai_ctx {
     void *arg;
     int cancel;
     int error;
+    struct shard *sh;
     uint16_t port;
 };
 
@@ -30,6 +31,7 @@ btpd_addrinfo(const char *node, uint16_t port, struct addrinfo *hints,
     ctx->arg = arg;    
     snprintf(ctx->node, sizeof(ctx->node), "%s", node);
     ctx->port = port;
+    ctx->sh = btpd_shard;
     snprintf(ctx->service, sizeof(ctx->service), "%hu", port);
 
     pthread_mutex_lock(&m_aiq_lock);
@@ -72,9 +74,7 @@ addrinfo_td(void *arg)
         ctx->error =
             getaddrinfo(ctx->node, ctx->service, &ctx->hints, &ctx->res);
 
-        td_post_begin();
-        td_post(addrinfo_td_cb, ctx);
-        td_post_end();
+        shard_post(ctx->sh, addrinfo_td_cb, ctx);
     }
     pthread_exit(NULL);
 }
@@ -1,15 +1,16 @@
 #include "btpd.h"
 
 #include <openssl/sha.h>
+#include <sha1.h>
 #include <signal.h>
 
 static uint8_t m_peer_id[20];
-static struct timeout m_heartbeat;
+static __thread struct timeout m_heartbeat;
 static int m_signal;
 static int m_shutdown;
 static int m_ghost;
 
-long btpd_seconds;
+__thread long btpd_seconds;
 
 void
 btpd_exit(int code)
@@ -60,6 +61,19 @@ btpd_get_peer_id(void)
     return m_peer_id;
 }
 
+/*
+ * Milliseconds on the monotonic clock, as of the start of the loop
+ * iteration. Used where the one second resolution of btpd_seconds is
+ * too coarse.
+ */
+long long
+btpd_msecs(void)
+{
+    struct timespec ts;
+    evtimer_now(&ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void
 signal_handler(int signal)
 {
@@ -72,7 +86,9 @@ heartbeat_cb(int fd, short type, void *arg)
     btpd_timer_add(&m_heartbeat, (& (struct timespec) { 1, 0 }));
     btpd_seconds++;
     net_on_tick();
-    torrent_on_tick_all();
+    torrent_on_tick();
+    if (btpd_shard->num != 0)
+        return;
     if (m_signal) {
         btpd_log(BTPD_L_BTPD, "Got signal %d.\n", m_signal);
         m_signal = 0;
@@ -85,9 +101,24 @@ heartbeat_cb(int fd, short type, void *arg)
 
 void tr_init(void);
 void ipc_init(void);
-void td_init(void);
 void addrinfo_init(void);
 
+/*
+ * Sets up the state each shard has of its own, on the shard's thread.
+ */
+void
+btpd_shard_init(void)
+{
+    torrent_shard_init();
+    net_shard_init();
+    ul_init();
+    cache_init();
+    cm_init();
+
+    evtimer_init(&m_heartbeat, heartbeat_cb, NULL);
+    btpd_timer_add(&m_heartbeat, (& (struct timespec) { 1, 0 }));
+}
+
 void
 btpd_init(void)
 {
@@ -121,15 +152,12 @@ btpd_init(void)
 
     srandom(seed);
 
-    td_init();
+    sha1_setup();
     addrinfo_init();
+    disk_init();
     net_init();
     ipc_init();
-    ul_init();
-    cm_init();
     tr_init();
     tlib_init();
-
-    evtimer_init(&m_heartbeat, heartbeat_cb, NULL);
-    btpd_timer_add(&m_heartbeat, (& (struct timespec) { 1, 0 }));
+    shard_init();
 }
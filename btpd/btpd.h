@@ -27,6 +27,7 @@
 #include <unistd.h>
 
 #include <benc.h>
+#include <bitset.h>
 #define DAEMON
 #include <btpd_if.h>
 #undef DAEMON
@@ -34,6 +35,7 @@
 #include <metainfo.h>
 #include <queue.h>
 #include <subr.h>
+#include <utp.h>
 
 #include "active.h"
 #include "hashtable.h"
@@ -45,9 +47,13 @@
 #include "torrent.h"
 #include "download.h"
 #include "upload.h"
+#include "pex.h"
+#include "disk.h"
 #include "content.h"
+#include "cache.h"
 #include "opts.h"
 #include "tracker_req.h"
+#include "shard.h"
 
 #define BTPD_VERSION PACKAGE_NAME "/" PACKAGE_VERSION
 
@@ -60,9 +66,12 @@
 #define BTPD_L_POL      0x00000020
 #define BTPD_L_BAD      0x00000040
 
-extern long btpd_seconds;
+extern __thread long btpd_seconds;
+
+long long btpd_msecs(void);
 
 void btpd_init(void);
+void btpd_shard_init(void);
 
 __attribute__((format (printf, 2, 3)))
 void btpd_log(uint32_t type, const char *fmt, ...);
@@ -74,12 +83,31 @@ __attribute__((malloc))
 void *btpd_malloc(size_t size);
 __attribute__((malloc))
 void *btpd_calloc(size_t nmemb, size_t size);
+void *btpd_realloc(void *ptr, size_t size);
+
+struct pool {
+    size_t size;
+    unsigned max;
+    unsigned nfree;
+    void *free;
+};
+
+#define POOL_INIT(size, max) { (size), (max), 0, NULL }
+
+extern __thread long long btpd_pool_allocs;
+extern __thread long long btpd_pool_reuses;
+extern __thread long long btpd_pool_free;
+
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *obj);
 
 void btpd_ev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb,
     void *arg);
 void btpd_ev_del(struct fdev *ev);
 void btpd_ev_enable(struct fdev *ev, uint16_t flags);
 void btpd_ev_disable(struct fdev *ev, uint16_t flags);
+void btpd_ev_again(struct fdev *ev, uint16_t flags);
+void btpd_ev_err(int fd, int err, void *arg);
 void btpd_timer_add(struct timeout *to, struct timespec *ts);
 void btpd_timer_del(struct timeout *to);
 
@@ -94,13 +122,6 @@ const uint8_t *btpd_get_peer_id(void);
 int btpd_id_eq(const void *id1, const void *id2);
 uint32_t btpd_id_hash(const void *id);
 
-void td_acquire_lock(void);
-void td_release_lock(void);
-
-void td_post(void (*cb)(void *), void *arg);
-void td_post_end();
-#define td_post_begin td_acquire_lock
-
 typedef struct ai_ctx * aictx_t;
 aictx_t btpd_addrinfo(const char *node, uint16_t port, struct addrinfo *hints,
     void (*cb)(void *, int, struct addrinfo *), void *arg);
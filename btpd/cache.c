@@ -0,0 +1,240 @@
+#include "btpd.h"
+
+/*
+ * A cache of whole pieces for serving uploads, shared by all peers and
+ * limited to cache_size bytes. A piece is only read into the cache when a
+ * second peer asks for it, until then it's remembered by a ghost entry
+ * without data and its blocks are read from the content one at a time.
+ * This keeps pieces that only one peer wants from pushing out those that
+ * the whole swarm wants. The piece is read by a disk job and is served
+ * from the content until it's been loaded.
+ *
+ * Entries in use by net_bufs are held and are never evicted. An entry
+ * whose torrent goes away while it's held is freed when it's put back.
+ *
+ * Each shard has a cache of its own, with its share of cache_size.
+ */
+
+#define CACHE_MAXGHOSTS 1024
+
+struct cache_key {
+    struct torrent *tp;
+    uint32_t piece;
+};
+
+struct cache_ent {
+    struct cache_key key;
+    HTBL_ENTRY(chain);
+    unsigned refs;
+    int dead;
+    int loading;
+    size_t len;
+    uint8_t *data;
+    uint8_t asker[20];      // Id of the peer that made the ghost.
+    BTPDQ_ENTRY(cache_ent) entry;
+};
+
+BTPDQ_HEAD(cache_ent_tq, cache_ent);
+
+HTBL_TYPE(cachetbl, cache_ent, struct cache_key, key, chain);
+
+__thread long long cache_hits;
+__thread long long cache_misses;
+__thread long long cache_evictions;
+__thread size_t cache_bytes;
+
+static __thread size_t m_size;
+static __thread struct cachetbl *m_tbl;
+static __thread struct cache_ent_tq m_lru;
+static __thread struct cache_ent_tq m_ghosts;
+static __thread struct cache_ent_tq m_loading;
+static __thread unsigned m_nghosts;
+
+static int
+key_eq(const void *k1, const void *k2)
+{
+    const struct cache_key *a = k1, *b = k2;
+    return a->tp == b->tp && a->piece == b->piece;
+}
+
+static uint32_t
+key_hash(const void *k)
+{
+    const struct cache_key *key = k;
+    return (uint32_t)(uintptr_t)key->tp ^ key->piece * 2654435761U;
+}
+
+static void
+ent_free(struct cache_ent *ce)
+{
+    if (ce->data != NULL)
+        free(ce->data);
+    free(ce);
+}
+
+static void
+ent_remove(struct cache_ent *ce)
+{
+    cachetbl_remove(m_tbl, &ce->key);
+    if (ce->loading) {
+        BTPDQ_REMOVE(&m_loading, ce, entry);
+        ce->dead = 1;
+        return;
+    } else if (ce->data != NULL) {
+        BTPDQ_REMOVE(&m_lru, ce, entry);
+        cache_bytes -= ce->len;
+    } else {
+        BTPDQ_REMOVE(&m_ghosts, ce, entry);
+        m_nghosts--;
+    }
+    if (ce->refs == 0)
+        ent_free(ce);
+    else
+        ce->dead = 1;
+}
+
+static void
+cache_evict(void)
+{
+    struct cache_ent *ce, *next;
+    BTPDQ_FOREACH_MUTABLE(ce, &m_lru, entry, next) {
+        if (cache_bytes <= m_size)
+            break;
+        if (ce->refs == 0) {
+            ent_remove(ce);
+            cache_evictions++;
+        }
+    }
+}
+
+static void
+ghost_add(struct torrent *tp, uint32_t piece, struct peer *p)
+{
+    struct cache_ent *ce = btpd_calloc(1, sizeof(*ce));
+    ce->key.tp = tp;
+    ce->key.piece = piece;
+    bcopy(p->mp->id, ce->asker, sizeof(ce->asker));
+    cachetbl_insert(m_tbl, ce);
+    BTPDQ_INSERT_TAIL(&m_ghosts, ce, entry);
+    m_nghosts++;
+    if (m_nghosts > CACHE_MAXGHOSTS)
+        ent_remove(BTPDQ_FIRST(&m_ghosts));
+}
+
+static void
+cache_load_cb(void *arg, int err, uint8_t *buf)
+{
+    struct cache_ent *ce = arg;
+    ce->loading = 0;
+    if (ce->dead) {
+        free(buf);
+        ent_free(ce);
+        return;
+    }
+    BTPDQ_REMOVE(&m_loading, ce, entry);
+    if (err != 0) {
+        free(buf);
+        cachetbl_remove(m_tbl, &ce->key);
+        ent_free(ce);
+        return;
+    }
+    ce->data = buf;
+    BTPDQ_INSERT_TAIL(&m_lru, ce, entry);
+    cache_bytes += ce->len;
+    cache_evict();
+}
+
+/*
+ * Looks up the piece for peer p. On success *out is either a held entry,
+ * which must be put back with cache_put, or NULL if the piece isn't
+ * cached and should be read by the caller.
+ */
+int
+cache_get(struct torrent *tp, uint32_t piece, struct peer *p,
+    struct cache_ent **out)
+{
+    int err;
+    struct cache_ent *ce;
+    struct cache_key key = { tp, piece };
+    size_t len = torrent_piece_size(tp, piece);
+
+    *out = NULL;
+    if (len > m_size)
+        return 0;
+
+    if ((ce = cachetbl_find(m_tbl, &key)) != NULL && ce->data != NULL) {
+        cache_hits++;
+        BTPDQ_REMOVE(&m_lru, ce, entry);
+        BTPDQ_INSERT_TAIL(&m_lru, ce, entry);
+        ce->refs++;
+        *out = ce;
+        return 0;
+    }
+
+    cache_misses++;
+    if (ce == NULL) {
+        ghost_add(tp, piece, p);
+        return 0;
+    } else if (ce->loading ||
+            bcmp(ce->asker, p->mp->id, sizeof(ce->asker)) == 0) {
+        if (!ce->loading) {
+            BTPDQ_REMOVE(&m_ghosts, ce, entry);
+            BTPDQ_INSERT_TAIL(&m_ghosts, ce, entry);
+        }
+        return 0;
+    }
+
+    if ((err = cm_read(tp, piece, 0, len, cache_load_cb, ce)) != 0)
+        return err;
+    BTPDQ_REMOVE(&m_ghosts, ce, entry);
+    m_nghosts--;
+    BTPDQ_INSERT_TAIL(&m_loading, ce, entry);
+    ce->loading = 1;
+    ce->len = len;
+    return 0;
+}
+
+const uint8_t *
+cache_data(struct cache_ent *ce)
+{
+    return ce->data;
+}
+
+void
+cache_put(struct cache_ent *ce)
+{
+    assert(ce->refs > 0);
+    ce->refs--;
+    if (ce->refs == 0) {
+        if (ce->dead)
+            ent_free(ce);
+        else if (cache_bytes > m_size)
+            cache_evict();
+    }
+}
+
+void
+cache_forget(struct torrent *tp)
+{
+    struct cache_ent *ce, *next;
+    BTPDQ_FOREACH_MUTABLE(ce, &m_lru, entry, next)
+        if (ce->key.tp == tp)
+            ent_remove(ce);
+    BTPDQ_FOREACH_MUTABLE(ce, &m_ghosts, entry, next)
+        if (ce->key.tp == tp)
+            ent_remove(ce);
+    BTPDQ_FOREACH_MUTABLE(ce, &m_loading, entry, next)
+        if (ce->key.tp == tp)
+            ent_remove(ce);
+}
+
+void
+cache_init(void)
+{
+    m_size = shard_share(cache_size);
+    BTPDQ_INIT(&m_lru);
+    BTPDQ_INIT(&m_ghosts);
+    BTPDQ_INIT(&m_loading);
+    if ((m_tbl = cachetbl_create(1, key_eq, key_hash)) == NULL)
+        btpd_err("Failed to create the piece cache.\n");
+}
@@ -0,0 +1,19 @@
+#ifndef BTPD_CACHE_H
+#define BTPD_CACHE_H
+
+struct cache_ent;
+
+extern __thread long long cache_hits;
+extern __thread long long cache_misses;
+extern __thread long long cache_evictions;
+extern __thread size_t cache_bytes;
+
+void cache_init(void);
+
+int cache_get(struct torrent *tp, uint32_t piece, struct peer *p,
+    struct cache_ent **out);
+const uint8_t *cache_data(struct cache_ent *ce);
+void cache_put(struct cache_ent *ce);
+void cache_forget(struct torrent *tp);
+
+#endif
@@ -74,19 +74,24 @@ write_ans(struct iobuf *iob, struct tlib *tl, enum ipc_tval val)
             iobuf_print(iob, "i%dei%de", IPC_TYPE_NUM, 0);
         else {
             unsigned long pcseen = 0;
-            for (unsigned long i = 0; i < tl->tp->npieces; i++)
-                if (tl->tp->net->piece_count[i] > 0)
-                    pcseen++;
+            if (tl->tp->net->nseeds > 0)
+                pcseen = tl->tp->npieces;
+            else
+                for (unsigned long i = 0; i < tl->tp->npieces; i++)
+                    if (tl->tp->net->piece_count[i] > 0)
+                        pcseen++;
             iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM, pcseen);
         }
         return;
     case IPC_TVAL_RATEDWN:
         iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM,
-            tl->tp == NULL ? 0UL : tl->tp->net->rate_dwn / RATEHISTORY);
+            tl->tp == NULL ? 0UL :
+            rate_get(&tl->tp->net->rate_dwn) / RATEHISTORY);
         return;
     case IPC_TVAL_RATEUP:
         iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM,
-            tl->tp == NULL ? 0UL : tl->tp->net->rate_up / RATEHISTORY);
+            tl->tp == NULL ? 0UL :
+            rate_get(&tl->tp->net->rate_up) / RATEHISTORY);
         return;
     case IPC_TVAL_SESSDWN:
         iobuf_print(iob, "i%dei%llde", IPC_TYPE_NUM,
@@ -164,12 +169,158 @@ write_ans(struct iobuf *iob, struct tlib *tl, enum ipc_tval val)
         else
             iobuf_print(iob, "i%dei%de", IPC_TYPE_ERR, IPC_EBADTENT);
        return;
+    case IPC_TVAL_CHKDONE:
+    case IPC_TVAL_CHKTOTAL: {
+        uint32_t done = 0, total = 0;
+        if (tl->tp != NULL)
+            cm_check_progress(tl->tp, &done, &total);
+        iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM, (unsigned long)
+            (val == IPC_TVAL_CHKDONE ? done : total));
+        return;
+    }
+    case IPC_TVAL_LIMUP:
+        iobuf_print(iob, "i%dei%ue", IPC_TYPE_NUM, tl->bw_limit_out);
+        return;
+    case IPC_TVAL_LIMDWN:
+        iobuf_print(iob, "i%dei%ue", IPC_TYPE_NUM, tl->bw_limit_in);
+        return;
+    case IPC_TVAL_PLIMUP:
+        iobuf_print(iob, "i%dei%ue", IPC_TYPE_NUM, tl->peer_bw_limit_out);
+        return;
+    case IPC_TVAL_PLIMDWN:
+        iobuf_print(iob, "i%dei%ue", IPC_TYPE_NUM, tl->peer_bw_limit_in);
+        return;
     case IPC_TVALCOUNT:
         break;
     }
     iobuf_print(iob, "i%dei%de", IPC_TYPE_ERR, IPC_ENOKEY);
 }
 
+struct ans_call {
+    struct iobuf *iob;
+    struct tlib *tl;
+    enum ipc_tval *opts;
+    size_t nkeys;
+};
+
+static void
+write_torrent_cb(void *arg)
+{
+    struct ans_call *ac = arg;
+    iobuf_swrite(ac->iob, "l");
+    for (int k = 0; k < ac->nkeys; k++)
+        write_ans(ac->iob, ac->tl, ac->opts[k]);
+    iobuf_swrite(ac->iob, "e");
+}
+
+/*
+ * The values of an active torrent are read on its shard.
+ */
+static void
+write_torrent(struct iobuf *iob, struct tlib *tl, enum ipc_tval *opts,
+    size_t nkeys)
+{
+    struct ans_call ac = { iob, tl, opts, nkeys };
+    if (tl->tp != NULL)
+        shard_call(tl->tp->shard, write_torrent_cb, &ac);
+    else
+        write_torrent_cb(&ac);
+}
+
+struct dval_sum {
+    enum ipc_dval val;
+    long long sum;
+};
+
+static void
+dval_add(void *arg)
+{
+    struct dval_sum *ds = arg;
+    switch (ds->val) {
+    case IPC_DVAL_POOLALLOC:
+        ds->sum += btpd_pool_allocs;
+        break;
+    case IPC_DVAL_POOLREUSE:
+        ds->sum += btpd_pool_reuses;
+        break;
+    case IPC_DVAL_POOLFREE:
+        ds->sum += btpd_pool_free;
+        break;
+    case IPC_DVAL_CACHEHIT:
+        ds->sum += cache_hits;
+        break;
+    case IPC_DVAL_CACHEMISS:
+        ds->sum += cache_misses;
+        break;
+    case IPC_DVAL_CACHEEVICT:
+        ds->sum += cache_evictions;
+        break;
+    case IPC_DVAL_CACHEBYTES:
+        ds->sum += cache_bytes;
+        break;
+    default:
+        abort();
+    }
+}
+
+static void
+write_dans(struct iobuf *iob, enum ipc_dval val)
+{
+    switch (val) {
+    case IPC_DVAL_POOLALLOC:
+    case IPC_DVAL_POOLREUSE:
+    case IPC_DVAL_POOLFREE:
+    case IPC_DVAL_CACHEHIT:
+    case IPC_DVAL_CACHEMISS:
+    case IPC_DVAL_CACHEEVICT:
+    case IPC_DVAL_CACHEBYTES: {
+        // The counters are kept by each shard.
+        struct dval_sum ds = { val, 0 };
+        shard_call_all(dval_add, &ds);
+        iobuf_print(iob, "i%dei%llde", IPC_TYPE_NUM, ds.sum);
+        return;
+    }
+    case IPC_DVAL_PUPMEAN:
+    case IPC_DVAL_PUPDEV:
+    case IPC_DVAL_PDWNMEAN:
+    case IPC_DVAL_PDWNDEV: {
+        unsigned long mean, dev;
+        net_peer_rates(val == IPC_DVAL_PUPMEAN || val == IPC_DVAL_PUPDEV,
+            &mean, &dev);
+        iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM,
+            val == IPC_DVAL_PUPMEAN || val == IPC_DVAL_PDWNMEAN ? mean : dev);
+        return;
+    }
+    case IPC_DVALCOUNT:
+        break;
+    }
+    iobuf_print(iob, "i%dei%de", IPC_TYPE_ERR, IPC_ENOKEY);
+}
+
+static int
+cmd_get(struct cli *cli, int argc, const char *args)
+{
+    const char *keys, *p;
+    struct iobuf iob;
+
+    if (argc != 1 || !benc_isdct(args))
+        return IPC_COMMERR;
+    if ((keys = benc_dget_lst(args, "keys")) == NULL)
+        return IPC_COMMERR;
+
+    iob = iobuf_init(1 << 10);
+    iobuf_swrite(&iob, "d4:codei0e6:resultl");
+    for (p = benc_first(keys); p != NULL; p = benc_next(p)) {
+        if (!benc_isint(p)) {
+            iobuf_free(&iob);
+            return IPC_COMMERR;
+        }
+        write_dans(&iob, benc_int(p, NULL));
+    }
+    iobuf_swrite(&iob, "ee");
+    return write_buffer(cli, &iob);
+}
+
 static int
 cmd_tget(struct cli *cli, int argc, const char *args)
 {
@@ -202,12 +353,8 @@ cmd_tget(struct cli *cli, int argc, const char *args)
             if (!torrent_haunting(tl) && (
                     from == IPC_TWC_ALL ||
                     (!torrent_active(tl) && from == IPC_TWC_INACTIVE) ||
-                    (torrent_active(tl) && from == IPC_TWC_ACTIVE))) {
-                iobuf_swrite(&iob, "l");
-                for (int k = 0; k < nkeys; k++)
-                    write_ans(&iob, tl, opts[k]);
-                iobuf_swrite(&iob, "e");
-            }
+                    (torrent_active(tl) && from == IPC_TWC_ACTIVE)))
+                write_torrent(&iob, tl, opts, nkeys);
         }
     } else if (benc_islst(p)) {
         for (p = benc_first(p); p != NULL; p = benc_next(p)) {
@@ -221,12 +368,9 @@ cmd_tget(struct cli *cli, int argc, const char *args)
                 free(opts);
                 return IPC_COMMERR;
             }
-            if (tl != NULL && !torrent_haunting(tl)) {
-                iobuf_swrite(&iob, "l");
-                for (int i = 0; i < nkeys; i++)
-                    write_ans(&iob, tl, opts[i]);
-                iobuf_swrite(&iob, "e");
-            } else
+            if (tl != NULL && !torrent_haunting(tl))
+                write_torrent(&iob, tl, opts, nkeys);
+            else
                 iobuf_print(&iob, "i%de", IPC_ENOTENT);
         }
     }
@@ -395,6 +539,13 @@ cmd_stop_all(struct cli *cli, int argc, const char *args)
     return ret;
 }
 
+static void
+rate_set_cb(void *arg)
+{
+    net_set_limits();
+    ul_set_max_uploads();
+}
+
 static int
 cmd_rate(struct cli *cli, int argc, const char *args)
 {
@@ -417,8 +568,58 @@ cmd_rate(struct cli *cli, int argc, const char *args)
 
     net_bw_limit_out = up;
     net_bw_limit_in  = down;
-    ul_set_max_uploads();
+    shard_call_all(rate_set_cb, NULL);
+
+    return write_code_buffer(cli, IPC_OK);
+}
+
+struct trate_call {
+    struct tlib *tl;
+    unsigned *rates;
+};
 
+static void
+trate_set_cb(void *arg)
+{
+    struct trate_call *tc = arg;
+    tlib_set_bw_limits(tc->tl, tc->rates[0], tc->rates[1], tc->rates[2],
+        tc->rates[3]);
+}
+
+static int
+cmd_trate(struct cli *cli, int argc, const char *args)
+{
+    struct tlib *tl;
+    unsigned rates[4];
+    struct trate_call tc = { NULL, rates };
+
+    if (argc != 5)
+        return IPC_COMMERR;
+    if (btpd_is_stopping())
+        return write_code_buffer(cli, IPC_ESHUTDOWN);
+
+    if (benc_isstr(args) && benc_strlen(args) == 20)
+        tl = tlib_by_hash(benc_mem(args, NULL, &args));
+    else if (benc_isint(args))
+        tl = tlib_by_num(benc_int(args, &args));
+    else
+        return IPC_COMMERR;
+
+    for (int i = 0; i < 4; i++) {
+        if (benc_isint(args))
+            rates[i] = (unsigned)benc_int(args, &args);
+        else
+            return IPC_COMMERR;
+    }
+
+    if (tl == NULL || torrent_haunting(tl))
+        return write_code_buffer(cli, IPC_ENOTENT);
+    tc.tl = tl;
+    // The limits of an active torrent are used by its shard.
+    if (tl->tp != NULL)
+        shard_call(tl->tp->shard, trate_set_cb, &tc);
+    else
+        trate_set_cb(&tc);
     return write_code_buffer(cli, IPC_OK);
 }
 
@@ -441,12 +642,14 @@ static struct {
     { "add",    3, cmd_add },
     { "del",    3, cmd_del },
     { "die",    3, cmd_die },
+    { "get",    3, cmd_get },
     { "rate",   4, cmd_rate },
     { "start",  5, cmd_start },
     { "start-all", 9, cmd_start_all},
     { "stop",   4, cmd_stop },
     { "stop-all", 8, cmd_stop_all},
-    { "tget",   4, cmd_tget }
+    { "tget",   4, cmd_tget },
+    { "trate",  5, cmd_trate }
 };
 
 static int
@@ -1,10 +1,22 @@
 #include "btpd.h"
 
-#include <openssl/sha.h>
+#include <sha1.h>
 #include <stream.h>
 
+#ifdef HAVE_PREADV2_NOWAIT
+#include <sys/uio.h>
+#endif
+
+/*
+ * A stream isn't safe to use from more than one thread at a time, so each
+ * test job takes a stream of its own. Streams are kept for reuse when the
+ * job is done, up to CM_TEST_STREAMS per torrent, so their open files are
+ * reused as well.
+ */
+#define CM_TEST_STREAMS 8
+
 struct content {
-    enum { CM_INACTIVE, CM_STARTING, CM_ACTIVE } state;
+    enum { CM_INACTIVE, CM_STARTING, CM_ACTIVE, CM_STOPPING } state;
 
     int error;
 
@@ -19,11 +31,75 @@ struct content {
     uint8_t *pos_field;
 
     struct bt_stream *rds;
-    struct bt_stream *wrs;
+    struct bt_stream *wrs;  // Only used by the disk jobs.
+    struct bt_stream *jrds; // The disk jobs' read stream.
+    struct bt_stream *tbts[CM_TEST_STREAMS]; // Idle test job streams.
+    unsigned ntbts;
+
+    uint8_t *hashes;        // The pieces' hashes, from the metainfo.
+
+    struct disk_strand ds;
+    uint16_t *pc_writes;    // Block writes in progress per piece.
+    uint8_t *test_field;    // Pieces waiting for or being tested.
+    struct cm_hash **pc_hash;
+    unsigned ntests;        // Test jobs in progress.
+
+    struct start_test_data *std;
 
     struct resume_data *resd;
 };
 
+/*
+ * Blocks are written, content is read for uploads and pieces are tested
+ * by disk jobs off the event loop. A piece isn't tested until all its
+ * blocks have been written, and its test runs apart from the torrent's
+ * strand, on a stream of its own. Peers aren't read from while more than
+ * CM_WQUEUE_MAX bytes wait to be written.
+ */
+#define CM_WQUEUE_MAX (16 << 20)
+
+/*
+ * The hash of a piece being downloaded is computed as its blocks are
+ * written, so the piece needn't be read back to be tested. It's advanced
+ * by the write jobs, which run in order on the torrent's strand. Blocks
+ * written ahead of the hashed part are copied and held until the gap is
+ * filled. If more than CM_HASH_HOLDMAX bytes would be held the hash is
+ * given up and the piece is read from disk when tested, as are pieces
+ * that had blocks before the torrent was started.
+ */
+#define CM_HASH_HOLDMAX (1 << 21)
+
+struct cm_hash {
+    struct sha1_ctx ctx;
+    uint32_t off;       // Bytes hashed.
+    uint32_t size;
+    uint32_t nblocks;
+    size_t nheld;
+    int lost;
+    uint8_t *held[];
+};
+
+struct cm_job {
+    struct disk_job dj;
+    struct torrent *tp;
+    uint32_t piece;
+    uint32_t begin;
+    size_t len;
+    uint8_t *buf;
+    int err;
+    int ok;             // For tests, bit i is set if pieces[i] is good.
+    struct bt_stream *bts;
+    struct cm_hash *hs;
+    uint32_t ra;        // Piece to read ahead, if not the tested piece.
+    int npieces;        // Pieces tested together, the first being piece.
+    uint32_t pieces[SHA1_MAXLANES];
+    void (*cb)(void *, int, uint8_t *);
+    void *arg;
+};
+
+static __thread size_t m_wbytes;
+static __thread struct pool m_blk_pool = POOL_INIT(PIECE_BLOCKLEN, 256);
+
 #define ZEROBUFLEN (1 << 14)
 
 static const uint8_t m_zerobuf[ZEROBUFLEN];
@@ -42,60 +118,51 @@ fd_cb_wr(const char *path, int *fd, void *arg)
     return vopen(fd, O_RDWR, "%s/%s", tp->tl->dir, path);
 }
 
+/*
+ * The pieces that may have changed since a torrent was last active are
+ * tested when it's started. The tests are jobs on the disk threads, at
+ * most a shard's share of cm_check_jobs at a time for the torrents of the
+ * shard. Each torrent being started gets to submit
+ * a test in turn, and each test asks the system to read ahead the piece
+ * to be tested once the jobs before it are done.
+ */
 struct start_test_data {
     struct torrent *tp;
     struct file_time_size *fts;
-    uint32_t start;
+    uint32_t next;      // The next piece to submit a test for.
+    uint32_t ntests;    // The number of pieces to test.
+    uint32_t ndone;
     BTPDQ_ENTRY(start_test_data) entry;
 };
 
 BTPDQ_HEAD(std_tq, start_test_data);
 
-static struct std_tq m_startq = BTPDQ_HEAD_INITIALIZER(m_startq);
-
-static struct timeout m_workev;
-
-#define READBUFLEN (1 << 14)
+static __thread struct std_tq m_startq;
+static __thread unsigned m_nchecks;
 
+/*
+ * Called from the test jobs.
+ */
 static int
 test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece)
 {
-    char piece_hash[SHA_DIGEST_LENGTH];
-    tlib_read_hash(tp->tl, tp->pieces_off, piece, piece_hash);
-    return bcmp(hash, piece_hash, SHA_DIGEST_LENGTH);
+    return bcmp(hash, tp->cm->hashes + piece * SHA_DIGEST_LENGTH,
+        SHA_DIGEST_LENGTH);
 }
 
-static int
-test_piece(struct torrent *tp, uint32_t piece, int *ok)
-{
-    int err;
-    uint8_t hash[SHA_DIGEST_LENGTH];
-    if ((err = bts_sha(tp->cm->rds, piece * tp->piece_length,
-             torrent_piece_size(tp, piece), hash)) != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-            bts_filename(tp->cm->rds), strerror(err));
-        return err;;
-    }
-    *ok = test_hash(tp, hash, piece) == 0;
-    return 0;
-}
-
-static int test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece);
-
 static void startup_test_run(void);
 
-void
-worker_cb(int fd, short type, void *arg)
-{
-    startup_test_run();
-}
-
 void
 cm_kill(struct torrent *tp)
 {
     struct content *cm = tp->cm;
+    cache_forget(tp);
     tlib_close_resume(cm->resd);
     free(cm->pos_field);
+    free(cm->pc_writes);
+    free(cm->pc_hash);
+    free(cm->test_field);
+    free(cm->hashes);
     free(cm);
     tp->cm = NULL;
 }
@@ -137,6 +204,32 @@ cm_write_done(struct torrent *tp)
         cm_save(tp);
 }
 
+static void hash_free(struct cm_hash *hs);
+
+static void
+cm_stop_end(struct torrent *tp)
+{
+    struct content *cm = tp->cm;
+
+    if (cm->rds != NULL)
+        bts_close(cm->rds);
+    if (cm->jrds != NULL)
+        bts_close(cm->jrds);
+    cm->rds = cm->jrds = NULL;
+    while (cm->ntbts > 0)
+        bts_close(cm->tbts[--cm->ntbts]);
+    if (cm->wrs != NULL)
+        cm_write_done(tp);
+    bzero(cm->test_field, ceil(tp->npieces / 8.0));
+    for (uint32_t i = 0; i < tp->npieces; i++)
+        if (cm->pc_hash[i] != NULL) {
+            hash_free(cm->pc_hash[i]);
+            cm->pc_hash[i] = NULL;
+        }
+
+    cm->state = CM_INACTIVE;
+}
+
 void
 cm_stop(struct torrent *tp)
 {
@@ -145,23 +238,17 @@ cm_stop(struct torrent *tp)
     if (cm->state != CM_STARTING && cm->state != CM_ACTIVE)
         return;
 
-    if (cm->state == CM_STARTING) {
-        struct start_test_data *std;
-        BTPDQ_FOREACH(std, &m_startq, entry)
-            if (std->tp == tp) {
-                BTPDQ_REMOVE(&m_startq, std, entry);
-                free(std->fts);
-                free(std);
-                break;
-            }
+    if (cm->state == CM_STARTING && cm->std != NULL) {
+        BTPDQ_REMOVE(&m_startq, cm->std, entry);
+        free(cm->std->fts);
+        free(cm->std);
+        cm->std = NULL;
     }
 
-    if (cm->rds != NULL)
-        bts_close(cm->rds);
-    if (cm->wrs != NULL)
-        cm_write_done(tp);
-
-    cm->state = CM_INACTIVE;
+    if (cm->ds.njobs > 0 || cm->ntests > 0)
+        cm->state = CM_STOPPING;
+    else
+        cm_stop_end(tp);
 }
 
 int
@@ -191,6 +278,13 @@ cm_create(struct torrent *tp, const char *mi)
     struct content *cm = btpd_calloc(1, sizeof(*cm));
     cm->bppbf = ceil((double)tp->piece_length / (1 << 17));
     cm->pos_field = btpd_calloc(pfield_size, 1);
+    cm->test_field = btpd_calloc(pfield_size, 1);
+    cm->pc_writes = btpd_calloc(tp->npieces, sizeof(*cm->pc_writes));
+    cm->pc_hash = btpd_calloc(tp->npieces, sizeof(*cm->pc_hash));
+    cm->hashes = btpd_malloc(tp->npieces * SHA_DIGEST_LENGTH);
+    bcopy(benc_dget_mem(benc_dget_dct(mi, "info"), "pieces", NULL),
+        cm->hashes, tp->npieces * SHA_DIGEST_LENGTH);
+    disk_strand_init(&cm->ds);
     cm->resd = tlib_open_resume(tp->tl, tp->nfiles, pfield_size,
         cm->bppbf * tp->npieces);
     cm->piece_field = resume_piece_field(cm->resd);
@@ -217,6 +311,43 @@ cm_get_bytes(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
     return err;
 }
 
+#ifdef HAVE_PREADV2_NOWAIT
+/*
+ * Reads len bytes of the piece, starting at begin, into buf if they're
+ * all in the page cache. Returns EAGAIN if that would mean waiting for
+ * the disk, in which case they're to be read by cm_read instead.
+ */
+int
+cm_get_cached(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, uint8_t *buf)
+{
+    int err, fd;
+    off_t foff;
+    size_t flen, want, got = 0;
+    ssize_t nread;
+    struct iovec iov;
+
+    if (tp->cm->error)
+        return EIO;
+
+    while (got < len) {
+        err = bts_fdoff(tp->cm->rds, piece * tp->piece_length + begin + got,
+            &fd, &foff, &flen);
+        if (err != 0)
+            return err;
+        want = min(len - got, flen);
+        iov.iov_base = buf + got;
+        iov.iov_len = want;
+        if ((nread = preadv2(fd, &iov, 1, foff, RWF_NOWAIT)) < 0)
+            return errno;
+        else if (nread < want)
+            return EAGAIN;
+        got += nread;
+    }
+    return 0;
+}
+#endif
+
 void
 cm_prealloc(struct torrent *tp, uint32_t piece)
 {
@@ -226,14 +357,11 @@ cm_prealloc(struct torrent *tp, uint32_t piece)
         set_bit(cm->pos_field, piece);
 }
 
-void
-cm_test_piece(struct torrent *tp, uint32_t piece)
+static void
+cm_test_done(struct torrent *tp, uint32_t piece, int ok)
 {
-    int ok;
     struct content *cm = tp->cm;
-    if ((errno = test_piece(tp, piece, &ok)) != 0)
-        cm_on_error(tp);
-    else if (ok) {
+    if (ok) {
         assert(cm->npieces_got < tp->npieces);
         cm->npieces_got++;
         set_bit(cm->piece_field, piece);
@@ -249,11 +377,367 @@ cm_test_piece(struct torrent *tp, uint32_t piece)
     }
 }
 
+static void cm_test_submit(struct torrent *tp, uint32_t piece);
+
+/*
+ * Tests the piece once its blocks have been written. The piece is kept
+ * busy in the download, and so isn't picked, until the test is done.
+ */
+void
+cm_test_piece(struct torrent *tp, uint32_t piece)
+{
+    struct content *cm = tp->cm;
+    set_bit(cm->test_field, piece);
+    if (cm->pc_writes[piece] == 0)
+        cm_test_submit(tp, piece);
+}
+
+static void
+job_zero_run(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    off_t len = torrent_piece_size(tp, job->piece);
+    off_t off = tp->piece_length * job->piece;
+    while (len > 0 && job->err == 0) {
+        size_t wlen = min(ZEROBUFLEN, len);
+        job->err = bts_put(tp->cm->wrs, off, m_zerobuf, wlen);
+        len -= wlen;
+        off += wlen;
+    }
+}
+
+static int
+has_blocks(const uint8_t *bf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (bf[i] != 0)
+            return 1;
+    return 0;
+}
+
+static struct cm_hash *
+hash_create(struct torrent *tp, uint32_t piece)
+{
+    uint32_t nblocks = torrent_piece_blocks(tp, piece);
+    struct cm_hash *hs =
+        btpd_calloc(1, sizeof(*hs) + nblocks * sizeof(hs->held[0]));
+    sha1_init(&hs->ctx);
+    hs->size = torrent_piece_size(tp, piece);
+    hs->nblocks = nblocks;
+    return hs;
+}
+
+static void
+hash_free(struct cm_hash *hs)
+{
+    for (uint32_t i = 0; i < hs->nblocks; i++)
+        free(hs->held[i]);
+    free(hs);
+}
+
+static void
+hash_lose(struct cm_hash *hs)
+{
+    for (uint32_t i = 0; i < hs->nblocks; i++) {
+        free(hs->held[i]);
+        hs->held[i] = NULL;
+    }
+    hs->nheld = 0;
+    hs->lost = 1;
+}
+
+/*
+ * Called from the write jobs.
+ */
+static void
+hash_add(struct cm_hash *hs, uint32_t begin, const uint8_t *buf, size_t len)
+{
+    uint32_t i;
+    if (hs->lost)
+        return;
+    if (begin != hs->off) {
+        if (hs->nheld + len > CM_HASH_HOLDMAX) {
+            hash_lose(hs);
+            return;
+        }
+        hs->held[begin / PIECE_BLOCKLEN] = btpd_malloc(len);
+        bcopy(buf, hs->held[begin / PIECE_BLOCKLEN], len);
+        hs->nheld += len;
+        return;
+    }
+    sha1_update(&hs->ctx, buf, len);
+    hs->off += len;
+    while (hs->off < hs->size
+        && hs->held[i = hs->off / PIECE_BLOCKLEN] != NULL) {
+        len = min(PIECE_BLOCKLEN, hs->size - hs->off);
+        sha1_update(&hs->ctx, hs->held[i], len);
+        free(hs->held[i]);
+        hs->held[i] = NULL;
+        hs->nheld -= len;
+        hs->off += len;
+    }
+}
+
+static void
+job_write_run(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    job->err = bts_put(tp->cm->wrs, job->piece * tp->piece_length +
+        job->begin, job->buf, job->len);
+    if (job->err == 0 && job->hs != NULL)
+        hash_add(job->hs, job->begin, job->buf, job->len);
+}
+
+static void
+job_read_run(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    job->buf = btpd_malloc(job->len);
+    job->err = bts_get(tp->cm->jrds, job->piece * tp->piece_length +
+        job->begin, job->buf, job->len);
+}
+
+/*
+ * Called after the done function of each job. Finishes stopping the
+ * content once its last job is done.
+ */
+static void
+job_end(struct cm_job *job)
+{
+    struct torrent *tp = job->tp;
+    struct content *cm = tp->cm;
+    free(job);
+    if (cm->state == CM_STOPPING && cm->ds.njobs == 0 && cm->ntests == 0)
+        cm_stop_end(tp);
+}
+
+static void
+job_error(struct cm_job *job, struct bt_stream *bts)
+{
+    if (!job->tp->cm->error) {
+        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+            bts_filename(bts), strerror(job->err));
+        cm_on_error(job->tp);
+    }
+}
+
+static void
+job_zero_done(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    if (job->err != 0)
+        job_error(job, job->tp->cm->wrs);
+    job_end(job);
+}
+
+static void
+job_write_done(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct content *cm = tp->cm;
+    uint32_t piece = job->piece;
+
+    m_wbytes -= job->len;
+    cm->pc_writes[piece]--;
+    if (job->err != 0)
+        job_error(job, cm->wrs);
+    if (job->len <= PIECE_BLOCKLEN)
+        pool_put(&m_blk_pool, job->buf);
+    else
+        free(job->buf);
+
+    if (cm->pc_writes[piece] == 0 && has_bit(cm->test_field, piece)
+        && !cm->error)
+        cm_test_submit(tp, piece);
+    if (m_wbytes <= CM_WQUEUE_MAX / 2)
+        net_on_disk_ready();
+    job_end(job);
+}
+
+static void
+job_read_done(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    if (job->err != 0)
+        job_error(job, job->tp->cm->jrds);
+    job->cb(job->arg, job->err, job->buf);
+    job_end(job);
+}
+
+static void
+job_test_run(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct cm_hash *hs = job->hs;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    if (job->ra != job->piece) {
+        off_t len = 0;
+        for (uint32_t i = job->ra;
+             i < job->ra + job->npieces && i < tp->npieces; i++)
+            len += torrent_piece_size(tp, i);
+        bts_willneed(job->bts, (off_t)job->ra * tp->piece_length, len);
+    }
+    if (job->npieces > 1) {
+        uint8_t hashes[SHA1_MAXLANES][SHA_DIGEST_LENGTH];
+        uint8_t *hp[SHA1_MAXLANES];
+        off_t start[SHA1_MAXLANES];
+        for (int i = 0; i < job->npieces; i++) {
+            hp[i] = hashes[i];
+            start[i] = (off_t)job->pieces[i] * tp->piece_length;
+        }
+        job->err = bts_sha_multi(job->bts, start, job->npieces,
+            torrent_piece_size(tp, job->piece), hp);
+        for (int i = 0; i < job->npieces && job->err == 0; i++)
+            if (test_hash(tp, hashes[i], job->pieces[i]) == 0)
+                job->ok |= 1 << i;
+        return;
+    }
+    if (hs != NULL && !hs->lost && hs->off == hs->size)
+        sha1_final(&hs->ctx, hash);
+    else
+        job->err = bts_sha(job->bts, job->piece * tp->piece_length,
+            torrent_piece_size(tp, job->piece), hash);
+    if (job->err == 0)
+        job->ok = test_hash(tp, hash, job->piece) == 0;
+}
+
+static int
+test_stream_get(struct torrent *tp, struct bt_stream **bts)
+{
+    struct content *cm = tp->cm;
+    if (cm->ntbts > 0) {
+        *bts = cm->tbts[--cm->ntbts];
+        return 0;
+    }
+    return bts_open(bts, tp->nfiles, tp->files, fd_cb_rd, tp);
+}
+
+/*
+ * A stream that had an error is closed rather than reused.
+ */
+static void
+test_stream_put(struct torrent *tp, struct bt_stream *bts, int err)
+{
+    struct content *cm = tp->cm;
+    if (err == 0 && cm->ntbts < CM_TEST_STREAMS)
+        cm->tbts[cm->ntbts++] = bts;
+    else
+        bts_close(bts);
+}
+
+static void
+job_test_done(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct content *cm = tp->cm;
+
+    cm->ntests--;
+    clear_bit(cm->test_field, job->piece);
+    if (job->err != 0)
+        job_error(job, job->bts);
+    else if (!cm->error)
+        cm_test_done(tp, job->piece, job->ok);
+    test_stream_put(tp, job->bts, job->err);
+    if (job->hs != NULL)
+        hash_free(job->hs);
+    job_end(job);
+}
+
+static void
+job_submit(struct torrent *tp, struct cm_job *job,
+    void (*run)(struct disk_job *), void (*done)(struct disk_job *))
+{
+    job->tp = tp;
+    job->dj.run = run;
+    job->dj.done = done;
+    disk_submit(&tp->cm->ds, &job->dj);
+}
+
+/*
+ * Submits a test of the n pieces, which runs on a stream of its own and
+ * apart from the torrent's strand. Pieces tested together must be of the
+ * same size.
+ */
+static int
+test_submit(struct torrent *tp, const uint32_t *pieces, int n, uint32_t ra,
+    void (*done)(struct disk_job *), void *arg)
+{
+    int err;
+    struct cm_job *job = btpd_calloc(1, sizeof(*job));
+    if ((err = test_stream_get(tp, &job->bts)) != 0) {
+        btpd_log(BTPD_L_ERROR, "failed to open stream for '%s' (%s).\n",
+            torrent_name(tp), strerror(err));
+        free(job);
+        cm_on_error(tp);
+        return err;
+    }
+    job->tp = tp;
+    job->piece = pieces[0];
+    job->npieces = n;
+    bcopy(pieces, job->pieces, n * sizeof(*pieces));
+    job->ra = ra;
+    job->arg = arg;
+    job->hs = tp->cm->pc_hash[job->piece];
+    tp->cm->pc_hash[job->piece] = NULL;
+    job->dj.run = job_test_run;
+    job->dj.done = done;
+    tp->cm->ntests++;
+    disk_submit(NULL, &job->dj);
+    return 0;
+}
+
+static void
+cm_test_submit(struct torrent *tp, uint32_t piece)
+{
+    test_submit(tp, &piece, 1, piece, job_test_done, NULL);
+}
+
+/*
+ * Reads len bytes of the piece, starting at begin, off the event loop.
+ * When done cb is called with an error code and the data, which the
+ * callback must free. The data is there even if the read failed.
+ */
+int
+cm_read(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    void (*cb)(void *, int, uint8_t *), void *arg)
+{
+    struct cm_job *job;
+
+    if (tp->cm->error || tp->cm->jrds == NULL)
+        return EIO;
+
+    job = btpd_calloc(1, sizeof(*job));
+    job->piece = piece;
+    job->begin = begin;
+    job->len = len;
+    job->cb = cb;
+    job->arg = arg;
+    job_submit(tp, job, job_read_run, job_read_done);
+    return 0;
+}
+
+int
+cm_write_full(void)
+{
+    return m_wbytes >= CM_WQUEUE_MAX;
+}
+
+/*
+ * Queues the block to be written. Space for pieces not yet written to is
+ * first filled with zeros, cm_alloc_size bytes at a time. The block is
+ * counted as had right away, so it isn't requested again while queued.
+ */
 int
 cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
     const uint8_t *buf, size_t len)
 {
-    int err;
+    struct cm_job *job;
     struct content *cm = tp->cm;
 
     if (cm->error)
@@ -271,35 +755,30 @@ cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
         while (start < end) {
             if (!has_bit(cm->pos_field, start)) {
                 assert(!has_bit(cm->piece_field, start));
-                off_t len = torrent_piece_size(tp, start);
-                off_t off = tp->piece_length * start;
-                while (len > 0) {
-                    size_t wlen = min(ZEROBUFLEN, len);
-                    if ((err = bts_put(cm->wrs, off, m_zerobuf, wlen)) != 0) {
-                        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-                            bts_filename(cm->wrs), strerror(errno));
-                        cm_on_error(tp);
-                        return err;
-                    }
-
-                    len -= wlen;
-                    off += wlen;
-                }
+                job = btpd_calloc(1, sizeof(*job));
+                job->piece = start;
+                job_submit(tp, job, job_zero_run, job_zero_done);
                 set_bit(cm->pos_field, start);
             }
             start++;
         }
     }
-    err = bts_put(cm->wrs, piece * tp->piece_length + begin, buf, len);
-    if (err != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s)\n",
-            bts_filename(cm->wrs), strerror(err));
-        cm_on_error(tp);
-        return err;
-    }
 
+    job = btpd_calloc(1, sizeof(*job));
+    job->piece = piece;
+    job->begin = begin;
+    job->len = len;
+    job->buf = len <= PIECE_BLOCKLEN ?
+        pool_get(&m_blk_pool) : btpd_malloc(len);
+    bcopy(buf, job->buf, len);
+    if (cm->pc_hash[piece] == NULL && !has_blocks(bf, cm->bppbf))
+        cm->pc_hash[piece] = hash_create(tp, piece);
+    job->hs = cm->pc_hash[piece];
     cm->ncontent_bytes += len;
     set_bit(bf, begin / PIECE_BLOCKLEN);
+    cm->pc_writes[piece]++;
+    m_wbytes += len;
+    job_submit(tp, job, job_write_run, job_write_done);
 
     return 0;
 }
@@ -378,42 +857,40 @@ again:
     return 0;
 }
 
-void
-startup_test_end(struct torrent *tp, int unclean)
+static void
+startup_test_end(struct torrent *tp, struct start_test_data *std)
 {
     struct content *cm = tp->cm;
-
-    bzero(cm->pos_field, ceil(tp->npieces / 8.0));
-    for (uint32_t piece = 0; piece < tp->npieces; piece++) {
-        if (cm_has_piece(tp, piece)) {
-            cm->ncontent_bytes += torrent_piece_size(tp, piece);
-            cm->npieces_got++;
-            set_bit(cm->pos_field, piece);
-            continue;
-        }
+    uint32_t piece, last = tp->npieces - 1;
+
+    bcopy(cm->piece_field, cm->pos_field, ceil(tp->npieces / 8.0));
+    cm->npieces_got += count_bits(cm->piece_field, tp->npieces);
+    cm->ncontent_bytes += (off_t)cm->npieces_got * tp->piece_length;
+    if (cm_has_piece(tp, last))
+        cm->ncontent_bytes -= tp->piece_length - torrent_piece_size(tp, last);
+    for (piece = next_zero_bit(cm->piece_field, tp->npieces, 0);
+         piece < tp->npieces;
+         piece = next_zero_bit(cm->piece_field, tp->npieces, piece + 1)) {
         uint8_t *bf = cm->block_field + cm->bppbf * piece;
         uint32_t nblocks = torrent_piece_blocks(tp, piece);
-        uint32_t nblocks_got = 0;
-        for (uint32_t i = 0; i < nblocks; i++) {
-            if (has_bit(bf, i)) {
-                nblocks_got++;
-                cm->ncontent_bytes +=
-                    torrent_block_size(tp, piece, nblocks, i);
-            }
-        }
-        if (nblocks_got == nblocks) {
+        uint32_t nblocks_got = count_bits(bf, nblocks);
+        if (nblocks_got == nblocks)
             bzero(bf, cm->bppbf);
-            cm->ncontent_bytes -= torrent_piece_size(tp, piece);
-        } else if (nblocks_got > 0)
+        else if (nblocks_got > 0) {
+            cm->ncontent_bytes += (off_t)nblocks_got * PIECE_BLOCKLEN;
+            if (has_bit(bf, nblocks - 1))
+                cm->ncontent_bytes -= PIECE_BLOCKLEN
+                    - torrent_block_size(tp, piece, nblocks, nblocks - 1);
             set_bit(cm->pos_field, piece);
+        }
     }
-    if (unclean) {
-        struct start_test_data *std = BTPDQ_FIRST(&m_startq);
+    if (std != NULL) {
         BTPDQ_REMOVE(&m_startq, std, entry);
         for (int i = 0; i < tp->nfiles; i++)
             resume_set_fts(cm->resd, i, std->fts + i);
         free(std->fts);
         free(std);
+        cm->std = NULL;
     }
     if (!cm_full(tp)) {
         int err;
@@ -429,57 +906,116 @@ startup_test_end(struct torrent *tp, int unclean)
     cm->state = CM_ACTIVE;
 }
 
-void
+static uint32_t
+next_test(struct torrent *tp, uint32_t piece)
+{
+    return next_bit(tp->cm->pos_field, tp->npieces, piece);
+}
+
+static void
+job_start_test_done(struct disk_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct content *cm = tp->cm;
+    struct start_test_data *std = job->arg;
+
+    m_nchecks--;
+    cm->ntests--;
+    if (cm->state == CM_STARTING) {
+        if (job->err != 0)
+            job_error(job, job->bts);
+        else {
+            for (int i = 0; i < job->npieces; i++)
+                if (job->ok & (1 << i))
+                    set_bit(cm->piece_field, job->pieces[i]);
+                else
+                    clear_bit(cm->piece_field, job->pieces[i]);
+            std->ndone += job->npieces;
+            if (std->ndone == std->ntests)
+                startup_test_end(tp, std);
+        }
+    }
+    test_stream_put(tp, job->bts, job->err);
+    job_end(job);
+    startup_test_run();
+}
+
+/*
+ * Submits tests until the shard's jobs are running, taking pieces from each
+ * torrent in turn. As many pieces of the same size as the SHA1 code can
+ * hash in lockstep are tested by each job.
+ */
+static void
 startup_test_run(void)
 {
-    int ok;
+    struct start_test_data *std;
     struct torrent *tp;
-    struct content *cm;
-    struct start_test_data * std = BTPDQ_FIRST(&m_startq);
-    uint32_t this;
-    if (std == NULL)
-        return;
-    tp = std->tp;
-    cm = tp->cm;
-    if (test_piece(std->tp, std->start, &ok) != 0) {
-        cm_on_error(std->tp);
-        return;
+    uint32_t ra, pieces[SHA1_MAXLANES];
+    int n, npieces, lanes = sha1_lanes();
+    unsigned jobs = shard_share(cm_check_jobs);
+
+    while (m_nchecks < jobs) {
+        BTPDQ_FOREACH(std, &m_startq, entry)
+            if (std->next < std->tp->npieces)
+                break;
+        if (std == NULL)
+            return;
+        tp = std->tp;
+        BTPDQ_REMOVE(&m_startq, std, entry);
+        BTPDQ_INSERT_TAIL(&m_startq, std, entry);
+        ra = std->next;
+        for (npieces = 0; npieces < lanes && ra < tp->npieces
+                 && torrent_piece_size(tp, ra)
+                 == torrent_piece_size(tp, std->next); npieces++) {
+            pieces[npieces] = ra;
+            ra = next_test(tp, ra + 1);
+        }
+        for (n = 1; n < jobs * npieces && ra < tp->npieces; n++)
+            ra = next_test(tp, ra + 1);
+        if (ra >= tp->npieces)
+            ra = std->next;
+        if (test_submit(tp, pieces, npieces, ra, job_start_test_done,
+                std) != 0)
+            continue;
+        m_nchecks++;
+        std->next = next_test(tp, pieces[npieces - 1] + 1);
     }
-    if (ok)
-        set_bit(cm->piece_field, std->start);
-    else
-        clear_bit(cm->piece_field, std->start);
-    this = std->start;
-    do
-        std->start++;
-    while (std->start < tp->npieces && !has_bit(cm->pos_field, std->start));
-    if (std->start >= tp->npieces)
-        startup_test_end(tp, 1);
-    if (!BTPDQ_EMPTY(&m_startq))
-        btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
 }
 
-void
+static void
 startup_test_begin(struct torrent *tp, struct file_time_size *fts)
 {
-    uint32_t piece = 0;
     struct content *cm = tp->cm;
-    while (piece < tp->npieces && !has_bit(cm->pos_field, piece))
-        piece++;
+    uint32_t piece = next_test(tp, 0);
     if (piece < tp->npieces) {
         struct start_test_data *std = btpd_calloc(1, sizeof(*std));
         std->tp = tp;
-        std->start = piece;
+        std->next = piece;
         std->fts = fts;
+        for (; piece < tp->npieces; piece = next_test(tp, piece + 1))
+            std->ntests++;
+        cm->std = std;
         BTPDQ_INSERT_TAIL(&m_startq, std, entry);
-        if (std == BTPDQ_FIRST(&m_startq))
-            btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
+        startup_test_run();
     } else {
         free(fts);
-        startup_test_end(tp, 0);
+        startup_test_end(tp, NULL);
     }
 }
 
+/*
+ * Returns the number of pieces tested and to test while the torrent is
+ * being started.
+ */
+void
+cm_check_progress(struct torrent *tp, uint32_t *done, uint32_t *total)
+{
+    struct start_test_data *std = tp->cm->std;
+    *done = std != NULL ? std->ndone : 0;
+    *total = std != NULL ? std->ntests : 0;
+}
+
 void
 cm_start(struct torrent *tp, int force_test)
 {
@@ -490,7 +1026,9 @@ cm_start(struct torrent *tp, int force_test)
     cm->state = CM_STARTING;
 
     if ((errno =
-            bts_open(&cm->rds, tp->nfiles, tp->files, fd_cb_rd, tp)) != 0) {
+            bts_open(&cm->rds, tp->nfiles, tp->files, fd_cb_rd, tp)) != 0
+        || (errno =
+            bts_open(&cm->jrds, tp->nfiles, tp->files, fd_cb_rd, tp)) != 0) {
         btpd_log(BTPD_L_ERROR, "failed to open stream for '%s' (%s).\n",
             torrent_name(tp), strerror(errno));
         cm_on_error(tp);
@@ -539,5 +1077,5 @@ cm_start(struct torrent *tp, int force_test)
 void
 cm_init(void)
 {
-    evtimer_init(&m_workev, worker_cb, NULL);
+    BTPDQ_INIT(&m_startq);
 }
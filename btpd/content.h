@@ -2,7 +2,6 @@
 #define BTPD_CONTENT_H
 
 void cm_init(void);
-
 void cm_create(struct torrent *tp, const char *mi);
 void cm_kill(struct torrent *tp);
 
@@ -26,8 +25,14 @@ int cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
     const uint8_t *buf, size_t len);
 int cm_get_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
     size_t len, uint8_t **buf);
+int cm_read(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    void (*cb)(void *, int, uint8_t *), void *arg);
+int cm_write_full(void);
+int cm_get_cached(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, uint8_t *buf);
 
 void cm_prealloc(struct torrent *tp, uint32_t piece);
 void cm_test_piece(struct torrent *tp, uint32_t piece);
+void cm_check_progress(struct torrent *tp, uint32_t *done, uint32_t *total);
 
 #endif
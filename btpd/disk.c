@@ -0,0 +1,122 @@
+#include "btpd.h"
+
+#include <pthread.h>
+
+/*
+ * A pool of threads doing disk I/O off the event loop. Jobs are given to
+ * a strand, usually one per torrent, and their run function is called on
+ * one of the threads. When it returns the job's done function is called
+ * on the shard that submitted it. Jobs without a strand are run in any
+ * order, after the strands waiting to run.
+ *
+ * Only the worker running a strand touches it, and it lets go of the
+ * strand before posting the job back, so once the shard has seen all jobs
+ * of a strand done it can free it.
+ */
+
+BTPDQ_HEAD(disk_strand_tq, disk_strand);
+
+static struct disk_strand_tq m_runq = BTPDQ_HEAD_INITIALIZER(m_runq);
+static struct disk_job_tq m_jobq = BTPDQ_HEAD_INITIALIZER(m_jobq);
+static pthread_mutex_t m_lock;
+static pthread_cond_t m_cond;
+
+static void
+disk_td_cb(void *arg)
+{
+    struct disk_job *job = arg;
+    if (job->ds != NULL)
+        job->ds->njobs--;
+    job->done(job);
+}
+
+static void *
+disk_td(void *arg)
+{
+    struct disk_strand *ds;
+    struct disk_job *job;
+
+    pthread_mutex_lock(&m_lock);
+    while (1) {
+        while (BTPDQ_EMPTY(&m_runq) && BTPDQ_EMPTY(&m_jobq))
+            pthread_cond_wait(&m_cond, &m_lock);
+        if ((ds = BTPDQ_FIRST(&m_runq)) != NULL) {
+            BTPDQ_REMOVE(&m_runq, ds, entry);
+            ds->queued = 0;
+            ds->running = 1;
+            job = BTPDQ_FIRST(&ds->jobs);
+            BTPDQ_REMOVE(&ds->jobs, job, entry);
+        } else {
+            job = BTPDQ_FIRST(&m_jobq);
+            BTPDQ_REMOVE(&m_jobq, job, entry);
+        }
+        pthread_mutex_unlock(&m_lock);
+
+        job->run(job);
+
+        if (ds != NULL) {
+            pthread_mutex_lock(&m_lock);
+            ds->running = 0;
+            if (!BTPDQ_EMPTY(&ds->jobs)) {
+                ds->queued = 1;
+                BTPDQ_INSERT_TAIL(&m_runq, ds, entry);
+            }
+            pthread_mutex_unlock(&m_lock);
+        }
+
+        shard_post(job->sh, disk_td_cb, job);
+
+        pthread_mutex_lock(&m_lock);
+    }
+    return NULL;
+}
+
+void
+disk_strand_init(struct disk_strand *ds)
+{
+    bzero(ds, sizeof(*ds));
+    BTPDQ_INIT(&ds->jobs);
+}
+
+/*
+ * Called on a shard's thread. The strand's njobs counts the jobs that
+ * haven't been done yet, not counting the one whose done function is
+ * running. The strand may be NULL.
+ */
+void
+disk_submit(struct disk_strand *ds, struct disk_job *job)
+{
+    job->ds = ds;
+    job->sh = btpd_shard;
+    pthread_mutex_lock(&m_lock);
+    if (ds == NULL) {
+        BTPDQ_INSERT_TAIL(&m_jobq, job, entry);
+        pthread_cond_signal(&m_cond);
+    } else {
+        ds->njobs++;
+        BTPDQ_INSERT_TAIL(&ds->jobs, job, entry);
+        if (!ds->queued && !ds->running) {
+            ds->queued = 1;
+            BTPDQ_INSERT_TAIL(&m_runq, ds, entry);
+            pthread_cond_signal(&m_cond);
+        }
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+static void
+errdie(int err, const char *str)
+{
+    if (err != 0)
+        btpd_err("disk_init: %s (%s).\n", str, strerror(err));
+}
+
+void
+disk_init(void)
+{
+    pthread_t td;
+    errdie(pthread_mutex_init(&m_lock, NULL), "pthread_mutex_init");
+    errdie(pthread_cond_init(&m_cond, NULL), "pthread_cond_init");
+    for (int i = 0; i < disk_threads; i++)
+        errdie(pthread_create(&td, NULL, disk_td, NULL), "pthread_create");
+}
@@ -0,0 +1,33 @@
+#ifndef BTPD_DISK_H
+#define BTPD_DISK_H
+
+struct disk_strand;
+
+struct disk_job {
+    struct disk_strand *ds;
+    struct shard *sh;
+    void (*run)(struct disk_job *job);
+    void (*done)(struct disk_job *job);
+    BTPDQ_ENTRY(disk_job) entry;
+};
+
+BTPDQ_HEAD(disk_job_tq, disk_job);
+
+/*
+ * The jobs of a strand are run one at a time and in the order they were
+ * submitted. Different strands are run in parallel. Jobs submitted
+ * without a strand may run in parallel with any other job.
+ */
+struct disk_strand {
+    struct disk_job_tq jobs;
+    unsigned njobs;
+    int queued;
+    int running;
+    BTPDQ_ENTRY(disk_strand) entry;
+};
+
+void disk_init(void);
+void disk_strand_init(struct disk_strand *ds);
+void disk_submit(struct disk_strand *ds, struct disk_job *job);
+
+#endif
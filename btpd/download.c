@@ -10,7 +10,7 @@ void
 dl_on_piece_ann(struct peer *p, uint32_t index)
 {
     struct net *n = p->n;
-    n->piece_count[index]++;
+    dl_piece_count_inc(n, index);
     if (cm_has_piece(n->tp, index))
         return;
     struct piece *pc = dl_find_piece(n, index);
@@ -32,6 +32,29 @@ dl_on_piece_ann(struct peer *p, uint32_t index)
     }
 }
 
+/*
+ * Called when a peer announces it has every piece, before it has
+ * announced any. Instead of counting each piece it's counted as a seed,
+ * which changes the order of none of them. It's wanted for every piece
+ * dl_on_piece_ann would have wanted it for.
+ */
+void
+dl_on_seed_ann(struct peer *p)
+{
+    struct net *n = p->n;
+    struct piece *pc;
+    uint32_t want = n->tp->npieces - cm_pieces(n->tp);
+    p->mp->flags |= PF_SEED;
+    n->nseeds++;
+    if (!n->endgame)
+        BTPDQ_FOREACH(pc, &n->getlst, entry)
+            if (piece_full(pc))
+                want--;
+    peer_want_pieces(p, want);
+    if (want > 0 && peer_leech_ok(p))
+        dl_on_download(p);
+}
+
 void
 dl_on_download(struct peer *p)
 {
@@ -83,11 +106,16 @@ dl_on_ok_piece(struct net *n, uint32_t piece)
             peer_send(p, have);
     nb_drop(have);
 
+    if (cm_full(n->tp))
+        BTPDQ_FOREACH(p, &n->peers, p_entry)
+            peer_timer_update(p);
+
     if (n->endgame)
         BTPDQ_FOREACH(p, &n->peers, p_entry)
             peer_unwant(p, pc->index);
 
     piece_log_good(pc);
+    dl_rare_remove(n, pc->index);
 
     assert(pc->nreqs == 0);
     piece_free(pc);
@@ -104,8 +132,7 @@ dl_on_bad_piece(struct net *n, uint32_t piece)
     btpd_log(BTPD_L_ERROR, "Bad hash for piece %u of '%s'.\n",
         pc->index, torrent_name(n->tp));
 
-    for (uint32_t i = 0; i < pc->nblocks; i++)
-        clear_bit(pc->down_field, i);
+    clear_bits(pc->down_field, 0, pc->nblocks);
 
     pc->ngot = 0;
     pc->nbusy = 0;
@@ -131,10 +158,13 @@ void
 dl_on_lost_peer(struct peer *p)
 {
     struct net *n = p->n;
+    uint32_t i, npieces = n->tp->npieces;
 
-    for (uint32_t i = 0; i < n->tp->npieces; i++)
-        if (peer_has(p, i))
-            n->piece_count[i]--;
+    if (p->mp->flags & PF_SEED)
+        n->nseeds--;
+    else
+        BIT_FOREACH(i, p->piece_field, npieces)
+            dl_piece_count_dec(n, i);
 
     if (p->nreqs_out > 0)
         dl_on_undownload(p);
@@ -168,17 +198,15 @@ dl_on_block(struct peer *p, struct block_request *req,
             if (nb_get_begin(req->msg) != begin)
                 continue;
             BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
-            nb_drop(req->msg);
             if (peer_leech_ok(req->p))
                 dl_assign_requests_eg(req->p);
-            free(req);
+            dl_free_request(req);
         }
         if (pc->ngot == pc->nblocks)
             cm_test_piece(pc->n->tp, pc->index);
     } else {
         BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
-        nb_drop(req->msg);
-        free(req);
+        dl_free_request(req);
         pc->nreqs--;
         // XXX: Needs to be looked at if we introduce snubbing.
         clear_bit(pc->down_field, begin / PIECE_BLOCKLEN);
@@ -187,5 +215,84 @@ dl_on_block(struct peer *p, struct block_request *req,
             cm_test_piece(pc->n->tp, pc->index);
         if (peer_leech_ok(p))
             dl_assign_requests(p);
+        else
+            dl_on_allowed_fast(p);
     }
 }
+
+/*
+ * Called when a peer with the fast extension won't answer a request.
+ * The block is given back so it can be requested again, from this peer
+ * or another.
+ */
+void
+dl_on_reject(struct peer *p, struct block_request *req)
+{
+    struct net *n = p->n;
+    struct piece *pc = dl_find_piece(n, nb_get_index(req->msg));
+    int was_full = piece_full(pc);
+
+    BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
+    p->nreqs_out--;
+    BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
+    pc->nreqs--;
+    if (!n->endgame) {
+        clear_bit(pc->down_field, nb_get_begin(req->msg) / PIECE_BLOCKLEN);
+        pc->nbusy--;
+    }
+    dl_free_request(req);
+    if (p->nreqs_out == 0)
+        peer_on_no_reqs(p);
+
+    if (n->endgame)
+        dl_piece_reorder_eg(pc);
+    else if (was_full)
+        dl_on_piece_unfull(pc);
+
+    if (peer_leech_ok(p))
+        dl_on_download(p);
+    else
+        dl_on_allowed_fast(p);
+}
+
+/*
+ * Requests what can be had of the piece from the peer, starting on the
+ * piece if need be. Only used outside of end game.
+ */
+static void
+dl_request_piece(struct peer *p, uint32_t index)
+{
+    struct net *n = p->n;
+    struct piece *pc;
+    if (n->endgame || peer_laden(p) || !peer_requestable(p, index)
+        || cm_has_piece(n->tp, index))
+        return;
+    if ((pc = dl_find_piece(n, index)) == NULL)
+        pc = dl_new_piece(n, index);
+    if (!piece_full(pc))
+        dl_piece_assign_requests(pc, p);
+}
+
+/*
+ * Called when a peer that chokes us may have blocks of the pieces it
+ * lets us have fast to give.
+ */
+void
+dl_on_allowed_fast(struct peer *p)
+{
+    if ((p->mp->flags & (PF_BANNED|PF_SUSPECT|PF_P_CHOKE)) != PF_P_CHOKE)
+        return;
+    for (unsigned i = 0; i < p->nfast_in; i++)
+        dl_request_piece(p, p->fast_in[i]);
+}
+
+/*
+ * Called when a peer suggests a piece. It's started before the rarest
+ * ones, since the peer is likely to have it cached.
+ */
+void
+dl_on_suggest(struct peer *p, uint32_t index)
+{
+    if (peer_leech_ok(p))
+        dl_request_piece(p, index);
+}
@@ -11,6 +11,7 @@ void piece_log_good(struct piece *pc);
 void piece_log_block(struct piece *pc, struct peer *p, uint32_t begin);
 
 void dl_on_piece_unfull(struct piece *pc);
+void dl_free_request(struct block_request *req);
 
 struct piece *dl_new_piece(struct net *n, uint32_t index);
 struct piece *dl_find_piece(struct net *n, uint32_t index);
@@ -21,6 +22,11 @@ void dl_unassign_requests(struct peer *p);
 void dl_unassign_requests_eg(struct peer *p);
 void dl_piece_reorder_eg(struct piece *pc);
 
+void dl_rare_init(struct net *n);
+void dl_rare_remove(struct net *n, uint32_t index);
+void dl_piece_count_inc(struct net *n, uint32_t index);
+void dl_piece_count_dec(struct net *n, uint32_t index);
+
 // download.c
 
 void dl_on_new_peer(struct peer *p);
@@ -31,8 +37,12 @@ void dl_on_unchoke(struct peer *p);
 void dl_on_download(struct peer *p);
 void dl_on_undownload(struct peer *p);
 void dl_on_piece_ann(struct peer *p, uint32_t index);
+void dl_on_seed_ann(struct peer *p);
 void dl_on_block(struct peer *p, struct block_request *req,
     uint32_t index, uint32_t begin, uint32_t length, const uint8_t *data);
+void dl_on_reject(struct peer *p, struct block_request *req);
+void dl_on_allowed_fast(struct peer *p);
+void dl_on_suggest(struct peer *p, uint32_t index);
 
 void dl_on_ok_piece(struct net *n, uint32_t piece);
 void dl_on_bad_piece(struct net *n, uint32_t piece);
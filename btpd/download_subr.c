@@ -21,9 +21,28 @@
 
 #include "btpd.h"
 
-#include <openssl/sha.h>
+#include <sha1.h>
 #include <stream.h>
 
+/*
+ * Block requests and the records of who sent what in a piece come and go
+ * with every block, so they're kept in pools. Records for pieces with more
+ * than BLOG_POOLBLOCKS blocks are allocated on their own.
+ */
+#define BLOG_POOLBLOCKS 256
+
+static __thread struct pool m_req_pool =
+    POOL_INIT(sizeof(struct block_request), 4096);
+static __thread struct pool m_blog_pool =
+    POOL_INIT(sizeof(struct blog_record) + BLOG_POOLBLOCKS / 8, 1024);
+
+void
+dl_free_request(struct block_request *req)
+{
+    nb_drop(req->msg);
+    pool_put(&m_req_pool, req);
+}
+
 static void
 piece_new_log(struct piece *pc)
 {
@@ -42,7 +61,7 @@ piece_log_hashes(struct piece *pc)
     for (unsigned i = 0; i < pc->nblocks; i++) {
         uint32_t bsize = torrent_block_size(tp, pc->index, pc->nblocks, i);
         cm_get_bytes(tp, pc->index, i * PIECE_BLOCKLEN, bsize, &buf);
-        SHA1(buf, bsize, &log->hashes[i * 20]);
+        sha1(buf, bsize, &log->hashes[i * 20]);
         free(buf);
     }
 }
@@ -53,7 +72,10 @@ piece_log_free(struct piece *pc, struct blog *log)
     struct blog_record *r, *rnext;
     BTPDQ_FOREACH_MUTABLE(r, &log->records, entry, rnext) {
         mp_drop(r->mp, pc->n);
-        free(r);
+        if (pc->nblocks <= BLOG_POOLBLOCKS)
+            pool_put(&m_blog_pool, r);
+        else
+            free(r);
     }
     if (log->hashes != NULL)
         free(log->hashes);
@@ -76,14 +98,9 @@ piece_log_bad(struct piece *pc)
     struct blog_record *r = BTPDQ_FIRST(&log->records);
     struct meta_peer *culprit = NULL;
 
-    if (r == BTPDQ_LAST(&log->records, blog_record_tq)) {
-        unsigned i;
-        for (i = 0; i < pc->nblocks; i++)
-            if (!has_bit(r->down_field, i))
-                break;
-        if (i == pc->nblocks)
-            culprit = r->mp;
-    }
+    if (r == BTPDQ_LAST(&log->records, blog_record_tq)
+        && next_zero_bit(r->down_field, pc->nblocks, 0) == pc->nblocks)
+        culprit = r->mp;
     if (culprit != NULL) {
         if (pc->n->endgame && culprit->p != NULL)
             peer_unwant(culprit->p, pc->index);
@@ -119,10 +136,12 @@ piece_log_good(struct piece *pc)
     while (bad != NULL) {
         BTPDQ_FOREACH(r, &bad->records, entry) {
             int culprit = 0;
-            for (unsigned i = 0; i < pc->nblocks && !culprit; i++)
-                if (has_bit(r->down_field, i) && (
-                        bcmp(&log->hashes[i*20], &bad->hashes[i*20], 20) != 0))
+            unsigned i;
+            BIT_FOREACH(i, r->down_field, pc->nblocks)
+                if (bcmp(&log->hashes[i*20], &bad->hashes[i*20], 20) != 0) {
                     culprit = 1;
+                    break;
+                }
             if (culprit)
                 net_ban_peer(pc->n, r->mp);
             else if (r->mp->p != NULL)
@@ -142,7 +161,11 @@ piece_log_block(struct piece *pc, struct peer *p, uint32_t begin)
         if (r->mp == p->mp)
             break;
     if (r == NULL) {
-        r = btpd_calloc(1, sizeof(*r) + ceil(pc->nblocks / 8.0));
+        if (pc->nblocks <= BLOG_POOLBLOCKS)
+            r = pool_get(&m_blog_pool);
+        else
+            r = btpd_malloc(sizeof(*r) + ceil(pc->nblocks / 8.0));
+        bzero(r, sizeof(*r) + ceil(pc->nblocks / 8.0));
         r->mp = p->mp;
         mp_hold(r->mp);
         BTPDQ_INSERT_HEAD(&log->records, r, entry);
@@ -177,9 +200,7 @@ piece_alloc(struct net *n, uint32_t index)
     pc->nreqs = 0;
     pc->next_block = 0;
 
-    for (unsigned i = 0; i < nblocks; i++)
-        if (has_bit(pc->have_field, i))
-            pc->ngot++;
+    pc->ngot = count_bits(pc->have_field, nblocks);
     assert(pc->ngot < pc->nblocks);
 
     BTPDQ_INIT(&pc->reqs);
@@ -190,6 +211,7 @@ piece_alloc(struct net *n, uint32_t index)
     n->npcs_busy++;
     set_bit(n->busy_field, index);
     BTPDQ_INSERT_TAIL(&n->getlst, pc, entry);
+    n->pieces[index] = pc;
     return pc;
 }
 
@@ -202,9 +224,9 @@ piece_free(struct piece *pc)
     n->npcs_busy--;
     clear_bit(n->busy_field, pc->index);
     BTPDQ_REMOVE(&pc->n->getlst, pc, entry);
+    n->pieces[pc->index] = NULL;
     BTPDQ_FOREACH_MUTABLE(req, &pc->reqs, blk_entry, next) {
-        nb_drop(req->msg);
-        free(req);
+        dl_free_request(req);
     }
     piece_kill_logs(pc);
     if (pc->eg_reqs != NULL) {
@@ -282,8 +304,7 @@ dl_enter_endgame(struct net *n)
     pi = 0;
     BTPDQ_FOREACH(pc, &n->getlst, entry) {
         struct block_request *req;
-        for (unsigned i = 0; i < pc->nblocks; i++)
-            clear_bit(pc->down_field, i);
+        clear_bits(pc->down_field, 0, pc->nblocks);
         pc->nbusy = 0;
         pc->eg_reqs = btpd_calloc(pc->nblocks, sizeof(struct net_buf *));
         BTPDQ_FOREACH(req, &pc->reqs, blk_entry) {
@@ -313,11 +334,7 @@ dl_enter_endgame(struct net *n)
 struct piece *
 dl_find_piece(struct net *n, uint32_t index)
 {
-    struct piece *pc;
-    BTPDQ_FOREACH(pc, &n->getlst, entry)
-        if (pc->index == index)
-            break;
-    return pc;
+    return n->pieces[index];
 }
 
 static int
@@ -327,51 +344,138 @@ dl_piece_startable(struct peer *p, uint32_t index)
         && !has_bit(p->n->busy_field, index);
 }
 
+/*
+ * The pieces we lack are kept in rare_order sorted by how many peers
+ * have them, in buckets of pieces with the same count. Bucket c holds
+ * the pieces from rare_start[c] up to rare_start[c + 1], and the pieces
+ * we have follow the last bucket. A piece moves to the next or previous
+ * bucket by trading places with the piece at its edge, and the edge is
+ * moved past it. The counts of all pieces can change by one at a time
+ * only, so no other pieces need to be moved.
+ */
+
+static void
+dl_rare_swap(struct net *n, uint32_t a, uint32_t b)
+{
+    uint32_t pa = n->rare_order[a], pb = n->rare_order[b];
+    n->rare_order[a] = pb;
+    n->rare_pos[pb] = a;
+    n->rare_order[b] = pa;
+    n->rare_pos[pa] = b;
+}
+
+static int
+dl_rare_has(struct net *n, uint32_t index)
+{
+    return n->rare_pos[index] < n->rare_start[n->rare_nbuckets];
+}
+
+/*
+ * Moves the piece from its bucket to the first place of the next one.
+ */
+static void
+dl_rare_up(struct net *n, uint32_t index, unsigned c)
+{
+    dl_rare_swap(n, n->rare_pos[index], n->rare_start[c + 1] - 1);
+    n->rare_start[c + 1]--;
+}
+
+/*
+ * Sets up the buckets when the torrent starts and no peer is counted.
+ */
+void
+dl_rare_init(struct net *n)
+{
+    uint32_t i, k = 0, npieces = n->tp->npieces;
+    uint8_t *have = cm_get_piece_field(n->tp);
+    for (i = next_zero_bit(have, npieces, 0); i < npieces;
+         i = next_zero_bit(have, npieces, i + 1))
+        n->rare_order[k++] = i;
+    BIT_FOREACH(i, have, npieces)
+        n->rare_order[k++] = i;
+    for (i = 0; i < n->tp->npieces; i++)
+        n->rare_pos[n->rare_order[i]] = i;
+    n->rare_nbuckets = 1;
+    n->rare_start[0] = 0;
+    n->rare_start[1] = n->tp->npieces - cm_pieces(n->tp);
+}
+
+/*
+ * Called when we've got the piece. It's moved past the last bucket.
+ */
+void
+dl_rare_remove(struct net *n, uint32_t index)
+{
+    if (!dl_rare_has(n, index))
+        return;
+    for (unsigned c = n->piece_count[index]; c < n->rare_nbuckets; c++)
+        dl_rare_up(n, index, c);
+}
+
+void
+dl_piece_count_inc(struct net *n, uint32_t index)
+{
+    unsigned c = n->piece_count[index]++;
+    if (!dl_rare_has(n, index))
+        return;
+    if (c + 1 == n->rare_nbuckets) {
+        if (n->rare_nbuckets + 1 == n->rare_cap) {
+            n->rare_cap *= 2;
+            n->rare_start = btpd_realloc(n->rare_start,
+                n->rare_cap * sizeof(*n->rare_start));
+        }
+        n->rare_start[n->rare_nbuckets + 1] =
+            n->rare_start[n->rare_nbuckets];
+        n->rare_nbuckets++;
+    }
+    dl_rare_up(n, index, c);
+}
+
+void
+dl_piece_count_dec(struct net *n, uint32_t index)
+{
+    unsigned c = n->piece_count[index]--;
+    if (!dl_rare_has(n, index))
+        return;
+    dl_rare_swap(n, n->rare_pos[index], n->rare_start[c]);
+    n->rare_start[c]++;
+}
+
 /*
  * Find the rarest piece the peer has, that isn't already allocated
  * for download or already downloaded. If no such piece can be found
  * return ENOENT.
  *
+ * The buckets are searched from the rarest pieces any peer has, and
+ * the search ends in the first one with a piece to start. If there are
+ * seeds, the pieces no other peer has are among those. It's begun
+ * at a random place in the bucket so peers don't all pick the same
+ * piece.
+ *
  * Return 0 or ENOENT, index in res.
  */
 static int
 dl_choose_rarest(struct peer *p, uint32_t *res)
 {
-    uint32_t i;
     struct net *n = p->n;
 
     assert(n->endgame == 0);
 
-    for (i = 0; i < n->tp->npieces && !dl_piece_startable(p, i); i++)
-        ;
-
-    if (i == n->tp->npieces)
-        return ENOENT;
-
-    uint32_t min_i = i;
-    uint32_t min_c = 1;
-    for(i++; i < n->tp->npieces; i++) {
-        if (dl_piece_startable(p, i)) {
-            if (n->piece_count[i] == n->piece_count[min_i])
-                min_c++;
-            else if (n->piece_count[i] < n->piece_count[min_i]) {
-                min_i = i;
-                min_c = 1;
-            }
-        }
-    }
-    if (min_c > 1) {
-        min_c = rand_between(1, min_c);
-        for (i = min_i; min_c > 0; i++) {
-            if (dl_piece_startable(p, i)
-                && n->piece_count[i] == n->piece_count[min_i]) {
-                min_c--;
-                min_i = i;
+    for (unsigned c = n->nseeds > 0 ? 0 : 1; c < n->rare_nbuckets; c++) {
+        uint32_t *bucket = n->rare_order + n->rare_start[c];
+        uint32_t len = n->rare_start[c + 1] - n->rare_start[c];
+        if (len == 0)
+            continue;
+        uint32_t off = rand_between(0, len - 1);
+        for (uint32_t j = 0; j < len; j++) {
+            uint32_t i = bucket[(off + j) % len];
+            if (dl_piece_startable(p, i)) {
+                *res = i;
+                return 0;
             }
         }
     }
-    *res = min_i;
-    return 0;
+    return ENOENT;
 }
 
 /*
@@ -433,7 +537,7 @@ dl_new_request(struct peer *p, struct piece *pc, struct net_buf *msg)
             torrent_block_size(pc->n->tp, pc->index, pc->nblocks, block);
         msg = nb_create_request(pc->index, start, length);
     }
-    struct block_request *req = btpd_malloc(sizeof(*req));
+    struct block_request *req = pool_get(&m_req_pool);
     req->p = p;
     req->msg = msg;
     nb_hold(req->msg);
@@ -459,9 +563,12 @@ dl_piece_assign_requests(struct piece *pc, struct peer *p)
     assert(!piece_full(pc) && !peer_laden(p));
     unsigned count = 0;
     do {
-        while ((has_bit(pc->have_field, pc->next_block)
-                   || has_bit(pc->down_field, pc->next_block)))
-            INCNEXTBLOCK(pc);
+        uint32_t block = next_zero_bit_or(pc->have_field, pc->down_field,
+            pc->nblocks, pc->next_block);
+        if (block == pc->nblocks)
+            block = next_zero_bit_or(pc->have_field, pc->down_field,
+                pc->nblocks, 0);
+        pc->next_block = block;
         dl_new_request(p, pc, NULL);
         INCNEXTBLOCK(pc);
         count++;
@@ -533,8 +640,7 @@ dl_unassign_requests(struct peer *p)
             BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
             p->nreqs_out--;
             BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
-            nb_drop(req->msg);
-            free(req);
+            dl_free_request(req);
             pc->nreqs--;
 
             while (next != NULL && nb_get_index(next->msg) != pc->index)
@@ -618,8 +724,7 @@ dl_unassign_requests_eg(struct peer *p)
             BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
             p->nreqs_out--;
             BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
-            nb_drop(req->msg);
-            free(req);
+            dl_free_request(req);
             pc->nreqs--;
 
             while (next != NULL && nb_get_index(next->msg) != pc->index)
@@ -87,14 +87,14 @@ parse_reply(struct torrent *tp, struct tr_response *res, const char *content,
 
     if (benc_islst(peers)) {
         for (peers = benc_first(peers);
-             peers != NULL && net_npeers < net_max_peers;
+             peers != NULL && net_peer_room();
              peers = benc_next(peers))
             maybe_connect_to(tp, peers);
     } else if (benc_isstr(peers)) {
         if (net_ipv4) {
             peers = benc_dget_mem(content, "peers", &len);
-            for (size_t i = 0; i < len && net_npeers < net_max_peers; i += 6)
-                peer_create_out_compact(tp->net, AF_INET, peers + i);
+            for (size_t i = 0; i < len && net_peer_room(); i += 6)
+                peer_create_out_compact(tp->net, AF_INET, peers + i, 0);
         }
     } else
         goto bad_data;
@@ -106,8 +106,8 @@ after_peers:
         peers = benc_dget_any(content, v6key[k]);
         if (peers != NULL && benc_isstr(peers)) {
             peers = benc_dget_mem(content, v6key[k], &len);
-            for (size_t i = 0; i < len && net_npeers < net_max_peers; i += 18)
-                peer_create_out_compact(tp->net, AF_INET6, peers + i);
+            for (size_t i = 0; i < len && net_peer_room(); i += 18)
+                peer_create_out_compact(tp->net, AF_INET6, peers + i, 0);
         }
     }
 after_peers6:
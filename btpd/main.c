@@ -2,6 +2,7 @@
 
 #include <getopt.h>
 #include <time.h>
+#include <netinet/tcp.h>
 
 int btpd_daemon_phase = 2;
 int first_btpd_comm[2];
@@ -117,6 +118,10 @@ usage(void)
         "\tLimit outgoing BitTorrent traffic to n kB/s.\n"
         "\tDefault is 0 which means unlimited.\n"
         "\n"
+        "--bw-burst n\n"
+        "\tLet traffic under a bandwidth limit burst by at most n kB.\n"
+        "\tDefault is 0 which means a tenth of the limit, but at least 16.\n"
+        "\n"
         "-d dir\n"
         "\tThe directory in which to run btpd. Default is '$HOME/.btpd'.\n"
         "\n"
@@ -160,8 +165,50 @@ usage(void)
         "\tNote that n will be rounded up to the closest multiple of the\n"
         "\ttorrent piece size. If n is zero no preallocation will be done.\n"
         "\n"
+        "--cache-size n\n"
+        "\tUse at most n MB of memory to cache pieces that several peers\n"
+        "\tdownload from btpd. Default is 32. If n is zero nothing is cached.\n"
+        "\n"
+        "--disk-threads n\n"
+        "\tUse n threads for disk reads, writes and piece tests.\n"
+        "\tDefault is 4.\n"
+        "\n"
+        "--congestion name\n"
+        "\tUse the named TCP congestion control, such as lp, for peer\n"
+        "\tconnections. A delay based one lets other traffic on the link\n"
+        "\tkeep its latency when btpd uses all the bandwidth.\n"
+        "\n"
+        "--check-jobs n\n"
+        "\tTest at most n pieces at once when checking the content of\n"
+        "\ttorrents being started. Default is 3.\n"
+        "\n"
+        "--dscp n\n"
+        "\tMark peer traffic with the DSCP n, such as 8 (CS1) to let\n"
+        "\trouters put it behind other traffic. Default is 0.\n"
+        "\n"
+        "--edge-triggered\n"
+        "\tHave the event loop report peer sockets only as they become\n"
+        "\tready, where it supports that, to save system calls.\n"
+        "\n"
+        "--utp mode\n"
+        "\tUse uTP, BitTorrent over UDP with delay based congestion\n"
+        "\tcontrol, where mode is one of:\n"
+        "\t\toff : Use TCP only (default).\n"
+        "\t\ton : Accept uTP and use it to peers known to have it.\n"
+        "\t\tprefer : Try uTP first for every peer.\n"
+        "\n"
+        "--shards n\n"
+        "\tSpread the torrents over n event loops on threads of their own.\n"
+        "\tThe bandwidth, peer, upload and cache limits are split evenly\n"
+        "\tamong them. Default is 1.\n"
+        "\n"
         "--numwant n\n"
         "\tSet the number of peers to fetch on each request. Default is 50.\n"
+        "\n"
+        "--min-requests n, --max-requests n\n"
+        "\tKeep between n block requests outstanding to each peer, as many\n"
+        "\tas its download rate and response time call for.\n"
+        "\tDefaults are 10 and 128.\n"
         "\n");
     exit(1);
 }
@@ -182,6 +229,17 @@ static struct option longopts[] = {
     { "ip", required_argument,          &longval,       10 },
     { "logmask", required_argument,     &longval,       11 },
     { "numwant", required_argument,     &longval,       12 },
+    { "cache-size", required_argument,  &longval,       13 },
+    { "disk-threads", required_argument, &longval,      14 },
+    { "check-jobs", required_argument,  &longval,       15 },
+    { "bw-burst", required_argument,    &longval,       16 },
+    { "min-requests", required_argument, &longval,      17 },
+    { "max-requests", required_argument, &longval,      18 },
+    { "congestion", required_argument,  &longval,       19 },
+    { "dscp",   required_argument,      &longval,       20 },
+    { "edge-triggered", no_argument,    &longval,       21 },
+    { "utp",    required_argument,      &longval,       22 },
+    { "shards", required_argument,      &longval,       23 },
     { "help",   no_argument,            &longval,       128 },
     { NULL,     0,                      NULL,           0 }
 };
@@ -246,6 +304,52 @@ main(int argc, char **argv)
             case 12:
                 net_numwant = (unsigned)atoi(optarg);
                 break;
+            case 13:
+                cache_size = (size_t)atoi(optarg) << 20;
+                break;
+            case 14:
+                disk_threads = max(1, atoi(optarg));
+                break;
+            case 15:
+                cm_check_jobs = max(1, atoi(optarg));
+                break;
+            case 16:
+                net_bw_burst = atoi(optarg) * 1024;
+                break;
+            case 17:
+                net_min_requests = max(1, atoi(optarg));
+                break;
+            case 18:
+                net_max_requests = max(1, atoi(optarg));
+                break;
+            case 19:
+#ifdef TCP_CONGESTION
+                net_congestion = optarg;
+#else
+                btpd_err("--congestion isn't supported on this system.\n");
+#endif
+                break;
+            case 20:
+                net_dscp = atoi(optarg);
+                if (net_dscp < 0 || net_dscp > 63)
+                    usage();
+                break;
+            case 21:
+                net_edge_triggered = 1;
+                break;
+            case 22:
+                if (strcmp(optarg, "off") == 0)
+                    net_utp = NET_UTP_OFF;
+                else if (strcmp(optarg, "on") == 0)
+                    net_utp = NET_UTP_ON;
+                else if (strcmp(optarg, "prefer") == 0)
+                    net_utp = NET_UTP_PREFER;
+                else
+                    usage();
+                break;
+            case 23:
+                btpd_shards = max(1, atoi(optarg));
+                break;
             default:
                 usage();
             }
@@ -259,6 +363,8 @@ args_done:
     argc -= optind;
     argv += optind;
 
+    net_max_requests = max(net_max_requests, net_min_requests);
+
     if (opt6) {
         net_ipv6 = 1;
         if (!opt4)
@@ -272,6 +378,7 @@ args_done:
 
     if (evloop_init() != 0)
         btpd_err("Failed to initialize evloop (%s).\n", strerror(errno));
+    evloop_set_errcb(btpd_ev_err);
 
     btpd_init();
 
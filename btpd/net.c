@@ -2,26 +2,67 @@
 
 #include <sys/uio.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+
+/*
+ * The bandwidth limits are kept with token buckets in three levels, the
+ * global limits, the limits of a torrent and the limits of each of its
+ * peers. A peer may transfer as much as the emptiest of the buckets of the
+ * levels with a limit allows, and what it transfers is taken from all of
+ * them. The limits are ceilings, so what a torrent or peer doesn't use
+ * is left in the bucket above it for its siblings to borrow.
+ *
+ * The buckets are filled with the bytes earned since they were last
+ * filled, to at most the burst size, whenever a peer wants to read or
+ * write and by a timer running while peers wait for bandwidth. The timer
+ * is set to when the buckets of the first peer able to continue will
+ * hold about a hundredth of a second's worth of traffic, but at least
+ * NET_BW_QUANTUM bytes.
+ *
+ * Each shard keeps to its share of the global limits with buckets of its
+ * own.
+ */
+#define NET_BW_MINBURST (16 << 10)
+#define NET_BW_QUANTUM 1460
+#define NET_BW_LEVELS 3
+
+struct bw_level {
+    struct bw_bucket *b;
+    unsigned limit;
+};
 
-static unsigned long m_bw_bytes_in;
-static unsigned long m_bw_bytes_out;
+static __thread struct bw_bucket m_bw_in;
+static __thread struct bw_bucket m_bw_out;
+static __thread unsigned m_bw_limit_in;
+static __thread unsigned m_bw_limit_out;
+static __thread struct timeout m_bw_timer;
 
-static unsigned long m_rate_up;
-static unsigned long m_rate_dwn;
+static __thread struct rate m_rate_up;
+static __thread struct rate m_rate_dwn;
 
 struct net_listener {
+    int family;
     int sd;
     struct fdev ev;
+    int usd;                /* The UDP socket for uTP, on the same port */
+    struct utp_sock *utp;
+    struct utp_sock *fed;   /* For uTP connections taken over from shard 0 */
 };
 
-static int m_nlisteners;
-static struct net_listener *m_net_listeners;
+/*
+ * The listeners are on shard 0. The other shards only have uTP sockets
+ * to dial from, and socks fed by shard 0 with the datagrams for the uTP
+ * connections it has handed them, which they answer on shard 0's sockets.
+ */
+static __thread int m_nlisteners;
+static __thread struct net_listener *m_net_listeners;
+static int m_utp_sd4 = -1, m_utp_sd6 = -1;
 
-unsigned net_npeers;
+__thread unsigned net_npeers;
 
-struct peer_tq net_bw_readq = BTPDQ_HEAD_INITIALIZER(net_bw_readq);
-struct peer_tq net_bw_writeq = BTPDQ_HEAD_INITIALIZER(net_bw_writeq);
-struct peer_tq net_unattached = BTPDQ_HEAD_INITIALIZER(net_unattached);
+__thread struct peer_tq net_bw_readq;
+__thread struct peer_tq net_bw_writeq;
+__thread struct peer_tq net_unattached;
 
 void
 net_ban_peer(struct net *n, struct meta_peer *mp)
@@ -31,6 +72,8 @@ net_ban_peer(struct net *n, struct meta_peer *mp)
     mp_hold(mp); // Keep the meta peer alive
     mp->flags |= PF_BANNED;
     btpd_log(BTPD_L_BAD, "banned peer %p.\n", mp);
+    if (mp->p != NULL)
+        peer_timer_update(mp->p);
 }
 
 int
@@ -39,6 +82,16 @@ net_torrent_has_peer(struct net *n, const uint8_t *id)
     return mptbl_find(n->mptbl, id) != NULL;
 }
 
+/*
+ * Whether the shard may have another peer, within its share of
+ * net_max_peers.
+ */
+int
+net_peer_room(void)
+{
+    return net_npeers < shard_share(net_max_peers);
+}
+
 void
 net_create(struct torrent *tp)
 {
@@ -53,6 +106,11 @@ net_create(struct torrent *tp)
 
     n->busy_field = btpd_calloc(ceil(tp->npieces / 8.0), 1);
     n->piece_count = btpd_calloc(tp->npieces, sizeof(*n->piece_count));
+    n->pieces = btpd_calloc(tp->npieces, sizeof(*n->pieces));
+    n->rare_order = btpd_calloc(tp->npieces, sizeof(*n->rare_order));
+    n->rare_pos = btpd_calloc(tp->npieces, sizeof(*n->rare_pos));
+    n->rare_cap = 8;
+    n->rare_start = btpd_calloc(n->rare_cap, sizeof(*n->rare_start));
 }
 
 void
@@ -67,6 +125,10 @@ net_kill(struct torrent *tp)
     }
     mptbl_free(tp->net->mptbl);
     free(tp->net->piece_count);
+    free(tp->net->pieces);
+    free(tp->net->rare_order);
+    free(tp->net->rare_pos);
+    free(tp->net->rare_start);
     free(tp->net->busy_field);
     free(tp->net);
     tp->net = NULL;
@@ -76,6 +138,7 @@ void
 net_start(struct torrent *tp)
 {
     struct net *n = tp->net;
+    dl_rare_init(n);
     n->active = 1;
 }
 
@@ -85,8 +148,8 @@ net_stop(struct torrent *tp)
     struct net *n = tp->net;
 
     n->active = 0;
-    n->rate_up = 0;
-    n->rate_dwn = 0;
+    bzero(&n->rate_up, sizeof(n->rate_up));
+    bzero(&n->rate_dwn, sizeof(n->rate_dwn));
 
     ul_on_lost_torrent(n);
 
@@ -117,38 +180,179 @@ net_active(struct torrent *tp)
     return tp->net->active;
 }
 
-#define BLOCK_MEM_COUNT 1
+static unsigned long
+bw_burst(unsigned limit)
+{
+    return net_bw_burst > 0 ? net_bw_burst : max(limit / 10, NET_BW_MINBURST);
+}
 
+static void
+bw_fill(struct bw_bucket *b, unsigned limit)
+{
+    long long now = btpd_msecs();
+    long long ms = min(now - b->time, 3600 * 1000LL);
+    unsigned long long add;
+    unsigned long burst = bw_burst(limit);
+    if (ms <= 0)
+        return;
+    b->time = now;
+    add = (unsigned long long)limit * ms + b->rem;
+    b->rem = add % 1000;
+    if (b->bytes + add / 1000 >= burst) {
+        b->bytes = burst;
+        b->rem = 0;
+    } else
+        b->bytes += add / 1000;
+}
+
+/*
+ * Fills the buckets of the levels limiting the peer's traffic in one
+ * direction and returns how many there are. A peer that hasn't told
+ * which torrent it's for yet is only limited globally.
+ */
+static int
+bw_levels(struct peer *p, int out, struct bw_level *lv)
+{
+    int n = 0;
+    struct tlib *tl;
+    if ((lv[n].limit = out ? m_bw_limit_out : m_bw_limit_in) > 0)
+        lv[n++].b = out ? &m_bw_out : &m_bw_in;
+    if (p->n != NULL) {
+        tl = p->n->tp->tl;
+        if ((lv[n].limit = out ? tl->bw_limit_out : tl->bw_limit_in) > 0)
+            lv[n++].b = out ? &p->n->bw_out : &p->n->bw_in;
+        if ((lv[n].limit =
+                out ? tl->peer_bw_limit_out : tl->peer_bw_limit_in) > 0)
+            lv[n++].b = out ? &p->bw_out : &p->bw_in;
+    }
+    for (int i = 0; i < n; i++)
+        bw_fill(lv[i].b, lv[i].limit);
+    return n;
+}
+
+/*
+ * Starts a turn for the peer and returns how many bytes it may transfer
+ * in it, 0 if it has to wait and ULONG_MAX if it isn't limited. Limited
+ * peers take turns in deficit round robin, so one that isn't on the queue
+ * waits if others are. Each turn adds a quantum of a
+ * hundredth of a second's worth of the peer's tightest limit to its
+ * deficit, and the peer may transfer as much as its deficit and buckets
+ * allow. What it's kept from using by the buckets is saved for its next
+ * turn, what it doesn't want is dropped.
+ */
 static unsigned long
-net_write(struct peer *p, unsigned long wmax)
+bw_turn(struct peer *p, int out, int others_wait)
+{
+    struct bw_level lv[NET_BW_LEVELS];
+    unsigned long allow = ULONG_MAX, quantum;
+    unsigned long *deficit = out ? &p->bw_deficit_out : &p->bw_deficit_in;
+    unsigned limit = UINT_MAX;
+    int n = bw_levels(p, out, lv);
+    if (n == 0)
+        return ULONG_MAX;
+    for (int i = 0; i < n; i++) {
+        allow = min(allow, lv[i].b->bytes);
+        limit = min(limit, lv[i].limit);
+    }
+    if (allow == 0 || others_wait)
+        return 0;
+    quantum = max(limit / 100, NET_BW_QUANTUM);
+    *deficit = min(*deficit + quantum, 2 * quantum);
+    return min(allow, *deficit);
+}
+
+/*
+ * Called with what the peer transferred of the turn's allowance.
+ */
+static void
+bw_spend(struct peer *p, int out, unsigned long bytes, unsigned long allow)
+{
+    struct bw_level lv[NET_BW_LEVELS];
+    unsigned long *deficit = out ? &p->bw_deficit_out : &p->bw_deficit_in;
+    int n = bw_levels(p, out, lv);
+    for (int i = 0; i < n; i++)
+        lv[i].b->bytes -= min(bytes, lv[i].b->bytes);
+    *deficit = bytes < allow ? 0 : *deficit - min(bytes, *deficit);
+}
+
+#ifdef EVLOOP_IOURING
+/*
+ * I/O queued on the event loop is charged all it may transfer when it's
+ * queued, so the turns of other peers don't see the bandwidth as free
+ * while it's in flight. The charge is given back when it's done, before
+ * what was transferred is spent.
+ */
+static void
+bw_charge(struct peer *p, int out, unsigned long bytes)
+{
+    struct bw_level lv[NET_BW_LEVELS];
+    int n = bw_levels(p, out, lv);
+    for (int i = 0; i < n; i++)
+        lv[i].b->bytes -= min(bytes, lv[i].b->bytes);
+}
+
+static void
+bw_refund(struct peer *p, int out, unsigned long bytes)
+{
+    struct bw_level lv[NET_BW_LEVELS];
+    int n = bw_levels(p, out, lv);
+    for (int i = 0; i < n; i++)
+        lv[i].b->bytes =
+            min(lv[i].b->bytes + bytes, bw_burst(lv[i].limit));
+}
+#endif
+
+static void
+net_count_up(struct peer *p, unsigned long bytes)
+{
+    p->n->uploaded += bytes;
+    rate_add(&p->rate_up, bytes);
+    rate_add(&p->n->rate_up, bytes);
+    rate_add(&m_rate_up, bytes);
+}
+
+#define BLOCK_MEM_COUNT 1
+
+#ifdef EVLOOP_IOURING
+static void net_io_done(int sd, short type, int res, void *arg);
+#define NET_IOV_MAX EVLOOP_IOV_MAX
+#else
+#define NET_IOV_MAX IOV_MAX
+#endif
+
+/*
+ * Fills iov with the buffers at the head of the peer's outq, up to wmax
+ * bytes if it's non zero. Returns the number of iovecs, or -1 if the peer
+ * was killed.
+ */
+static int
+net_write_iov(struct peer *p, unsigned long wmax, struct iovec *iov)
 {
     struct nb_link *nl;
-    struct iovec iov[IOV_MAX];
-    int niov;
-    int limited;
-    ssize_t nwritten;
-    unsigned long bcount;
+    int niov = 0;
+    int limited = wmax > 0;
     int block_count = 0;
 
-    limited = wmax > 0;
-
-    niov = 0;
     assert((nl = BTPDQ_FIRST(&p->outq)) != NULL);
     if (nl->nb->type == NB_TORRENTDATA)
         block_count = 1;
-    while ((niov < IOV_MAX && nl != NULL
+    while ((niov < NET_IOV_MAX && nl != NULL
                && (!limited || (limited && wmax > 0)))) {
         if (nl->nb->type == NB_PIECE) {
             if (block_count >= BLOCK_MEM_COUNT)
                 break;
             struct net_buf *tdata = BTPDQ_NEXT(nl, entry)->nb;
-            if (tdata->buf == NULL) {
-                if (nb_torrentdata_fill(tdata, p->n->tp, nb_get_index(nl->nb),
-                        nb_get_begin(nl->nb), nb_get_length(nl->nb)) != 0) {
+            if (tdata->buf == NULL && !tdata->loading) {
+                if (nb_torrentdata_fill(tdata, p) != 0) {
                     peer_kill(p);
-                    return 0;
+                    return -1;
                 }
             }
+            if (tdata->loading) {
+                if (niov == 0)
+                    peer_ev_disable(p, EV_WRITE);
+                break;
+            }
             block_count++;
         }
         if (niov > 0) {
@@ -166,23 +370,51 @@ net_write(struct peer *p, unsigned long wmax)
         niov++;
         nl = BTPDQ_NEXT(nl, entry);
     }
+    return niov;
+}
+
+/*
+ * Kills a peer whose connection failed, or was closed if err is 0. One
+ * that didn't answer over uTP, or hung up before the handshake was done,
+ * is dialed again over TCP.
+ */
+static void
+net_conn_failed(struct peer *p, int err)
+{
+    if ((err == ECONNREFUSED || p->in.state < BTP_MSGSIZE)
+        && p->utp != NULL && !(p->mp->flags & PF_INCOMING))
+        peer_redial_tcp(p);
+    else
+        peer_kill(p);
+}
+
+/*
+ * Takes what was written off the peer's outq. Nwritten is minus the
+ * error if the write failed. Returns -1 if the peer was killed.
+ */
+static long
+net_write_done(struct peer *p, ssize_t nwritten, ssize_t tried,
+    unsigned long allow)
+{
+    struct nb_link *nl;
+    unsigned long bcount;
 
-    nwritten = writev(p->sd, iov, niov);
     if (nwritten < 0) {
-        if (errno == EAGAIN) {
-            p->t_wantwrite = btpd_seconds;
+        if (nwritten == -EAGAIN) {
+            p->t_wantwrite = btpd_msecs();
             return 0;
         } else {
-            btpd_log(BTPD_L_CONN, "write error: %s\n", strerror(errno));
-            peer_kill(p);
-            return 0;
+            btpd_log(BTPD_L_CONN, "write error: %s\n", strerror(-nwritten));
+            net_conn_failed(p, -nwritten);
+            return -1;
         }
     } else if (nwritten == 0) {
         btpd_log(BTPD_L_CONN, "connection closed by peer.\n");
         peer_kill(p);
-        return 0;
+        return -1;
     }
 
+    bw_spend(p, 1, nwritten, allow);
     bcount = nwritten;
 
     nl = BTPDQ_FIRST(&p->outq);
@@ -190,34 +422,68 @@ net_write(struct peer *p, unsigned long wmax)
         unsigned long bufdelta = nl->nb->len - p->outq_off;
         if (bcount >= bufdelta) {
             peer_sent(p, nl->nb);
-            if (nl->nb->type == NB_TORRENTDATA) {
-                p->n->uploaded += bufdelta;
-                p->count_up += bufdelta;
-            }
+            if (nl->nb->type == NB_TORRENTDATA)
+                net_count_up(p, bufdelta);
             bcount -= bufdelta;
             BTPDQ_REMOVE(&p->outq, nl, entry);
-            nb_drop(nl->nb);
-            free(nl);
+            peer_nl_drop(nl);
             p->outq_off = 0;
             nl = BTPDQ_FIRST(&p->outq);
         } else {
-            if (nl->nb->type == NB_TORRENTDATA) {
-                p->n->uploaded += bcount;
-                p->count_up += bcount;
-            }
+            if (nl->nb->type == NB_TORRENTDATA)
+                net_count_up(p, bcount);
             p->outq_off +=  bcount;
             bcount = 0;
         }
     }
-    if (!BTPDQ_EMPTY(&p->outq))
-        p->t_wantwrite = btpd_seconds;
-    else
-        btpd_ev_disable(&p->ioev, EV_WRITE);
-    p->t_lastwrite = btpd_seconds;
+    p->t_lastwrite = btpd_msecs();
+    if (!BTPDQ_EMPTY(&p->outq)) {
+        p->t_wantwrite = p->t_lastwrite;
+        // The socket can take more if all that was tried went out.
+        if (nwritten == tried)
+            peer_ev_again(p, EV_WRITE);
+    } else
+        peer_ev_disable(p, EV_WRITE);
 
     return nwritten;
 }
 
+static unsigned long
+net_write(struct peer *p, unsigned long wmax)
+{
+    struct iovec iov[NET_IOV_MAX];
+    int niov;
+    ssize_t nwritten, tried = 0;
+    long ret;
+
+    if ((niov = net_write_iov(p, wmax, iov)) <= 0)
+        return 0;
+    for (int i = 0; i < niov; i++)
+        tried += iov[i].iov_len;
+
+    if (p->utp != NULL) {
+        if ((nwritten = utp_writev(p->utp, iov, niov)) < 0)
+            nwritten = -errno;
+        ret = net_write_done(p, nwritten, tried, wmax);
+        return ret > 0 ? ret : 0;
+    }
+
+#ifdef EVLOOP_IOURING
+    if (fdev_writev(&p->ioev, iov, niov, net_io_done) == 0) {
+        p->io.wtried = tried;
+        p->io.wallow = wmax;
+        p->io.npinned = niov;
+        bw_charge(p, 1, tried);
+        return 0;
+    }
+#endif
+
+    if ((nwritten = writev(p->sd, iov, niov)) < 0)
+        nwritten = -errno;
+    ret = net_write_done(p, nwritten, tried, wmax);
+    return ret > 0 ? ret : 0;
+}
+
 static int
 net_dispatch_msg(struct peer *p, const char *buf)
 {
@@ -246,11 +512,22 @@ net_dispatch_msg(struct peer *p, const char *buf)
         else
             res = 1;
         break;
+    case MSG_HAVE_ALL:
+        if (p->npieces == 0)
+            peer_on_have_all(p);
+        else
+            res = 1;
+        break;
+    case MSG_HAVE_NONE:
+        if (p->npieces != 0)
+            res = 1;
+        break;
     case MSG_REQUEST:
-        if ((p->mp->flags & (PF_P_WANT|PF_I_CHOKE)) == PF_P_WANT) {
-            index = dec_be32(buf);
-            begin = dec_be32(buf + 4);
-            length = dec_be32(buf + 8);
+        index = dec_be32(buf);
+        begin = dec_be32(buf + 4);
+        length = dec_be32(buf + 8);
+        if ((p->mp->flags & (PF_P_WANT|PF_I_CHOKE)) == PF_P_WANT
+            || peer_allowed_fast(p, index)) {
             if ((length > PIECE_BLOCKLEN
                     || index >= p->n->tp->npieces
                     || !cm_has_piece(p->n->tp, index)
@@ -261,7 +538,8 @@ net_dispatch_msg(struct peer *p, const char *buf)
                 break;
             }
             peer_on_request(p, index, begin, length);
-        }
+        } else if (p->mp->flags & PF_FAST)
+            peer_send(p, nb_create_reject(index, begin, length));
         break;
     case MSG_CANCEL:
         index = dec_be32(buf);
@@ -273,12 +551,33 @@ net_dispatch_msg(struct peer *p, const char *buf)
         length = p->in.msg_len - 9;
         peer_on_piece(p, p->in.pc_index, p->in.pc_begin, length, buf);
         break;
+    case MSG_REJECT:
+        index = dec_be32(buf);
+        begin = dec_be32(buf + 4);
+        length = dec_be32(buf + 8);
+        peer_on_reject(p, index, begin, length);
+        break;
+    case MSG_SUGGEST:
+    case MSG_ALLOWED_FAST:
+        index = dec_be32(buf);
+        if (index >= p->n->tp->npieces)
+            res = 1;
+        else if (p->in.msg_num == MSG_SUGGEST)
+            peer_on_suggest(p, index);
+        else
+            peer_on_allowed_fast(p, index);
+        break;
+    case MSG_EXTENDED:
+        peer_on_extended(p, buf[0], buf + 1, p->in.msg_len - 2);
+        break;
     default:
         abort();
     }
     return res;
 }
 
+#define EXTMSGMAX (1 << 16)
+
 static int
 net_mh_ok(struct peer *p)
 {
@@ -298,6 +597,16 @@ net_mh_ok(struct peer *p)
         return mlen == 13;
     case MSG_PIECE:
         return mlen <= PIECE_BLOCKLEN + 9;
+    case MSG_HAVE_ALL:
+    case MSG_HAVE_NONE:
+        return (p->mp->flags & PF_FAST) && mlen == 1;
+    case MSG_SUGGEST:
+    case MSG_ALLOWED_FAST:
+        return (p->mp->flags & PF_FAST) && mlen == 5;
+    case MSG_REJECT:
+        return (p->mp->flags & PF_FAST) && mlen == 13;
+    case MSG_EXTENDED:
+        return (p->mp->flags & PF_EXT) && mlen >= 2 && mlen <= EXTMSGMAX;
     default:
         return 0;
     }
@@ -308,10 +617,14 @@ net_progress(struct peer *p, size_t length)
 {
     if (p->in.state == BTP_MSGBODY && p->in.msg_num == MSG_PIECE) {
         p->n->downloaded += length;
-        p->count_dwn += length;
+        rate_add(&p->rate_dwn, length);
+        rate_add(&p->n->rate_dwn, length);
+        rate_add(&m_rate_dwn, length);
     }
 }
 
+static void net_handoff(struct peer *p, struct torrent *tp);
+
 static int
 net_state(struct peer *p, const char *buf)
 {
@@ -319,6 +632,10 @@ net_state(struct peer *p, const char *buf)
     case SHAKE_PSTR:
         if (bcmp(buf, "\x13""BitTorrent protocol", 20) != 0)
             goto bad;
+        if (buf[25] & 0x10)
+            p->mp->flags |= PF_EXT;
+        if (buf[27] & 0x04)
+            p->mp->flags |= PF_FAST;
         peer_set_in_state(p, SHAKE_INFO, 20);
         break;
     case SHAKE_INFO:
@@ -326,6 +643,10 @@ net_state(struct peer *p, const char *buf)
             struct torrent *tp = torrent_by_hash(buf);
             if (tp == NULL || !net_active(tp))
                 goto bad;
+            if (tp->shard != btpd_shard) {
+                net_handoff(p, tp);
+                return -1;
+            }
             p->n = tp->net;
             peer_send(p, nb_create_shake(tp));
         } else if (bcmp(buf, p->n->tp->tl->hash, 20) != 0)
@@ -382,77 +703,303 @@ bad:
     return -1;
 }
 
-#define GRBUFLEN (1 << 15)
+/*
+ * Incoming data is read into a per peer buffer and the states are parsed
+ * where they lie. A read never goes past RBUF_READEND unless that's needed
+ * to complete the current state, so every state starting in the buffer
+ * also ends in it and nothing needs to be moved. The buffer is given back
+ * to the pool as soon as it's been emptied. States that don't fit, which
+ * can only be large bitfields, get a buffer of their own.
+ */
+#define RBUFLEN (1 << 16)
+#define RBUF_MSGMAX (4 + 9 + PIECE_BLOCKLEN)
+#define RBUF_READEND (RBUFLEN - RBUF_MSGMAX)
+#define RBUF_POOLMAX 32
+
+static __thread struct pool m_rbuf_pool = POOL_INIT(RBUFLEN, RBUF_POOLMAX);
 
-static unsigned long
-net_read(struct peer *p, unsigned long rmax)
+static void
+net_rbuf_get(struct peer *p)
 {
-    size_t rest = p->in.buf != NULL ? p->in.st_bytes - p->in.off : 0;
-    char buf[GRBUFLEN];
-    struct iovec iov[2] = {
-        {
-            p->in.buf + p->in.off,
-            rest
-        }, {
-            buf,
-            sizeof(buf)
-        }
-    };
+    if (p->in.st_bytes > RBUFLEN) {
+        p->in.buf = btpd_malloc(p->in.st_bytes);
+        p->in.cap = p->in.st_bytes;
+    } else {
+        p->in.buf = pool_get(&m_rbuf_pool);
+        p->in.cap = RBUFLEN;
+    }
+    p->in.off = p->in.len = 0;
+}
 
-    if (rmax > 0) {
-        if (iov[0].iov_len > rmax)
-            iov[0].iov_len = rmax;
-        iov[1].iov_len = min(rmax - iov[0].iov_len, iov[1].iov_len);
+void
+net_rbuf_put(struct peer *p)
+{
+    if (p->in.cap == RBUFLEN)
+        pool_put(&m_rbuf_pool, p->in.buf);
+    else
+        free(p->in.buf);
+    p->in.buf = NULL;
+    p->in.off = p->in.len = p->in.cap = 0;
+}
+
+/*
+ * Runs the states that are complete in the peer's buffer. Returns non zero
+ * if the peer was killed.
+ */
+static int
+net_parse(struct peer *p)
+{
+    while (p->in.len - p->in.off >= p->in.st_bytes) {
+        const char *buf = p->in.buf + p->in.off;
+        p->in.off += p->in.st_bytes;
+        net_progress(p, p->in.st_bytes);
+        if (net_state(p, buf) != 0)
+            return -1;
     }
 
-    ssize_t nread = readv(p->sd, iov, 2);
-    if (nread < 0 && errno == EAGAIN)
-        goto out;
-    else if (nread < 0) {
-        btpd_log(BTPD_L_CONN, "Read error (%s) on %p.\n", strerror(errno), p);
-        peer_kill(p);
-        return 0;
-    } else if (nread == 0) {
-        btpd_log(BTPD_L_CONN, "Connection closed by %p.\n", p);
-        peer_kill(p);
-        return 0;
+    if (p->in.off == p->in.len)
+        net_rbuf_put(p);
+    else if (p->in.off + p->in.st_bytes > p->in.cap) {
+        size_t have = p->in.len - p->in.off;
+        char *buf = btpd_malloc(p->in.st_bytes);
+        bcopy(p->in.buf + p->in.off, buf, have);
+        net_rbuf_put(p);
+        p->in.buf = buf;
+        p->in.cap = p->in.st_bytes;
+        p->in.len = have;
     }
+    return 0;
+}
 
-    if (rest > 0) {
-        if (nread < rest) {
-            p->in.off += nread;
-            net_progress(p, nread);
-            goto out;
-        }
-        net_progress(p, rest);
-        if (net_state(p, p->in.buf) != 0)
-            return nread;
-        free(p->in.buf);
-        p->in.buf = NULL;
-        p->in.off = 0;
+/*
+ * Incoming peers are taken by shard 0 and handed to the shard of their
+ * torrent once they've told which one it is. The socket, or the uTP
+ * connection, is passed on with what's been read after the info hash, and
+ * the peer here is killed. The torrent can't go away before the other
+ * shard has the peer, since the main thread only kills torrents by
+ * calling their shard.
+ */
+struct handoff {
+    struct torrent *tp;
+    int sd;
+    struct utp *utp;
+    int flags;
+    size_t len;
+    char buf[];
+};
+
+struct utp_dgram {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    uint8_t buf[];
+};
+
+static struct utp_sock *
+net_utp_fed(int family)
+{
+    for (int i = 0; i < m_nlisteners; i++)
+        if (m_net_listeners[i].family == family)
+            return m_net_listeners[i].fed;
+    return NULL;
+}
+
+static void
+net_utp_input(void *arg)
+{
+    struct utp_dgram *d = arg;
+    struct utp_sock *s = net_utp_fed(d->addr.ss_family);
+    if (s != NULL)
+        utp_sock_input(s, d->buf, d->len, (struct sockaddr *)&d->addr,
+            d->addrlen);
+    free(d);
+}
+
+/*
+ * Passes a datagram for a handed off uTP connection on to its shard. It
+ * gets there after the connection, as the posts to a shard run in order.
+ */
+static void
+net_utp_forward(const uint8_t *buf, size_t len, const struct sockaddr *sa,
+    socklen_t salen, void *arg)
+{
+    struct utp_dgram *d = btpd_malloc(sizeof(*d) + len);
+    bcopy(sa, &d->addr, salen);
+    d->addrlen = salen;
+    d->len = len;
+    bcopy(buf, d->buf, len);
+    shard_post(arg, net_utp_input, d);
+}
+
+static void
+net_adopt(void *arg)
+{
+    struct handoff *h = arg;
+    struct peer *p;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (h->utp != NULL) {
+        utp_peername(h->utp, (struct sockaddr *)&addr, &addrlen);
+        utp_adopt(net_utp_fed(addr.ss_family), h->utp);
+    }
+    if (!net_active(h->tp) || !net_peer_room()) {
+        if (h->utp != NULL)
+            utp_close(h->utp);
+        else
+            close(h->sd);
+        free(h);
+        return;
+    }
+    p = peer_create_in(h->sd, h->utp);
+    p->mp->flags |= h->flags;
+    p->n = h->tp->net;
+    peer_send(p, nb_create_shake(h->tp));
+    peer_set_in_state(p, SHAKE_ID, 20);
+    if (h->len > 0) {
+        net_rbuf_get(p);
+        bcopy(h->buf, p->in.buf, h->len);
+        p->in.len = h->len;
+        net_parse(p);
     }
+    free(h);
+}
 
-    iov[1].iov_len = nread - rest;
-    while (p->in.st_bytes <= iov[1].iov_len) {
-        size_t consumed = p->in.st_bytes;
-        net_progress(p, consumed);
-        if (net_state(p, iov[1].iov_base) != 0)
-            return nread;
-        iov[1].iov_base += consumed;
-        iov[1].iov_len -= consumed;
+static void
+net_handoff(struct peer *p, struct torrent *tp)
+{
+    size_t len = p->in.len - p->in.off;
+    struct handoff *h = btpd_malloc(sizeof(*h) + len);
+    h->tp = tp;
+    h->flags = p->mp->flags & (PF_EXT | PF_FAST);
+    h->len = len;
+    bcopy(p->in.buf + p->in.off, h->buf, len);
+    h->utp = NULL;
+    h->sd = -1;
+    if (p->utp == NULL)
+        h->sd = dup(p->sd);
+    else if (utp_move(p->utp, net_utp_forward, tp->shard) == 0) {
+        h->utp = p->utp;
+        p->utp = NULL;
     }
+    peer_kill(p);
+    if (h->sd < 0 && h->utp == NULL) {
+        free(h);
+        return;
+    }
+    shard_post(tp->shard, net_adopt, h);
+}
 
-    if (iov[1].iov_len > 0) {
-        net_progress(p, iov[1].iov_len);
-        p->in.off = iov[1].iov_len;
-        p->in.buf = btpd_malloc(p->in.st_bytes);
-        bcopy(iov[1].iov_base, p->in.buf, iov[1].iov_len);
+/*
+ * Runs the states completed by what was read. Nread is minus the error if
+ * the read failed. Returns -1 if the peer was killed.
+ */
+static long
+net_read_done(struct peer *p, ssize_t nread, size_t want, unsigned long rmax)
+{
+    if (nread == -EAGAIN)
+        goto out;
+    else if (nread < 0) {
+        btpd_log(BTPD_L_CONN, "Read error (%s) on %p.\n", strerror(-nread),
+            p);
+        net_conn_failed(p, -nread);
+        return -1;
+    } else if (nread == 0) {
+        btpd_log(BTPD_L_CONN, "Connection closed by %p.\n", p);
+        net_conn_failed(p, 0);
+        return -1;
     }
 
+    p->in.len += nread;
+    bw_spend(p, 0, nread, rmax);
+    if (net_parse(p) != 0)
+        return -1;
+    // There may be more to read without the socket becoming ready again.
+    if (nread == want)
+        peer_ev_again(p, EV_READ);
+
 out:
+    if (p->in.buf != NULL && p->in.len == 0)
+        net_rbuf_put(p);
     return nread > 0 ? nread : 0;
 }
 
+static unsigned long
+net_read(struct peer *p, unsigned long rmax)
+{
+    size_t want;
+    ssize_t nread;
+    long ret;
+
+    if (p->in.buf == NULL)
+        net_rbuf_get(p);
+
+    want = p->in.off + p->in.st_bytes;
+    if (p->in.cap == RBUFLEN)
+        want = max(want, RBUF_READEND);
+    want -= p->in.len;
+    if (rmax > 0)
+        want = min(want, rmax);
+
+#ifdef EVLOOP_IOURING
+    struct iovec iov = { p->in.buf + p->in.len, want };
+    if (p->utp == NULL && fdev_readv(&p->ioev, &iov, 1, net_io_done) == 0) {
+        p->io.rwant = want;
+        p->io.rmax = rmax;
+        bw_charge(p, 0, want);
+        return 0;
+    }
+#endif
+
+    if (p->utp != NULL)
+        nread = utp_read(p->utp, p->in.buf + p->in.len, want);
+    else
+        nread = read(p->sd, p->in.buf + p->in.len, want);
+    if (nread < 0)
+        nread = -errno;
+    ret = net_read_done(p, nread, want, rmax);
+    return ret > 0 ? ret : 0;
+}
+
+/*
+ * Lets peer traffic give way to other traffic when asked to. A delay based
+ * congestion control, such as TCP-LP, backs off as soon as queues start to
+ * build, instead of filling them like the default one does. The DSCP lets
+ * routers that honour it do the same, CS1 being the one for bulk traffic.
+ */
+static int
+net_set_congestion(int sd)
+{
+#ifdef TCP_CONGESTION
+    if (net_congestion != NULL && setsockopt(sd, IPPROTO_TCP,
+            TCP_CONGESTION, net_congestion, strlen(net_congestion)) != 0)
+        return errno;
+#endif
+    return 0;
+}
+
+static int
+net_set_dscp(int sd, int family)
+{
+    int tos = net_dscp << 2;
+    if (net_dscp == 0)
+        return 0;
+    if (family == AF_INET6) {
+        if (setsockopt(sd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) != 0)
+            return errno;
+        // Used for IPv4 mapped addresses.
+        setsockopt(sd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    } else if (setsockopt(sd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) != 0)
+        return errno;
+    return 0;
+}
+
+static void
+net_set_sockopts(int sd, int family)
+{
+    net_set_congestion(sd);
+    net_set_dscp(sd, family);
+}
+
 int
 net_connect_addr(int family, struct sockaddr *sa, socklen_t salen, int *sd)
 {
@@ -460,6 +1007,7 @@ net_connect_addr(int family, struct sockaddr *sa, socklen_t salen, int *sd)
         return errno;
 
     set_nonblocking(*sd);
+    net_set_sockopts(*sd, family);
 
     if (connect(*sd, sa, salen) == -1 && errno != EINPROGRESS) {
         int err = errno;
@@ -471,29 +1019,6 @@ net_connect_addr(int family, struct sockaddr *sa, socklen_t salen, int *sd)
     return 0;
 }
 
-int
-net_connect_name(const char *ip, int port, int *sd)
-{
-    struct addrinfo hints, *res;
-    char portstr[6];
-
-    assert(net_npeers < net_max_peers);
-
-    if (snprintf(portstr, sizeof(portstr), "%d", port) >= sizeof(portstr))
-        return EINVAL;
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = net_af_spec();
-    hints.ai_flags = AI_NUMERICHOST;
-    hints.ai_socktype = SOCK_STREAM;
-    if (getaddrinfo(ip, portstr, &hints, &res) != 0)
-        return errno;
-
-    int error =
-        net_connect_addr(res->ai_family, res->ai_addr, res->ai_addrlen, sd);
-    freeaddrinfo(res);
-    return error;
-}
-
 void
 net_connection_cb(int sd, short type, void *arg)
 {
@@ -512,17 +1037,62 @@ net_connection_cb(int sd, short type, void *arg)
         return;
     }
 
-    assert(net_npeers <= net_max_peers);
-    if (net_npeers == net_max_peers) {
+    if (!net_peer_room()) {
         close(nsd);
         return;
     }
 
-    peer_create_in(nsd);
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(nsd, (struct sockaddr *)&addr, &addrlen) == 0)
+        net_set_sockopts(nsd, addr.ss_family);
+
+    peer_create_in(nsd, NULL);
 
     btpd_log(BTPD_L_CONN, "got connection.\n");
 }
 
+static void
+net_utp_accept_cb(struct utp *u, void *arg)
+{
+    if (!net_peer_room()) {
+        utp_close(u);
+        return;
+    }
+
+    peer_create_in(-1, u);
+
+    btpd_log(BTPD_L_CONN, "got uTP connection.\n");
+}
+
+/*
+ * Dials over the uTP socket of the address family. The IPv6 socket only
+ * takes IPv6, so mapped IPv4 addresses are dialed as IPv4. Returns NULL
+ * with errno set if it can't be done.
+ */
+struct utp *
+net_connect_utp(int family, struct sockaddr *sa, socklen_t salen)
+{
+    struct sockaddr_in a4;
+    struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)sa;
+
+    if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&a6->sin6_addr)) {
+        bzero(&a4, sizeof(a4));
+        a4.sin_family = AF_INET;
+        a4.sin_port = a6->sin6_port;
+        bcopy(a6->sin6_addr.s6_addr + 12, &a4.sin_addr, 4);
+        family = AF_INET;
+        sa = (struct sockaddr *)&a4;
+        salen = sizeof(a4);
+    }
+    for (int i = 0; i < m_nlisteners; i++)
+        if (m_net_listeners[i].utp != NULL
+            && m_net_listeners[i].family == family)
+            return utp_connect(m_net_listeners[i].utp, sa, salen);
+    errno = EAFNOSUPPORT;
+    return NULL;
+}
+
 static unsigned long
 compute_rate_sub(unsigned long rate)
 {
@@ -533,125 +1103,261 @@ compute_rate_sub(unsigned long rate)
 }
 
 static void
-compute_rates(void) {
-    unsigned long tot_up = 0, tot_dwn = 0;
+rate_fold(struct rate *r)
+{
+    if (r->second == btpd_seconds)
+        return;
+    r->value += r->count - compute_rate_sub(r->value);
+    r->count = 0;
+    for (r->second++; r->second < btpd_seconds && r->value > 0; r->second++)
+        r->value -= compute_rate_sub(r->value);
+    r->second = btpd_seconds;
+}
+
+void
+rate_add(struct rate *r, unsigned long bytes)
+{
+    rate_fold(r);
+    r->count += bytes;
+}
+
+unsigned long
+rate_get(struct rate *r)
+{
+    rate_fold(r);
+    return r->value;
+}
+
+struct peer_rates {
+    int up;
+    double sum, sqsum;
+    unsigned long n;
+};
+
+static void
+net_peer_rates_add(void *arg)
+{
+    struct peer_rates *pr = arg;
     struct torrent *tp;
-    BTPDQ_FOREACH(tp, torrent_get_all(), entry) {
-        unsigned long tp_up = 0, tp_dwn = 0;
-        struct net *n = tp->net;
-        struct peer *p;
-        BTPDQ_FOREACH(p, &n->peers, p_entry) {
-            if (p->count_up > 0 || peer_active_up(p)) {
-                tp_up += p->count_up;
-                p->rate_up += p->count_up - compute_rate_sub(p->rate_up);
-                p->count_up = 0;
-            }
-            if (p->count_dwn > 0 || peer_active_down(p)) {
-                tp_dwn += p->count_dwn;
-                p->rate_dwn += p->count_dwn - compute_rate_sub(p->rate_dwn);
-                p->count_dwn = 0;
+    struct peer *p;
+    double r;
+    BTPDQ_FOREACH(tp, torrent_get_shard(), sh_entry) {
+        BTPDQ_FOREACH(p, &tp->net->peers, p_entry) {
+            r = rate_get(pr->up ? &p->rate_up : &p->rate_dwn) / RATEHISTORY;
+            if (r > 0) {
+                pr->sum += r;
+                pr->sqsum += r * r;
+                pr->n++;
             }
         }
-        n->rate_up += tp_up - compute_rate_sub(n->rate_up);
-        n->rate_dwn += tp_dwn - compute_rate_sub(n->rate_dwn);
-        tot_up += tp_up;
-        tot_dwn += tp_dwn;
     }
-    m_rate_up += tot_up - compute_rate_sub(m_rate_up);
-    m_rate_dwn += tot_dwn - compute_rate_sub(m_rate_dwn);
 }
 
+/*
+ * Gives the mean and the standard deviation of the rates of the peers
+ * that have transferred anything lately, to see how evenly the bandwidth
+ * is shared.
+ */
+void
+net_peer_rates(int up, unsigned long *mean, unsigned long *dev)
+{
+    struct peer_rates pr = { up, 0, 0, 0 };
+    shard_call_all(net_peer_rates_add, &pr);
+    if (pr.n == 0) {
+        *mean = *dev = 0;
+        return;
+    }
+    *mean = pr.sum / pr.n;
+    *dev = sqrt(max(pr.sqsum / pr.n - (pr.sum / pr.n) * (pr.sum / pr.n), 0));
+}
+
+/*
+ * The peers waiting on the queues are given a turn each, in order, and
+ * those still without bandwidth are put back last. The readq also holds
+ * peers waiting for the disk to catch up with the writes.
+ */
 static void
-net_bw_tick(void)
+net_readq_run(void)
 {
     struct peer *p;
-
-    m_bw_bytes_out = net_bw_limit_out;
-    m_bw_bytes_in = net_bw_limit_in;
-
-    if (net_bw_limit_in > 0) {
-        while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL && m_bw_bytes_in > 0) {
-            BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
-            btpd_ev_enable(&p->ioev, EV_READ);
-            p->mp->flags &= ~PF_ON_READQ;
-            m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
-        }
-    } else {
-        while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL) {
-            BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
-            btpd_ev_enable(&p->ioev, EV_READ);
-            p->mp->flags &= ~PF_ON_READQ;
-            net_read(p, 0);
+    unsigned long allow;
+    unsigned n = 0;
+    BTPDQ_FOREACH(p, &net_bw_readq, rq_entry)
+        n++;
+    for (; n > 0 && !cm_write_full()
+             && (p = BTPDQ_FIRST(&net_bw_readq)) != NULL; n--) {
+        BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
+        if ((allow = bw_turn(p, 0, 0)) == 0) {
+            BTPDQ_INSERT_TAIL(&net_bw_readq, p, rq_entry);
+            continue;
         }
+        peer_ev_enable(p, EV_READ);
+        p->mp->flags &= ~PF_ON_READQ;
+        net_read(p, allow);
     }
+}
 
-    if (net_bw_limit_out) {
-        while (((p = BTPDQ_FIRST(&net_bw_writeq)) != NULL
-                   && m_bw_bytes_out > 0)) {
-            BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
-            btpd_ev_enable(&p->ioev, EV_WRITE);
-            p->mp->flags &= ~PF_ON_WRITEQ;
-            m_bw_bytes_out -=  net_write(p, m_bw_bytes_out);
-        }
-    } else {
-        while ((p = BTPDQ_FIRST(&net_bw_writeq)) != NULL) {
-            BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
-            btpd_ev_enable(&p->ioev, EV_WRITE);
-            p->mp->flags &= ~PF_ON_WRITEQ;
-            net_write(p, 0);
+static void
+net_writeq_run(void)
+{
+    struct peer *p;
+    unsigned long allow;
+    unsigned n = 0;
+    BTPDQ_FOREACH(p, &net_bw_writeq, wq_entry)
+        n++;
+    for (; n > 0 && (p = BTPDQ_FIRST(&net_bw_writeq)) != NULL; n--) {
+        BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
+        if ((allow = bw_turn(p, 1, 0)) == 0) {
+            BTPDQ_INSERT_TAIL(&net_bw_writeq, p, wq_entry);
+            continue;
         }
+        peer_ev_enable(p, EV_WRITE);
+        p->mp->flags &= ~PF_ON_WRITEQ;
+        net_write(p, allow);
     }
 }
 
+static long long
+bw_delay(unsigned long bytes, unsigned limit)
+{
+    unsigned long want =
+        min(bw_burst(limit), max(limit / 100, NET_BW_QUANTUM));
+    if (bytes >= want)
+        return 1;
+    return max(1, (want - bytes) * 1000 / limit);
+}
+
+/*
+ * Returns the milliseconds until all the peer's buckets can let it go
+ * on, or -1 if it isn't limited.
+ */
+static long long
+bw_wait(struct peer *p, int out)
+{
+    struct bw_level lv[NET_BW_LEVELS];
+    long long ms = -1;
+    int n = bw_levels(p, out, lv);
+    for (int i = 0; i < n; i++)
+        ms = max(ms, bw_delay(lv[i].b->bytes, lv[i].limit));
+    return ms;
+}
+
+/*
+ * Sets the timer for when there's bandwidth for the first of the waiting
+ * peers. Peers waiting for the disk are run when it's ready.
+ */
 static void
-run_peer_ticks(void)
+net_bw_schedule(void)
 {
-    struct torrent *tp;
-    struct peer *p, *next;
+    struct peer *p;
+    long long ms = -1, pms;
+    if (!cm_write_full())
+        BTPDQ_FOREACH(p, &net_bw_readq, rq_entry)
+            if ((pms = bw_wait(p, 0)) > 0)
+                ms = ms < 0 ? pms : min(ms, pms);
+    BTPDQ_FOREACH(p, &net_bw_writeq, wq_entry)
+        if ((pms = bw_wait(p, 1)) > 0)
+            ms = ms < 0 ? pms : min(ms, pms);
+    if (ms > 0)
+        btpd_timer_add(&m_bw_timer,
+            (& (struct timespec) { ms / 1000, (ms % 1000) * 1000000 }));
+}
 
-    BTPDQ_FOREACH_MUTABLE(p, &net_unattached, p_entry, next)
-        peer_on_tick(p);
+static void
+net_bw_tick(void)
+{
+    net_readq_run();
+    net_writeq_run();
+    net_bw_schedule();
+}
 
-    BTPDQ_FOREACH(tp, torrent_get_all(), entry)
-        BTPDQ_FOREACH_MUTABLE(p, &tp->net->peers, p_entry, next)
-        peer_on_tick(p);
+static void
+net_bw_cb(int fd, short type, void *arg)
+{
+    net_bw_tick();
 }
 
 void
 net_on_tick(void)
 {
-    run_peer_ticks();
-    compute_rates();
     net_bw_tick();
 }
 
+void
+net_on_disk_ready(void)
+{
+    net_readq_run();
+    net_bw_schedule();
+}
+
+/*
+ * Called when the data of a block the peer waits to send has been read.
+ */
+void
+net_on_data_ready(struct peer *p)
+{
+    if (!(p->mp->flags & PF_ON_WRITEQ) && !BTPDQ_EMPTY(&p->outq))
+        peer_ev_enable(p, EV_WRITE);
+}
+
 static void
 net_read_cb(struct peer *p)
 {
-    if (net_bw_limit_in == 0)
-        net_read(p, 0);
-    else if (m_bw_bytes_in > 0)
-        m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
-    else {
-        btpd_ev_disable(&p->ioev, EV_READ);
-        p->mp->flags |= PF_ON_READQ;
-        BTPDQ_INSERT_TAIL(&net_bw_readq, p, rq_entry);
+    unsigned long allow;
+    if (!cm_write_full()
+        && (allow = bw_turn(p, 0, !BTPDQ_EMPTY(&net_bw_readq))) > 0) {
+        net_read(p, allow);
+        return;
     }
+    peer_ev_disable(p, EV_READ);
+    p->mp->flags |= PF_ON_READQ;
+    BTPDQ_INSERT_TAIL(&net_bw_readq, p, rq_entry);
+    net_bw_schedule();
 }
 
 static void
 net_write_cb(struct peer *p)
 {
-    if (net_bw_limit_out == 0)
-        net_write(p, 0);
-    else if (m_bw_bytes_out > 0)
-        m_bw_bytes_out -= net_write(p, m_bw_bytes_out);
-    else {
-        btpd_ev_disable(&p->ioev, EV_WRITE);
-        p->mp->flags |= PF_ON_WRITEQ;
-        BTPDQ_INSERT_TAIL(&net_bw_writeq, p, wq_entry);
+    unsigned long allow;
+    if ((allow = bw_turn(p, 1, !BTPDQ_EMPTY(&net_bw_writeq))) > 0) {
+        net_write(p, allow);
+        return;
+    }
+    peer_ev_disable(p, EV_WRITE);
+    p->mp->flags |= PF_ON_WRITEQ;
+    BTPDQ_INSERT_TAIL(&net_bw_writeq, p, wq_entry);
+    net_bw_schedule();
+}
+
+#ifdef EVLOOP_IOURING
+/*
+ * Called when a read or write done by the event loop completes. Another
+ * is queued right away if this one got through and there's bandwidth, so
+ * a busy peer doesn't wait for readiness in between.
+ */
+static void
+net_io_done(int sd, short type, int res, void *arg)
+{
+    struct peer *p = arg;
+    switch (type) {
+    case EV_READ:
+        bw_refund(p, 0, p->io.rwant);
+        if (net_read_done(p, res, p->io.rwant, p->io.rmax) > 0
+            && (p->ioev.flags & EV_READ))
+            net_read_cb(p);
+        break;
+    case EV_WRITE:
+        p->io.npinned = 0;
+        bw_refund(p, 1, p->io.wtried);
+        if (net_write_done(p, res, p->io.wtried, p->io.wallow) > 0
+            && (p->ioev.flags & EV_WRITE))
+            net_write_cb(p);
+        break;
+    default:
+        abort();
     }
 }
+#endif
 
 void
 net_io_cb(int sd, short type, void *arg)
@@ -663,6 +1369,12 @@ net_io_cb(int sd, short type, void *arg)
     case EV_WRITE:
         net_write_cb(arg);
         break;
+#ifdef EVLOOP_IOURING
+    case EV_GONE:
+        close(sd);
+        peer_free(arg);
+        break;
+#endif
     default:
         abort();
     }
@@ -682,18 +1394,50 @@ net_af_spec(void)
 void
 net_shutdown(void)
 {
+    struct peer *p, *next;
+
+    // The peers still shaking hands over uTP go with the sockets.
+    BTPDQ_FOREACH_MUTABLE(p, &net_unattached, p_entry, next)
+        if (p->utp != NULL)
+            peer_kill(p);
     for (int i = 0; i < m_nlisteners; i++) {
         btpd_ev_del(&m_net_listeners[i].ev);
         close(m_net_listeners[i].sd);
+        // The other shards may still send on the UDP socket.
+        if (m_net_listeners[i].utp != NULL) {
+            utp_sock_free(m_net_listeners[i].utp);
+            if (btpd_shards == 1)
+                close(m_net_listeners[i].usd);
+        }
     }
 }
 
+/*
+ * Opens the UDP socket for uTP next to a TCP listener.
+ */
+static void
+net_utp_listen(struct net_listener *l, struct addrinfo *ai, utp_accept_cb_t cb)
+{
+    int sd, flag = 1;
+    if ((sd = socket(ai->ai_family, SOCK_DGRAM, 0)) == -1)
+        btpd_err("failed to create socket (%s).\n", strerror(errno));
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6)
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+#endif
+    if ((errno = net_set_dscp(sd, ai->ai_family)) != 0)
+        btpd_err("Couldn't set DSCP %d (%s).\n", net_dscp, strerror(errno));
+    if (bind(sd, ai->ai_addr, ai->ai_addrlen) == -1)
+        btpd_err("bind failed (%s).\n", strerror(errno));
+    set_nonblocking(sd);
+    if ((l->utp = utp_sock_new(sd, cb, NULL)) == NULL)
+        btpd_err("Failed to add event (%s).\n", strerror(errno));
+    l->usd = sd;
+}
+
 void
 net_init(void)
 {
-    m_bw_bytes_out = net_bw_limit_out;
-    m_bw_bytes_in = net_bw_limit_in;
-
     int safe_fds = getdtablesize() * 4 / 5;
     if (net_max_peers == 0 || net_max_peers > safe_fds)
         net_max_peers = safe_fds;
@@ -730,13 +1474,84 @@ net_init(void)
         if (ai->ai_family == AF_INET6)
             setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
 #endif
+        if ((errno = net_set_congestion(sd)) != 0)
+            btpd_err("Couldn't use congestion control '%s' (%s).\n",
+                net_congestion, strerror(errno));
+        if ((errno = net_set_dscp(sd, ai->ai_family)) != 0)
+            btpd_err("Couldn't set DSCP %d (%s).\n", net_dscp,
+                strerror(errno));
         if (bind(sd, ai->ai_addr, ai->ai_addrlen) == -1)
             btpd_err("bind failed (%s).\n", strerror(errno));
         listen(sd, 10);
         set_nonblocking(sd);
+        m_net_listeners[count].family = ai->ai_family;
         m_net_listeners[count].sd = sd;
         btpd_ev_new(&m_net_listeners[count].ev, sd, EV_READ,
             net_connection_cb, NULL);
+        if (net_utp != NET_UTP_OFF) {
+            net_utp_listen(&m_net_listeners[count], ai, net_utp_accept_cb);
+            if (ai->ai_family == AF_INET)
+                m_utp_sd4 = m_net_listeners[count].usd;
+            else
+                m_utp_sd6 = m_net_listeners[count].usd;
+        }
     }
     freeaddrinfo(res);
 }
+
+/*
+ * The other shards dial uTP from sockets of their own, on ports picked by
+ * the system, and take no connections on them.
+ */
+static void
+net_utp_dialers(void)
+{
+    struct sockaddr_storage ss;
+    struct addrinfo ai;
+    int families[2], n = 0;
+
+    if (net_ipv4)
+        families[n++] = AF_INET;
+    if (net_ipv6)
+        families[n++] = AF_INET6;
+    m_net_listeners = btpd_calloc(n, sizeof(*m_net_listeners));
+    for (int i = 0; i < n; i++) {
+        bzero(&ss, sizeof(ss));
+        bzero(&ai, sizeof(ai));
+        ss.ss_family = families[i];
+        ai.ai_family = families[i];
+        ai.ai_addr = (struct sockaddr *)&ss;
+        ai.ai_addrlen = families[i] == AF_INET ?
+            sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        m_net_listeners[i].family = families[i];
+        m_net_listeners[i].sd = -1;
+        net_utp_listen(&m_net_listeners[i], &ai, NULL);
+        m_net_listeners[i].fed = utp_sock_fed(families[i] == AF_INET ?
+            m_utp_sd4 : m_utp_sd6);
+        if (m_net_listeners[i].fed == NULL)
+            btpd_err("Out of memory.\n");
+    }
+    m_nlisteners = n;
+}
+
+/*
+ * Takes the shard's share of the global bandwidth limits.
+ */
+void
+net_set_limits(void)
+{
+    m_bw_limit_in = shard_share(net_bw_limit_in);
+    m_bw_limit_out = shard_share(net_bw_limit_out);
+}
+
+void
+net_shard_init(void)
+{
+    BTPDQ_INIT(&net_bw_readq);
+    BTPDQ_INIT(&net_bw_writeq);
+    BTPDQ_INIT(&net_unattached);
+    evtimer_init(&m_bw_timer, net_bw_cb, NULL);
+    net_set_limits();
+    if (btpd_shard->num != 0 && net_utp != NET_UTP_OFF)
+        net_utp_dialers();
+}
@@ -10,17 +10,39 @@
 #define MSG_REQUEST     6
 #define MSG_PIECE       7
 #define MSG_CANCEL      8
+#define MSG_SUGGEST     13
+#define MSG_HAVE_ALL    14
+#define MSG_HAVE_NONE   15
+#define MSG_REJECT      16
+#define MSG_ALLOWED_FAST 17
+#define MSG_EXTENDED    20
+
+#define EXT_HANDSHAKE   0
+#define EXT_UT_PEX      1   /* The number we've given ut_pex */
 
 #define RATEHISTORY 20
 
-extern struct peer_tq net_unattached;
-extern struct peer_tq net_bw_readq;
-extern struct peer_tq net_bw_writeq;
-extern unsigned net_npeers;
+#define NET_UTP_OFF     0   /* Only TCP */
+#define NET_UTP_ON      1   /* Take uTP, dial it to peers known to have it */
+#define NET_UTP_PREFER  2   /* Dial uTP first to every peer */
+
+extern __thread struct peer_tq net_unattached;
+extern __thread struct peer_tq net_bw_readq;
+extern __thread struct peer_tq net_bw_writeq;
+extern __thread unsigned net_npeers;
 
 void net_init(void);
+void net_shard_init(void);
+void net_set_limits(void);
+int net_peer_room(void);
 
 void net_on_tick(void);
+void net_on_disk_ready(void);
+void net_on_data_ready(struct peer *p);
+
+void rate_add(struct rate *r, unsigned long bytes);
+unsigned long rate_get(struct rate *r);
+void net_peer_rates(int up, unsigned long *mean, unsigned long *dev);
 
 void net_create(struct torrent *tp);
 void net_kill(struct torrent *tp);
@@ -33,10 +55,11 @@ void net_ban_peer(struct net *n, struct meta_peer *mp);
 int net_torrent_has_peer(struct net *n, const uint8_t *id);
 
 void net_io_cb(int sd, short type, void *arg);
+void net_rbuf_put(struct peer *p);
 
 int net_connect_addr(int family, struct sockaddr *sa, socklen_t salen,
     int *sd);
-int net_connect_name(const char *ip, int port, int *sd);
+struct utp *net_connect_utp(int family, struct sockaddr *sa, socklen_t salen);
 
 int net_af_spec(void);
 
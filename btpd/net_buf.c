@@ -1,10 +1,28 @@
 #include "btpd.h"
 
-static struct net_buf *m_choke;
-static struct net_buf *m_unchoke;
-static struct net_buf *m_interest;
-static struct net_buf *m_uninterest;
-static struct net_buf *m_keepalive;
+static __thread struct net_buf *m_choke;
+static __thread struct net_buf *m_unchoke;
+static __thread struct net_buf *m_interest;
+static __thread struct net_buf *m_uninterest;
+static __thread struct net_buf *m_keepalive;
+static __thread struct net_buf *m_have_all;
+static __thread struct net_buf *m_have_none;
+static __thread struct net_buf *m_ext_shake;
+
+/*
+ * Buffers with room for the largest of the fixed size messages, the
+ * handshake, come from a pool. Larger ones are allocated on their own.
+ */
+#define NB_POOLDATA 68
+
+static __thread struct pool m_nb_pool =
+    POOL_INIT(sizeof(struct net_buf) + NB_POOLDATA, 1024);
+
+static int
+nb_pooled(struct net_buf *nb)
+{
+    return nb->buf != (char *)(nb + 1) || nb->len <= NB_POOLDATA;
+}
 
 static void
 kill_buf_no(char *buf, size_t len)
@@ -26,7 +44,12 @@ kill_buf_abort(char *buf, size_t len)
 static struct net_buf *
 nb_create_alloc(short type, size_t len)
 {
-    struct net_buf *nb = btpd_calloc(1, sizeof(*nb) + len);
+    struct net_buf *nb;
+    if (len <= NB_POOLDATA) {
+        nb = pool_get(&m_nb_pool);
+        bzero(nb, sizeof(*nb) + len);
+    } else
+        nb = btpd_calloc(1, sizeof(*nb) + len);
     nb->type = type;
     nb->buf = (char *)(nb + 1);
     nb->len = len;
@@ -38,7 +61,8 @@ static struct net_buf *
 nb_create_set(short type, char *buf, size_t len,
     void (*kill_buf)(char *, size_t))
 {
-    struct net_buf *nb = btpd_calloc(1, sizeof(*nb));
+    struct net_buf *nb = pool_get(&m_nb_pool);
+    bzero(nb, sizeof(*nb));
     nb->type = type;
     nb->buf = buf;
     nb->len = len;
@@ -86,26 +110,83 @@ nb_create_piece(uint32_t index, uint32_t begin, size_t blen)
     return out;
 }
 
+/*
+ * The data isn't read until it's about to be sent, by nb_torrentdata_fill.
+ */
 struct net_buf *
-nb_create_torrentdata(void)
+nb_create_torrentdata(uint32_t index, uint32_t begin, size_t blen)
 {
     struct net_buf *out;
-    out = nb_create_set(NB_TORRENTDATA, NULL, 0, kill_buf_no);
+    out = nb_create_set(NB_TORRENTDATA, NULL, blen, kill_buf_no);
+    out->index = index;
+    out->begin = begin;
     return out;
 }
 
+struct nb_load {
+    struct net_buf *nb;
+    struct meta_peer *mp;
+    struct net *n;
+};
+
+static void
+nb_load_cb(void *arg, int err, uint8_t *buf)
+{
+    struct nb_load *ld = arg;
+    struct net_buf *nb = ld->nb;
+    nb->loading = 0;
+    if (err == 0) {
+        nb->buf = (char *)buf;
+        nb->kill_buf = kill_buf_free;
+    } else
+        free(buf);
+    if (ld->mp->p != NULL)
+        net_on_data_ready(ld->mp->p);
+    mp_drop(ld->mp, ld->n);
+    nb_drop(nb);
+    free(ld);
+}
+
+/*
+ * Gets the data for the peer p from the piece cache or the page cache if
+ * it's there, else starts reading it from the content on the disk threads
+ * and sets loading until it's been read. The event loop never waits for
+ * the disk.
+ */
 int
-nb_torrentdata_fill(struct net_buf *nb, struct torrent *tp, uint32_t index,
-    uint32_t begin, uint32_t length)
+nb_torrentdata_fill(struct net_buf *nb, struct peer *p)
 {
     int err;
-    uint8_t *content;
+    struct cache_ent *ce;
     assert(nb->type == NB_TORRENTDATA && nb->buf == NULL);
-    if ((err = cm_get_bytes(tp, index, begin, length, &content)) != 0)
+    if ((err = cache_get(p->n->tp, nb->index, p, &ce)) != 0)
         return err;
-    nb->buf = content;
-    nb->len = length;
-    nb->kill_buf = kill_buf_free;
+    if (ce != NULL) {
+        nb->buf = (char *)cache_data(ce) + nb->begin;
+        nb->ce = ce;
+        return 0;
+    }
+#ifdef HAVE_PREADV2_NOWAIT
+    uint8_t *buf = btpd_malloc(nb->len);
+    if (cm_get_cached(p->n->tp, nb->index, nb->begin, nb->len, buf) == 0) {
+        nb->buf = (char *)buf;
+        nb->kill_buf = kill_buf_free;
+        return 0;
+    }
+    free(buf);
+#endif
+    struct nb_load *ld = btpd_calloc(1, sizeof(*ld));
+    ld->nb = nb;
+    ld->mp = p->mp;
+    ld->n = p->n;
+    if ((err = cm_read(p->n->tp, nb->index, nb->begin, nb->len, nb_load_cb,
+             ld)) != 0) {
+        free(ld);
+        return err;
+    }
+    nb_hold(nb);
+    mp_hold(p->mp);
+    nb->loading = 1;
     return 0;
 }
 
@@ -133,6 +214,57 @@ nb_create_cancel(uint32_t index, uint32_t begin, uint32_t length)
     return out;
 }
 
+struct net_buf *
+nb_create_reject(uint32_t index, uint32_t begin, uint32_t length)
+{
+    struct net_buf *out = nb_create_alloc(NB_REJECT, 17);
+    enc_be32(out->buf, 13);
+    out->buf[4] = MSG_REJECT;
+    enc_be32(out->buf + 5, index);
+    enc_be32(out->buf + 9, begin);
+    enc_be32(out->buf + 13, length);
+    return out;
+}
+
+struct net_buf *
+nb_create_allowed_fast(uint32_t index)
+{
+    struct net_buf *out = nb_create_alloc(NB_ALLOWEDFAST, 9);
+    enc_be32(out->buf, 5);
+    out->buf[4] = MSG_ALLOWED_FAST;
+    enc_be32(out->buf + 5, index);
+    return out;
+}
+
+struct net_buf *
+nb_create_extended(uint8_t ext, const void *data, size_t len)
+{
+    struct net_buf *out = nb_create_alloc(NB_EXTENDED, 6 + len);
+    enc_be32(out->buf, 2 + len);
+    out->buf[4] = MSG_EXTENDED;
+    out->buf[5] = ext;
+    bcopy(data, out->buf + 6, len);
+    return out;
+}
+
+/*
+ * The extension handshake tells the peer which extension messages we
+ * understand, and the port we listen at.
+ */
+struct net_buf *
+nb_create_ext_shake(void)
+{
+    if (m_ext_shake == NULL) {
+        char buf[128];
+        int len = snprintf(buf, sizeof(buf),
+            "d1:md6:ut_pexi%dee1:pi%de1:v%d:%se", EXT_UT_PEX, net_port,
+            (int)strlen(BTPD_VERSION), BTPD_VERSION);
+        m_ext_shake = nb_create_extended(EXT_HANDSHAKE, buf, len);
+        nb_singleton(m_ext_shake);
+    }
+    return m_ext_shake;
+}
+
 struct net_buf *
 nb_create_have(uint32_t index)
 {
@@ -146,19 +278,36 @@ nb_create_have(uint32_t index)
 struct net_buf *
 nb_create_multihave(struct torrent *tp)
 {
-    uint32_t have_npieces = cm_pieces(tp);
+    uint32_t i, count = 0, have_npieces = cm_pieces(tp);
+    uint8_t *have = cm_get_piece_field(tp);
     struct net_buf *out = nb_create_alloc(NB_MULTIHAVE, 9 * have_npieces);
-    for (uint32_t i = 0, count = 0; count < have_npieces; i++) {
-        if (cm_has_piece(tp, i)) {
-            enc_be32(out->buf + count * 9, 5);
-            out->buf[count * 9 + 4] = MSG_HAVE;
-            enc_be32(out->buf + count * 9 + 5, i);
-            count++;
-        }
+    BIT_FOREACH(i, have, tp->npieces) {
+        enc_be32(out->buf + count * 9, 5);
+        out->buf[count * 9 + 4] = MSG_HAVE;
+        enc_be32(out->buf + count * 9 + 5, i);
+        count++;
     }
     return out;
 }
 
+struct net_buf *
+nb_create_have_all(void)
+{
+    if (m_have_all == NULL)
+        m_have_all =
+            nb_singleton(nb_create_onesized(MSG_HAVE_ALL, NB_HAVEALL));
+    return m_have_all;
+}
+
+struct net_buf *
+nb_create_have_none(void)
+{
+    if (m_have_none == NULL)
+        m_have_none =
+            nb_singleton(nb_create_onesized(MSG_HAVE_NONE, NB_HAVENONE));
+    return m_have_none;
+}
+
 struct net_buf *
 nb_create_unchoke(void)
 {
@@ -217,7 +366,7 @@ struct net_buf *
 nb_create_shake(struct torrent *tp)
 {
     struct net_buf *out = nb_create_alloc(NB_SHAKE, 68);
-    bcopy("\x13""BitTorrent protocol\0\0\0\0\0\0\0\0", out->buf, 28);
+    bcopy("\x13""BitTorrent protocol\0\0\0\0\0\x10\0\4", out->buf, 28);
     bcopy(tp->tl->hash, out->buf + 28, 20);
     bcopy(btpd_get_peer_id(), out->buf + 48, 20);
     return out;
@@ -227,9 +376,11 @@ uint32_t
 nb_get_index(struct net_buf *nb)
 {
     switch (nb->type) {
+    case NB_ALLOWEDFAST:
     case NB_CANCEL:
     case NB_HAVE:
     case NB_PIECE:
+    case NB_REJECT:
     case NB_REQUEST:
         return dec_be32(nb->buf + 5);
     default:
@@ -243,6 +394,7 @@ nb_get_begin(struct net_buf *nb)
     switch (nb->type) {
     case NB_CANCEL:
     case NB_PIECE:
+    case NB_REJECT:
     case NB_REQUEST:
         return dec_be32(nb->buf + 9);
     default:
@@ -255,6 +407,7 @@ nb_get_length(struct net_buf *nb)
 {
     switch (nb->type) {
     case NB_CANCEL:
+    case NB_REJECT:
     case NB_REQUEST:
         return dec_be32(nb->buf + 13);
     case NB_PIECE:
@@ -264,6 +417,13 @@ nb_get_length(struct net_buf *nb)
     }
 }
 
+uint8_t
+nb_get_ext(struct net_buf *nb)
+{
+    assert(nb->type == NB_EXTENDED);
+    return nb->buf[5];
+}
+
 int
 nb_drop(struct net_buf *nb)
 {
@@ -271,7 +431,12 @@ nb_drop(struct net_buf *nb)
     nb->refs--;
     if (nb->refs == 0) {
         nb->kill_buf(nb->buf, nb->len);
-        free(nb);
+        if (nb->ce != NULL)
+            cache_put(nb->ce);
+        if (nb_pooled(nb))
+            pool_put(&m_nb_pool, nb);
+        else
+            free(nb);
         return 1;
     } else
         return 0;
@@ -15,12 +15,20 @@
 #define NB_BITDATA      12
 #define NB_SHAKE        13
 #define NB_KEEPALIVE    14
+#define NB_HAVEALL      15
+#define NB_HAVENONE     16
+#define NB_REJECT       17
+#define NB_ALLOWEDFAST  18
+#define NB_EXTENDED     19
 
 struct net_buf {
     short type;
     unsigned refs;
     char *buf;
     size_t len;
+    uint32_t index, begin;  // The block held by an NB_TORRENTDATA.
+    struct cache_ent *ce;   // The cached piece it's in, if any.
+    int loading;            // Its data is being read.
     void (*kill_buf)(char *, size_t);
 };
 
@@ -33,10 +41,12 @@ BTPDQ_HEAD(nb_tq, nb_link);
 
 struct torrent;
 struct peer;
+struct cache_ent;
 
 struct net_buf *nb_create_keepalive(void);
 struct net_buf *nb_create_piece(uint32_t index, uint32_t begin, size_t blen);
-struct net_buf *nb_create_torrentdata(void);
+struct net_buf *nb_create_torrentdata(uint32_t index, uint32_t begin,
+    size_t blen);
 struct net_buf *nb_create_request(uint32_t index,
     uint32_t begin, uint32_t length);
 struct net_buf *nb_create_cancel(uint32_t index,
@@ -50,9 +60,15 @@ struct net_buf *nb_create_interest(void);
 struct net_buf *nb_create_bitfield(struct torrent *tp);
 struct net_buf *nb_create_bitdata(struct torrent *tp);
 struct net_buf *nb_create_shake(struct torrent *tp);
-
-int nb_torrentdata_fill(struct net_buf *nb, struct torrent *tp, uint32_t index,
+struct net_buf *nb_create_have_all(void);
+struct net_buf *nb_create_have_none(void);
+struct net_buf *nb_create_reject(uint32_t index,
     uint32_t begin, uint32_t length);
+struct net_buf *nb_create_allowed_fast(uint32_t index);
+struct net_buf *nb_create_extended(uint8_t ext, const void *data, size_t len);
+struct net_buf *nb_create_ext_shake(void);
+
+int nb_torrentdata_fill(struct net_buf *nb, struct peer *p);
 
 int nb_drop(struct net_buf *nb);
 void nb_hold(struct net_buf *nb);
@@ -60,5 +76,6 @@ void nb_hold(struct net_buf *nb);
 uint32_t nb_get_index(struct net_buf *nb);
 uint32_t nb_get_begin(struct net_buf *nb);
 uint32_t nb_get_length(struct net_buf *nb);
+uint8_t nb_get_ext(struct net_buf *nb);
 
 #endif
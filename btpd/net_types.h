@@ -7,6 +7,29 @@ BTPDQ_HEAD(block_request_tq, block_request);
 BTPDQ_HEAD(blog_tq, blog);
 BTPDQ_HEAD(blog_record_tq, blog_record);
 
+/*
+ * A transfer rate. Bytes are added to count as they are transferred and
+ * folded into value when a new second has started, with the same decay
+ * as a once per second update would give.
+ */
+struct rate {
+    unsigned long value;
+    unsigned long count;
+    long second;
+};
+
+/*
+ * A token bucket for one direction of traffic. It only holds what has
+ * been earned, the limit it's filled at is looked up when it's filled.
+ */
+struct bw_bucket {
+    unsigned long bytes;
+    unsigned long rem;
+    long long time;
+};
+
+#define NET_PEXMAX 50   /* The most peers added or dropped per exchange */
+
 struct net {
     struct torrent *tp;
 
@@ -15,15 +38,28 @@ struct net {
 
     uint8_t *busy_field;
     uint32_t npcs_busy;
-    unsigned *piece_count;
+    unsigned *piece_count;  /* Not counting the peers in nseeds */
+    unsigned nseeds;        /* Peers that had every piece from the start */
     struct piece_tq getlst;
+    struct piece **pieces;  /* The pieces on getlst by index */
+
+    uint32_t *rare_order;   /* The pieces we lack by count, then the rest */
+    uint32_t *rare_pos;     /* Where each piece is in rare_order */
+    uint32_t *rare_start;   /* Where the pieces with each count start */
+    unsigned rare_nbuckets, rare_cap;
 
-    unsigned long rate_up, rate_dwn;
+    struct rate rate_up, rate_dwn;
     unsigned long long uploaded, downloaded;
+    struct bw_bucket bw_in, bw_out;
 
     unsigned npeers;
     struct peer_tq peers;
     struct mptbl *mptbl;
+
+    long pex_time;                      /* When to exchange peers next */
+    char pex_dropped[NET_PEXMAX * 6];   /* Peers lost since then */
+    char pex_dropped6[NET_PEXMAX * 18];
+    unsigned pex_ndropped, pex_ndropped6;
 };
 
 enum input_state {
@@ -46,8 +82,11 @@ struct meta_peer {
 
 HTBL_TYPE(mptbl, meta_peer, uint8_t, id, chain);
 
+#define NET_NFAST 10    /* The size of the allowed fast sets */
+
 struct peer {
     int sd;
+    struct utp *utp;        // The uTP connection, if it isn't over TCP.
     uint8_t *piece_field;
     uint8_t *bad_field;
     uint32_t npieces;
@@ -60,21 +99,30 @@ struct peer {
 
     struct block_request_tq my_reqs;
 
+    uint32_t fast_in[NET_NFAST];    /* Pieces the peer lets us have fast */
+    uint32_t fast_out[NET_NFAST];   /* Pieces we let the peer have fast */
+    unsigned nfast_in, nfast_out;
+
     unsigned nreqs_out;
+    unsigned maxreqs;
     unsigned npiece_msgs;
+    long long rtt_min;
 
     size_t outq_off;
     struct nb_tq outq;
 
     struct fdev ioev;
+    struct timeout timer;
 
-    unsigned long rate_up, rate_dwn;
-    unsigned long count_up, count_dwn;
+    struct rate rate_up, rate_dwn;
+    struct bw_bucket bw_in, bw_out;
+    unsigned long bw_deficit_in, bw_deficit_out;
 
-    long t_created;
-    long t_lastwrite;
-    long t_wantwrite;
-    long t_nointerest;
+    long long t_created;
+    long long t_lastwrite;
+    long long t_wantwrite;
+    long long t_nointerest;
+    long long t_deadline;
 
     struct {
         uint32_t msg_len;
@@ -85,8 +133,29 @@ struct peer {
         size_t st_bytes;
         char *buf;
         size_t off;
+        size_t len;
+        size_t cap;
     } in;
 
+    struct {
+        uint8_t id;         // The peer's number for ut_pex, zero if none.
+        int sent;           // The peer has been sent our peers.
+        int announced;      // The peer has been sent to our peers.
+        int af;             // The family of addr, zero if it's unknown.
+        char addr[18];      // Where the peer listens, in compact form.
+        long long t_recv;
+    } pex;
+
+#ifdef EVLOOP_IOURING
+    struct {
+        size_t rwant;           // The size of the read in flight.
+        unsigned long rmax;
+        ssize_t wtried;         // The size of the write in flight.
+        unsigned long wallow;
+        unsigned npinned;       // Links at the head of outq it uses.
+    } io;
+#endif
+
     BTPDQ_ENTRY(peer) p_entry;
     BTPDQ_ENTRY(peer) ul_entry;
     BTPDQ_ENTRY(peer) rq_entry;
@@ -130,6 +199,7 @@ struct blog_record {
 struct block_request {
     struct peer *p;
     struct net_buf *msg;
+    long long t_requested;
     BTPDQ_ENTRY(block_request) p_entry;
     BTPDQ_ENTRY(block_request) blk_entry;
 };
@@ -6,11 +6,22 @@ int net_max_uploads = -2;
 unsigned net_max_peers;
 unsigned net_bw_limit_in;
 unsigned net_bw_limit_out;
+unsigned net_bw_burst;
 int net_port = 6881;
 off_t cm_alloc_size = 2048 * 1024;
+size_t cache_size = 32 << 20;
+unsigned cm_check_jobs = 3;
+unsigned disk_threads = 4;
 int ipcprot = 0600;
 int empty_start = 0;
 const char *tr_ip_arg;
 int net_ipv4 = 1;
 int net_ipv6 = 0;
 unsigned net_numwant = 50;
+unsigned net_min_requests = 10;
+unsigned net_max_requests = 128;
+const char *net_congestion;
+int net_dscp;
+int net_edge_triggered;
+int net_utp;
+unsigned btpd_shards = 1;
@@ -7,12 +7,23 @@ extern int net_max_uploads;
 extern unsigned net_max_peers;
 extern unsigned net_bw_limit_in;
 extern unsigned net_bw_limit_out;
+extern unsigned net_bw_burst;
 extern int net_port;
 extern off_t cm_alloc_size;
+extern size_t cache_size;
+extern unsigned cm_check_jobs;
+extern unsigned disk_threads;
 extern int ipcprot;
 extern int empty_start;
 extern const char *tr_ip_arg;
 extern int net_ipv4, net_ipv6;
 extern unsigned net_numwant;
+extern unsigned net_min_requests;
+extern unsigned net_max_requests;
+extern const char *net_congestion;
+extern int net_dscp;
+extern int net_edge_triggered;
+extern int net_utp;
+extern unsigned btpd_shards;
 
 #endif
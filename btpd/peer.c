@@ -1,6 +1,7 @@
 #include "btpd.h"
 
 #include <ctype.h>
+#include <sha1.h>
 
 struct meta_peer *
 mp_create(void)
@@ -36,7 +37,7 @@ mp_drop(struct meta_peer *mp, struct net *n)
 void
 peer_kill(struct peer *p)
 {
-    struct nb_link *nl;
+    int busy = 0;
 
     btpd_log(BTPD_L_CONN, "killed peer %p\n", p);
 
@@ -46,6 +47,7 @@ peer_kill(struct peer *p)
         if (p->n->active) {
             ul_on_lost_peer(p);
             dl_on_lost_peer(p);
+            pex_on_lost_peer(p);
         }
     } else
         BTPDQ_REMOVE(&net_unattached, p, p_entry);
@@ -54,27 +56,90 @@ peer_kill(struct peer *p)
     if (p->mp->flags & PF_ON_WRITEQ)
         BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
 
-    btpd_ev_del(&p->ioev);
-    close(p->sd);
+    // A uTP peer handed to another shard has neither connection nor socket.
+    if (p->utp != NULL)
+        utp_close(p->utp);
+    else if (p->sd >= 0) {
+#ifdef EVLOOP_IOURING
+        busy = fdev_busy(&p->ioev);
+#endif
+        btpd_ev_del(&p->ioev);
+        /*
+         * I/O queued for the socket may not have been submitted yet, so
+         * it's kept open until that's done lest the I/O hit a new socket
+         * with the same number.
+         */
+        if (!busy)
+            close(p->sd);
+    }
+    btpd_timer_del(&p->timer);
+
+    p->mp->p = NULL;
+    mp_drop(p->mp, p->n);
+    p->mp = NULL;
+    net_npeers--;
+    if (!busy)
+        peer_free(p);
+}
 
-    nl = BTPDQ_FIRST(&p->outq);
+/*
+ * Frees a killed peer. A peer killed with I/O in flight is freed, and its
+ * socket closed, once the event loop is done with it and its buffers.
+ */
+void
+peer_free(struct peer *p)
+{
+    struct nb_link *nl = BTPDQ_FIRST(&p->outq);
     while (nl != NULL) {
         struct nb_link *next = BTPDQ_NEXT(nl, entry);
-        nb_drop(nl->nb);
-        free(nl);
+        peer_nl_drop(nl);
         nl = next;
     }
-
-    p->mp->p = NULL;
-    mp_drop(p->mp, p->n);
     if (p->in.buf != NULL)
-        free(p->in.buf);
+        net_rbuf_put(p);
     if (p->piece_field != NULL)
         free(p->piece_field);
     if (p->bad_field != NULL)
         free(p->bad_field);
     free(p);
-    net_npeers--;
+}
+
+/*
+ * A peer's I/O is watched by its fdev, or by its uTP connection which is
+ * always level triggered.
+ */
+void
+peer_ev_enable(struct peer *p, uint16_t flags)
+{
+    if (p->utp != NULL)
+        utp_enable(p->utp, flags);
+    else
+        btpd_ev_enable(&p->ioev, flags);
+}
+
+void
+peer_ev_disable(struct peer *p, uint16_t flags)
+{
+    if (p->utp != NULL)
+        utp_disable(p->utp, flags);
+    else
+        btpd_ev_disable(&p->ioev, flags);
+}
+
+void
+peer_ev_again(struct peer *p, uint16_t flags)
+{
+    if (p->utp == NULL)
+        btpd_ev_again(&p->ioev, flags);
+}
+
+int
+peer_addr(struct peer *p, struct sockaddr *sa, socklen_t *salen)
+{
+    if (p->utp != NULL)
+        return utp_peername(p->utp, sa, salen);
+    else
+        return getpeername(p->sd, sa, salen);
 }
 
 void
@@ -84,19 +149,35 @@ peer_set_in_state(struct peer *p, enum input_state state, size_t size)
     p->in.st_bytes = size;
 }
 
+static __thread struct pool m_nl_pool =
+    POOL_INIT(sizeof(struct nb_link), 4096);
+
+/*
+ * Drop the buffer of a link that has been taken off a peer's outq and
+ * free the link.
+ */
+void
+peer_nl_drop(struct nb_link *nl)
+{
+    nb_drop(nl->nb);
+    pool_put(&m_nl_pool, nl);
+}
+
 void
 peer_send(struct peer *p, struct net_buf *nb)
 {
-    struct nb_link *nl = btpd_calloc(1, sizeof(*nl));
+    struct nb_link *nl = pool_get(&m_nl_pool);
     nl->nb = nb;
     nb_hold(nb);
 
     if (BTPDQ_EMPTY(&p->outq)) {
         assert(p->outq_off == 0);
-        btpd_ev_enable(&p->ioev, EV_WRITE);
-        p->t_wantwrite = btpd_seconds;
-    }
-    BTPDQ_INSERT_TAIL(&p->outq, nl, entry);
+        peer_ev_enable(p, EV_WRITE);
+        p->t_wantwrite = btpd_msecs();
+        BTPDQ_INSERT_TAIL(&p->outq, nl, entry);
+        peer_timer_update(p);
+    } else
+        BTPDQ_INSERT_TAIL(&p->outq, nl, entry);
 }
 
 /*
@@ -109,26 +190,53 @@ peer_send(struct peer *p, struct net_buf *nb)
 int
 peer_unsend(struct peer *p, struct nb_link *nl)
 {
+#ifdef EVLOOP_IOURING
+    // Nor can buffers the event loop is writing.
+    struct nb_link *it = BTPDQ_FIRST(&p->outq);
+    for (unsigned i = 0; i < p->io.npinned; i++) {
+        if (it == nl)
+            return 0;
+        it = BTPDQ_NEXT(it, entry);
+    }
+#endif
     if (!(nl == BTPDQ_FIRST(&p->outq) && p->outq_off > 0)) {
         BTPDQ_REMOVE(&p->outq, nl, entry);
         if (nl->nb->type == NB_TORRENTDATA) {
             assert(p->npiece_msgs > 0);
             p->npiece_msgs--;
         }
-        nb_drop(nl->nb);
-        free(nl);
+        peer_nl_drop(nl);
         if (BTPDQ_EMPTY(&p->outq)) {
             if (p->mp->flags & PF_ON_WRITEQ) {
                 BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
                 p->mp->flags &= ~PF_ON_WRITEQ;
             } else
-                btpd_ev_disable(&p->ioev, EV_WRITE);
+                peer_ev_disable(p, EV_WRITE);
         }
         return 1;
     } else
         return 0;
 }
 
+/*
+ * Stamps the request when it has gone on the wire, so its round trip
+ * doesn't count the time spent in the send queue. Requests are sent in
+ * the order they're queued, so the unsent ones are at the end of my_reqs.
+ * The request may have been cancelled already.
+ */
+static void
+peer_request_sent(struct peer *p, struct net_buf *nb)
+{
+    struct block_request *req = BTPDQ_LAST(&p->my_reqs, block_request_tq);
+    while (req != NULL && req->t_requested == 0) {
+        if (req->msg == nb) {
+            req->t_requested = btpd_msecs();
+            return;
+        }
+        req = BTPDQ_PREV(req, block_request_tq, p_entry);
+    }
+}
+
 void
 peer_sent(struct peer *p, struct net_buf *nb)
 {
@@ -159,6 +267,7 @@ peer_sent(struct peer *p, struct net_buf *nb)
     case NB_REQUEST:
         btpd_log(BTPD_L_MSG, "sent request(%u,%u,%u) to %p\n",
             nb_get_index(nb), nb_get_begin(nb), nb_get_length(nb), p);
+        peer_request_sent(p, nb);
         break;
     case NB_PIECE:
         btpd_log(BTPD_L_MSG, "sent piece(%u,%u,%u) to %p\n",
@@ -182,14 +291,33 @@ peer_sent(struct peer *p, struct net_buf *nb)
     case NB_SHAKE:
         btpd_log(BTPD_L_MSG, "sent shake to %p\n", p);
         break;
+    case NB_HAVEALL:
+        btpd_log(BTPD_L_MSG, "sent have all to %p\n", p);
+        break;
+    case NB_HAVENONE:
+        btpd_log(BTPD_L_MSG, "sent have none to %p\n", p);
+        break;
+    case NB_REJECT:
+        btpd_log(BTPD_L_MSG, "sent reject(%u,%u,%u) to %p\n",
+            nb_get_index(nb), nb_get_begin(nb), nb_get_length(nb), p);
+        break;
+    case NB_ALLOWEDFAST:
+        btpd_log(BTPD_L_MSG, "sent allowed fast(%u) to %p\n",
+            nb_get_index(nb), p);
+        break;
+    case NB_EXTENDED:
+        btpd_log(BTPD_L_MSG, "sent extended(%u) to %p\n",
+            nb_get_ext(nb), p);
+        break;
     }
 }
 
 void
 peer_request(struct peer *p, struct block_request *req)
 {
-    assert(p->nreqs_out < MAXPIPEDREQUESTS);
+    assert(p->nreqs_out < p->maxreqs);
     p->nreqs_out++;
+    req->t_requested = 0;
     BTPDQ_INSERT_TAIL(&p->my_reqs, req, p_entry);
     peer_send(p, req->msg);
 }
@@ -238,17 +366,29 @@ peer_unchoke(struct peer *p)
     peer_send(p, nb_create_unchoke());
 }
 
+/*
+ * Drops the pieces queued for the peer. A peer with the fast extension
+ * is told which requests won't be answered, and keeps getting the pieces
+ * it's allowed to have fast.
+ */
 void
 peer_choke(struct peer *p)
 {
     struct nb_link *nl = BTPDQ_FIRST(&p->outq);
     while (nl != NULL) {
         struct nb_link *next = BTPDQ_NEXT(nl, entry);
-        if (nl->nb->type == NB_PIECE) {
+        if (nl->nb->type == NB_PIECE
+            && !peer_allowed_fast(p, nb_get_index(nl->nb))) {
             struct nb_link *data = next;
+            uint32_t index = nb_get_index(nl->nb);
+            uint32_t begin = nb_get_begin(nl->nb);
+            uint32_t length = nb_get_length(nl->nb);
             next = BTPDQ_NEXT(next, entry);
-            if (peer_unsend(p, nl))
+            if (peer_unsend(p, nl)) {
                 peer_unsend(p, data);
+                if (p->mp->flags & PF_FAST)
+                    peer_send(p, nb_create_reject(index, begin, length));
+            }
         }
         nl = next;
     }
@@ -257,14 +397,17 @@ peer_choke(struct peer *p)
     peer_send(p, nb_create_choke());
 }
 
+/*
+ * Increases the peer's wanted level by count pieces it has.
+ */
 void
-peer_want(struct peer *p, uint32_t index)
+peer_want_pieces(struct peer *p, uint32_t count)
 {
-    if (!has_bit(p->piece_field, index) || peer_has_bad(p, index))
+    if (count == 0)
         return;
-    assert(p->nwant < p->npieces);
-    p->nwant++;
-    if (p->nwant == 1) {
+    assert(p->nwant + count <= p->npieces);
+    p->nwant += count;
+    if (p->nwant == count) {
         p->mp->flags |= PF_I_WANT;
         if (p->mp->flags & PF_SUSPECT)
             return;
@@ -283,6 +426,14 @@ peer_want(struct peer *p, uint32_t index)
     }
 }
 
+void
+peer_want(struct peer *p, uint32_t index)
+{
+    if (!has_bit(p->piece_field, index) || peer_has_bad(p, index))
+        return;
+    peer_want_pieces(p, 1);
+}
+
 void
 peer_unwant(struct peer *p, uint32_t index)
 {
@@ -294,7 +445,7 @@ peer_unwant(struct peer *p, uint32_t index)
         p->mp->flags &= ~PF_I_WANT;
         if (p->mp->flags & PF_SUSPECT)
             return;
-        p->t_nointerest = btpd_seconds;
+        p->t_nointerest = btpd_msecs();
         if (p->nreqs_out == 0)
             peer_send(p, nb_create_uninterest());
         else
@@ -302,8 +453,79 @@ peer_unwant(struct peer *p, uint32_t index)
     }
 }
 
+/*
+ * Returns when the peer's timer should next fire, given its current
+ * state. The deadlines it's made from only move forward, except when the
+ * outq stops being empty, when the peer loses interest and when the
+ * torrent becomes complete. Those call peer_timer_update. A timer that
+ * fires too early simply rearms itself.
+ */
+static long long
+peer_deadline(struct peer *p)
+{
+    long long t;
+    if (p->mp->flags & PF_BANNED)
+        return 0;
+    if (!(p->mp->flags & PF_ATTACHED))
+        return p->t_created + 60000;
+    if (BTPDQ_EMPTY(&p->outq))
+        t = p->t_lastwrite + 120000;
+    else
+        t = p->t_wantwrite + 60000;
+    if (cm_full(p->n->tp) && !(p->mp->flags & PF_P_WANT))
+        t = min(t, p->t_nointerest + 600000);
+    return t;
+}
+
+static void
+peer_timer_arm(struct peer *p, long long deadline)
+{
+    long long delay = max(deadline - btpd_msecs(), 0);
+    p->t_deadline = deadline;
+    btpd_timer_add(&p->timer,
+        (& (struct timespec) { delay / 1000, delay % 1000 * 1000000 }));
+}
+
+void
+peer_timer_update(struct peer *p)
+{
+    long long deadline = peer_deadline(p);
+    if (deadline < p->t_deadline)
+        peer_timer_arm(p, deadline);
+}
+
+static void
+peer_timer_cb(int fd, short type, void *arg)
+{
+    struct peer *p = arg;
+    long long now = btpd_msecs();
+    if (p->mp->flags & PF_BANNED)
+        goto kill;
+    if (p->mp->flags & PF_ATTACHED) {
+        if (BTPDQ_EMPTY(&p->outq)) {
+            if (now - p->t_lastwrite >= 120000)
+                peer_keepalive(p);
+        } else if (now - p->t_wantwrite >= 60000) {
+            btpd_log(BTPD_L_CONN, "write attempt timed out.\n");
+            goto kill;
+        }
+        if ((cm_full(p->n->tp) && !(p->mp->flags & PF_P_WANT) &&
+                now - p->t_nointerest >= 600000)) {
+            btpd_log(BTPD_L_CONN, "no interest for 10 minutes.\n");
+            goto kill;
+        }
+    } else if (now - p->t_created >= 60000) {
+            btpd_log(BTPD_L_CONN, "hand shake timed out.\n");
+            goto kill;
+    }
+    peer_timer_arm(p, peer_deadline(p));
+    return;
+kill:
+    peer_kill(p);
+}
+
 static struct peer *
-peer_create_common(int sd)
+peer_create_common(int sd, struct utp *u)
 {
     struct peer *p = btpd_calloc(1, sizeof(*p));
 
@@ -312,48 +534,48 @@ peer_create_common(int sd)
     p->mp->p = p;
 
     p->sd = sd;
+    p->utp = u;
+    p->maxreqs = net_min_requests;
     p->mp->flags = PF_I_CHOKE | PF_P_CHOKE;
-    p->t_created = btpd_seconds;
-    p->t_lastwrite = btpd_seconds;
-    p->t_nointerest = btpd_seconds;
+    p->t_created = btpd_msecs();
+    p->t_lastwrite = p->t_created;
+    p->t_nointerest = p->t_created;
     BTPDQ_INIT(&p->my_reqs);
     BTPDQ_INIT(&p->outq);
 
     peer_set_in_state(p, SHAKE_PSTR, 28);
 
-    btpd_ev_new(&p->ioev, p->sd, EV_READ, net_io_cb, p);
+    if (u != NULL) {
+        utp_set_cb(u, net_io_cb, p);
+        utp_enable(u, EV_READ);
+    } else
+        btpd_ev_new(&p->ioev, p->sd,
+            EV_READ | (net_edge_triggered ? EV_EDGE : 0), net_io_cb, p);
+    evtimer_init(&p->timer, peer_timer_cb, p);
+    peer_timer_arm(p, peer_deadline(p));
 
     BTPDQ_INSERT_TAIL(&net_unattached, p, p_entry);
     net_npeers++;
     return p;
 }
 
-void
-peer_create_in(int sd)
+struct peer *
+peer_create_in(int sd, struct utp *u)
 {
-    struct peer *p = peer_create_common(sd);
+    struct peer *p = peer_create_common(sd, u);
     p->mp->flags |= PF_INCOMING;
+    return p;
 }
 
-void
-peer_create_out(struct net *n, const uint8_t *id,
-    const char *ip, int port)
-{
-    int sd;
-    struct peer *p;
-
-    if (net_connect_name(ip, port, &sd) != 0)
-        return;
-
-    p = peer_create_common(sd);
-    p->n = n;
-    peer_send(p, nb_create_shake(n->tp));
-}
-
-void
-peer_create_out_compact(struct net *n, int family, const char *compact)
+/*
+ * Connects to the peer over uTP if utp is set and it's possible, else
+ * over TCP.
+ */
+static void
+peer_dial(struct net *n, int family, const char *compact, int utp)
 {
-    int sd;
+    int sd = -1;
+    struct utp *u = NULL;
     struct peer *p;
     struct sockaddr_storage addr;
     struct sockaddr_in *a4;
@@ -382,14 +604,64 @@ peer_create_out_compact(struct net *n, int family, const char *compact)
     default:
         abort();
     }
-    if (net_connect_addr(family, (struct sockaddr *)&addr, addrlen, &sd) != 0)
+    if (utp)
+        u = net_connect_utp(family, (struct sockaddr *)&addr, addrlen);
+    if (u == NULL
+        && net_connect_addr(family, (struct sockaddr *)&addr, addrlen, &sd)
+        != 0)
         return;
 
-    p = peer_create_common(sd);
+    p = peer_create_common(sd, u);
     p->n = n;
+    pex_on_dial(p, family, compact);
     peer_send(p, nb_create_shake(n->tp));
 }
 
+void
+peer_create_out(struct net *n, const uint8_t *id,
+    const char *ip, int port)
+{
+    char compact[18];
+    uint16_t nport = htons(port);
+
+    if (inet_pton(AF_INET, ip, compact) == 1) {
+        bcopy(&nport, compact + 4, 2);
+        peer_create_out_compact(n, AF_INET, compact, 0);
+    } else if (inet_pton(AF_INET6, ip, compact) == 1) {
+        bcopy(&nport, compact + 16, 2);
+        peer_create_out_compact(n, AF_INET6, compact, 0);
+    }
+}
+
+/*
+ * The peer is dialed over uTP if it's preferred, or if it's allowed and
+ * the peer is known to speak it.
+ */
+void
+peer_create_out_compact(struct net *n, int family, const char *compact,
+    int utp)
+{
+    peer_dial(n, family, compact, net_utp == NET_UTP_PREFER
+        || (net_utp != NET_UTP_OFF && utp));
+}
+
+/*
+ * A peer that refused our uTP connection, or closed it during the
+ * handshake, is tried again over TCP.
+ */
+void
+peer_redial_tcp(struct peer *p)
+{
+    struct net *n = p->n;
+    int af = p->pex.af;
+    char addr[18];
+
+    bcopy(p->pex.addr, addr, sizeof(addr));
+    peer_kill(p);
+    if (af != 0 && n->active && net_peer_room())
+        peer_dial(n, af, addr, 0);
+}
+
 void
 peer_on_no_reqs(struct peer *p)
 {
@@ -416,7 +688,11 @@ peer_on_shake(struct peer *p)
     printid[i] = '\0';
     btpd_log(BTPD_L_MSG, "received shake(%s) from %p\n", printid, p);
     p->piece_field = btpd_calloc(1, (int)ceil(p->n->tp->npieces / 8.0));
-    if (cm_pieces(p->n->tp) > 0) {
+    if ((p->mp->flags & PF_FAST) && cm_full(p->n->tp))
+        peer_send(p, nb_create_have_all());
+    else if ((p->mp->flags & PF_FAST) && cm_pieces(p->n->tp) == 0)
+        peer_send(p, nb_create_have_none());
+    else if (cm_pieces(p->n->tp) > 0) {
         if ((cm_pieces(p->n->tp) * 9 < 5 +
                 ceil(p->n->tp->npieces / 8.0)))
             peer_send(p, nb_create_multihave(p->n->tp));
@@ -425,6 +701,10 @@ peer_on_shake(struct peer *p)
             peer_send(p, nb_create_bitdata(p->n->tp));
         }
     }
+    if (p->mp->flags & PF_FAST)
+        peer_send_allowed_fast(p);
+    if (p->mp->flags & PF_EXT)
+        peer_send(p, nb_create_ext_shake());
 
     mptbl_insert(p->n->mptbl, p->mp);
     BTPDQ_REMOVE(&net_unattached, p, p_entry);
@@ -434,6 +714,7 @@ peer_on_shake(struct peer *p)
 
     ul_on_new_peer(p);
     dl_on_new_peer(p);
+    pex_on_new_peer(p);
 }
 
 void
@@ -442,7 +723,11 @@ peer_on_choke(struct peer *p)
     btpd_log(BTPD_L_MSG, "received choke from %p\n", p);
     if ((p->mp->flags & PF_P_CHOKE) != 0)
         return;
-    else {
+    else if (p->mp->flags & PF_FAST) {
+        // The peer rejects the requests it won't answer.
+        p->mp->flags |= PF_P_CHOKE;
+        dl_on_allowed_fast(p);
+    } else {
         p->mp->flags |= PF_P_CHOKE;
         dl_on_choke(p);
         struct nb_link *nl = BTPDQ_FIRST(&p->outq);
@@ -487,7 +772,8 @@ peer_on_uninterest(struct peer *p)
         return;
     else {
         p->mp->flags &= ~PF_P_WANT;
-        p->t_nointerest = btpd_seconds;
+        p->t_nointerest = btpd_msecs();
+        peer_timer_update(p);
         ul_on_uninterest(p);
     }
 }
@@ -500,21 +786,58 @@ peer_on_have(struct peer *p, uint32_t index)
         set_bit(p->piece_field, index);
         p->npieces++;
         dl_on_piece_ann(p, index);
+        dl_on_allowed_fast(p);
     }
 }
 
+void
+peer_on_have_all(struct peer *p)
+{
+    uint32_t npieces = p->n->tp->npieces;
+    btpd_log(BTPD_L_MSG, "received have all from %p\n", p);
+    assert(p->npieces == 0);
+    set_bits(p->piece_field, 0, npieces);
+    p->npieces = npieces;
+    dl_on_seed_ann(p);
+    dl_on_allowed_fast(p);
+}
+
 void
 peer_on_bitfield(struct peer *p, const uint8_t *field)
 {
+    uint32_t i, npieces = p->n->tp->npieces;
     btpd_log(BTPD_L_MSG, "received bitfield from %p\n", p);
     assert(p->npieces == 0);
-    bcopy(field, p->piece_field, (size_t)ceil(p->n->tp->npieces / 8.0));
-    for (uint32_t i = 0; i < p->n->tp->npieces; i++) {
-        if (has_bit(p->piece_field, i)) {
+    bcopy(field, p->piece_field, (size_t)ceil(npieces / 8.0));
+    if (count_bits(p->piece_field, npieces) == npieces) {
+        p->npieces = npieces;
+        dl_on_seed_ann(p);
+    } else {
+        BIT_FOREACH(i, p->piece_field, npieces) {
             p->npieces++;
             dl_on_piece_ann(p, i);
         }
     }
+    dl_on_allowed_fast(p);
+}
+
+/*
+ * Sets how many requests may be outstanding to the peer from its download
+ * rate and the shortest time it has taken to answer a request. Keeping
+ * twice the bandwidth-delay product in flight lets the pipeline grow
+ * until the link is full. The time a request takes grows with the number
+ * in flight ahead of it, so only the shortest one says much about the
+ * delay.
+ */
+static void
+peer_update_maxreqs(struct peer *p, long long rtt)
+{
+    unsigned long long want;
+    if (p->rtt_min == 0 || rtt < p->rtt_min)
+        p->rtt_min = max(rtt, 1);
+    want = 2ULL * (rate_get(&p->rate_dwn) / RATEHISTORY) * p->rtt_min
+        / (1000 * PIECE_BLOCKLEN) + 1;
+    p->maxreqs = min(max(want, net_min_requests), net_max_requests);
 }
 
 void
@@ -533,6 +856,8 @@ peer_on_piece(struct peer *p, uint32_t index, uint32_t begin,
         assert(p->nreqs_out > 0);
         p->nreqs_out--;
         BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
+        if (req->t_requested != 0)
+            peer_update_maxreqs(p, btpd_msecs() - req->t_requested);
         if (p->nreqs_out == 0)
             peer_on_no_reqs(p);
         dl_on_block(p, req, index, begin, length, data);
@@ -547,11 +872,13 @@ peer_on_request(struct peer *p, uint32_t index, uint32_t begin,
 {
     btpd_log(BTPD_L_MSG, "received request(%u,%u,%u) from %p\n",
         index, begin, length, p);
-    if ((p->mp->flags & PF_NO_REQUESTS) == 0) {
+    if ((p->mp->flags & PF_FAST) && p->npiece_msgs >= MAXPIECEMSGS)
+        peer_send(p, nb_create_reject(index, begin, length));
+    else if ((p->mp->flags & PF_NO_REQUESTS) == 0) {
         peer_send(p, nb_create_piece(index, begin, length));
-        peer_send(p, nb_create_torrentdata());
+        peer_send(p, nb_create_torrentdata(index, begin, length));
         p->npiece_msgs++;
-        if (p->npiece_msgs >= MAXPIECEMSGS) {
+        if (p->npiece_msgs >= MAXPIECEMSGS && !(p->mp->flags & PF_FAST)) {
             peer_send(p, nb_create_choke());
             peer_send(p, nb_create_unchoke());
             p->mp->flags |= PF_NO_REQUESTS;
@@ -572,37 +899,138 @@ peer_on_cancel(struct peer *p, uint32_t index, uint32_t begin,
             && nb_get_index(nl->nb) == index
             && nb_get_length(nl->nb) == length) {
             struct nb_link *data = BTPDQ_NEXT(nl, entry);
-            if (peer_unsend(p, nl))
+            if (peer_unsend(p, nl)) {
                 peer_unsend(p, data);
+                if (p->mp->flags & PF_FAST)
+                    peer_send(p, nb_create_reject(index, begin, length));
+            }
             break;
         }
 }
 
 void
-peer_on_tick(struct peer *p)
+peer_on_reject(struct peer *p, uint32_t index, uint32_t begin,
+    uint32_t length)
 {
-    if (p->mp->flags & PF_BANNED)
-        goto kill;
-    if (p->mp->flags & PF_ATTACHED) {
-        if (BTPDQ_EMPTY(&p->outq)) {
-            if (btpd_seconds - p->t_lastwrite >= 120)
-                peer_keepalive(p);
-        } else if (btpd_seconds - p->t_wantwrite >= 60) {
-            btpd_log(BTPD_L_CONN, "write attempt timed out.\n");
-            goto kill;
+    struct block_request *req;
+    btpd_log(BTPD_L_MSG, "received reject(%u,%u,%u) from %p\n",
+        index, begin, length, p);
+    BTPDQ_FOREACH(req, &p->my_reqs, p_entry)
+        if ((nb_get_begin(req->msg) == begin &&
+                nb_get_index(req->msg) == index &&
+                nb_get_length(req->msg) == length))
+            break;
+    if (req == NULL)
+        return;
+    // Don't keep asking for a piece the peer won't give us.
+    for (unsigned i = 0; i < p->nfast_in; i++)
+        if (p->fast_in[i] == index) {
+            p->fast_in[i] = p->fast_in[--p->nfast_in];
+            break;
         }
-        if ((cm_full(p->n->tp) && !(p->mp->flags & PF_P_WANT) &&
-                btpd_seconds - p->t_nointerest >= 600)) {
-            btpd_log(BTPD_L_CONN, "no interest for 10 minutes.\n");
-            goto kill;
+    dl_on_reject(p, req);
+}
+
+void
+peer_on_suggest(struct peer *p, uint32_t index)
+{
+    btpd_log(BTPD_L_MSG, "received suggest(%u) from %p\n", index, p);
+    dl_on_suggest(p, index);
+}
+
+void
+peer_on_allowed_fast(struct peer *p, uint32_t index)
+{
+    btpd_log(BTPD_L_MSG, "received allowed fast(%u) from %p\n", index, p);
+    if (p->nfast_in == NET_NFAST)
+        return;
+    for (unsigned i = 0; i < p->nfast_in; i++)
+        if (p->fast_in[i] == index)
+            return;
+    p->fast_in[p->nfast_in++] = index;
+    dl_on_allowed_fast(p);
+}
+
+/*
+ * The extension handshake says which extension messages the peer
+ * understands, and may give the port it listens at.
+ */
+static void
+peer_on_ext_shake(struct peer *p, const char *buf, size_t len)
+{
+    const char *m;
+    long long id, port;
+    if (benc_validate(buf, len) != 0 || !benc_isdct(buf))
+        return;
+    if ((m = benc_dget_dct(buf, "m")) != NULL) {
+        id = benc_dget_int(m, "ut_pex");
+        p->pex.id = id > 0 && id < 256 ? id : 0;
+    }
+    port = benc_dget_int(buf, "p");
+    if (port > 0 && port < 65536)
+        pex_on_port(p, port);
+}
+
+void
+peer_on_extended(struct peer *p, uint8_t ext, const char *buf, size_t len)
+{
+    btpd_log(BTPD_L_MSG, "received extended(%u) from %p\n", ext, p);
+    switch (ext) {
+    case EXT_HANDSHAKE:
+        peer_on_ext_shake(p, buf, len);
+        break;
+    case EXT_UT_PEX:
+        pex_on_msg(p, buf, len);
+        break;
+    }
+}
+
+int
+peer_allowed_fast(struct peer *p, uint32_t index)
+{
+    for (unsigned i = 0; i < p->nfast_out; i++)
+        if (p->fast_out[i] == index)
+            return 1;
+    return 0;
+}
+
+/*
+ * Sends the peer the pieces it may download while choked, chosen from
+ * its address and the info hash as in BEP 6. Peers in the same /24
+ * network get the same set, so reconnecting doesn't give more.
+ */
+void
+peer_send_allowed_fast(struct peer *p)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    uint8_t x[24], hash[20];
+    uint32_t npieces = p->n->tp->npieces;
+    unsigned k = min(NET_NFAST, npieces);
+
+    if (peer_addr(p, (struct sockaddr *)&addr, &addrlen) != 0)
+        return;
+    if (addr.ss_family == AF_INET)
+        bcopy(&((struct sockaddr_in *)&addr)->sin_addr, x, 4);
+    else if (addr.ss_family == AF_INET6
+        && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)&addr)->sin6_addr))
+        bcopy(((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr + 12, x, 4);
+    else
+        return;
+    x[3] = 0;
+    bcopy(p->n->tp->tl->hash, x + 4, 20);
+    sha1(x, sizeof(x), hash);
+
+    while (p->nfast_out < k) {
+        for (int i = 0; i < 5 && p->nfast_out < k; i++) {
+            uint32_t index = dec_be32(hash + 4 * i) % npieces;
+            if (!peer_allowed_fast(p, index)) {
+                p->fast_out[p->nfast_out++] = index;
+                peer_send(p, nb_create_allowed_fast(index));
+            }
         }
-    } else if (btpd_seconds - p->t_created >= 60) {
-            btpd_log(BTPD_L_CONN, "hand shake timed out.\n");
-            goto kill;
+        sha1(hash, sizeof(hash), hash);
     }
-    return;
-kill:
-    peer_kill(p);
 }
 
 void
@@ -672,7 +1100,7 @@ peer_has_bad(struct peer *p, uint32_t index)
 int
 peer_laden(struct peer *p)
 {
-    return p->nreqs_out >= MAXPIPEDREQUESTS;
+    return p->nreqs_out >= p->maxreqs;
 }
 
 int
@@ -13,14 +13,22 @@
 #define PF_DO_UNWANT    0x200
 #define PF_SUSPECT      0x400
 #define PF_BANNED       0x800
+#define PF_FAST        0x1000   /* The peer supports the fast extension */
+#define PF_EXT         0x2000   /* The peer supports extension messages */
+#define PF_SEED        0x4000   /* The peer is counted in the net's nseeds */
 
 #define MAXPIECEMSGS 128
-#define MAXPIPEDREQUESTS 10
+
+void peer_ev_enable(struct peer *p, uint16_t flags);
+void peer_ev_disable(struct peer *p, uint16_t flags);
+void peer_ev_again(struct peer *p, uint16_t flags);
+int peer_addr(struct peer *p, struct sockaddr *sa, socklen_t *salen);
 
 void peer_set_in_state(struct peer *p, enum input_state state, size_t size);
 
 void peer_send(struct peer *p, struct net_buf *nb);
 int peer_unsend(struct peer *p, struct nb_link *nl);
+void peer_nl_drop(struct nb_link *nl);
 void peer_sent(struct peer *p, struct net_buf *nb);
 
 void peer_keepalive(struct peer *p);
@@ -28,17 +36,21 @@ void peer_unchoke(struct peer *p);
 void peer_choke(struct peer *p);
 void peer_unwant(struct peer *p, uint32_t index);
 void peer_want(struct peer *p, uint32_t index);
+void peer_want_pieces(struct peer *p, uint32_t count);
 void peer_request(struct peer *p, struct block_request *req);
 void peer_cancel(struct peer *p, struct block_request *req,
     struct net_buf *nb);
 
 int peer_requested(struct peer *p, uint32_t piece, uint32_t block);
 
-void peer_create_in(int sd);
+struct peer *peer_create_in(int sd, struct utp *u);
 void peer_create_out(struct net *n, const uint8_t *id,
     const char *ip, int port);
-void peer_create_out_compact(struct net *n, int family, const char *compact);
+void peer_create_out_compact(struct net *n, int family, const char *compact,
+    int utp);
+void peer_redial_tcp(struct peer *p);
 void peer_kill(struct peer *p);
+void peer_free(struct peer *p);
 
 void peer_on_no_reqs(struct peer *p);
 void peer_on_keepalive(struct peer *p);
@@ -55,7 +67,15 @@ void peer_on_request(struct peer *p, uint32_t index, uint32_t begin,
     uint32_t length);
 void peer_on_cancel(struct peer *p, uint32_t index, uint32_t begin,
     uint32_t length);
-void peer_on_tick(struct peer *p);
+void peer_on_have_all(struct peer *p);
+void peer_on_reject(struct peer *p, uint32_t index, uint32_t begin,
+    uint32_t length);
+void peer_on_suggest(struct peer *p, uint32_t index);
+void peer_on_allowed_fast(struct peer *p, uint32_t index);
+void peer_send_allowed_fast(struct peer *p);
+void peer_on_extended(struct peer *p, uint8_t ext, const char *buf,
+    size_t len);
+void peer_timer_update(struct peer *p);
 
 int peer_active_down(struct peer *p);
 int peer_active_up(struct peer *p);
@@ -69,6 +89,7 @@ int peer_full(struct peer *p);
 void peer_bad_piece(struct peer *p, uint32_t index);
 void peer_good_piece(struct peer *p, uint32_t index);
 int peer_requestable(struct peer *p, uint32_t index);
+int peer_allowed_fast(struct peer *p, uint32_t index);
 
 void mp_hold(struct meta_peer *mp);
 void mp_drop(struct meta_peer *mp, struct net *n);
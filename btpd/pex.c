@@ -0,0 +1,269 @@
+#include "btpd.h"
+
+#include <iobuf.h>
+
+/*
+ * Peer exchange, ut_pex. Once a minute each peer that understands it is
+ * sent the peers that have been found and lost since the last time. A
+ * peer gets all the peers announced so far the first time. The peers
+ * we're sent are connected to like the ones from the tracker.
+ */
+
+#define PEX_INTERVAL 60
+
+#define PEX_SEED        0x02
+#define PEX_UTP         0x04
+#define PEX_REACHABLE   0x10
+
+struct pex_list {
+    char a4[NET_PEXMAX * 6], f4[NET_PEXMAX];
+    char a6[NET_PEXMAX * 18], f6[NET_PEXMAX];
+    unsigned n4, n6;
+};
+
+/*
+ * Finds where the peer listens. That's the address it's connected from
+ * and, unless we connected to it, the port it gave in its handshake.
+ */
+static void
+pex_set_addr(struct peer *p, int port)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct sockaddr_in *a4 = (struct sockaddr_in *)&addr;
+    struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&addr;
+    uint16_t nport = htons(port);
+
+    if (peer_addr(p, (struct sockaddr *)&addr, &addrlen) != 0)
+        return;
+    if (addr.ss_family == AF_INET) {
+        p->pex.af = AF_INET;
+        bcopy(&a4->sin_addr, p->pex.addr, 4);
+        bcopy(port == 0 ? &a4->sin_port : &nport, p->pex.addr + 4, 2);
+    } else if (addr.ss_family == AF_INET6
+        && IN6_IS_ADDR_V4MAPPED(&a6->sin6_addr)) {
+        p->pex.af = AF_INET;
+        bcopy(a6->sin6_addr.s6_addr + 12, p->pex.addr, 4);
+        bcopy(port == 0 ? &a6->sin6_port : &nport, p->pex.addr + 4, 2);
+    } else if (addr.ss_family == AF_INET6) {
+        p->pex.af = AF_INET6;
+        bcopy(&a6->sin6_addr, p->pex.addr, 16);
+        bcopy(port == 0 ? &a6->sin6_port : &nport, p->pex.addr + 16, 2);
+    }
+}
+
+/*
+ * The address of a peer we connect to is known before the hand shake,
+ * so it isn't connected to twice while the hand shake is going on.
+ */
+void
+pex_on_dial(struct peer *p, int af, const char *compact)
+{
+    if (af == AF_INET6 && IN6_IS_ADDR_V4MAPPED((struct in6_addr *)compact)) {
+        p->pex.af = AF_INET;
+        bcopy(compact + 12, p->pex.addr, 6);
+    } else {
+        p->pex.af = af;
+        bcopy(compact, p->pex.addr, af == AF_INET ? 6 : 18);
+    }
+}
+
+void
+pex_on_new_peer(struct peer *p)
+{
+    if (!(p->mp->flags & PF_INCOMING) && p->pex.af == 0)
+        pex_set_addr(p, 0);
+}
+
+void
+pex_on_port(struct peer *p, int port)
+{
+    if (p->mp->flags & PF_INCOMING)
+        pex_set_addr(p, port);
+}
+
+/*
+ * Only the peers our peers have been told about are sent as dropped.
+ */
+void
+pex_on_lost_peer(struct peer *p)
+{
+    struct net *n = p->n;
+    if (!p->pex.announced)
+        return;
+    if (p->pex.af == AF_INET && n->pex_ndropped < NET_PEXMAX) {
+        bcopy(p->pex.addr, n->pex_dropped + n->pex_ndropped * 6, 6);
+        n->pex_ndropped++;
+    } else if (p->pex.af == AF_INET6 && n->pex_ndropped6 < NET_PEXMAX) {
+        bcopy(p->pex.addr, n->pex_dropped6 + n->pex_ndropped6 * 18, 18);
+        n->pex_ndropped6++;
+    }
+}
+
+/*
+ * Adds the peer to the list if it has room for it.
+ * Returns 1 if it was added, otherwise 0.
+ */
+static int
+pex_list_add(struct pex_list *l, struct peer *p)
+{
+    char flags = 0;
+    if (peer_full(p))
+        flags |= PEX_SEED;
+    if (!(p->mp->flags & PF_INCOMING))
+        flags |= PEX_REACHABLE;
+    if (p->utp != NULL)
+        flags |= PEX_UTP;
+    if (p->pex.af == AF_INET && l->n4 < NET_PEXMAX) {
+        bcopy(p->pex.addr, l->a4 + l->n4 * 6, 6);
+        l->f4[l->n4++] = flags;
+    } else if (p->pex.af == AF_INET6 && l->n6 < NET_PEXMAX) {
+        bcopy(p->pex.addr, l->a6 + l->n6 * 18, 18);
+        l->f6[l->n6++] = flags;
+    } else
+        return 0;
+    return 1;
+}
+
+static void
+pex_print_mem(struct iobuf *iob, const char *key, const char *mem,
+    size_t len)
+{
+    if (len > 0) {
+        iobuf_print(iob, "%d:%s%d:", (int)strlen(key), key, (int)len);
+        iobuf_write(iob, mem, len);
+    }
+}
+
+static void
+pex_print(struct iobuf *iob, struct pex_list *added, struct net *n)
+{
+    iobuf_swrite(iob, "d");
+    pex_print_mem(iob, "added", added->a4, added->n4 * 6);
+    pex_print_mem(iob, "added.f", added->f4, added->n4);
+    pex_print_mem(iob, "added6", added->a6, added->n6 * 18);
+    pex_print_mem(iob, "added6.f", added->f6, added->n6);
+    if (n != NULL) {
+        pex_print_mem(iob, "dropped", n->pex_dropped, n->pex_ndropped * 6);
+        pex_print_mem(iob, "dropped6", n->pex_dropped6,
+            n->pex_ndropped6 * 18);
+    }
+    iobuf_swrite(iob, "e");
+    if (iob->error)
+        btpd_err("Out of memory.\n");
+}
+
+static void
+pex_send_all(struct peer *p)
+{
+    struct peer *q;
+    struct pex_list all;
+    struct iobuf iob = iobuf_init(1024);
+    all.n4 = all.n6 = 0;
+    BTPDQ_FOREACH(q, &p->n->peers, p_entry)
+        if (q != p && q->pex.announced)
+            pex_list_add(&all, q);
+    pex_print(&iob, &all, NULL);
+    peer_send(p, nb_create_extended(p->pex.id, iob.buf, iob.off));
+    iobuf_free(&iob);
+    p->pex.sent = 1;
+}
+
+void
+pex_on_tick(struct net *n)
+{
+    struct peer *p;
+    struct pex_list added;
+    struct iobuf iob;
+
+    if (btpd_seconds < n->pex_time)
+        return;
+    n->pex_time = btpd_seconds + PEX_INTERVAL;
+
+    added.n4 = added.n6 = 0;
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        if (!p->pex.announced && pex_list_add(&added, p))
+            p->pex.announced = 1;
+    iob = iobuf_init(1024);
+    if (added.n4 + added.n6 + n->pex_ndropped + n->pex_ndropped6 > 0)
+        pex_print(&iob, &added, n);
+
+    BTPDQ_FOREACH(p, &n->peers, p_entry) {
+        if (p->pex.id == 0)
+            continue;
+        if (!p->pex.sent)
+            pex_send_all(p);
+        else if (iob.off > 0)
+            peer_send(p, nb_create_extended(p->pex.id, iob.buf, iob.off));
+    }
+    iobuf_free(&iob);
+    n->pex_ndropped = n->pex_ndropped6 = 0;
+}
+
+static int
+pex_same(struct peer *p, int af, const char *addr)
+{
+    return p->pex.af == af
+        && bcmp(p->pex.addr, addr, af == AF_INET ? 6 : 18) == 0;
+}
+
+/*
+ * Returns 1 if we have, or are shaking hands with, a peer at the address.
+ */
+static int
+pex_connected(struct net *n, int af, const char *addr)
+{
+    struct peer *p;
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        if (pex_same(p, af, addr))
+            return 1;
+    BTPDQ_FOREACH(p, &net_unattached, p_entry)
+        if (p->n == n && pex_same(p, af, addr))
+            return 1;
+    return 0;
+}
+
+static void
+pex_connect(struct net *n, int af, const char *added, size_t alen,
+    const char *flags, size_t flen)
+{
+    size_t clen = af == AF_INET ? 6 : 18;
+    int seed = cm_full(n->tp);
+    for (size_t i = 0; i < min(alen / clen, NET_PEXMAX)
+             && net_peer_room(); i++) {
+        if (seed && i < flen && (flags[i] & PEX_SEED))
+            continue;
+        if (!pex_connected(n, af, added + i * clen))
+            peer_create_out_compact(n, af, added + i * clen,
+                i < flen && (flags[i] & PEX_UTP));
+    }
+}
+
+/*
+ * Connects to the peers we're sent, as long as there's room for them. A
+ * peer that sends more often than we do is ignored, so it can't make us
+ * connect to more than a few peers a minute.
+ */
+void
+pex_on_msg(struct peer *p, const char *buf, size_t len)
+{
+    const char *added, *flags;
+    size_t alen, flen;
+
+    if (btpd_msecs() - p->pex.t_recv < PEX_INTERVAL * 1000 / 2)
+        return;
+    p->pex.t_recv = btpd_msecs();
+    if (benc_validate(buf, len) != 0 || !benc_isdct(buf))
+        return;
+
+    if ((added = benc_dget_mem(buf, "added", &alen)) != NULL) {
+        if ((flags = benc_dget_mem(buf, "added.f", &flen)) == NULL)
+            flen = 0;
+        pex_connect(p->n, AF_INET, added, alen, flags, flen);
+    }
+    if ((added = benc_dget_mem(buf, "added6", &alen)) != NULL) {
+        if ((flags = benc_dget_mem(buf, "added6.f", &flen)) == NULL)
+            flen = 0;
+        pex_connect(p->n, AF_INET6, added, alen, flags, flen);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef BTPD_PEX_H
+#define BTPD_PEX_H
+
+void pex_on_dial(struct peer *p, int af, const char *compact);
+void pex_on_new_peer(struct peer *p);
+void pex_on_lost_peer(struct peer *p);
+void pex_on_port(struct peer *p, int port);
+void pex_on_msg(struct peer *p, const char *buf, size_t len);
+void pex_on_tick(struct net *n);
+
+#endif
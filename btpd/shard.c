@@ -0,0 +1,185 @@
+#include "btpd.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+struct shard_cb {
+    void (*fun)(void *);
+    void *arg;
+    BTPDQ_ENTRY(shard_cb) entry;
+};
+
+struct shard_call {
+    void (*fun)(void *);
+    void *arg;
+    int done;
+};
+
+__thread struct shard *btpd_shard;
+
+static struct shard *m_shards;
+static pthread_mutex_t m_call_lock;
+static pthread_cond_t m_call_cond;
+
+struct shard *
+shard_main(void)
+{
+    return &m_shards[0];
+}
+
+struct shard *
+shard_least_loaded(void)
+{
+    struct shard *best = &m_shards[0];
+    for (unsigned i = 1; i < btpd_shards; i++)
+        if (m_shards[i].ntorrents < best->ntorrents)
+            best = &m_shards[i];
+    return best;
+}
+
+/*
+ * A shard's part of a process wide limit. Rounded up, so no shard is
+ * left without when there's anything to split.
+ */
+size_t
+shard_share(size_t total)
+{
+    return total / btpd_shards + (total % btpd_shards != 0);
+}
+
+void
+shard_post(struct shard *sh, void (*fun)(void *), void *arg)
+{
+    char c = '1';
+    int wake;
+    struct shard_cb *cb = btpd_calloc(1, sizeof(*cb));
+    cb->fun = fun;
+    cb->arg = arg;
+    pthread_mutex_lock(&sh->lock);
+    wake = BTPDQ_EMPTY(&sh->cbs);
+    BTPDQ_INSERT_TAIL(&sh->cbs, cb, entry);
+    pthread_mutex_unlock(&sh->lock);
+    // The shard takes all that's queued when woken, so one wake will do.
+    if (wake)
+        write(sh->wr, &c, sizeof(c));
+}
+
+static void
+shard_cb(int fd, short type, void *arg)
+{
+    char buf[1024];
+    struct shard *sh = arg;
+    struct shard_cb_tq tmpq;
+    struct shard_cb *cb, *next;
+
+    read(fd, buf, sizeof(buf));
+    BTPDQ_INIT(&tmpq);
+    pthread_mutex_lock(&sh->lock);
+    BTPDQ_FOREACH_MUTABLE(cb, &sh->cbs, entry, next)
+        BTPDQ_INSERT_TAIL(&tmpq, cb, entry);
+    BTPDQ_INIT(&sh->cbs);
+    pthread_mutex_unlock(&sh->lock);
+
+    BTPDQ_FOREACH_MUTABLE(cb, &tmpq, entry, next) {
+        cb->fun(cb->arg);
+        free(cb);
+    }
+}
+
+static void
+shard_call_cb(void *arg)
+{
+    struct shard_call *call = arg;
+    call->fun(call->arg);
+    pthread_mutex_lock(&m_call_lock);
+    call->done = 1;
+    pthread_cond_broadcast(&m_call_cond);
+    pthread_mutex_unlock(&m_call_lock);
+}
+
+/*
+ * Runs fun on the shard and returns when it's done. Only the main thread
+ * calls other shards, so they never wait for each other.
+ */
+void
+shard_call(struct shard *sh, void (*fun)(void *), void *arg)
+{
+    struct shard_call call = { fun, arg, 0 };
+    if (sh == btpd_shard) {
+        fun(arg);
+        return;
+    }
+    assert(btpd_shard == &m_shards[0]);
+    shard_post(sh, shard_call_cb, &call);
+    pthread_mutex_lock(&m_call_lock);
+    while (!call.done)
+        pthread_cond_wait(&m_call_cond, &m_call_lock);
+    pthread_mutex_unlock(&m_call_lock);
+}
+
+void
+shard_call_all(void (*fun)(void *), void *arg)
+{
+    for (unsigned i = 0; i < btpd_shards; i++)
+        shard_call(&m_shards[i], fun, arg);
+}
+
+static void
+shard_listen(struct shard *sh)
+{
+    btpd_shard = sh;
+    btpd_ev_new(&sh->ev, sh->rd, EV_READ, shard_cb, sh);
+    btpd_shard_init();
+}
+
+static void *
+shard_td(void *arg)
+{
+    if (evloop_init() != 0)
+        btpd_err("Failed to initialize evloop (%s).\n", strerror(errno));
+    evloop_set_errcb(btpd_ev_err);
+    shard_listen(arg);
+    evloop();
+    btpd_err("Exit from evloop with error (%s).\n", strerror(errno));
+}
+
+static void
+errdie(int err, const char *str)
+{
+    if (err != 0)
+        btpd_err("shard_init: %s (%s).\n", str, strerror(err));
+}
+
+/*
+ * Called on the main thread, which becomes shard 0, once the state shared
+ * by the shards has been set up.
+ */
+void
+shard_init(void)
+{
+    int fds[2];
+    sigset_t set, old;
+    m_shards = btpd_calloc(btpd_shards, sizeof(*m_shards));
+    errdie(pthread_mutex_init(&m_call_lock, NULL), "pthread_mutex_init");
+    errdie(pthread_cond_init(&m_call_cond, NULL), "pthread_cond_init");
+    for (unsigned i = 0; i < btpd_shards; i++) {
+        struct shard *sh = &m_shards[i];
+        sh->num = i;
+        if (pipe(fds) == -1)
+            btpd_err("Couldn't create thread callback pipe (%s).\n",
+                strerror(errno));
+        sh->rd = fds[0];
+        sh->wr = fds[1];
+        BTPDQ_INIT(&sh->cbs);
+        errdie(pthread_mutex_init(&sh->lock, NULL), "pthread_mutex_init");
+    }
+    shard_listen(&m_shards[0]);
+    m_shards[0].td = pthread_self();
+    // Signals are left to the main thread.
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (unsigned i = 1; i < btpd_shards; i++)
+        errdie(pthread_create(&m_shards[i].td, NULL, shard_td, &m_shards[i]),
+            "pthread_create");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
@@ -0,0 +1,44 @@
+#ifndef BTPD_SHARD_H
+#define BTPD_SHARD_H
+
+#include <pthread.h>
+
+/*
+ * The torrents are spread over btpd_shards event loops, each running on
+ * a thread of its own. Shard 0 is run by the main thread, which also has
+ * the listeners, the ipc and the torrent library. A torrent, its content,
+ * trackers and peers belong to one shard and are only touched by its
+ * thread. The main thread gets at them with shard_call, which runs a
+ * function on the shard while the main thread waits, so the function may
+ * use the main thread's state as well.
+ *
+ * Other threads hand work to a shard with shard_post. The functions
+ * posted to a shard are run in order by its event loop.
+ */
+
+struct shard_cb;
+
+BTPDQ_HEAD(shard_cb_tq, shard_cb);
+
+struct shard {
+    unsigned num;
+    unsigned ntorrents;     // Torrents of the shard, kept by torrent.c.
+    pthread_t td;
+    int rd, wr;
+    struct fdev ev;
+    pthread_mutex_t lock;
+    struct shard_cb_tq cbs;
+};
+
+extern __thread struct shard *btpd_shard;
+
+void shard_init(void);
+struct shard *shard_main(void);
+struct shard *shard_least_loaded(void);
+size_t shard_share(size_t total);
+
+void shard_post(struct shard *sh, void (*fun)(void *), void *arg);
+void shard_call(struct shard *sh, void (*fun)(void *), void *arg);
+void shard_call_all(void (*fun)(void *), void *arg);
+
+#endif
@@ -174,6 +174,10 @@ load_info(struct tlib *tl, const char *path)
     tl->tot_down = benc_dget_int(info, "total download");
     tl->content_size = benc_dget_int(info, "content size");
     tl->content_have = benc_dget_int(info, "content have");
+    tl->bw_limit_in = benc_dget_int(info, "rate down");
+    tl->bw_limit_out = benc_dget_int(info, "rate up");
+    tl->peer_bw_limit_in = benc_dget_int(info, "peer rate down");
+    tl->peer_bw_limit_out = benc_dget_int(info, "peer rate up");
     if (tl->name == NULL || tl->dir == NULL)
         btpd_err("Out of memory.\n");
 }
@@ -190,11 +194,15 @@ save_info(struct tlib *tl)
         "12:content havei%llde12:content sizei%llde"
         "3:dir%d:%s4:name%d:%s"
         "5:label%d:%s"
+        "14:peer rate downi%ue12:peer rate upi%ue"
+        "9:rate downi%ue7:rate upi%ue"
         "14:total downloadi%llde12:total uploadi%llde"
         "ee",
         (long long)tl->content_have, (long long)tl->content_size,
         (int)strlen(tl->dir), tl->dir, (int)strlen(tl->name), tl->name,
         (int)strlen(tl->label), tl->label,
+        tl->peer_bw_limit_in, tl->peer_bw_limit_out,
+        tl->bw_limit_in, tl->bw_limit_out,
         tl->tot_down, tl->tot_up);
     if (iob.error)
         btpd_err("Out of memory.\n");
@@ -231,6 +239,17 @@ tlib_update_info(struct tlib *tl, int only_file)
     save_info(tl);
 }
 
+void
+tlib_set_bw_limits(struct tlib *tl, unsigned up, unsigned down,
+    unsigned peer_up, unsigned peer_down)
+{
+    tl->bw_limit_out = up;
+    tl->bw_limit_in = down;
+    tl->peer_bw_limit_out = peer_up;
+    tl->peer_bw_limit_in = peer_down;
+    save_info(tl);
+}
+
 static void
 write_torrent(const char *mi, size_t mi_size, const char *path)
 {
@@ -326,29 +345,6 @@ tlib_init(void)
     closedir(dirp);
 }
 
-void
-tlib_read_hash(struct tlib *tl, size_t off, uint32_t piece, uint8_t *hash)
-{
-    int fd;
-    ssize_t nread;
-    char relpath[RELPATH_SIZE];
-    bin2hex(tl->hash, relpath, 20);
-
-    if ((errno = vopen(&fd, O_RDONLY, "torrents/%s/torrent", relpath)) != 0)
-        btpd_err("failed to open 'torrents/%s/torrent' (%s).\n",
-            relpath, strerror(errno));
-    lseek(fd, off + piece * 20, SEEK_SET);
-    if ((nread = read(fd, hash, 20)) != 20) {
-        if (nread == -1)
-            btpd_err("failed to read 'torrents/%s/torrent' (%s).\n", relpath,
-                strerror(errno));
-        else
-            btpd_err("corrupt file: 'torrents/%s/torrent'.\n", relpath);
-    }
-
-    close(fd);
-}
-
 int
 tlib_load_mi(struct tlib *tl, char **res)
 {
@@ -12,6 +12,8 @@ struct tlib {
 
     unsigned long long tot_up, tot_down;
     off_t content_size, content_have;
+    unsigned bw_limit_in, bw_limit_out;
+    unsigned peer_bw_limit_in, peer_bw_limit_out;
 
     HTBL_ENTRY(nchain);
     HTBL_ENTRY(hchain);
@@ -35,6 +37,8 @@ int tlib_del(struct tlib *tl);
 void tlib_kill(struct tlib *tl);
 
 void tlib_update_info(struct tlib *tl, int only_file);
+void tlib_set_bw_limits(struct tlib *tl, unsigned up, unsigned down,
+    unsigned peer_up, unsigned peer_down);
 
 struct tlib *tlib_by_hash(const uint8_t *hash);
 struct tlib *tlib_by_num(unsigned num);
@@ -42,9 +46,6 @@ unsigned tlib_count(void);
 
 int tlib_load_mi(struct tlib *tl, char **res);
 
-void tlib_read_hash(struct tlib *tl, size_t off, uint32_t piece,
-    uint8_t *hash);
-
 struct resume_data *tlib_open_resume(struct tlib *tl, unsigned nfiles,
     size_t pfsize, size_t bfsize);
 void tlib_close_resume(struct resume_data *resume);
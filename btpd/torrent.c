@@ -4,9 +4,20 @@
 
 #define SAVE_INTERVAL 300
 
+/*
+ * The list of torrents belongs to the main thread. What's done here to a
+ * torrent is done on its shard, with the main thread waiting in
+ * shard_call, so both the torrent and the list may be touched.
+ *
+ * Each shard also keeps a list of its own torrents, which it ticks on its
+ * own. A torrent due for a change of state has the main thread tick it in
+ * a shard_call, as the change may touch the main thread's state too.
+ */
+
 static unsigned m_nghosts;
 static unsigned m_ntorrents;
 static struct torrent_tq m_torrents = BTPDQ_HEAD_INITIALIZER(m_torrents);
+static __thread struct torrent_tq m_shard_torrents;
 
 static unsigned m_tsave;
 static struct torrent *m_savetp;
@@ -17,6 +28,15 @@ torrent_get_all(void)
     return &m_torrents;
 }
 
+/*
+ * The torrents of the calling shard.
+ */
+const struct torrent_tq *
+torrent_get_shard(void)
+{
+    return &m_shard_torrents;
+}
+
 unsigned
 torrent_count(void)
 {
@@ -86,7 +106,9 @@ torrent_kill(struct torrent *tp)
     if (tp->state == T_GHOST)
         m_nghosts--;
     m_ntorrents--;
+    tp->shard->ntorrents--;
     BTPDQ_REMOVE(&m_torrents, tp, entry);
+    BTPDQ_REMOVE(&m_shard_torrents, tp, sh_entry);
     if (tp->delete)
         tlib_kill(tp->tl);
     else
@@ -101,26 +123,33 @@ torrent_kill(struct torrent *tp)
     free(tp);
 }
 
-enum ipc_err
-torrent_start(struct tlib *tl)
+static void
+torrent_kill_cb(void *arg)
 {
+    torrent_kill(arg);
+}
+
+struct start_call {
+    struct tlib *tl;
+    enum ipc_err err;
+};
+
+static void
+torrent_start_cb(void *arg)
+{
+    struct start_call *sc = arg;
+    struct tlib *tl = sc->tl;
     struct torrent *tp;
     char *mi;
 
-    if (tl->tp != NULL) {
-        assert(torrent_startable(tl));
-        torrent_kill(tl->tp);
-        tl->tp = NULL;
+    if (tl->dir == NULL || tlib_load_mi(tl, &mi) != 0) {
+        sc->err = IPC_EBADTENT;
+        return;
     }
 
-    if (tl->dir == NULL)
-        return IPC_EBADTENT;
-
-    if (tlib_load_mi(tl, &mi) != 0)
-        return IPC_EBADTENT;
-
     tp = btpd_calloc(1, sizeof(*tp));
     tp->tl = tl;
+    tp->shard = btpd_shard;
     tp->files = mi_files(mi);
     tp->nfiles = mi_nfiles(mi);
     if (tp->files == NULL)
@@ -128,8 +157,6 @@ torrent_start(struct tlib *tl)
     tp->total_length = mi_total_length(mi);
     tp->piece_length = mi_piece_length(mi);
     tp->npieces = mi_npieces(mi);
-    tp->pieces_off =
-        benc_dget_mem(benc_dget_dct(mi, "info"), "pieces", NULL) - mi;
 
     btpd_log(BTPD_L_BTPD, "Starting torrent '%s'.\n", torrent_name(tp));
     tr_create(tp, mi);
@@ -137,14 +164,34 @@ torrent_start(struct tlib *tl)
     net_create(tp);
     cm_create(tp, mi);
     BTPDQ_INSERT_TAIL(&m_torrents, tp, entry);
+    BTPDQ_INSERT_TAIL(&m_shard_torrents, tp, sh_entry);
     m_ntorrents++;
+    tp->shard->ntorrents++;
     cm_start(tp, 0);
     free(mi);
-    if (m_ntorrents == 1) {
+    sc->err = IPC_OK;
+}
+
+/*
+ * Starts the torrent on the shard with the fewest torrents.
+ */
+enum ipc_err
+torrent_start(struct tlib *tl)
+{
+    struct start_call sc = { tl, IPC_OK };
+
+    if (tl->tp != NULL) {
+        assert(torrent_startable(tl));
+        shard_call(tl->tp->shard, torrent_kill_cb, tl->tp);
+        tl->tp = NULL;
+    }
+
+    shard_call(shard_least_loaded(), torrent_start_cb, &sc);
+    if (sc.err == IPC_OK && m_ntorrents == 1) {
         m_tsave = btpd_seconds + SAVE_INTERVAL;
-        m_savetp = tp;
+        m_savetp = tl->tp;
     }
-    return IPC_OK;
+    return sc.err;
 }
 
 static
@@ -159,10 +206,17 @@ void become_ghost(struct torrent *tp)
     m_nghosts++;
 }
 
-void
-torrent_stop(struct torrent *tp, int delete)
+struct stop_call {
+    struct torrent *tp;
+    int delete;
+};
+
+static void
+torrent_stop_cb(void *arg)
 {
-    if (delete)
+    struct stop_call *sc = arg;
+    struct torrent *tp = sc->tp;
+    if (sc->delete)
         tp->delete = 1;
     switch (tp->state) {
     case T_LEECH:
@@ -187,8 +241,16 @@ torrent_stop(struct torrent *tp, int delete)
 }
 
 void
-torrent_on_tick(struct torrent *tp)
+torrent_stop(struct torrent *tp, int delete)
+{
+    struct stop_call sc = { tp, delete };
+    shard_call(tp->shard, torrent_stop_cb, &sc);
+}
+
+static void
+torrent_tick(struct torrent *tp)
 {
+    tp->tick_wanted = 0;
     if (tp->state != T_STOPPING && cm_error(tp))
         torrent_stop(tp, 0);
     switch (tp->state) {
@@ -229,16 +291,91 @@ torrent_on_tick(struct torrent *tp)
     }
 }
 
+static void
+torrent_tick_cb(void *arg)
+{
+    torrent_tick(arg);
+}
+
+/*
+ * Whether torrent_tick has anything to do for the torrent.
+ */
+static int
+torrent_tick_due(struct torrent *tp)
+{
+    switch (tp->state) {
+    case T_STARTING:
+        return cm_error(tp) || cm_started(tp);
+    case T_LEECH:
+        return cm_error(tp) || cm_full(tp);
+    case T_SEED:
+        return cm_error(tp);
+    case T_STOPPING:
+        return !cm_active(tp);
+    case T_GHOST:
+        return !tr_active(tp);
+    default:
+        return 0;
+    }
+}
+
+struct tick_call {
+    struct shard *sh;
+    uint8_t hash[20];
+};
+
+/*
+ * Run by the main thread for a shard's torrent that's due for a tick. The
+ * torrent is looked up again, as it may have gone since it was posted.
+ */
+static void
+torrent_tick_post_cb(void *arg)
+{
+    struct tick_call *tc = arg;
+    struct torrent *tp = torrent_by_hash(tc->hash);
+    if (tp != NULL && tp->shard == tc->sh)
+        shard_call(tp->shard, torrent_tick_cb, tp);
+    free(tc);
+}
+
+static void
+torrent_on_tick_shard(void)
+{
+    struct torrent *tp;
+    struct tick_call *tc;
+    BTPDQ_FOREACH(tp, &m_shard_torrents, sh_entry) {
+        if (tp->state == T_LEECH || tp->state == T_SEED)
+            pex_on_tick(tp->net);
+        if (!tp->tick_wanted && torrent_tick_due(tp)) {
+            tp->tick_wanted = 1;
+            tc = btpd_calloc(1, sizeof(*tc));
+            tc->sh = btpd_shard;
+            bcopy(tp->tl->hash, tc->hash, 20);
+            shard_post(shard_main(), torrent_tick_post_cb, tc);
+        }
+    }
+}
+
+static void
+torrent_save_cb(void *arg)
+{
+    tlib_update_info(arg, 1);
+}
+
+/*
+ * Called each second on every shard. The main thread also saves the info
+ * of a torrent now and then.
+ */
 void
-torrent_on_tick_all(void)
+torrent_on_tick(void)
 {
-    struct torrent *tp, *next;
-    BTPDQ_FOREACH_MUTABLE(tp, &m_torrents, entry, next)
-        torrent_on_tick(tp);
+    torrent_on_tick_shard();
+    if (btpd_shard != shard_main())
+        return;
 
     if (m_savetp != NULL && m_tsave <= btpd_seconds) {
         if (m_savetp->state == T_LEECH || m_savetp->state == T_SEED) {
-            tlib_update_info(m_savetp->tl, 1);
+            shard_call(m_savetp->shard, torrent_save_cb, m_savetp->tl);
             if ((m_savetp = BTPDQ_NEXT(m_savetp, entry)) == NULL)
                 m_savetp = BTPDQ_FIRST(&m_torrents);
             if (m_ntorrents > 0)
@@ -248,6 +385,12 @@ torrent_on_tick_all(void)
     }
 }
 
+void
+torrent_shard_init(void)
+{
+    BTPDQ_INIT(&m_shard_torrents);
+}
+
 int
 torrent_active(struct tlib *tl)
 {
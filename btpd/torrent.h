@@ -14,6 +14,7 @@ enum torrent_state {
 
 struct torrent {
     struct tlib *tl;
+    struct shard *shard;
 
     enum torrent_state state;
     int delete;
@@ -27,9 +28,10 @@ struct torrent {
     uint32_t npieces;
     unsigned nfiles;
     struct mi_file *files;
-    size_t pieces_off;
+    int tick_wanted;        // The main thread has been asked to tick it.
 
     BTPDQ_ENTRY(torrent) entry;
+    BTPDQ_ENTRY(torrent) sh_entry;
 };
 
 BTPDQ_HEAD(torrent_tq, torrent);
@@ -53,6 +55,8 @@ uint32_t torrent_block_size(struct torrent *tp, uint32_t piece,
     uint32_t nblocks, uint32_t block);
 const char *torrent_name(struct torrent *tp);
 
-void torrent_on_tick_all(void);
+void torrent_shard_init(void);
+void torrent_on_tick(void);
+const struct torrent_tq *torrent_get_shard(void);
 
 #endif
@@ -8,7 +8,7 @@
 
 long tr_key;
 
-static long m_tlast_req, m_tnext_req;
+static __thread long m_tlast_req, m_tnext_req;
 
 struct tr_entry {
     BTPDQ_ENTRY(tr_entry) entry;
@@ -2,10 +2,13 @@
 
 #define CHOKE_INTERVAL (& (struct timespec) { 10, 0 })
 
-static struct timeout m_choke_timer;
-static unsigned m_npeers;
-static struct peer_tq m_peerq = BTPDQ_HEAD_INITIALIZER(m_peerq);
-static int m_max_uploads;
+/*
+ * Each shard chokes its own peers, with its share of the uploads.
+ */
+static __thread struct timeout m_choke_timer;
+static __thread unsigned m_npeers;
+static __thread struct peer_tq m_peerq;
+static __thread int m_max_uploads;
 
 struct peer_sort {
     struct peer *p;
@@ -17,8 +20,10 @@ rate_cmp(const void *arg1, const void *arg2)
 {
     struct peer *p1 = ((struct peer_sort *)arg1)->p;
     struct peer *p2 = ((struct peer_sort *)arg2)->p;
-    unsigned long rate1 = cm_full(p1->n->tp) ? p1->rate_up / 2: p1->rate_dwn;
-    unsigned long rate2 = cm_full(p2->n->tp) ? p2->rate_up / 2: p2->rate_dwn;
+    unsigned long rate1 = cm_full(p1->n->tp) ?
+        rate_get(&p1->rate_up) / 2 : rate_get(&p1->rate_dwn);
+    unsigned long rate2 = cm_full(p2->n->tp) ?
+        rate_get(&p2->rate_up) / 2 : rate_get(&p2->rate_dwn);
     if (rate1 < rate2)
         return -1;
     else if (rate1 == rate2)
@@ -52,9 +57,10 @@ choke_do(void)
             int ok = 0;
             if (!peer_full(p)) {
                 if (cm_full(p->n->tp)) {
-                    if (p->rate_up > 0)
+                    if (rate_get(&p->rate_up) > 0)
                         ok = 1;
-                } else if (peer_active_down(p) && p->rate_dwn > 0)
+                } else if (peer_active_down(p) &&
+                        rate_get(&p->rate_dwn) > 0)
                     ok = 1;
             }
             if (ok) {
@@ -111,7 +117,7 @@ static void
 choke_cb(int sd, short type, void *arg)
 {
     btpd_timer_add(&m_choke_timer, CHOKE_INTERVAL);
-    static int cb_count = 0;
+    static __thread int cb_count = 0;
     cb_count++;
     if (cb_count % 3 == 0)
         shuffle_optimists();
@@ -175,25 +181,29 @@ ul_on_uninterest(struct peer *p)
 void
 ul_set_max_uploads(void)
 {
-    if (net_max_uploads >= -1)
+    unsigned bw_out = shard_share(net_bw_limit_out);
+    if (net_max_uploads > 0)
+        m_max_uploads = shard_share(net_max_uploads);
+    else if (net_max_uploads >= -1)
         m_max_uploads = net_max_uploads;
     else {
-        if (net_bw_limit_out == 0)
+        if (bw_out == 0)
             m_max_uploads = 8;
-        else if (net_bw_limit_out < (10 << 10))
+        else if (bw_out < (10 << 10))
             m_max_uploads = 2;
-        else if (net_bw_limit_out < (20 << 10))
+        else if (bw_out < (20 << 10))
             m_max_uploads = 3;
-        else if (net_bw_limit_out < (40 << 10))
+        else if (bw_out < (40 << 10))
             m_max_uploads = 4;
         else
-            m_max_uploads = 5 + (net_bw_limit_out / (100 << 10));
+            m_max_uploads = 5 + (bw_out / (100 << 10));
     }
 }
 
 void
 ul_init(void)
 {
+    BTPDQ_INIT(&m_peerq);
     ul_set_max_uploads();
 
     evtimer_init(&m_choke_timer, choke_cb, NULL);
@@ -33,6 +33,53 @@ btpd_calloc(size_t nmemb, size_t size)
     return a;
 }
 
+void *
+btpd_realloc(void *ptr, size_t size)
+{
+    void *a;
+    if ((a = realloc(ptr, size)) == NULL)
+        btpd_err("Failed to allocate %d bytes.\n", (int)size);
+    return a;
+}
+
+/*
+ * A free list of objects of one size. Objects put back are kept for reuse,
+ * up to max of them, rather than freed. The counters are for all pools of
+ * a shard and show how much of the allocator traffic the pools take.
+ */
+
+__thread long long btpd_pool_allocs;
+__thread long long btpd_pool_reuses;
+__thread long long btpd_pool_free;
+
+void *
+pool_get(struct pool *pool)
+{
+    void *obj;
+    if ((obj = pool->free) != NULL) {
+        pool->free = *(void **)obj;
+        pool->nfree--;
+        btpd_pool_free--;
+        btpd_pool_reuses++;
+    } else {
+        obj = btpd_malloc(pool->size);
+        btpd_pool_allocs++;
+    }
+    return obj;
+}
+
+void
+pool_put(struct pool *pool, void *obj)
+{
+    if (pool->nfree < pool->max) {
+        *(void **)obj = pool->free;
+        pool->free = obj;
+        pool->nfree++;
+        btpd_pool_free++;
+    } else
+        free(obj);
+}
+
 void
 btpd_ev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
 {
@@ -61,6 +108,20 @@ btpd_ev_disable(struct fdev *ev, uint16_t flags)
         btpd_err("Failed to disable event (%s).\n", strerror(errno));
 }
 
+void
+btpd_ev_again(struct fdev *ev, uint16_t flags)
+{
+    if (fdev_again(ev, flags) != 0)
+        btpd_err("Failed to requeue event (%s).\n", strerror(errno));
+}
+
+void
+btpd_ev_err(int fd, int err, void *arg)
+{
+    btpd_log(BTPD_L_ERROR, "Stopped watching fd %d (%s).\n", fd,
+        strerror(err));
+}
+
 void
 btpd_timer_add(struct timeout *to, struct timespec *ts)
 {
@@ -93,11 +154,15 @@ static void
 log_common(uint32_t type, const char *fmt, va_list ap)
 {
     if (type & btpd_logmask) {
-        char tbuf[20];
+        char tbuf[32];
+        struct tm tm;
         time_t tp = time(NULL);
-        strftime(tbuf, 20, "%Y %b %e %T", localtime(&tp));
+        strftime(tbuf, sizeof(tbuf), "%Y %b %e %T", localtime_r(&tp, &tm));
+        // The shards log from their own threads.
+        flockfile(stdout);
         printf("%s %s: ", tbuf, logtype_str(type));
         vprintf(fmt, ap);
+        funlockfile(stdout);
     }
 }
 
@@ -113,6 +113,7 @@ static struct {
 } cmd_table[] = {
     { "add", cmd_add, usage_add },
     { "del", cmd_del, usage_del },
+    { "info", cmd_info, usage_info },
     { "kill", cmd_kill, usage_kill },
     { "list", cmd_list, usage_list },
     { "rate", cmd_rate, usage_rate },
@@ -139,6 +140,7 @@ usage(void)
         "Commands:\n"
         "add\t- Add torrents to btpd.\n"
         "del\t- Remove torrents from btpd.\n"
+        "info\t- Show btpd's internal counters.\n"
         "kill\t- Shut down btpd.\n"
         "list\t- List torrents.\n"
         "rate\t- Set up/download rate limits.\n"
@@ -43,6 +43,8 @@ void usage_list(void);
 void cmd_list(int argc, char **argv);
 void usage_stat(void);
 void cmd_stat(int argc, char **argv);
+void usage_info(void);
+void cmd_info(int argc, char **argv);
 void usage_kill(void);
 void cmd_kill(int argc, char **argv);
 void usage_rate(void);
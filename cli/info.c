@@ -0,0 +1,41 @@
+#include "btcli.h"
+
+void
+usage_info(void)
+{
+    printf(
+        "Show btpd's internal counters.\n"
+        "\n"
+        "Usage: info\n"
+        "\n"
+        );
+    exit(1);
+}
+
+static void
+info_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
+{
+    for (int i = 0; i < IPC_DVALCOUNT; i++) {
+        if (res[i].type == IPC_TYPE_NUM)
+            printf("%-16s %lld\n", dval_name(i), res[i].v.num);
+        else
+            printf("%-16s -\n", dval_name(i));
+    }
+}
+
+void
+cmd_info(int argc, char **argv)
+{
+    enum ipc_err code;
+    enum ipc_dval keys[IPC_DVALCOUNT];
+
+    if (argc > 1)
+        usage_info();
+
+    for (int i = 0; i < IPC_DVALCOUNT; i++)
+        keys[i] = i;
+
+    btpd_connect();
+    if ((code = btpd_get(ipc, keys, IPC_DVALCOUNT, info_cb, NULL)) != 0)
+        diemsg("command failed (%s).\n", ipc_strerror(code));
+}
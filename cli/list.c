@@ -33,6 +33,7 @@ struct item {
     char st;
     long long cgot, csize, totup, downloaded, uploaded, rate_up, rate_down;
     uint32_t torrent_pieces, pieces_have, pieces_seen;
+    uint32_t check_done, check_total;
     BTPDQ_ENTRY(item) entry;
 };
 
@@ -95,6 +96,8 @@ list_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
     itm->torrent_pieces = (uint32_t)res[IPC_TVAL_PCCOUNT].v.num;
     itm->pieces_seen    = (uint32_t)res[IPC_TVAL_PCSEEN].v.num;
     itm->pieces_have    = (uint32_t)res[IPC_TVAL_PCGOT].v.num;
+    itm->check_done     = (uint32_t)res[IPC_TVAL_CHKDONE].v.num;
+    itm->check_total    = (uint32_t)res[IPC_TVAL_CHKTOTAL].v.num;
 
     itm_insert(itms, itm);
 }
@@ -123,6 +126,8 @@ print_items(struct items* itms, char *format)
                             case 'U': printf("%lld", p->uploaded);       break;
                             case 'T': printf("%u",   p->torrent_pieces); break;
 
+                            case 'c': print_percent(p->check_done,
+                                          max(p->check_total, 1)); break;
                             case 'd': printf("%s",   p->dir);            break;
                             case 'g': printf("%lld", p->cgot);           break;
                             case 'h': printf("%s",   p->hash);           break;
@@ -176,7 +181,8 @@ cmd_list(int argc, char **argv)
            IPC_TVAL_TOTUP,   IPC_TVAL_CSIZE,  IPC_TVAL_CGOT,    IPC_TVAL_PCOUNT,
            IPC_TVAL_PCCOUNT, IPC_TVAL_PCSEEN, IPC_TVAL_PCGOT,   IPC_TVAL_SESSUP,
            IPC_TVAL_SESSDWN, IPC_TVAL_RATEUP, IPC_TVAL_RATEDWN, IPC_TVAL_IHASH,
-           IPC_TVAL_DIR, IPC_TVAL_LABEL };
+           IPC_TVAL_DIR,     IPC_TVAL_LABEL,  IPC_TVAL_CHKDONE,
+           IPC_TVAL_CHKTOTAL };
     size_t nkeys = ARRAY_COUNT(keys);
     struct items itms;
     while ((ch = getopt_long(argc, argv, "aif:", list_opts, NULL)) != -1) {
@@ -7,10 +7,21 @@ usage_rate(void)
         "Set upload and download rate.\n"
         "\n"
         "Usage: rate <up> <down>\n"
+        "       rate -t torrent <up> <down> [<peer up> <peer down>]\n"
         "\n"
         "Arguments:\n"
         "<up> <down>\n"
-        "\tThe up/down rate in KB/s\n"
+        "\tThe up/down rate in KB/s. Zero means no limit.\n"
+        "\n"
+        "<peer up> <peer down>\n"
+        "\tThe up/down rate of each of the torrent's peers.\n"
+        "\n"
+        "Options:\n"
+        "-t torrent\n"
+        "\tSet the rates of the torrent instead of the global rates.\n"
+        "\tThe torrent's traffic also counts against the global rates,\n"
+        "\tand what one torrent or peer doesn't use can be used by the\n"
+        "\tothers.\n"
         "\n"
         );
     exit(1);
@@ -61,20 +72,40 @@ void
 cmd_rate(int argc, char **argv)
 {
     int ch;
-    unsigned up, down;
+    unsigned up, down, peer_up = 0, peer_down = 0;
+    char *torrent = NULL;
+    struct ipc_torrent t;
 
-    while ((ch = getopt_long(argc, argv, "", start_opts, NULL)) != -1)
-        usage_rate();
+    while ((ch = getopt_long(argc, argv, "t:", start_opts, NULL)) != -1) {
+        switch (ch) {
+        case 't':
+            torrent = optarg;
+            break;
+        default:
+            usage_rate();
+        }
+    }
     argc -= optind;
     argv += optind;
 
-    if (argc < 2)
+    if (argc < 2 || (torrent != NULL && argc != 2 && argc != 4))
         usage_rate();
 
     up = parse_rate(argv[0]);
     down = parse_rate(argv[1]);
+    if (argc == 4) {
+        peer_up = parse_rate(argv[2]);
+        peer_down = parse_rate(argv[3]);
+    }
+
+    if (torrent != NULL && !torrent_spec(torrent, &t))
+        exit(1);
 
     btpd_connect();
-    handle_ipc_res(btpd_rate(ipc, up, down), "rate", argv[1]);
+    if (torrent != NULL)
+        handle_ipc_res(btpd_trate(ipc, &t, up, down, peer_up, peer_down),
+            "rate", torrent);
+    else
+        handle_ipc_res(btpd_rate(ipc, up, down), "rate", argv[1]);
 }
 
@@ -15,7 +15,8 @@ usage_stat(void)
         "\n"
         "Options:\n"
         "-i\n"
-        "\tDisplay individual lines for each torrent.\n"
+        "\tDisplay individual lines for each torrent, followed by the\n"
+        "\ttorrent's rate limits if it has any.\n"
         "\n"
         "-n\n"
         "\tDisplay the name of each torrent. Implies '-i'.\n"
@@ -54,7 +55,11 @@ static enum ipc_tval stkeys[] = {
     IPC_TVAL_RATEUP,
     IPC_TVAL_RATEDWN,
     IPC_TVAL_CGOT,
-    IPC_TVAL_CSIZE
+    IPC_TVAL_CSIZE,
+    IPC_TVAL_LIMUP,
+    IPC_TVAL_LIMDWN,
+    IPC_TVAL_PLIMUP,
+    IPC_TVAL_PLIMDWN
 };
 
 #define NSTKEYS ARRAY_COUNT(stkeys)
@@ -74,6 +79,31 @@ print_stat(struct btstat *st)
     printf("\n");
 }
 
+static void
+print_limit(const char *name, long long rate)
+{
+    printf("%s ", name);
+    if (rate > 0)
+        print_rate(rate);
+    else
+        printf("%10s ", "-");
+}
+
+static void
+print_limits(struct ipc_get_res *res)
+{
+    if ((res[IPC_TVAL_LIMUP].v.num == 0 && res[IPC_TVAL_LIMDWN].v.num == 0
+            && res[IPC_TVAL_PLIMUP].v.num == 0
+            && res[IPC_TVAL_PLIMDWN].v.num == 0))
+        return;
+    printf("        limits ");
+    print_limit("up", res[IPC_TVAL_LIMUP].v.num);
+    print_limit("down", res[IPC_TVAL_LIMDWN].v.num);
+    print_limit("peer up", res[IPC_TVAL_PLIMUP].v.num);
+    print_limit("peer down", res[IPC_TVAL_PLIMDWN].v.num);
+    printf("\n");
+}
+
 static void
 stat_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
 {
@@ -101,6 +131,7 @@ stat_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
                 res[IPC_TVAL_NAME].v.str.p);
         printf("%4u %c. ", st.num, tstate_char(st.state));
         print_stat(&st);
+        print_limits(res);
     }
 }
 
@@ -1,19 +1,186 @@
 #include <sys/epoll.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "evloop.h"
 
-static int m_epfd;
+/*
+ * Interest changes are not given to the kernel right away. An fdev whose
+ * flags change is put on the change list and the difference between its
+ * flags and what the kernel has (kflags) is applied once, right before
+ * epoll_wait. A peer that enables and disables EV_WRITE several times in
+ * one iteration thus costs at most one epoll_ctl.
+ *
+ * An fdev with EV_EDGE is edge triggered. The kernel only reports it when
+ * it becomes ready, so an fdev that is handed to fdev_again, or enabled
+ * while the kernel already watches it, is put on the again list and its
+ * callback is run in the next iteration without waiting for the kernel.
+ */
 
-static struct epoll_event m_evs[100];
-static uint8_t m_valid[100];
+#define EV_INIT_SIZE 100
+#define EV_MAX_SIZE 6400
+
+static __thread int m_epfd;
+
+static __thread struct epoll_event *m_evs;
+static __thread uint8_t *m_valid;
+static __thread int m_evcap;
+
+static __thread struct fdev **m_changes;
+static __thread int m_nchanges, m_chcap;
+
+static __thread struct fdev **m_again;
+static __thread int m_nagain, m_agcap;
+
+static __thread evloop_errcb_t m_errcb;
+
+#define EV_KMASK (EV_READ|EV_WRITE)
+
+static int
+ev_grow(void)
+{
+    int ncap = m_evcap > 0 ? m_evcap * 2 : EV_INIT_SIZE;
+    struct epoll_event *nm_evs = realloc(m_evs, ncap * sizeof(*m_evs));
+    uint8_t *nm_valid = realloc(m_valid, ncap * sizeof(*m_valid));
+    if (nm_evs != NULL)
+        m_evs = nm_evs;
+    if (nm_valid != NULL)
+        m_valid = nm_valid;
+    if (nm_evs == NULL || nm_valid == NULL)
+        return errno;
+    m_evcap = ncap;
+    return 0;
+}
+
+static int
+list_add(struct fdev ***list, int *n, int *cap, struct fdev *ev, int *idx)
+{
+    if (*idx >= 0)
+        return 0;
+    if (*n == *cap) {
+        int ncap = *cap > 0 ? *cap * 2 : EV_INIT_SIZE;
+        struct fdev **nlist = realloc(*list, ncap * sizeof(**list));
+        if (nlist == NULL)
+            return errno;
+        *list = nlist;
+        *cap = ncap;
+    }
+    *idx = *n;
+    (*list)[*n] = ev;
+    (*n)++;
+    return 0;
+}
+
+static int
+change_add(struct fdev *ev)
+{
+    return list_add(&m_changes, &m_nchanges, &m_chcap, ev, &ev->chidx);
+}
+
+static int
+again_add(struct fdev *ev, uint16_t flags)
+{
+    ev->aflags |= flags;
+    return list_add(&m_again, &m_nagain, &m_agcap, ev, &ev->agidx);
+}
+
+/*
+ * An fdev the kernel won't take is dropped from the loop. Its flags are
+ * cleared and the error is handed to the error callback, if there's one,
+ * so the rest of the loop carries on.
+ */
+static void
+change_failed(struct fdev *ev, int op, int err)
+{
+    if (op == EPOLL_CTL_MOD)
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+    ev->flags &= ~EV_KMASK;
+    ev->kflags = 0;
+    if (m_errcb != NULL)
+        m_errcb(ev->fd, err, ev->arg);
+}
+
+static void
+changes_apply(void)
+{
+    int i, op;
+    uint16_t want;
+    struct epoll_event epev;
+    for (i = 0; i < m_nchanges; i++) {
+        struct fdev *ev = m_changes[i];
+        if (ev == NULL)
+            continue;
+        ev->chidx = -1;
+        want = ev->flags & EV_KMASK;
+        if (want == ev->kflags)
+            continue;
+        epev.data.ptr = ev;
+        epev.events =
+            ((want & EV_READ) ? EPOLLIN : 0) |
+            ((want & EV_WRITE) ? EPOLLOUT : 0) |
+            ((ev->flags & EV_EDGE) ? EPOLLET : 0);
+        if (ev->kflags == 0)
+            op = EPOLL_CTL_ADD;
+        else if (want == 0)
+            op = EPOLL_CTL_DEL;
+        else
+            op = EPOLL_CTL_MOD;
+        if (epoll_ctl(m_epfd, op, ev->fd, op == EPOLL_CTL_DEL ? NULL : &epev)
+                != 0)
+            change_failed(ev, op, errno);
+        else
+            ev->kflags = want;
+    }
+    m_nchanges = 0;
+}
+
+/*
+ * Runs the callbacks of the fdevs on the again list. Those that are put
+ * back on it by their callbacks are run in the next iteration.
+ */
+static void
+again_run(void)
+{
+    int i, n = m_nagain;
+    for (i = 0; i < n; i++) {
+        struct fdev *ev = m_again[i];
+        uint16_t flags;
+        if (ev == NULL)
+            continue;
+        flags = ev->aflags & ev->flags;
+        ev->aflags = 0;
+        if (flags & EV_READ)
+            ev->cb(ev->fd, EV_READ, ev->arg);
+        if (m_again[i] == ev && flags & ev->flags & EV_WRITE)
+            ev->cb(ev->fd, EV_WRITE, ev->arg);
+        if (m_again[i] != ev)
+            continue;
+        m_again[i] = NULL;
+        ev->agidx = -1;
+        if (ev->aflags != 0)
+            list_add(&m_again, &m_nagain, &m_agcap, ev, &ev->agidx);
+    }
+    m_nagain -= n;
+    memmove(m_again, m_again + n, m_nagain * sizeof(*m_again));
+    for (i = 0; i < m_nagain; i++)
+        if (m_again[i] != NULL)
+            m_again[i]->agidx = i;
+}
+
+void
+evloop_set_errcb(evloop_errcb_t cb)
+{
+    m_errcb = cb;
+}
 
 int
 evloop_init(void)
 {
-    if (timeheap_init() != 0)
+    if (evtimers_init() != 0)
+        return -1;
+    if (ev_grow() != 0)
         return -1;
     m_epfd = epoll_create(getdtablesize());
     return m_epfd >= 0 ? 0 : -1;
@@ -25,49 +192,48 @@ fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
     ev->fd = fd;
     ev->cb = cb;
     ev->arg = arg;
-    ev->flags = 0;
+    ev->flags = flags & EV_EDGE;
+    ev->kflags = 0;
+    ev->aflags = 0;
     ev->index = -1;
-    return fdev_enable(ev, flags);
+    ev->chidx = -1;
+    ev->agidx = -1;
+    return fdev_enable(ev, flags & EV_KMASK);
 }
 
 int
 fdev_enable(struct fdev *ev, uint16_t flags)
 {
-    struct epoll_event epev;
-    int err = 0;
     uint16_t sf = ev->flags;
-    ev->flags |= flags;
-    if (sf != ev->flags) {
-        epev.data.ptr = ev;
-        epev.events =
-            ((ev->flags & EV_READ) ? EPOLLIN : 0) |
-            ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
-        if (sf == 0)
-            err = epoll_ctl(m_epfd, EPOLL_CTL_ADD, ev->fd, &epev);
-        else
-            err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
+    ev->flags |= flags & EV_KMASK;
+    if (sf == ev->flags)
+        return 0;
+    /*
+     * Turning a flag back on before the kernel saw it turned off gives
+     * no new edge, so the fdev is run anyway.
+     */
+    if (ev->flags & EV_EDGE && ev->kflags & ev->flags & ~sf) {
+        int err = again_add(ev, ev->kflags & ev->flags & ~sf);
+        if (err != 0)
+            return err;
     }
-    return err;
+    return change_add(ev);
 }
 
 int
 fdev_disable(struct fdev *ev, uint16_t flags)
 {
-    struct epoll_event epev;
-    int err = 0;
     uint16_t sf = ev->flags;
-    ev->flags &= ~flags;
-    if (sf != ev->flags) {
-        epev.data.ptr = ev;
-        epev.events =
-            ((ev->flags & EV_READ) ? EPOLLIN : 0) |
-            ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
-        if (ev->flags == 0)
-            err = epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, &epev);
-        else
-            err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
-    }
-    return err;
+    ev->flags &= ~(flags & EV_KMASK);
+    return sf != ev->flags ? change_add(ev) : 0;
+}
+
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    if (!(ev->flags & EV_EDGE))
+        return 0;
+    return again_add(ev, flags & EV_KMASK);
 }
 
 int
@@ -75,7 +241,20 @@ fdev_del(struct fdev *ev)
 {
     if (ev->index >= 0)
         m_valid[ev->index] = 0;
-    return fdev_disable(ev, EV_READ|EV_WRITE);
+    if (ev->chidx >= 0) {
+        m_changes[ev->chidx] = NULL;
+        ev->chidx = -1;
+    }
+    if (ev->agidx >= 0) {
+        m_again[ev->agidx] = NULL;
+        ev->agidx = -1;
+    }
+    ev->flags = 0;
+    if (ev->kflags != 0) {
+        ev->kflags = 0;
+        return epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+    }
+    return 0;
 }
 
 int
@@ -91,12 +270,17 @@ evloop(void)
         else
             millisecs = -1;
 
-        if ((nev = epoll_wait(m_epfd, m_evs, 100, millisecs)) < 0) {
+        changes_apply();
+        if (m_nagain > 0)
+            millisecs = 0;
+
+        if ((nev = epoll_wait(m_epfd, m_evs, m_evcap, millisecs)) < 0) {
             if (errno == EINTR)
                 continue;
             else
                 return -1;
         }
+        evtimer_update();
         memset(m_valid, 1, nev);
         for (i = 0; i < nev; i++) {
             struct fdev *ev = m_evs[i].data.ptr;
@@ -114,5 +298,8 @@ evloop(void)
             if (m_valid[i])
                 ev->index = -1;
         }
+        if (nev == m_evcap && m_evcap < EV_MAX_SIZE)
+            ev_grow();
+        again_run();
     }
 }
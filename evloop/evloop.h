@@ -4,23 +4,32 @@
 #include <sys/time.h>
 #include <stdint.h>
 
-#include "timeheap.h"
+#include "timewheel.h"
 
 #define EV_READ    1
 #define EV_WRITE   2
 #define EV_TIMEOUT 3
+#define EV_EDGE    4    /* Only given to fdev_new. See fdev_again. */
 
 typedef void (*evloop_cb_t)(int fd, short type, void *arg);
 
-#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE) || \
+    defined(EVLOOP_IOURING)
 
 struct fdev {
     evloop_cb_t cb;
     void *arg;
     int fd;
     uint16_t flags;
-#ifdef EVLOOP_EPOLL
-    int16_t index;
+#if defined(EVLOOP_EPOLL)
+    uint16_t kflags;
+    uint16_t aflags;
+    int index;
+    int chidx;
+    int agidx;
+#elif defined(EVLOOP_IOURING)
+    int16_t armed;
+    int slot;
 #else
     int16_t rdidx;
     int16_t wridx;
@@ -40,23 +49,76 @@ struct fdev {
 struct timeout {
     evloop_cb_t cb;
     void *arg;
-    struct th_handle th;
+    struct tw_handle tw;
 };
 
+/*
+ * The loop state is kept per thread. A thread that wants to run its own
+ * loop calls evloop_init and then evloop. Fdevs and timeouts belong to
+ * the loop of the thread that created them and must only be touched
+ * from that thread.
+ */
 int evloop_init(void);
 int evloop(void);
 
+/*
+ * Called when the loop can't watch an fdev. The fdev's flags have been
+ * cleared and it won't be reported until it's enabled again. Like the
+ * rest of the loop state, the callback is per thread.
+ */
+typedef void (*evloop_errcb_t)(int fd, int err, void *arg);
+void evloop_set_errcb(evloop_errcb_t cb);
+
 int fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb,
     void *arg);
 int fdev_del(struct fdev *ev);
 int fdev_enable(struct fdev *ev, uint16_t flags);
 int fdev_disable(struct fdev *ev, uint16_t flags);
 
+/*
+ * An fdev created with EV_EDGE may only be reported when it becomes
+ * ready, where the method supports it. Its callback must then either do
+ * I/O until it would block or call fdev_again, which has it called again
+ * without waiting. For other fdevs fdev_again does nothing.
+ */
+int fdev_again(struct fdev *ev, uint16_t flags);
+
+#ifdef EVLOOP_IOURING
+#include <sys/uio.h>
+
+#define EV_GONE 8
+#define EVLOOP_IOV_MAX 16
+
+/*
+ * The uring method can do an fdev's reads and writes itself, which saves
+ * the system calls that doing them when the fdev is reported would take.
+ * A read or write queued with fdev_readv or fdev_writev takes the place
+ * of reporting that the fd is readable or writable, and cb is given what
+ * readv or writev would have returned, or minus the error, once it's
+ * done. The iovecs needn't be kept, but the memory they point to must be
+ * until then. Each fdev can have one read and one write in flight. They
+ * return ENOTSUP if the kernel is too old to do them this way.
+ *
+ * An fdev deleted while fdev_busy returns true has its I/O cancelled, and
+ * it and the memory the I/O used must be kept until its callback has been
+ * called with EV_GONE.
+ */
+typedef void (*evloop_iocb_t)(int fd, short type, int res, void *arg);
+int fdev_readv(struct fdev *ev, const struct iovec *iov, int niov,
+    evloop_iocb_t cb);
+int fdev_writev(struct fdev *ev, const struct iovec *iov, int niov,
+    evloop_iocb_t cb);
+int fdev_busy(struct fdev *ev);
+#endif
+
 void evtimer_init(struct timeout *, evloop_cb_t, void *);
 int evtimer_add(struct timeout *, struct timespec *);
 void evtimer_del(struct timeout *);
 
+int evtimers_init(void);
 void evtimers_run(void);
+void evtimer_update(void);
+void evtimer_now(struct timespec *);
 struct timespec evtimer_delay(void);
 int evtimer_gettime(struct timespec *);
 
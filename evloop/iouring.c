@@ -0,0 +1,529 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evloop.h"
+
+/*
+ * Readiness is collected with one shot IORING_OP_POLL_ADD requests. Changes
+ * to an fdev's flags only mark it dirty; the poll requests they imply are
+ * queued as sqes right before the loop waits and are submitted by the same
+ * io_uring_enter call that waits for completions. A busy loop thus makes one
+ * system call per iteration no matter how many fds changed state.
+ *
+ * The kernel hands back the user_data of a request long after the fdev it
+ * was made for may have been deleted and freed, so user_data never holds a
+ * pointer. It holds an index into the slot table and the sequence number of
+ * the slot's current request. Completions whose sequence doesn't match are
+ * stale and are dropped.
+ *
+ * Reads and writes queued with fdev_readv and fdev_writev are tagged with
+ * their kind in user_data instead and always complete, so they carry no
+ * sequence number. A deleted fdev's slot isn't reused until they have.
+ * Their iovecs are copied to a table indexed like the sqes, which is fine
+ * as the kernel is done with them once the sqe has been submitted. The
+ * kernel waits for the fd to be ready by itself before doing them.
+ */
+
+#define URING_ENTRIES 256
+#define SLOT_INIT_SIZE 64
+
+#define UD_NONE    (~(uint64_t)0)
+#define UD_TIMEOUT (~(uint64_t)0 - 1)
+
+#define UD_POLL 0
+#define UD_MAKE(slot, kind, seq) \
+    ((uint64_t)(seq) << 32 | (uint32_t)(kind) << 30 | (uint32_t)(slot))
+#define UD_SLOT(ud) ((int)((uint32_t)(ud) & 0x3fffffff))
+#define UD_KIND(ud) ((int)((uint32_t)(ud) >> 30))
+#define UD_SEQ(ud) ((uint32_t)((ud) >> 32))
+
+struct ur_slot {
+    struct fdev *ev;
+    uint32_t seq;
+    int next;
+    int dirty;
+    uint16_t busy;      // EV_READ and EV_WRITE while I/O is in flight.
+    int gone;           // Deleted while busy.
+    evloop_iocb_t iocb[2];
+};
+
+static __thread int m_ufd;
+static __thread uint32_t m_features;
+
+static __thread unsigned *m_sq_head, *m_sq_tail, *m_sq_mask, *m_sq_array;
+static __thread unsigned m_sq_entries, m_sqtail;
+static __thread struct io_uring_sqe *m_sqes;
+static __thread struct iovec (*m_iovs)[EVLOOP_IOV_MAX];
+
+static __thread unsigned *m_cq_head, *m_cq_tail, *m_cq_mask;
+static __thread struct io_uring_cqe *m_cqes;
+
+static __thread struct ur_slot *m_slots;
+static __thread int *m_dirty;
+static __thread int m_cap, m_ndirty, m_free = -1;
+
+static __thread struct __kernel_timespec m_ts;
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+    void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, m_ufd, to_submit, min_complete,
+        flags, arg, argsz);
+}
+
+static unsigned
+sq_unsubmitted(void)
+{
+    return m_sqtail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void
+sq_publish(void)
+{
+    __atomic_store_n(m_sq_tail, m_sqtail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *
+sq_get(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+    while (sq_unsubmitted() == m_sq_entries) {
+        sq_publish();
+        if (uring_enter(m_sq_entries, 0, 0, NULL, 0) < 0 && errno != EINTR
+                && errno != EAGAIN && errno != EBUSY)
+            return NULL;
+    }
+    idx = m_sqtail & *m_sq_mask;
+    sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[idx] = idx;
+    m_sqtail++;
+    return sqe;
+}
+
+static int
+slot_grow(void)
+{
+    int i, ncap = m_cap > 0 ? m_cap * 2 : SLOT_INIT_SIZE;
+    struct ur_slot *nm_slots = realloc(m_slots, ncap * sizeof(*m_slots));
+    int *nm_dirty = realloc(m_dirty, ncap * sizeof(*m_dirty));
+    if (nm_slots != NULL)
+        m_slots = nm_slots;
+    if (nm_dirty != NULL)
+        m_dirty = nm_dirty;
+    if (nm_slots == NULL || nm_dirty == NULL)
+        return errno;
+    for (i = m_cap; i < ncap; i++) {
+        m_slots[i].ev = NULL;
+        m_slots[i].seq = 0;
+        m_slots[i].dirty = 0;
+        m_slots[i].busy = 0;
+        m_slots[i].gone = 0;
+        m_slots[i].next = i + 1 < ncap ? i + 1 : m_free;
+    }
+    m_free = m_cap;
+    m_cap = ncap;
+    return 0;
+}
+
+static void
+slot_dirty(int i)
+{
+    if (!m_slots[i].dirty) {
+        m_slots[i].dirty = 1;
+        m_dirty[m_ndirty] = i;
+        m_ndirty++;
+    }
+}
+
+static short
+poll_mask(uint16_t flags)
+{
+    return
+        ((flags & EV_READ) ? POLLIN : 0) |
+        ((flags & EV_WRITE) ? POLLOUT : 0);
+}
+
+static int
+queue_remove(int i)
+{
+    struct io_uring_sqe *sqe;
+    if ((sqe = sq_get()) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UD_MAKE(i, UD_POLL, m_slots[i].seq);
+    sqe->user_data = UD_NONE;
+    m_slots[i].seq++;
+    return 0;
+}
+
+static int
+queue_add(int i, short mask)
+{
+    struct io_uring_sqe *sqe;
+    if ((sqe = sq_get()) == NULL)
+        return -1;
+    m_slots[i].seq++;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_slots[i].ev->fd;
+    sqe->poll_events = mask;
+    sqe->user_data = UD_MAKE(i, UD_POLL, m_slots[i].seq);
+    return 0;
+}
+
+static int
+queue_changes(void)
+{
+    int n;
+    for (n = 0; n < m_ndirty; n++) {
+        int i = m_dirty[n];
+        struct fdev *ev = m_slots[i].ev;
+        short want;
+        m_slots[i].dirty = 0;
+        if (ev == NULL)
+            continue;
+        want = poll_mask(ev->flags & ~m_slots[i].busy);
+        if (ev->armed == want)
+            continue;
+        if (ev->armed != 0) {
+            if (queue_remove(i) != 0)
+                return -1;
+            ev->armed = 0;
+        }
+        if (want != 0) {
+            if (queue_add(i, want) != 0)
+                return -1;
+            ev->armed = want;
+        }
+    }
+    m_ndirty = 0;
+    return 0;
+}
+
+int
+evloop_init(void)
+{
+    struct io_uring_params p;
+    size_t sqsz, cqsz;
+    char *sqp, *cqp;
+
+    if (evtimers_init() != 0)
+        return -1;
+
+    memset(&p, 0, sizeof(p));
+    if ((m_ufd = uring_setup(URING_ENTRIES, &p)) < 0)
+        return -1;
+    m_features = p.features;
+
+    sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((m_features & IORING_FEAT_SINGLE_MMAP) && cqsz > sqsz)
+        sqsz = cqsz;
+    sqp = mmap(NULL, sqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        m_ufd, IORING_OFF_SQ_RING);
+    if (sqp == MAP_FAILED)
+        return -1;
+    if (m_features & IORING_FEAT_SINGLE_MMAP)
+        cqp = sqp;
+    else {
+        cqp = mmap(NULL, cqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            m_ufd, IORING_OFF_CQ_RING);
+        if (cqp == MAP_FAILED)
+            return -1;
+    }
+    m_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_ufd,
+        IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+        return -1;
+    if ((m_iovs = calloc(p.sq_entries, sizeof(*m_iovs))) == NULL)
+        return -1;
+
+    m_sq_head = (unsigned *)(sqp + p.sq_off.head);
+    m_sq_tail = (unsigned *)(sqp + p.sq_off.tail);
+    m_sq_mask = (unsigned *)(sqp + p.sq_off.ring_mask);
+    m_sq_array = (unsigned *)(sqp + p.sq_off.array);
+    m_sq_entries = p.sq_entries;
+    m_sqtail = *m_sq_tail;
+    m_cq_head = (unsigned *)(cqp + p.cq_off.head);
+    m_cq_tail = (unsigned *)(cqp + p.cq_off.tail);
+    m_cq_mask = (unsigned *)(cqp + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(cqp + p.cq_off.cqes);
+
+    return slot_grow() == 0 ? 0 : -1;
+}
+
+int
+fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
+{
+    if (m_free < 0 && slot_grow() != 0)
+        return errno;
+    ev->slot = m_free;
+    m_free = m_slots[ev->slot].next;
+    m_slots[ev->slot].ev = ev;
+    ev->fd = fd;
+    ev->cb = cb;
+    ev->arg = arg;
+    ev->flags = 0;
+    ev->armed = 0;
+    return fdev_enable(ev, flags);
+}
+
+int
+fdev_enable(struct fdev *ev, uint16_t flags)
+{
+    uint16_t sf = ev->flags;
+    ev->flags |= flags;
+    if (sf != ev->flags)
+        slot_dirty(ev->slot);
+    return 0;
+}
+
+int
+fdev_disable(struct fdev *ev, uint16_t flags)
+{
+    uint16_t sf = ev->flags;
+    ev->flags &= ~flags;
+    if (sf != ev->flags)
+        slot_dirty(ev->slot);
+    return 0;
+}
+
+static void
+slot_free(int i)
+{
+    m_slots[i].seq++;
+    m_slots[i].ev = NULL;
+    m_slots[i].gone = 0;
+    m_slots[i].next = m_free;
+    m_free = i;
+}
+
+static int
+queue_cancel(int i, int kind)
+{
+    struct io_uring_sqe *sqe;
+    if ((sqe = sq_get()) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UD_MAKE(i, kind, 0);
+    sqe->user_data = UD_NONE;
+    return 0;
+}
+
+int
+fdev_del(struct fdev *ev)
+{
+    int i = ev->slot;
+    if (ev->armed != 0 && queue_remove(i) != 0)
+        return -1;
+    ev->armed = 0;
+    if (m_slots[i].busy != 0) {
+        if ((m_slots[i].busy & EV_READ) && queue_cancel(i, EV_READ) != 0)
+            return -1;
+        if ((m_slots[i].busy & EV_WRITE) && queue_cancel(i, EV_WRITE) != 0)
+            return -1;
+        m_slots[i].seq++;
+        m_slots[i].gone = 1;
+        ev->flags = 0;
+        return 0;
+    }
+    slot_free(i);
+    return 0;
+}
+
+static int
+queue_io(struct fdev *ev, int kind, uint8_t opcode, const struct iovec *iov,
+    int niov, evloop_iocb_t cb)
+{
+    struct io_uring_sqe *sqe;
+    struct ur_slot *s = &m_slots[ev->slot];
+    unsigned idx;
+
+    if (!(m_features & IORING_FEAT_SUBMIT_STABLE) ||
+            !(m_features & IORING_FEAT_FAST_POLL))
+        return ENOTSUP;
+    if (niov > EVLOOP_IOV_MAX || (s->busy & kind))
+        return EINVAL;
+    if ((sqe = sq_get()) == NULL)
+        return errno;
+    idx = sqe - m_sqes;
+    memcpy(m_iovs[idx], iov, niov * sizeof(*iov));
+    sqe->opcode = opcode;
+    sqe->fd = ev->fd;
+    sqe->addr = (uint64_t)(uintptr_t)m_iovs[idx];
+    sqe->len = niov;
+    sqe->user_data = UD_MAKE(ev->slot, kind, 0);
+    s->busy |= kind;
+    s->iocb[kind - 1] = cb;
+    // A poll for what the I/O waits on is no longer wanted.
+    slot_dirty(ev->slot);
+    return 0;
+}
+
+int
+fdev_readv(struct fdev *ev, const struct iovec *iov, int niov,
+    evloop_iocb_t cb)
+{
+    return queue_io(ev, EV_READ, IORING_OP_READV, iov, niov, cb);
+}
+
+int
+fdev_writev(struct fdev *ev, const struct iovec *iov, int niov,
+    evloop_iocb_t cb)
+{
+    return queue_io(ev, EV_WRITE, IORING_OP_WRITEV, iov, niov, cb);
+}
+
+int
+fdev_busy(struct fdev *ev)
+{
+    return m_slots[ev->slot].busy != 0;
+}
+
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    return 0;
+}
+
+/*
+ * A poll request the kernel won't take completes with an error, which
+ * is reported to the fdev as readiness.
+ */
+void
+evloop_set_errcb(evloop_errcb_t cb)
+{
+}
+
+static void
+io_done(int i, int kind, int res)
+{
+    struct ur_slot *s = &m_slots[i];
+    struct fdev *ev = s->ev;
+
+    s->busy &= ~kind;
+    if (s->gone) {
+        if (s->busy == 0) {
+            slot_free(i);
+            ev->cb(ev->fd, EV_GONE, ev->arg);
+        }
+        return;
+    }
+    slot_dirty(i);
+    s->iocb[kind - 1](ev->fd, kind, res, ev->arg);
+}
+
+static void
+dispatch(uint64_t ud, int res)
+{
+    int i = UD_SLOT(ud);
+    uint32_t seq = UD_SEQ(ud);
+    struct fdev *ev = m_slots[i].ev;
+
+    if (UD_KIND(ud) != UD_POLL) {
+        io_done(i, UD_KIND(ud), res);
+        return;
+    }
+    if (ev == NULL || m_slots[i].seq != seq || ev->armed == 0)
+        return;
+    ev->armed = 0;
+    slot_dirty(i);
+    if (res == -ECANCELED)
+        return;
+    else if (res < 0)
+        res = POLLERR;
+
+    if (ev->flags & ~m_slots[i].busy & EV_READ &&
+            res & (POLLIN|POLLERR|POLLHUP))
+        ev->cb(ev->fd, EV_READ, ev->arg);
+    if (m_slots[i].ev == ev && m_slots[i].seq == seq &&
+            ev->flags & ~m_slots[i].busy & EV_WRITE &&
+            res & (POLLOUT|POLLERR|POLLHUP))
+        ev->cb(ev->fd, EV_WRITE, ev->arg);
+}
+
+int
+evloop(void)
+{
+    struct timespec delay;
+    struct io_uring_getevents_arg garg;
+    struct io_uring_sqe *sqe;
+    unsigned head, wait, flags;
+    void *arg;
+    size_t argsz;
+
+    while (1) {
+        evtimers_run();
+
+        if (queue_changes() != 0)
+            return -1;
+
+        delay = evtimer_delay();
+        wait = delay.tv_sec != 0 || delay.tv_nsec != 0;
+        flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        arg = NULL;
+        argsz = 0;
+        if (wait && delay.tv_sec >= 0) {
+            m_ts.tv_sec = delay.tv_sec;
+            m_ts.tv_nsec = delay.tv_nsec;
+            if (m_features & IORING_FEAT_EXT_ARG) {
+                memset(&garg, 0, sizeof(garg));
+                garg.ts = (uint64_t)(uintptr_t)&m_ts;
+                flags |= IORING_ENTER_EXT_ARG;
+                arg = &garg;
+                argsz = sizeof(garg);
+            } else {
+                /*
+                 * Without the extended argument the wait is bounded by a
+                 * timeout request that also completes as soon as any
+                 * other request does.
+                 */
+                if ((sqe = sq_get()) == NULL)
+                    return -1;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)&m_ts;
+                sqe->len = 1;
+                sqe->off = 1;
+                sqe->user_data = UD_TIMEOUT;
+            }
+        }
+        sq_publish();
+
+        if (uring_enter(sq_unsubmitted(), wait, flags, arg, argsz) < 0) {
+            if (errno != EINTR && errno != ETIME && errno != EAGAIN &&
+                    errno != EBUSY)
+                return -1;
+        }
+        evtimer_update();
+
+        head = *m_cq_head;
+        while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+            if (ud != UD_NONE && ud != UD_TIMEOUT)
+                dispatch(ud, res);
+        }
+    }
+}
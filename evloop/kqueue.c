@@ -8,15 +8,15 @@
 
 #include "evloop.h"
 
-static int m_kq;
+static __thread int m_kq;
 
-static struct kevent m_evs[100];
-static uint8_t m_valid[100];
+static __thread struct kevent m_evs[100];
+static __thread uint8_t m_valid[100];
 
 int
 evloop_init(void)
 {
-    if (timeheap_init() != 0)
+    if (evtimers_init() != 0)
         return -1;
     m_kq = kqueue();
     return m_kq >= 0 ? 0 : -1;
@@ -86,6 +86,21 @@ fdev_del(struct fdev *ev)
     return fdev_disable(ev, EV_READ|EV_WRITE);
 }
 
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    return 0;
+}
+
+/*
+ * Changes are made right away, so their errors are returned by the
+ * fdev functions instead.
+ */
+void
+evloop_set_errcb(evloop_errcb_t cb)
+{
+}
+
 int
 evloop(void)
 {
@@ -101,6 +116,7 @@ evloop(void)
             else
                 return -1;
         }
+        evtimer_update();
         memset(m_valid, 1, nev);
         for (i = 0; i < nev; i++) {
             if (m_evs[i].flags & EV_ERROR) {
@@ -14,11 +14,11 @@ struct poll_ev {
     void *arg;
 };
 
-static struct pollfd *m_pfds;
-static struct poll_ev *m_pevs;
+static __thread struct pollfd *m_pfds;
+static __thread struct poll_ev *m_pevs;
 
-static int m_cap, m_size;
-static int m_cur = -1, m_curdel;
+static __thread int m_cap, m_size;
+static __thread int m_cur = -1, m_curdel;
 
 static int
 poll_grow(void)
@@ -39,7 +39,7 @@ poll_grow(void)
 int
 evloop_init(void)
 {
-    if (timeheap_init() != 0)
+    if (evtimers_init() != 0)
         return -1;
     m_cap = POLL_INIT_SIZE;
     m_size = 0;
@@ -101,6 +101,21 @@ fdev_del(struct fdev *ev)
     return 0;
 }
 
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    return 0;
+}
+
+/*
+ * Changes are made right away, so their errors are returned by the
+ * fdev functions instead.
+ */
+void
+evloop_set_errcb(evloop_errcb_t cb)
+{
+}
+
 int
 evloop(void)
 {
@@ -121,6 +136,7 @@ evloop(void)
             else
                 return -1;
         }
+        evtimer_update();
 
         m_cur = 0;
         while (m_cur < m_size) {
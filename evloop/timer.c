@@ -1,7 +1,7 @@
 #include <time.h>
 
 #include "evloop.h"
-#include "timeheap.h"
+#include "timewheel.h"
 
 #if defined(HAVE_CLOCK_MONOTONIC)
 
@@ -67,67 +67,114 @@ subtime(struct timespec a, struct timespec b)
     return ret;
 }
 
+/*
+ * The clock is read once per loop iteration, when the timers are run and
+ * again when the backend returns from waiting. Timeouts added in between
+ * count from that cached time.
+ */
+static __thread struct timespec m_now;
+
+/*
+ * Deadlines are rounded up to whole milliseconds and the clock they're
+ * run against is rounded down, so a timer never fires early.
+ */
+static uint64_t
+ts_ms_ceil(struct timespec ts)
+{
+    return (uint64_t)ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000;
+}
+
+static uint64_t
+ts_ms_floor(struct timespec ts)
+{
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+evtimers_init(void)
+{
+    if (evtimer_gettime(&m_now) != 0)
+        return -1;
+    timewheel_init(ts_ms_floor(m_now));
+    return 0;
+}
+
+void
+evtimer_update(void)
+{
+    evtimer_gettime(&m_now);
+}
+
+/*
+ * The cached time. Cheaper than evtimer_gettime for callers that are
+ * fine with the time the current loop iteration began.
+ */
+void
+evtimer_now(struct timespec *ts)
+{
+    *ts = m_now;
+}
+
 void
 evtimer_init(struct timeout *h, evloop_cb_t cb, void *arg)
 {
     h->cb = cb;
     h->arg = arg;
-    h->th.i = -1;
-    h->th.data = h;
+    h->tw.prev = NULL;
+    h->tw.data = h;
 }
 
 int
 evtimer_add(struct timeout *h, struct timespec *t)
 {
-    struct timespec now, sum;
-    evtimer_gettime(&now);
-    sum = addtime(now, *t);
-    if (h->th.i == -1)
-        return timeheap_insert(&h->th, &sum);
-    else {
-        timeheap_change(&h->th, &sum);
-        return 0;
-    }
+    timewheel_insert(&h->tw, ts_ms_ceil(addtime(m_now, *t)));
+    return 0;
 }
 
 void
 evtimer_del(struct timeout *h)
 {
-    if (h->th.i >= 0) {
-        timeheap_remove(&h->th);
-        h->th.i = -1;
-    }
+    if (h->tw.prev != NULL)
+        timewheel_remove(&h->tw);
 }
 
 void
 evtimers_run(void)
 {
-    struct timespec now;
-    evtimer_gettime(&now);
-    while (timeheap_size() > 0) {
-        struct timespec diff = subtime(timeheap_top(), now);
-        if (diff.tv_sec < 0 || (diff.tv_sec == 0 && diff.tv_nsec < 1000000)) {
-            struct timeout *t = timeheap_remove_top();
-            t->th.i = -1;
-            t->cb(-1, EV_TIMEOUT, t->arg);
-        } else
-            break;
-    }
+    struct timeout *t;
+    uint64_t now;
+    evtimer_update();
+    now = ts_ms_floor(m_now);
+    while ((t = timewheel_expire(now)) != NULL)
+        t->cb(-1, EV_TIMEOUT, t->arg);
 }
 
 struct timespec
 evtimer_delay(void)
 {
-    struct timespec now, diff;
-    if (timeheap_size() == 0) {
+    struct timespec diff;
+    if (timewheel_size() == 0) {
         diff.tv_sec = -1;
         diff.tv_nsec = 0;
     } else {
-        evtimer_gettime(&now);
-        diff = subtime(timeheap_top(), now);
+        /*
+         * A tick is run once the clock has reached it. The wait is
+         * rounded up to whole milliseconds.
+         */
+        struct timespec at;
+        uint64_t next = timewheel_next();
+        at.tv_sec = next / 1000;
+        at.tv_nsec = (next % 1000) * 1000000;
+        diff = subtime(at, m_now);
         if (diff.tv_sec < 0) {
             diff.tv_sec = 0;
             diff.tv_nsec = 0;
+        } else if (diff.tv_nsec % 1000000 != 0) {
+            diff.tv_nsec += 1000000 - diff.tv_nsec % 1000000;
+            if (diff.tv_nsec >= 1000000000) {
+                diff.tv_sec += 1;
+                diff.tv_nsec -= 1000000000;
+            }
         }
     }
     return diff;
@@ -0,0 +1,218 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "timewheel.h"
+
+/*
+ * A hierarchical timing wheel with one tick per millisecond. Level 0 has
+ * one slot per tick, each higher level has slots covering 64 times as many
+ * ticks as the level below. A timer is put on the lowest level whose span
+ * covers its distance from the wheel's clock, and is moved down a level
+ * each time the clock reaches the start of the slot it sits in. Insertion
+ * and removal are thus constant time. Timers further away than the top
+ * level covers are kept in its last slot and are simply moved again.
+ *
+ * The clock is the next tick to be run. Ticks that have nothing on level 0
+ * are skipped using the per level occupancy bitmaps.
+ */
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 5
+#define TW_SPAN(l) ((uint64_t)1 << (TW_BITS * (l)))
+#define TW_EXPIRED (-1)
+
+static __thread struct tw_handle *m_wheel[TW_LEVELS][TW_SIZE];
+static __thread uint64_t m_occ[TW_LEVELS];
+static __thread struct tw_handle *m_expired;
+static __thread uint64_t m_clock;
+static __thread int m_count;
+
+static struct tw_handle **
+slot_head(int slot)
+{
+    if (slot == TW_EXPIRED)
+        return &m_expired;
+    else
+        return &m_wheel[slot / TW_SIZE][slot % TW_SIZE];
+}
+
+static void
+slot_push(struct tw_handle *h, int slot)
+{
+    struct tw_handle **head = slot_head(slot);
+    h->slot = slot;
+    h->next = *head;
+    if (h->next != NULL)
+        h->next->prev = &h->next;
+    h->prev = head;
+    *head = h;
+    if (slot != TW_EXPIRED)
+        m_occ[slot / TW_SIZE] |= (uint64_t)1 << (slot % TW_SIZE);
+}
+
+static void
+slot_unlink(struct tw_handle *h)
+{
+    *h->prev = h->next;
+    if (h->next != NULL)
+        h->next->prev = h->prev;
+    if (h->slot != TW_EXPIRED && *slot_head(h->slot) == NULL)
+        m_occ[h->slot / TW_SIZE] &= ~((uint64_t)1 << (h->slot % TW_SIZE));
+    h->prev = NULL;
+}
+
+static void
+place(struct tw_handle *h)
+{
+    int l;
+    uint64_t expires = h->expires;
+    if (expires < m_clock) {
+        slot_push(h, m_clock & TW_MASK);
+        return;
+    }
+    if (expires - m_clock >= TW_SPAN(TW_LEVELS))
+        expires = m_clock + TW_SPAN(TW_LEVELS) - 1;
+    for (l = 0; expires - m_clock >= TW_SPAN(l + 1); l++)
+        ;
+    slot_push(h, l * TW_SIZE + ((expires >> (TW_BITS * l)) & TW_MASK));
+}
+
+static void
+cascade(void)
+{
+    int l;
+    for (l = 1; l < TW_LEVELS; l++) {
+        int idx = (m_clock >> (TW_BITS * l)) & TW_MASK;
+        struct tw_handle *h = m_wheel[l][idx];
+        m_wheel[l][idx] = NULL;
+        m_occ[l] &= ~((uint64_t)1 << idx);
+        while (h != NULL) {
+            struct tw_handle *next = h->next;
+            place(h);
+            h = next;
+        }
+        if (idx != 0)
+            break;
+    }
+}
+
+/*
+ * Runs ticks up to and including now, or until some timer has expired.
+ * The slots due to be moved down when the clock reaches the start of a
+ * level 0 rotation are moved right away, so timewheel_next and place
+ * never see a clock whose cascade is pending.
+ */
+static void
+advance(uint64_t now)
+{
+    while (m_expired == NULL && m_clock <= now) {
+        int idx = m_clock & TW_MASK;
+        uint64_t bits;
+        if (m_count == 0) {
+            m_clock = now + 1;
+            break;
+        }
+        if ((bits = m_occ[0] >> idx) == 0) {
+            uint64_t next = (m_clock | TW_MASK) + 1;
+            if (next > now + 1) {
+                m_clock = now + 1;
+                break;
+            }
+            m_clock = next;
+            cascade();
+            continue;
+        }
+        if (m_clock + __builtin_ctzll(bits) > now) {
+            m_clock = now + 1;
+            break;
+        }
+        idx += __builtin_ctzll(bits);
+        m_clock += __builtin_ctzll(bits);
+        while (m_wheel[0][idx] != NULL) {
+            struct tw_handle *h = m_wheel[0][idx];
+            slot_unlink(h);
+            slot_push(h, TW_EXPIRED);
+        }
+        m_clock++;
+        if ((m_clock & TW_MASK) == 0)
+            cascade();
+    }
+}
+
+void
+timewheel_init(uint64_t now)
+{
+    m_clock = now;
+}
+
+int
+timewheel_size(void)
+{
+    return m_count;
+}
+
+void
+timewheel_insert(struct tw_handle *h, uint64_t expires)
+{
+    if (h->prev != NULL)
+        slot_unlink(h);
+    else
+        m_count++;
+    h->expires = expires;
+    place(h);
+}
+
+void
+timewheel_remove(struct tw_handle *h)
+{
+    assert(h->prev != NULL);
+    slot_unlink(h);
+    m_count--;
+}
+
+void *
+timewheel_expire(uint64_t now)
+{
+    struct tw_handle *h;
+    advance(now);
+    if ((h = m_expired) == NULL)
+        return NULL;
+    slot_unlink(h);
+    m_count--;
+    return h->data;
+}
+
+/*
+ * Returns a lower bound for when the first timer expires. It's exact when
+ * that timer is on level 0, otherwise it's the tick where the slot it's in
+ * is moved down.
+ */
+uint64_t
+timewheel_next(void)
+{
+    int l;
+    uint64_t next = UINT64_MAX;
+    if (m_expired != NULL)
+        return m_clock;
+    for (l = 0; l < TW_LEVELS; l++) {
+        int pos, d, shift = TW_BITS * l;
+        uint64_t bits, t;
+        if (m_occ[l] == 0)
+            continue;
+        pos = (m_clock >> shift) & TW_MASK;
+        if (l > 0)
+            pos = (pos + 1) & TW_MASK;
+        bits = pos == 0 ? m_occ[l] :
+            m_occ[l] >> pos | m_occ[l] << (TW_SIZE - pos);
+        d = __builtin_ctzll(bits) + (l > 0 ? 1 : 0);
+        if (l == 0)
+            t = m_clock + d;
+        else
+            t = ((m_clock >> shift) + d) << shift;
+        if (t < next)
+            next = t;
+    }
+    return next;
+}
@@ -0,0 +1,23 @@
+#ifndef BTPD_TIMEWHEEL_H
+#define BTPD_TIMEWHEEL_H
+
+#include <stdint.h>
+
+struct tw_handle {
+    struct tw_handle *next;
+    struct tw_handle **prev;
+    uint64_t expires;
+    int slot;
+    void *data;
+};
+
+void timewheel_init(uint64_t now);
+int timewheel_size(void);
+
+void timewheel_insert(struct tw_handle *h, uint64_t expires);
+void timewheel_remove(struct tw_handle *h);
+
+void *timewheel_expire(uint64_t now);
+uint64_t timewheel_next(void);
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef BTPD_BITSET_H
+#define BTPD_BITSET_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Bit fields as they're sent in the protocol, with the first bit as the
+ * most significant bit of the first byte. The searches and counts work
+ * on 64 bits at a time.
+ */
+
+static inline void
+set_bit(uint8_t *bits, unsigned long index)
+{
+    bits[index / 8] |= (1 << (7 - index % 8));
+}
+
+static inline void
+clear_bit(uint8_t *bits, unsigned long index)
+{
+    bits[index / 8] &= ~(1 << (7 - index % 8));
+}
+
+static inline int
+has_bit(const uint8_t *bits, unsigned long index)
+{
+    return bits[index / 8] & (1 << (7 - index % 8));
+}
+
+/*
+ * Returns the 64 bits from bit 64 * k as a word with the first bit as
+ * its most significant one. Bits past the end of the field are zero.
+ */
+static inline uint64_t
+load_bits(const uint8_t *bits, unsigned long nbytes, unsigned long k)
+{
+    uint64_t w = 0;
+    unsigned long off = k * 8;
+    if (off + 8 <= nbytes) {
+        memcpy(&w, bits + off, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+    } else
+        for (unsigned long i = 0; i < 8; i++)
+            w = w << 8 | (off + i < nbytes ? bits[off + i] : 0);
+    return w;
+}
+
+/*
+ * Returns the index of the first set bit at or after from, or nbits if
+ * there's none.
+ */
+static inline unsigned long
+next_bit(const uint8_t *bits, unsigned long nbits, unsigned long from)
+{
+    unsigned long nbytes = (nbits + 7) / 8, k = from / 64, i;
+    uint64_t w;
+    if (from >= nbits)
+        return nbits;
+    w = load_bits(bits, nbytes, k) & (~0ULL >> from % 64);
+    while (w == 0) {
+        if (++k * 64 >= nbits)
+            return nbits;
+        w = load_bits(bits, nbytes, k);
+    }
+    i = k * 64 + __builtin_clzll(w);
+    return i < nbits ? i : nbits;
+}
+
+/*
+ * Returns the index of the first bit at or after from that's set in
+ * neither a nor b, or nbits if there's none.
+ */
+static inline unsigned long
+next_zero_bit_or(const uint8_t *a, const uint8_t *b, unsigned long nbits,
+    unsigned long from)
+{
+    unsigned long nbytes = (nbits + 7) / 8, k = from / 64, i;
+    uint64_t w;
+    if (from >= nbits)
+        return nbits;
+    w = ~(load_bits(a, nbytes, k) | load_bits(b, nbytes, k))
+        & (~0ULL >> from % 64);
+    while (w == 0) {
+        if (++k * 64 >= nbits)
+            return nbits;
+        w = ~(load_bits(a, nbytes, k) | load_bits(b, nbytes, k));
+    }
+    i = k * 64 + __builtin_clzll(w);
+    return i < nbits ? i : nbits;
+}
+
+/*
+ * Returns the index of the first clear bit at or after from, or nbits
+ * if there's none.
+ */
+static inline unsigned long
+next_zero_bit(const uint8_t *bits, unsigned long nbits, unsigned long from)
+{
+    return next_zero_bit_or(bits, bits, nbits, from);
+}
+
+/*
+ * Returns the number of set bits among the first nbits.
+ */
+static inline unsigned long
+count_bits(const uint8_t *bits, unsigned long nbits)
+{
+    unsigned long nbytes = (nbits + 7) / 8, count = 0, k;
+    for (k = 0; k < nbits / 64; k++)
+        count += __builtin_popcountll(load_bits(bits, nbytes, k));
+    if (nbits % 64 != 0)
+        count += __builtin_popcountll(load_bits(bits, nbytes, k)
+            & ~(~0ULL >> nbits % 64));
+    return count;
+}
+
+/*
+ * Sets the bits from index from up to, but not including, to.
+ */
+static inline void
+set_bits(uint8_t *bits, unsigned long from, unsigned long to)
+{
+    for (; from < to && from % 8 != 0; from++)
+        set_bit(bits, from);
+    if (from < to / 8 * 8) {
+        memset(bits + from / 8, 0xff, to / 8 - from / 8);
+        from = to / 8 * 8;
+    }
+    for (; from < to; from++)
+        set_bit(bits, from);
+}
+
+/*
+ * Clears the bits from index from up to, but not including, to.
+ */
+static inline void
+clear_bits(uint8_t *bits, unsigned long from, unsigned long to)
+{
+    for (; from < to && from % 8 != 0; from++)
+        clear_bit(bits, from);
+    if (from < to / 8 * 8) {
+        memset(bits + from / 8, 0, to / 8 - from / 8);
+        from = to / 8 * 8;
+    }
+    for (; from < to; from++)
+        clear_bit(bits, from);
+}
+
+#define BITS_AND    0
+#define BITS_ANDNOT 1
+#define BITS_OR     2
+
+static inline uint64_t
+bits_op64(uint64_t d, uint64_t s, int op)
+{
+    return op == BITS_AND ? d & s : op == BITS_ANDNOT ? d & ~s : d | s;
+}
+
+static inline void
+bits_op_masked(uint8_t *dst, const uint8_t *src, unsigned long i,
+    uint8_t mask, int op)
+{
+    dst[i] = (dst[i] & ~mask) | (bits_op64(dst[i], src[i], op) & mask);
+}
+
+/*
+ * Combines the bits from index from up to, but not including, to of src
+ * into dst. Whole bytes are done 64 bits at a time.
+ */
+static inline void
+bits_op(uint8_t *dst, const uint8_t *src, unsigned long from,
+    unsigned long to, int op)
+{
+    unsigned long i, j;
+    if (from >= to)
+        return;
+    i = from / 8;
+    j = (to - 1) / 8;
+    if (i == j) {
+        bits_op_masked(dst, src, i,
+            (0xff >> from % 8) & (0xff << (7 - (to - 1) % 8)), op);
+        return;
+    }
+    if (from % 8 != 0)
+        bits_op_masked(dst, src, i++, 0xff >> from % 8, op);
+    if (to % 8 != 0)
+        bits_op_masked(dst, src, j--, 0xff << (8 - to % 8), op);
+    for (; i + 8 <= j + 1; i += 8) {
+        uint64_t d, s;
+        memcpy(&d, dst + i, 8);
+        memcpy(&s, src + i, 8);
+        d = bits_op64(d, s, op);
+        memcpy(dst + i, &d, 8);
+    }
+    for (; i <= j; i++)
+        dst[i] = bits_op64(dst[i], src[i], op);
+}
+
+/*
+ * Keeps the bits in the range that are also set in src.
+ */
+static inline void
+and_bits(uint8_t *dst, const uint8_t *src, unsigned long from,
+    unsigned long to)
+{
+    bits_op(dst, src, from, to, BITS_AND);
+}
+
+/*
+ * Clears the bits in the range that are set in src.
+ */
+static inline void
+andnot_bits(uint8_t *dst, const uint8_t *src, unsigned long from,
+    unsigned long to)
+{
+    bits_op(dst, src, from, to, BITS_ANDNOT);
+}
+
+/*
+ * Sets the bits in the range that are set in src.
+ */
+static inline void
+or_bits(uint8_t *dst, const uint8_t *src, unsigned long from,
+    unsigned long to)
+{
+    bits_op(dst, src, from, to, BITS_OR);
+}
+
+/*
+ * Returns the 64 bits from bit 64 * k as a word with the first bit as
+ * its least significant one, which lets a walk over the set bits clear
+ * them with w & (w - 1). Bits past the end of the field are zero.
+ */
+static inline uint64_t
+load_bits_lsb(const uint8_t *bits, unsigned long nbytes, unsigned long k)
+{
+    uint64_t w = 0;
+    unsigned long off = k * 8;
+    if (off + 8 <= nbytes) {
+        memcpy(&w, bits + off, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+    } else
+        for (unsigned long i = 0; i < 8; i++)
+            w |= (uint64_t)(off + i < nbytes ? bits[off + i] : 0) << i * 8;
+    w = (w >> 1 & 0x5555555555555555ULL) | (w & 0x5555555555555555ULL) << 1;
+    w = (w >> 2 & 0x3333333333333333ULL) | (w & 0x3333333333333333ULL) << 2;
+    w = (w >> 4 & 0x0f0f0f0f0f0f0f0fULL) | (w & 0x0f0f0f0f0f0f0f0fULL) << 4;
+    return w;
+}
+
+/*
+ * Walks the set bits of a field a word at a time.
+ */
+struct bit_iter {
+    const uint8_t *bits;
+    unsigned long nbits, nbytes, k;
+    uint64_t w;
+};
+
+static inline struct bit_iter
+bit_iter_init(const uint8_t *bits, unsigned long nbits)
+{
+    struct bit_iter it = { bits, nbits, (nbits + 7) / 8, 0, 0 };
+    if (nbits > 0)
+        it.w = load_bits_lsb(bits, it.nbytes, 0);
+    return it;
+}
+
+/*
+ * Returns the index of the next set bit, or nbits when there are no more.
+ */
+static inline unsigned long
+bit_iter_next(struct bit_iter *it)
+{
+    unsigned long i;
+    while (it->w == 0) {
+        if (++it->k * 64 >= it->nbits)
+            return it->nbits;
+        it->w = load_bits_lsb(it->bits, it->nbytes, it->k);
+    }
+    i = it->k * 64 + __builtin_ctzll(it->w);
+    it->w &= it->w - 1;
+    return i < it->nbits ? i : it->nbits;
+}
+
+/*
+ * Loops over the indices of the set bits among the first nbits.
+ */
+#define BIT_FOREACH(i, bits, nbits) \
+    for (struct bit_iter bit_it_ = bit_iter_init((bits), (nbits)); \
+         ((i) = bit_iter_next(&bit_it_)) < (nbits); )
+
+#endif
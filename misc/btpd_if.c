@@ -34,6 +34,13 @@ static const char *tval_names[] = {
     NULL
 };
 
+static const char *dval_names[] = {
+#define DVDEF(val, type, name) name,
+#include "ipcdefs.h"
+#undef DVDEF
+    NULL
+};
+
 const char *
 ipc_strerror(enum ipc_err err)
 {
@@ -50,6 +57,14 @@ tval_name(enum ipc_tval key)
     return tval_names[key];
 }
 
+const char *
+dval_name(enum ipc_dval key)
+{
+    if (key < 0 || key >= IPC_DVALCOUNT)
+        return "unknown key";
+    return dval_names[key];
+}
+
 int
 ipc_open(const char *dir, struct ipc **out)
 {
@@ -262,6 +277,56 @@ btpd_tget_wc(struct ipc *ipc, enum ipc_twc twc, enum ipc_tval *keys,
     return err;
 }
 
+enum ipc_err
+btpd_get(struct ipc *ipc, enum ipc_dval *keys, size_t nkeys, tget_cb_t cb,
+    void *arg)
+{
+    char *ans;
+    uint32_t rlen;
+    enum ipc_err err;
+    const char *t, *v;
+    struct iobuf iob;
+    struct ipc_get_res cbres[IPC_DVALCOUNT];
+
+    if (nkeys == 0)
+        return IPC_COMMERR;
+
+    iob = iobuf_init(1 << 10);
+    iobuf_swrite(&iob, "l3:getd4:keysl");
+    for (int i = 0; i < nkeys; i++)
+        iobuf_print(&iob, "i%de", keys[i]);
+    iobuf_swrite(&iob, "eee");
+
+    if ((err = ipc_buf_req_res(ipc, &iob, &ans, &rlen)) != 0)
+        return err;
+    if ((err = benc_dget_int(ans, "code")) != 0) {
+        free(ans);
+        return err;
+    }
+
+    t = benc_first(benc_dget_lst(ans, "result"));
+    for (int j = 0; j < nkeys && t != NULL; j++) {
+        v = benc_next(t);
+        cbres[keys[j]].type = benc_int(t, NULL);
+        switch (cbres[keys[j]].type) {
+        case IPC_TYPE_ERR:
+        case IPC_TYPE_NUM:
+            cbres[keys[j]].v.num = benc_int(v, NULL);
+            break;
+        case IPC_TYPE_STR:
+        case IPC_TYPE_BIN:
+            cbres[keys[j]].v.str.p = benc_mem(v, &cbres[keys[j]].v.str.l,
+                NULL);
+            break;
+        }
+        t = benc_next(v);
+    }
+    cb(0, IPC_OK, cbres, arg);
+
+    free(ans);
+    return IPC_OK;
+}
+
 enum ipc_err
 btpd_add(struct ipc *ipc, const char *mi, size_t mi_size, const char *content,
     const char *name, const char *label)
@@ -306,6 +371,21 @@ btpd_rate(struct ipc *ipc, unsigned up, unsigned down)
     return ipc_buf_req_code(ipc, &iob);
 }
 
+enum ipc_err
+btpd_trate(struct ipc *ipc, struct ipc_torrent *tp, unsigned up,
+    unsigned down, unsigned peer_up, unsigned peer_down)
+{
+    struct iobuf iob = iobuf_init(64);
+    iobuf_swrite(&iob, "l5:trate");
+    if (tp->by_hash) {
+        iobuf_swrite(&iob, "20:");
+        iobuf_write(&iob, tp->u.hash, 20);
+    } else
+        iobuf_print(&iob, "i%ue", tp->u.num);
+    iobuf_print(&iob, "i%uei%uei%uei%uee", up, down, peer_up, peer_down);
+    return ipc_buf_req_code(ipc, &iob);
+}
+
 enum ipc_err
 btpd_start(struct ipc *ipc, struct ipc_torrent *tp)
 {
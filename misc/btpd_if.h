@@ -23,8 +23,10 @@ enum ipc_tval {
 };
 
 enum ipc_dval {
-    IPC_DVAL_MIN,
-    IPC_DVAL_MAX
+#define DVDEF(val, type, name) IPC_DVAL_##val,
+#include "ipcdefs.h"
+#undef DVDEF
+    IPC_DVALCOUNT
 };
 
 enum ipc_twc {
@@ -73,11 +75,14 @@ int ipc_open(const char *dir, struct ipc **out);
 void ipc_close(struct ipc *ipc);
 
 const char *ipc_strerror(enum ipc_err err);
+const char *dval_name(enum ipc_dval key);
 
 enum ipc_err btpd_add(struct ipc *ipc, const char *mi, size_t mi_size,
     const char *content, const char *name, const char *label);
 enum ipc_err btpd_del(struct ipc *ipc, struct ipc_torrent *tp);
 enum ipc_err btpd_rate(struct ipc *ipc, unsigned up, unsigned down);
+enum ipc_err btpd_trate(struct ipc *ipc, struct ipc_torrent *tp, unsigned up,
+    unsigned down, unsigned peer_up, unsigned peer_down);
 enum ipc_err btpd_start(struct ipc *ipc, struct ipc_torrent *tp);
 enum ipc_err btpd_start_all(struct ipc *ipc);
 enum ipc_err btpd_stop(struct ipc *ipc, struct ipc_torrent *tp);
@@ -43,7 +43,32 @@ TVDEF(TOTUP,    NUM,            "total_up")
 TVDEF(TRERR,    NUM,            "tr_errors")
 TVDEF(TRGOOD,   NUM,            "tr_good")
 TVDEF(LABEL,    STR,            "label")
+TVDEF(CHKDONE,  NUM,            "check_done")
+TVDEF(CHKTOTAL, NUM,            "check_total")
+TVDEF(LIMUP,    NUM,            "limit_up")
+TVDEF(LIMDWN,   NUM,            "limit_down")
+TVDEF(PLIMUP,   NUM,            "peer_limit_up")
+TVDEF(PLIMDWN,  NUM,            "peer_limit_down")
 #ifdef __IPCTV
 #undef __IPCTV
 #undef TVDEF
 #endif
+#ifndef DVDEF
+#define __IPCDV
+#define DVDEF(val, type, name)
+#endif
+DVDEF(POOLALLOC,  NUM,            "pool_allocs")
+DVDEF(POOLREUSE,  NUM,            "pool_reuses")
+DVDEF(POOLFREE,   NUM,            "pool_free")
+DVDEF(CACHEHIT,   NUM,            "cache_hits")
+DVDEF(CACHEMISS,  NUM,            "cache_misses")
+DVDEF(CACHEEVICT, NUM,            "cache_evictions")
+DVDEF(CACHEBYTES, NUM,            "cache_bytes")
+DVDEF(PUPMEAN,    NUM,            "peer_up_mean")
+DVDEF(PUPDEV,     NUM,            "peer_up_dev")
+DVDEF(PDWNMEAN,   NUM,            "peer_down_mean")
+DVDEF(PDWNDEV,    NUM,            "peer_down_dev")
+#ifdef __IPCDV
+#undef __IPCDV
+#undef DVDEF
+#endif
@@ -0,0 +1,454 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha1.h"
+
+/*
+ * SHA1 using the x86 SHA extensions when the CPU has them, and openssl
+ * otherwise. Which one to use is decided by sha1_setup, or the first time
+ * a hash is begun if it hasn't been called.
+ * Messages hashed in lockstep with the sha1_m functions use eight lane
+ * AVX2 code when the CPU has AVX2 but not the SHA extensions, and are
+ * hashed one after the other otherwise.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static int m_impl = -1;
+
+#ifdef SHA1_X86
+
+static int
+shani_supported(void)
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+    if (!(c & bit_SSSE3) || !(c & bit_SSE4_1))
+        return 0;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 29)) != 0;
+}
+
+static int
+avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * Four rounds, starting with round 4 * k. The message words are kept in
+ * W, four to a vector, with those for rounds 4 * k to 4 * k + 3 in
+ * W[k % 4]. E is the vector to add to the first round, computed from the
+ * state before the previous four rounds, which is saved in P.
+ */
+#define ROUNDS4(k) do {                                                 \
+    if ((k) < 4) {                                                      \
+        W[(k)] = _mm_loadu_si128((const __m128i *)(data + 16 * (k)));   \
+        W[(k)] = _mm_shuffle_epi8(W[(k)], bswap);                       \
+    } else                                                              \
+        W[(k) % 4] = _mm_sha1msg2_epu32(_mm_xor_si128(                  \
+            _mm_sha1msg1_epu32(W[(k) % 4], W[((k) + 1) % 4]),           \
+            W[((k) + 2) % 4]), W[((k) + 3) % 4]);                       \
+    if ((k) == 0)                                                       \
+        E = _mm_add_epi32(E, W[0]);                                     \
+    else                                                                \
+        E = _mm_sha1nexte_epu32(P, W[(k) % 4]);                         \
+    P = ABCD;                                                           \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E, (k) / 5);                       \
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+shani_blocks(uint32_t h[5], const uint8_t *data, size_t nblocks)
+{
+    __m128i ABCD, ABCD0, E, E0, P, W[4];
+    const __m128i bswap =
+        _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    E0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    for (; nblocks > 0; nblocks--, data += 64) {
+        ABCD0 = ABCD;
+        E = E0;
+        ROUNDS4(0);  ROUNDS4(1);  ROUNDS4(2);  ROUNDS4(3);
+        ROUNDS4(4);  ROUNDS4(5);  ROUNDS4(6);  ROUNDS4(7);
+        ROUNDS4(8);  ROUNDS4(9);  ROUNDS4(10); ROUNDS4(11);
+        ROUNDS4(12); ROUNDS4(13); ROUNDS4(14); ROUNDS4(15);
+        ROUNDS4(16); ROUNDS4(17); ROUNDS4(18); ROUNDS4(19);
+        E0 = _mm_sha1nexte_epu32(P, E0);
+        ABCD = _mm_add_epi32(ABCD, ABCD0);
+    }
+
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(ABCD, 0x1b));
+    h[4] = _mm_extract_epi32(E0, 3);
+}
+
+/*
+ * Eight lanes, with word j of each lane's state in h[j] and each lane's
+ * message in data. W[t % 16] holds message word t of every lane.
+ */
+#define ROL(x, n) _mm256_or_si256( \
+    _mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+#define ROUND(t, f, k) do {                                             \
+    __m256i tmp;                                                        \
+    if ((t) >= 16)                                                      \
+        W[(t) % 16] = ROL(_mm256_xor_si256(                             \
+            _mm256_xor_si256(W[((t) - 3) % 16], W[((t) - 8) % 16]),     \
+            _mm256_xor_si256(W[((t) - 14) % 16], W[(t) % 16])), 1);     \
+    tmp = _mm256_add_epi32(_mm256_add_epi32(ROL(a, 5), (f)),            \
+        _mm256_add_epi32(_mm256_add_epi32(e, (k)), W[(t) % 16]));       \
+    e = d;                                                              \
+    d = c;                                                              \
+    c = ROL(b, 30);                                                     \
+    b = a;                                                              \
+    a = tmp;                                                            \
+} while (0)
+
+#define ROUNDS5(t, f, k) do {                                           \
+    ROUND((t), f, k);     ROUND((t) + 1, f, k); ROUND((t) + 2, f, k);   \
+    ROUND((t) + 3, f, k); ROUND((t) + 4, f, k);                         \
+} while (0)
+
+#define ROUNDS20(t, f, k) do {                                          \
+    ROUNDS5((t), f, k);      ROUNDS5((t) + 5, f, k);                    \
+    ROUNDS5((t) + 10, f, k); ROUNDS5((t) + 15, f, k);                   \
+} while (0)
+
+#define F0 _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define F1 _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define F2 _mm256_or_si256(_mm256_and_si256(b, c), \
+    _mm256_and_si256(d, _mm256_or_si256(b, c)))
+
+/*
+ * Loads words 8 * half to 8 * half + 7 of the block at off in each lane,
+ * and transposes them so that w[i] holds word 8 * half + i of all lanes.
+ */
+__attribute__((target("avx2")))
+static inline void
+load8(__m256i *w, const uint8_t *const data[SHA1_MAXLANES], size_t off)
+{
+    __m256i r0, r1, r2, r3, r4, r5, r6, r7, t0, t1, t2, t3, t4, t5, t6, t7;
+    const __m256i bswap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    r0 = _mm256_loadu_si256((const __m256i *)(data[0] + off));
+    r1 = _mm256_loadu_si256((const __m256i *)(data[1] + off));
+    r2 = _mm256_loadu_si256((const __m256i *)(data[2] + off));
+    r3 = _mm256_loadu_si256((const __m256i *)(data[3] + off));
+    r4 = _mm256_loadu_si256((const __m256i *)(data[4] + off));
+    r5 = _mm256_loadu_si256((const __m256i *)(data[5] + off));
+    r6 = _mm256_loadu_si256((const __m256i *)(data[6] + off));
+    r7 = _mm256_loadu_si256((const __m256i *)(data[7] + off));
+
+    t0 = _mm256_unpacklo_epi32(r0, r1);
+    t1 = _mm256_unpackhi_epi32(r0, r1);
+    t2 = _mm256_unpacklo_epi32(r2, r3);
+    t3 = _mm256_unpackhi_epi32(r2, r3);
+    t4 = _mm256_unpacklo_epi32(r4, r5);
+    t5 = _mm256_unpackhi_epi32(r4, r5);
+    t6 = _mm256_unpacklo_epi32(r6, r7);
+    t7 = _mm256_unpackhi_epi32(r6, r7);
+
+    r0 = _mm256_unpacklo_epi64(t0, t2);
+    r1 = _mm256_unpackhi_epi64(t0, t2);
+    r2 = _mm256_unpacklo_epi64(t1, t3);
+    r3 = _mm256_unpackhi_epi64(t1, t3);
+    r4 = _mm256_unpacklo_epi64(t4, t6);
+    r5 = _mm256_unpackhi_epi64(t4, t6);
+    r6 = _mm256_unpacklo_epi64(t5, t7);
+    r7 = _mm256_unpackhi_epi64(t5, t7);
+
+    w[0] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r0, r4, 0x20), bswap);
+    w[1] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r1, r5, 0x20), bswap);
+    w[2] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r2, r6, 0x20), bswap);
+    w[3] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r3, r7, 0x20), bswap);
+    w[4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r0, r4, 0x31), bswap);
+    w[5] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r1, r5, 0x31), bswap);
+    w[6] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r2, r6, 0x31), bswap);
+    w[7] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r3, r7, 0x31), bswap);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_blocks(uint32_t h[5][SHA1_MAXLANES],
+    const uint8_t *const data[SHA1_MAXLANES], size_t nblocks)
+{
+    __m256i a, b, c, d, e, a0, b0, c0, d0, e0, W[16];
+    const __m256i k0 = _mm256_set1_epi32(0x5a827999);
+    const __m256i k1 = _mm256_set1_epi32(0x6ed9eba1);
+    const __m256i k2 = _mm256_set1_epi32(0x8f1bbcdc);
+    const __m256i k3 = _mm256_set1_epi32(0xca62c1d6);
+
+    a = _mm256_loadu_si256((const __m256i *)h[0]);
+    b = _mm256_loadu_si256((const __m256i *)h[1]);
+    c = _mm256_loadu_si256((const __m256i *)h[2]);
+    d = _mm256_loadu_si256((const __m256i *)h[3]);
+    e = _mm256_loadu_si256((const __m256i *)h[4]);
+
+    for (size_t off = 0; off < nblocks * 64; off += 64) {
+        load8(W, data, off);
+        load8(W + 8, data, off + 32);
+        a0 = a; b0 = b; c0 = c; d0 = d; e0 = e;
+        ROUNDS20(0, F0, k0);
+        ROUNDS20(20, F1, k1);
+        ROUNDS20(40, F2, k2);
+        ROUNDS20(60, F1, k3);
+        a = _mm256_add_epi32(a, a0);
+        b = _mm256_add_epi32(b, b0);
+        c = _mm256_add_epi32(c, c0);
+        d = _mm256_add_epi32(d, d0);
+        e = _mm256_add_epi32(e, e0);
+    }
+
+    _mm256_storeu_si256((__m256i *)h[0], a);
+    _mm256_storeu_si256((__m256i *)h[1], b);
+    _mm256_storeu_si256((__m256i *)h[2], c);
+    _mm256_storeu_si256((__m256i *)h[3], d);
+    _mm256_storeu_si256((__m256i *)h[4], e);
+}
+
+#endif
+
+/*
+ * Picks the implementation. Programs that hash from several threads must
+ * call it before they start them.
+ */
+void
+sha1_setup(void)
+{
+#ifdef SHA1_X86
+    if (shani_supported())
+        m_impl = SHA1_IMPL_SHANI;
+    else if (avx2_supported())
+        m_impl = SHA1_IMPL_AVX2;
+    else
+#endif
+        m_impl = SHA1_IMPL_OPENSSL;
+}
+
+/*
+ * Overrides the choice of implementation, for benchmarks. Returns
+ * ENOTSUP if the CPU lacks what impl needs.
+ */
+int
+sha1_set_impl(int impl)
+{
+    switch (impl) {
+    case SHA1_IMPL_OPENSSL:
+        break;
+#ifdef SHA1_X86
+    case SHA1_IMPL_SHANI:
+        if (!shani_supported())
+            return ENOTSUP;
+        break;
+    case SHA1_IMPL_AVX2:
+        if (!avx2_supported())
+            return ENOTSUP;
+        break;
+#endif
+    default:
+        return ENOTSUP;
+    }
+    m_impl = impl;
+    return 0;
+}
+
+/*
+ * Returns the number of messages worth hashing in lockstep.
+ */
+int
+sha1_lanes(void)
+{
+    if (m_impl < 0)
+        sha1_setup();
+    return m_impl == SHA1_IMPL_AVX2 ? SHA1_MAXLANES : 1;
+}
+
+void
+sha1_init(struct sha1_ctx *ctx)
+{
+    if (m_impl < 0)
+        sha1_setup();
+#ifdef SHA1_X86
+    if ((ctx->shani = m_impl == SHA1_IMPL_SHANI)) {
+        ctx->u.ni.h[0] = 0x67452301;
+        ctx->u.ni.h[1] = 0xefcdab89;
+        ctx->u.ni.h[2] = 0x98badcfe;
+        ctx->u.ni.h[3] = 0x10325476;
+        ctx->u.ni.h[4] = 0xc3d2e1f0;
+        ctx->u.ni.len = 0;
+        return;
+    }
+#else
+    ctx->shani = 0;
+#endif
+    SHA1_Init(&ctx->u.ossl);
+}
+
+void
+sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+#ifdef SHA1_X86
+    if (ctx->shani) {
+        const uint8_t *p = data;
+        size_t n, off = ctx->u.ni.len % 64;
+        ctx->u.ni.len += len;
+        if (off > 0) {
+            n = len < 64 - off ? len : 64 - off;
+            memcpy(ctx->u.ni.buf + off, p, n);
+            p += n;
+            len -= n;
+            if (off + n < 64)
+                return;
+            shani_blocks(ctx->u.ni.h, ctx->u.ni.buf, 1);
+        }
+        if (len >= 64) {
+            shani_blocks(ctx->u.ni.h, p, len / 64);
+            p += len - len % 64;
+            len %= 64;
+        }
+        memcpy(ctx->u.ni.buf, p, len);
+        return;
+    }
+#endif
+    SHA1_Update(&ctx->u.ossl, data, len);
+}
+
+void
+sha1_final(struct sha1_ctx *ctx, uint8_t *hash)
+{
+#ifdef SHA1_X86
+    if (ctx->shani) {
+        uint8_t pad[72];
+        uint64_t bits = ctx->u.ni.len * 8;
+        size_t n = 64 - ctx->u.ni.len % 64;
+        if (n < 9)
+            n += 64;
+        memset(pad, 0, n);
+        pad[0] = 0x80;
+        for (int i = 0; i < 8; i++)
+            pad[n - 1 - i] = bits >> (8 * i);
+        sha1_update(ctx, pad, n);
+        for (int i = 0; i < 5; i++) {
+            hash[4 * i] = ctx->u.ni.h[i] >> 24;
+            hash[4 * i + 1] = ctx->u.ni.h[i] >> 16;
+            hash[4 * i + 2] = ctx->u.ni.h[i] >> 8;
+            hash[4 * i + 3] = ctx->u.ni.h[i];
+        }
+        return;
+    }
+#endif
+    SHA1_Final(hash, &ctx->u.ossl);
+}
+
+void
+sha1(const void *data, size_t len, uint8_t *hash)
+{
+    struct sha1_ctx ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, len);
+    sha1_final(&ctx, hash);
+}
+
+void
+sha1_minit(struct sha1_mctx *m, int n)
+{
+    m->n = n;
+    m->len = 0;
+    if ((m->avx2 = sha1_lanes() > 1)) {
+        static const uint32_t iv[5] =
+            { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+        for (int j = 0; j < 5; j++)
+            for (int i = 0; i < SHA1_MAXLANES; i++)
+                m->h[j][i] = iv[j];
+    } else
+        for (int i = 0; i < n; i++)
+            sha1_init(&m->lane[i]);
+}
+
+/*
+ * Adds len bytes from each of data[0] to data[n - 1].
+ */
+void
+sha1_mupdate(struct sha1_mctx *m, const uint8_t *const data[], size_t len)
+{
+#ifdef SHA1_X86
+    if (m->avx2) {
+        const uint8_t *p[SHA1_MAXLANES], *bp[SHA1_MAXLANES];
+        size_t n, off = m->len % 64;
+        m->len += len;
+        // Lanes past n hash a copy of the first message.
+        for (int i = 0; i < SHA1_MAXLANES; i++) {
+            p[i] = data[i < m->n ? i : 0];
+            bp[i] = m->buf[i < m->n ? i : 0];
+        }
+        if (off > 0) {
+            n = len < 64 - off ? len : 64 - off;
+            for (int i = 0; i < m->n; i++) {
+                memcpy(m->buf[i] + off, p[i], n);
+                p[i] += n;
+            }
+            for (int i = m->n; i < SHA1_MAXLANES; i++)
+                p[i] += n;
+            len -= n;
+            if (off + n < 64)
+                return;
+            avx2_blocks(m->h, bp, 1);
+        }
+        if (len >= 64) {
+            avx2_blocks(m->h, p, len / 64);
+            for (int i = 0; i < SHA1_MAXLANES; i++)
+                p[i] += len - len % 64;
+            len %= 64;
+        }
+        for (int i = 0; i < m->n; i++)
+            memcpy(m->buf[i], p[i], len);
+        return;
+    }
+#endif
+    for (int i = 0; i < m->n; i++)
+        sha1_update(&m->lane[i], data[i], len);
+}
+
+void
+sha1_mfinal(struct sha1_mctx *m, uint8_t *const hash[])
+{
+    if (m->avx2) {
+        uint8_t pad[72];
+        const uint8_t *pads[SHA1_MAXLANES];
+        uint64_t bits = m->len * 8;
+        size_t n = 64 - m->len % 64;
+        if (n < 9)
+            n += 64;
+        memset(pad, 0, n);
+        pad[0] = 0x80;
+        for (int i = 0; i < 8; i++)
+            pad[n - 1 - i] = bits >> (8 * i);
+        for (int i = 0; i < m->n; i++)
+            pads[i] = pad;
+        sha1_mupdate(m, pads, n);
+        for (int i = 0; i < m->n; i++)
+            for (int j = 0; j < 5; j++) {
+                hash[i][4 * j] = m->h[j][i] >> 24;
+                hash[i][4 * j + 1] = m->h[j][i] >> 16;
+                hash[i][4 * j + 2] = m->h[j][i] >> 8;
+                hash[i][4 * j + 3] = m->h[j][i];
+            }
+        return;
+    }
+    for (int i = 0; i < m->n; i++)
+        sha1_final(&m->lane[i], hash[i]);
+}
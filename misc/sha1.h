@@ -0,0 +1,50 @@
+#ifndef BTPD_SHA1_H
+#define BTPD_SHA1_H
+
+#include <openssl/sha.h>
+
+#define SHA1_IMPL_OPENSSL 0
+#define SHA1_IMPL_SHANI   1
+#define SHA1_IMPL_AVX2    2
+
+#define SHA1_MAXLANES 8
+
+struct sha1_ctx {
+    int shani;
+    union {
+        SHA_CTX ossl;
+        struct {
+            uint32_t h[5];
+            uint64_t len;
+            uint8_t buf[64];
+        } ni;
+    } u;
+};
+
+/*
+ * Hashes up to SHA1_MAXLANES messages of the same length in lockstep.
+ */
+struct sha1_mctx {
+    int n;
+    int avx2;
+    uint64_t len;
+    uint32_t h[5][SHA1_MAXLANES];
+    uint8_t buf[SHA1_MAXLANES][64];
+    struct sha1_ctx lane[SHA1_MAXLANES];
+};
+
+void sha1_setup(void);
+int sha1_set_impl(int impl);
+int sha1_lanes(void);
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_ctx *ctx, uint8_t *hash);
+void sha1(const void *data, size_t len, uint8_t *hash);
+
+void sha1_minit(struct sha1_mctx *m, int n);
+void sha1_mupdate(struct sha1_mctx *m, const uint8_t *const data[],
+    size_t len);
+void sha1_mfinal(struct sha1_mctx *m, uint8_t *const hash[]);
+
+#endif
@@ -5,9 +5,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#include <openssl/sha.h>
-
 #include "metainfo.h"
+#include "sha1.h"
 #include "subr.h"
 #include "stream.h"
 
@@ -54,14 +53,11 @@ bts_seek(struct bt_stream *bts, off_t off)
     for (i = 0; off >= bts->files[i].length; i++)
         off -= bts->files[i].length;
 
-    if (i != bts->index) {
-        if (bts->fd != -1) {
-            if (close(bts->fd) == -1)
-                return errno;
-            bts->fd = -1;
-        }
-    } else if (bts->fd != -1)
-        lseek(bts->fd, off, SEEK_SET);
+    if (i != bts->index && bts->fd != -1) {
+        if (close(bts->fd) == -1)
+            return errno;
+        bts->fd = -1;
+    }
 
     bts->index = i;
     bts->f_off = off;
@@ -89,12 +85,10 @@ bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len)
                 &bts->fd, bts->fd_arg);
             if (err != 0)
                 return err;
-            if (bts->f_off != 0)
-                lseek(bts->fd, bts->f_off, SEEK_SET);
         }
 
         wantread = min(len - boff, bts->files[bts->index].length - bts->f_off);
-        didread = read(bts->fd, buf + boff, wantread);
+        didread = pread(bts->fd, buf + boff, wantread, bts->f_off);
         if (didread == -1)
             return errno;
 
@@ -133,12 +127,10 @@ bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len)
                 &bts->fd, bts->fd_arg);
             if (err != 0)
                 return err;
-            if (bts->f_off != 0)
-                lseek(bts->fd, bts->f_off, SEEK_SET);
         }
 
         wantwrite = min(len - boff, bts->files[bts->index].length - bts->f_off);
-        didwrite = write(bts->fd, buf + boff, wantwrite);
+        didwrite = pwrite(bts->fd, buf + boff, wantwrite, bts->f_off);
         if (didwrite == -1)
             return errno;
 
@@ -156,26 +148,110 @@ bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len)
     return 0;
 }
 
+/*
+ * Opens the file holding the stream offset off, if needed, and gives its
+ * descriptor, the offset within it and the number of bytes from there to
+ * its end. The stream keeps the descriptor.
+ */
+int
+bts_fdoff(struct bt_stream *bts, off_t off, int *fd, off_t *foff,
+    size_t *flen)
+{
+    int err;
+
+    assert(off < bts->totlen);
+    if ((err = bts_seek(bts, off)) != 0)
+        return err;
+
+    if (bts->fd == -1) {
+        while (bts->files[bts->index].length == 0)
+            bts->index++;
+        err = bts->fd_cb(bts->files[bts->index].path, &bts->fd, bts->fd_arg);
+        if (err != 0)
+            return err;
+    }
+    *fd = bts->fd;
+    *foff = bts->f_off;
+    *flen = bts->files[bts->index].length - bts->f_off;
+    return 0;
+}
+
+/*
+ * Tells the system that len bytes of the stream, starting at off, will
+ * be read soon.
+ */
+int
+bts_willneed(struct bt_stream *bts, off_t off, off_t len)
+{
+    int err, fd;
+    off_t foff;
+    size_t flen;
+
+    while (len > 0) {
+        if ((err = bts_fdoff(bts, off, &fd, &foff, &flen)) != 0)
+            return err;
+        flen = min(flen, len);
+        posix_fadvise(fd, foff, flen, POSIX_FADV_WILLNEED);
+        off += flen;
+        len -= flen;
+    }
+    return 0;
+}
+
 #define SHAFILEBUF (1 << 15)
 
 int
 bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash)
 {
-    SHA_CTX ctx;
+    struct sha1_ctx ctx;
     char buf[SHAFILEBUF];
     size_t wantread;
     int err = 0;
 
-    SHA1_Init(&ctx);
+    sha1_init(&ctx);
     while (length > 0) {
         wantread = min(length, SHAFILEBUF);
         if ((err = bts_get(bts, start, buf, wantread)) != 0)
             break;
         length -= wantread;
         start += wantread;
-        SHA1_Update(&ctx, buf, wantread);
+        sha1_update(&ctx, buf, wantread);
+    }
+    sha1_final(&ctx, hash);
+    return err;
+}
+
+/*
+ * Hashes n pieces of the same length in lockstep, a buffer of each at a
+ * time, which lets several of them share the AVX2 lanes.
+ */
+int
+bts_sha_multi(struct bt_stream *bts, const off_t start[], int n,
+    off_t length, uint8_t *const hash[])
+{
+    struct sha1_mctx ctx;
+    const uint8_t *bufs[SHA1_MAXLANES];
+    uint8_t *buf;
+    size_t wantread;
+    off_t off = 0;
+    int err = 0;
+
+    assert(n > 0 && n <= SHA1_MAXLANES);
+    if ((buf = malloc(n * SHAFILEBUF)) == NULL)
+        return ENOMEM;
+    for (int i = 0; i < n; i++)
+        bufs[i] = buf + i * SHAFILEBUF;
+    sha1_minit(&ctx, n);
+    while (off < length && err == 0) {
+        wantread = min(length - off, SHAFILEBUF);
+        for (int i = 0; i < n && err == 0; i++)
+            err = bts_get(bts, start[i] + off, buf + i * SHAFILEBUF,
+                wantread);
+        off += wantread;
+        sha1_mupdate(&ctx, bufs, wantread);
     }
-    SHA1_Final(hash, &ctx);
+    sha1_mfinal(&ctx, hash);
+    free(buf);
     return err;
 }
 
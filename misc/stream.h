@@ -22,6 +22,11 @@ int bts_close(struct bt_stream *bts);
 int bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len);
 int bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len);
 int bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash);
+int bts_sha_multi(struct bt_stream *bts, const off_t start[], int n,
+    off_t length, uint8_t *const hash[]);
+int bts_willneed(struct bt_stream *bts, off_t off, off_t len);
+int bts_fdoff(struct bt_stream *bts, off_t off, int *fd, off_t *foff,
+    size_t *flen);
 
 const char *bts_filename(struct bt_stream *bts);
 
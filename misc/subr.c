@@ -31,6 +31,21 @@ memfind(const void *sub, size_t sublen, const void *mem, size_t memlen)
     return NULL;
 }
 
+void
+enc_be16(void *buf, uint16_t num)
+{
+    uint8_t *p = buf;
+    *p = (num >> 8) & 0xff;
+    *(p + 1) = num & 0xff;
+}
+
+uint16_t
+dec_be16(const void *buf)
+{
+    const uint8_t *p = buf;
+    return (uint16_t)*p << 8 | *(p + 1);
+}
+
 void
 enc_be32(void *buf, uint32_t num)
 {
@@ -73,24 +88,6 @@ dec_be64(const void *buf)
         | (uint64_t)*(p + 6) << 8 | (uint64_t)*(p + 7);
 }
 
-void
-set_bit(uint8_t *bits, unsigned long index)
-{
-    bits[index / 8] |= (1 << (7 - index % 8));
-}
-
-void
-clear_bit(uint8_t *bits, unsigned long index)
-{
-    bits[index / 8] &= ~(1 << (7 - index % 8));
-}
-
-int
-has_bit(const uint8_t *bits, unsigned long index)
-{
-    return bits[index / 8] & (1 << (7 - index % 8));
-}
-
 uint8_t
 hex2i(char c)
 {
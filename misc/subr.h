@@ -12,8 +12,10 @@
 
 void *memfind(const void *sub, size_t sublen, const void *mem, size_t memlen);
 
+uint16_t dec_be16(const void *buf);
 uint32_t dec_be32(const void *buf);
 uint64_t dec_be64(const void *buf);
+void enc_be16(void *buf, uint16_t num);
 void enc_be32(void *buf, uint32_t num);
 void enc_be64(void *buf, uint64_t num);
 
@@ -30,10 +32,6 @@ __attribute__((format (printf, 3, 4)))
 int vfopen(FILE **ret, const char *mode, const char *fmt, ...);
 int vfsync(const char *fmt, ...);
 
-void set_bit(uint8_t *bits, unsigned long index);
-int has_bit(const uint8_t *bits, unsigned long index);
-void clear_bit(uint8_t *bits, unsigned long index);
-
 char *bin2hex(const uint8_t *bin, char *hex, size_t bsize);
 uint8_t *hex2bin(const char *hex, uint8_t *bin, size_t bsize);
 uint8_t hex2i(char c);
@@ -0,0 +1,1148 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "queue.h"
+#include "subr.h"
+#include "utp.h"
+
+/*
+ * Every packet starts with a 20 byte header: the type and version, the
+ * first extension, the connection id, the time it was sent and the delay
+ * the sender last saw in the other direction, both in microseconds, the
+ * receive window and the sequence and ack numbers. The connection id is
+ * the one the receiver knows the connection by, the initiator's plus one
+ * for packets it receives. A SYN carries the initiator's own.
+ *
+ * Sequence numbers count packets. A connection keeps the packets it has
+ * sent and not had acked, and those received out of order, in rings
+ * indexed by sequence number. What's written is cut into packets at
+ * once, so seq_nr is the number of the next packet to be made, seq_next
+ * that of the next to be sent and seq_una that of the oldest not acked.
+ *
+ * The congestion window follows LEDBAT. The one way delay of each acked
+ * packet, less the lowest seen in the last minutes, is the queuing delay
+ * the connection causes. The window grows in proportion to how far that
+ * is below the target and shrinks as far as it's above, and is halved at
+ * most once per round trip when packets are lost. Until the delay first
+ * gets near the target the window doubles every round trip.
+ */
+#define UTP_VERSION 1
+#define UTP_HDRLEN 20
+#define UTP_MSS 1400
+#define UTP_PKTSIZE (UTP_HDRLEN + UTP_MSS)
+#define UTP_RING 512
+#define UTP_SNDPKTS (UTP_RING - 32)     /* Room is left for a FIN */
+#define UTP_RCVBUF (UTP_SNDPKTS * UTP_MSS)
+#define UTP_SOCKBUF (1 << 20)
+#define UTP_NBUCKETS 256
+#define UTP_RECVMAX 256                 /* Datagrams read per wakeup */
+
+#define UTP_TARGET 100000               /* Queuing delay aimed for, us */
+#define UTP_GAIN 3000                   /* Window growth per round trip */
+#define UTP_MINWND UTP_PKTSIZE
+#define UTP_MAXWND (UTP_SNDPKTS * UTP_PKTSIZE)
+#define UTP_BASEHIST 13                 /* Minutes of delay minimums */
+#define UTP_MINRTO 500
+#define UTP_MAXRTO 60000
+#define UTP_RETRIES 8
+#define UTP_SYNRETRIES 2
+#define UTP_FWDIDLE 300                 /* Seconds a moved connection is */
+                                        /* forwarded without traffic */
+
+#define PKT_DATA(pkt) ((pkt)->buf + UTP_HDRLEN)
+
+enum { ST_DATA, ST_FIN, ST_STATE, ST_RESET, ST_SYN };
+
+enum utp_state { UTP_SYN_SENT, UTP_CONNECTED, UTP_DEAD };
+
+struct utp_pkt {
+    BTPDQ_ENTRY(utp_pkt) entry;
+    uint64_t t_sent;
+    uint16_t len;           /* Of the payload */
+    uint8_t type;
+    uint8_t nsent;
+    uint8_t counted;        /* Its size is in inflight */
+    uint8_t sacked;
+    uint8_t buf[];
+};
+
+BTPDQ_HEAD(utp_pkt_tq, utp_pkt);
+BTPDQ_HEAD(utp_tq, utp);
+BTPDQ_HEAD(utp_fwd_tq, utp_fwd);
+
+struct utp {
+    struct utp_sock *s;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    enum utp_state state;
+    int err;
+    int closed;
+    uint16_t id_recv, id_send;
+
+    evloop_cb_t cb;
+    void *arg;
+    uint16_t flags;
+    int queued;
+    int need_ack;
+
+    uint16_t seq_nr, seq_next, seq_una;
+    struct utp_pkt *out[UTP_RING];
+    size_t inflight;
+    size_t cwnd;
+    size_t peer_wnd;
+    int slow_start;
+    int cwnd_full;          /* Sending stopped at the window */
+    uint64_t t_lost;
+    uint32_t base_hist[UTP_BASEHIST];
+    int base_idx;
+    uint64_t t_base;
+    long rtt, rtt_var, rto;
+    int nretries;
+    int ndup;
+    struct timeout timer;
+
+    uint16_t ack_nr;
+    uint16_t fin_seq;
+    int got_fin;
+    uint32_t reply_micro;
+    struct utp_pkt *in[UTP_RING];
+    struct utp_pkt_tq rcvq;
+    size_t rcv_off;
+    size_t rcv_bytes;       /* Queued or out of order */
+    size_t adv_wnd;
+
+    BTPDQ_ENTRY(utp) entry;
+    BTPDQ_ENTRY(utp) rd_entry;
+    BTPDQ_ENTRY(utp) ack_entry;
+};
+
+/*
+ * Left in place of a connection moved to another sock, to send on what
+ * comes for it.
+ */
+struct utp_fwd {
+    struct utp_sock *s;
+    struct sockaddr_storage addr;
+    uint16_t id_recv, id_send;
+    utp_fwd_cb_t cb;
+    void *arg;
+    struct timeout timer;
+    BTPDQ_ENTRY(utp_fwd) entry;
+};
+
+struct utp_sock {
+    int sd;
+    int fed;                /* Given its datagrams by utp_sock_input */
+    struct fdev ev;
+    utp_accept_cb_t accept_cb;
+    void *arg;
+    struct utp_tq conns[UTP_NBUCKETS];
+    struct utp_tq readyq;
+    struct utp_tq ackq;
+    struct utp_fwd_tq fwds[UTP_NBUCKETS];
+    struct timeout ready_timer;
+    struct timeout ack_timer;
+    uint8_t buf[1 << 16];
+};
+
+static int
+seq_diff(uint16_t a, uint16_t b)
+{
+    return (int16_t)(a - b);
+}
+
+static uint64_t
+utp_now(void)
+{
+    struct timespec ts;
+    evtimer_gettime(&ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+utp_timer_set(struct utp *u, long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    evtimer_add(&u->timer, &ts);
+}
+
+static int
+utp_addr_eq(const struct sockaddr_storage *a, const struct sockaddr *b)
+{
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+    if (a->ss_family != b->sa_family)
+        return 0;
+    switch (b->sa_family) {
+    case AF_INET:
+        return a4->sin_port == b4->sin_port
+            && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    case AF_INET6:
+        return a6->sin6_port == b6->sin6_port
+            && bcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+    default:
+        return 0;
+    }
+}
+
+static struct utp *
+utp_find(struct utp_sock *s, const struct sockaddr *sa, uint16_t id)
+{
+    struct utp *u;
+    BTPDQ_FOREACH(u, &s->conns[id % UTP_NBUCKETS], entry)
+        if (u->id_recv == id && utp_addr_eq(&u->addr, sa))
+            return u;
+    return NULL;
+}
+
+/*
+ * A reset may carry either id of the connection, depending on who sent
+ * it, as it's also sent for packets of connections the sender has lost.
+ */
+static struct utp *
+utp_find_reset(struct utp_sock *s, const struct sockaddr *sa, uint16_t id)
+{
+    struct utp *u;
+    if ((u = utp_find(s, sa, id)) != NULL)
+        return u;
+    if ((u = utp_find(s, sa, id - 1)) != NULL && u->id_send == id)
+        return u;
+    if ((u = utp_find(s, sa, id + 1)) != NULL && u->id_send == id)
+        return u;
+    return NULL;
+}
+
+/*
+ * Finds where to forward a packet for a moved connection. The ids are
+ * matched as by utp_find_reset for resets and utp_on_syn for SYNs.
+ */
+static struct utp_fwd *
+utp_fwd_find(struct utp_sock *s, const struct sockaddr *sa, int type,
+    uint16_t id)
+{
+    struct utp_fwd *f;
+    uint16_t ids[3] = { type == ST_SYN ? id + 1 : id, id - 1, id + 1 };
+    for (int i = 0; i < (type == ST_RESET ? 3 : 1); i++)
+        BTPDQ_FOREACH(f, &s->fwds[ids[i] % UTP_NBUCKETS], entry)
+            if (f->id_recv == ids[i] && (i == 0 || f->id_send == id)
+                && utp_addr_eq(&f->addr, sa))
+                return f;
+    return NULL;
+}
+
+static size_t
+utp_wnd(struct utp *u)
+{
+    return u->rcv_bytes >= UTP_RCVBUF ? 0 : UTP_RCVBUF - u->rcv_bytes;
+}
+
+static int
+utp_eof(struct utp *u)
+{
+    return u->got_fin && u->ack_nr == u->fin_seq;
+}
+
+static int
+utp_readable(struct utp *u)
+{
+    return u->err != 0 || !BTPDQ_EMPTY(&u->rcvq) || utp_eof(u);
+}
+
+static int
+utp_writable(struct utp *u)
+{
+    return u->err != 0 || (u->state == UTP_CONNECTED
+        && (uint16_t)(u->seq_nr - u->seq_una) < UTP_SNDPKTS);
+}
+
+/*
+ * Queues the connection to have its callback called, if it's ready for
+ * something it waits for.
+ */
+static void
+utp_notify(struct utp *u)
+{
+    struct utp_sock *s = u->s;
+    if (u->queued || u->cb == NULL)
+        return;
+    if (!((u->flags & EV_READ) && utp_readable(u))
+        && !((u->flags & EV_WRITE) && utp_writable(u)))
+        return;
+    if (BTPDQ_EMPTY(&s->readyq))
+        evtimer_add(&s->ready_timer, (& (struct timespec) { 0, 0 }));
+    BTPDQ_INSERT_TAIL(&s->readyq, u, rd_entry);
+    u->queued = 1;
+}
+
+/*
+ * Gives the connections that were ready a turn each, in order. Those that
+ * still are when they've had it wait for the next round.
+ */
+static void
+utp_ready_cb(int fd, short type, void *arg)
+{
+    struct utp_sock *s = arg;
+    struct utp *u;
+    unsigned n = 0;
+    BTPDQ_FOREACH(u, &s->readyq, rd_entry)
+        n++;
+    for (; n > 0 && (u = BTPDQ_FIRST(&s->readyq)) != NULL; n--) {
+        BTPDQ_REMOVE(&s->readyq, u, rd_entry);
+        u->queued = 0;
+        if ((u->flags & EV_READ) && utp_readable(u))
+            u->cb(-1, EV_READ, u->arg);
+        if ((u->flags & EV_WRITE) && utp_writable(u))
+            u->cb(-1, EV_WRITE, u->arg);
+        utp_notify(u);
+    }
+    if (!BTPDQ_EMPTY(&s->readyq))
+        evtimer_add(&s->ready_timer, (& (struct timespec) { 0, 0 }));
+}
+
+static void
+utp_sendto(struct utp *u, const uint8_t *buf, size_t len)
+{
+    // A datagram the socket can't take is lost like any other.
+    sendto(u->s->sd, buf, len, 0, (struct sockaddr *)&u->addr, u->addrlen);
+}
+
+static void
+utp_header(struct utp *u, uint8_t *b, int type, uint16_t seq, uint64_t now)
+{
+    u->adv_wnd = utp_wnd(u);
+    b[0] = type << 4 | UTP_VERSION;
+    b[1] = 0;
+    enc_be16(b + 2, type == ST_SYN ? u->id_recv : u->id_send);
+    enc_be32(b + 4, now);
+    enc_be32(b + 8, u->reply_micro);
+    enc_be32(b + 12, u->adv_wnd);
+    enc_be16(b + 16, seq);
+    enc_be16(b + 18, u->ack_nr);
+}
+
+static void
+utp_want_ack(struct utp *u)
+{
+    if (!u->need_ack) {
+        u->need_ack = 1;
+        BTPDQ_INSERT_TAIL(&u->s->ackq, u, ack_entry);
+    }
+}
+
+static void
+utp_acked(struct utp *u)
+{
+    if (u->need_ack) {
+        u->need_ack = 0;
+        BTPDQ_REMOVE(&u->s->ackq, u, ack_entry);
+    }
+}
+
+/*
+ * Sends an ack, with a selective ack of the packets received out of
+ * order within the 32 after the first missing one.
+ */
+static void
+utp_send_state(struct utp *u)
+{
+    uint8_t b[UTP_HDRLEN + 6];
+    size_t len = UTP_HDRLEN;
+    utp_header(u, b, ST_STATE, u->seq_nr, utp_now());
+    for (int i = 0; i < 32; i++) {
+        if (u->in[(uint16_t)(u->ack_nr + 2 + i) % UTP_RING] == NULL)
+            continue;
+        if (len == UTP_HDRLEN) {
+            b[1] = 1;
+            b[len] = 0;
+            b[len + 1] = 4;
+            bzero(b + len + 2, 4);
+            len += 6;
+        }
+        b[UTP_HDRLEN + 2 + i / 8] |= 1 << (i % 8);
+    }
+    utp_acked(u);
+    utp_sendto(u, b, len);
+}
+
+static void
+utp_send_pkt(struct utp *u, struct utp_pkt *pkt, uint16_t seq, uint64_t now)
+{
+    utp_header(u, pkt->buf, pkt->type, seq, now);
+    pkt->t_sent = now;
+    pkt->nsent++;
+    utp_acked(u);
+    utp_sendto(u, pkt->buf, UTP_HDRLEN + pkt->len);
+}
+
+static void
+utp_send_reset(struct utp_sock *s, const struct sockaddr *sa,
+    socklen_t salen, uint16_t id, uint16_t ack)
+{
+    uint8_t b[UTP_HDRLEN];
+    bzero(b, sizeof(b));
+    b[0] = ST_RESET << 4 | UTP_VERSION;
+    enc_be16(b + 2, id);
+    enc_be32(b + 4, utp_now());
+    enc_be16(b + 16, random());
+    enc_be16(b + 18, ack);
+    sendto(s->sd, b, sizeof(b), 0, sa, salen);
+}
+
+static struct utp_pkt *
+utp_queue(struct utp *u, int type)
+{
+    struct utp_pkt *pkt = malloc(sizeof(*pkt) + UTP_PKTSIZE);
+    if (pkt == NULL)
+        return NULL;
+    bzero(pkt, sizeof(*pkt));
+    pkt->type = type;
+    u->out[u->seq_nr % UTP_RING] = pkt;
+    u->seq_nr++;
+    return pkt;
+}
+
+/*
+ * Sends the packets not yet sent, as far as the window allows. Packets
+ * that were selectively acked after a timeout aren't sent again. At
+ * least one packet is sent if none are in flight, so a closed receive
+ * window is probed.
+ */
+static void
+utp_flush(struct utp *u)
+{
+    uint64_t now = utp_now();
+    int was_idle = u->seq_una == u->seq_next;
+    size_t wnd = min(u->cwnd, u->peer_wnd);
+    u->cwnd_full = 0;
+    for (; u->seq_next != u->seq_nr; u->seq_next++) {
+        struct utp_pkt *pkt = u->out[u->seq_next % UTP_RING];
+        size_t size = UTP_HDRLEN + pkt->len;
+        if (pkt->sacked)
+            continue;
+        if (u->inflight > 0 && u->inflight + size > wnd) {
+            u->cwnd_full = 1;
+            break;
+        }
+        utp_send_pkt(u, pkt, u->seq_next, now);
+        pkt->counted = 1;
+        u->inflight += size;
+    }
+    if (was_idle && u->seq_una != u->seq_next)
+        utp_timer_set(u, u->rto);
+}
+
+static struct utp *
+utp_new(struct utp_sock *s, const struct sockaddr *sa, socklen_t salen,
+    uint16_t id_recv, uint16_t id_send);
+static void utp_free(struct utp *u);
+static void utp_timer_cb(int fd, short type, void *arg);
+
+/*
+ * The connection has failed. It's freed at once if the user is done with
+ * it, so the caller mustn't use it after this.
+ */
+static void
+utp_fail(struct utp *u, int err)
+{
+    if (u->closed) {
+        utp_free(u);
+        return;
+    }
+    u->err = err;
+    evtimer_del(&u->timer);
+    utp_notify(u);
+}
+
+static void
+utp_rtt(struct utp *u, uint64_t us)
+{
+    long ms = us / 1000;
+    if (u->rtt < 0) {
+        u->rtt = ms;
+        u->rtt_var = ms / 2;
+    } else {
+        u->rtt_var += (labs(u->rtt - ms) - u->rtt_var) / 4;
+        u->rtt += (ms - u->rtt) / 8;
+    }
+    u->rto = max(u->rtt + 4 * u->rtt_var, UTP_MINRTO);
+}
+
+static void
+utp_lost(struct utp *u, uint64_t now)
+{
+    if (now - u->t_lost < (uint64_t)max(u->rtt, 0) * 1000)
+        return;
+    u->t_lost = now;
+    u->slow_start = 0;
+    u->cwnd = max(u->cwnd / 2, UTP_MINWND);
+}
+
+/*
+ * Adjusts the window for acked bytes, given the one way delay the peer
+ * saw. The delay includes the difference between the clocks, which the
+ * base delay takes out again.
+ */
+static void
+utp_ledbat(struct utp *u, size_t acked, uint32_t delay, uint64_t now)
+{
+    uint32_t base;
+    int64_t qdelay, gain;
+
+    if (u->t_base == 0) {
+        for (int i = 0; i < UTP_BASEHIST; i++)
+            u->base_hist[i] = delay;
+        u->t_base = now;
+    } else if (now - u->t_base >= 60000000) {
+        u->base_idx = (u->base_idx + 1) % UTP_BASEHIST;
+        u->base_hist[u->base_idx] = delay;
+        u->t_base = now;
+    } else if ((int32_t)(delay - u->base_hist[u->base_idx]) < 0)
+        u->base_hist[u->base_idx] = delay;
+    base = u->base_hist[0];
+    for (int i = 1; i < UTP_BASEHIST; i++)
+        if ((int32_t)(u->base_hist[i] - base) < 0)
+            base = u->base_hist[i];
+    qdelay = (int32_t)(delay - base);
+
+    if (u->slow_start && qdelay > UTP_TARGET / 2)
+        u->slow_start = 0;
+    if (u->slow_start)
+        gain = u->cwnd_full ? acked : 0;
+    else if (qdelay > UTP_TARGET) {
+        // Shrink by the share of the window that's over the target, at
+        // most half of it per round trip, as LEDBAT++ does. Backing off by
+        // UTP_GAIN alone takes minutes with a large window.
+        gain = -min((int64_t)acked * (qdelay - UTP_TARGET) / UTP_TARGET,
+            (int64_t)acked / 2);
+    } else {
+        gain = (int64_t)UTP_GAIN * (UTP_TARGET - qdelay) / UTP_TARGET
+            * (int64_t)acked / (int64_t)u->cwnd;
+        // Only grow a window that's used.
+        if (gain > 0 && !u->cwnd_full)
+            gain = 0;
+    }
+    u->cwnd = min(max((int64_t)u->cwnd + gain, UTP_MINWND), UTP_MAXWND);
+}
+
+/*
+ * Takes the packets acked by the ack number and the selective ack off
+ * the ring. The oldest packet in flight is sent again at once if three
+ * acks in a row haven't acked it, or three later packets have been.
+ */
+static void
+utp_on_ack(struct utp *u, uint16_t ack, const uint8_t *sack,
+    size_t sacklen, uint32_t delay, int pure, uint64_t now)
+{
+    struct utp_pkt *pkt;
+    size_t acked = 0;
+    int64_t rtt = -1;
+    int nsacked = 0;
+
+    if (seq_diff(ack, u->seq_una) >= 0 && seq_diff(ack, u->seq_next) < 0) {
+        for (; u->seq_una != (uint16_t)(ack + 1); u->seq_una++) {
+            pkt = u->out[u->seq_una % UTP_RING];
+            u->out[u->seq_una % UTP_RING] = NULL;
+            if (pkt->counted)
+                u->inflight -= UTP_HDRLEN + pkt->len;
+            if (!pkt->sacked) {
+                acked += UTP_HDRLEN + pkt->len;
+                if (pkt->nsent == 1)
+                    rtt = now - pkt->t_sent;
+            }
+            free(pkt);
+        }
+        u->nretries = 0;
+        u->ndup = 0;
+        if (u->seq_una != u->seq_next)
+            utp_timer_set(u, u->rto);
+        else
+            evtimer_del(&u->timer);
+    } else if (pure && ack == (uint16_t)(u->seq_una - 1)
+        && u->seq_una != u->seq_next)
+        u->ndup++;
+
+    for (size_t i = 0; i < sacklen * 8; i++) {
+        uint16_t seq = ack + 2 + i;
+        if (!(sack[i / 8] & (1 << (i % 8)))
+            || seq_diff(seq, u->seq_una) < 0
+            || seq_diff(seq, u->seq_next) >= 0)
+            continue;
+        pkt = u->out[seq % UTP_RING];
+        nsacked++;
+        if (pkt->sacked)
+            continue;
+        pkt->sacked = 1;
+        if (pkt->counted) {
+            u->inflight -= UTP_HDRLEN + pkt->len;
+            pkt->counted = 0;
+        }
+        acked += UTP_HDRLEN + pkt->len;
+        if (pkt->nsent == 1)
+            rtt = now - pkt->t_sent;
+    }
+
+    if (rtt >= 0)
+        utp_rtt(u, rtt);
+    if (acked > 0 && delay != 0)
+        utp_ledbat(u, acked, delay, now);
+    if ((u->ndup >= 3 || nsacked >= 3) && u->seq_una != u->seq_next) {
+        pkt = u->out[u->seq_una % UTP_RING];
+        if (pkt->nsent == 1 && pkt->counted) {
+            utp_send_pkt(u, pkt, u->seq_una, now);
+            utp_lost(u, now);
+        }
+    }
+}
+
+/*
+ * Puts a received packet in the ring and moves what's now in order to
+ * the read queue. What arrives after the user is done is only acked.
+ */
+static void
+utp_on_data(struct utp *u, int type, uint16_t seq, const uint8_t *data,
+    size_t len)
+{
+    struct utp_pkt *pkt;
+    int d = seq_diff(seq, u->ack_nr + 1);
+
+    utp_want_ack(u);
+    if (d < 0 || d >= UTP_RING || u->in[seq % UTP_RING] != NULL)
+        return;
+    if (u->got_fin && seq_diff(seq, u->fin_seq) > 0)
+        return;
+    if ((pkt = malloc(sizeof(*pkt) + UTP_HDRLEN + len)) == NULL)
+        return;
+    if (type == ST_FIN) {
+        u->got_fin = 1;
+        u->fin_seq = seq;
+    }
+    pkt->len = len;
+    pkt->type = type;
+    bcopy(data, PKT_DATA(pkt), len);
+    u->in[seq % UTP_RING] = pkt;
+    u->rcv_bytes += len;
+
+    while ((pkt = u->in[(uint16_t)(u->ack_nr + 1) % UTP_RING]) != NULL) {
+        u->in[(uint16_t)(u->ack_nr + 1) % UTP_RING] = NULL;
+        u->ack_nr++;
+        if (pkt->len > 0 && !u->closed)
+            BTPDQ_INSERT_TAIL(&u->rcvq, pkt, entry);
+        else {
+            u->rcv_bytes -= pkt->len;
+            free(pkt);
+        }
+    }
+}
+
+static void
+utp_on_syn(struct utp_sock *s, const uint8_t *b, const struct sockaddr *sa,
+    socklen_t salen, uint64_t now)
+{
+    struct utp *u;
+    uint16_t id = dec_be16(b + 2);
+
+    // Our ack was lost if we already know the connection.
+    if ((u = utp_find(s, sa, id + 1)) != NULL) {
+        if (u->state != UTP_DEAD && u->err == 0)
+            utp_want_ack(u);
+        return;
+    }
+    if (s->accept_cb == NULL)
+        return;
+    if ((u = utp_new(s, sa, salen, id + 1, id)) == NULL)
+        return;
+    u->state = UTP_CONNECTED;
+    u->seq_nr = u->seq_next = u->seq_una = random();
+    u->ack_nr = dec_be16(b + 16);
+    u->reply_micro = (uint32_t)now - dec_be32(b + 4);
+    u->peer_wnd = dec_be32(b + 12);
+    utp_want_ack(u);
+    s->accept_cb(u, s->arg);
+}
+
+static void
+utp_input(struct utp_sock *s, const uint8_t *b, size_t len,
+    const struct sockaddr *sa, socklen_t salen, uint64_t now)
+{
+    struct utp *u;
+    const uint8_t *sack = NULL;
+    size_t off = UTP_HDRLEN, sacklen = 0;
+    struct utp_fwd *f;
+    int type, ext;
+    uint16_t id, seq, ack;
+
+    if (len < UTP_HDRLEN || (b[0] & 0xf) != UTP_VERSION
+        || (type = b[0] >> 4) > ST_SYN)
+        return;
+    for (ext = b[1]; ext != 0; ) {
+        if (off + 2 > len || off + 2 + b[off + 1] > len)
+            return;
+        if (ext == 1) {
+            sack = b + off + 2;
+            sacklen = b[off + 1];
+        }
+        ext = b[off];
+        off += 2 + b[off + 1];
+    }
+    id = dec_be16(b + 2);
+    seq = dec_be16(b + 16);
+    ack = dec_be16(b + 18);
+
+    if ((f = utp_fwd_find(s, sa, type, id)) != NULL) {
+        f->cb(b, len, sa, salen, f->arg);
+        evtimer_add(&f->timer, (& (struct timespec) { UTP_FWDIDLE, 0 }));
+        return;
+    }
+    if (type == ST_SYN) {
+        utp_on_syn(s, b, sa, salen, now);
+        return;
+    }
+    u = type == ST_RESET ? utp_find_reset(s, sa, id) : utp_find(s, sa, id);
+    if (u == NULL) {
+        if (type != ST_RESET)
+            utp_send_reset(s, sa, salen, id, seq);
+        return;
+    }
+    if (u->state == UTP_DEAD || u->err != 0)
+        return;
+    u->reply_micro = (uint32_t)now - dec_be32(b + 4);
+    u->peer_wnd = dec_be32(b + 12);
+
+    if (type == ST_RESET) {
+        utp_fail(u, u->state == UTP_SYN_SENT ? ECONNREFUSED : ECONNRESET);
+        return;
+    }
+    if (u->state == UTP_SYN_SENT) {
+        if (type != ST_STATE)
+            return;
+        u->state = UTP_CONNECTED;
+        u->ack_nr = seq - 1;
+    }
+    utp_on_ack(u, ack, sack, sacklen, dec_be32(b + 8),
+        type == ST_STATE && off == len, now);
+    // Everything, our FIN included, has been delivered.
+    if (u->closed && u->seq_una == u->seq_nr) {
+        utp_free(u);
+        return;
+    }
+    if (type == ST_DATA || type == ST_FIN)
+        utp_on_data(u, type, seq, b + off, len - off);
+    utp_flush(u);
+    utp_notify(u);
+}
+
+static void
+utp_sock_cb(int sd, short type, void *arg)
+{
+    struct utp_sock *s = arg;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    ssize_t len;
+    struct utp *u;
+
+    for (int i = 0; i < UTP_RECVMAX; i++) {
+        addrlen = sizeof(addr);
+        len = recvfrom(sd, s->buf, sizeof(s->buf), 0,
+            (struct sockaddr *)&addr, &addrlen);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            continue;
+        }
+        utp_input(s, s->buf, len, (struct sockaddr *)&addr, addrlen,
+            utp_now());
+    }
+    // One ack covers everything a connection got in the batch.
+    while ((u = BTPDQ_FIRST(&s->ackq)) != NULL)
+        utp_send_state(u);
+}
+
+/*
+ * A fed sock acks once the event loop is done with what it was given.
+ */
+static void
+utp_ack_cb(int fd, short type, void *arg)
+{
+    struct utp_sock *s = arg;
+    struct utp *u;
+    while ((u = BTPDQ_FIRST(&s->ackq)) != NULL)
+        utp_send_state(u);
+}
+
+void
+utp_sock_input(struct utp_sock *s, const uint8_t *buf, size_t len,
+    const struct sockaddr *sa, socklen_t salen)
+{
+    utp_input(s, buf, len, sa, salen, utp_now());
+    if (!BTPDQ_EMPTY(&s->ackq))
+        evtimer_add(&s->ack_timer, (& (struct timespec) { 0, 0 }));
+}
+
+/*
+ * Sends the packet at the head of the ring again when no ack has come in
+ * time. The window then starts over from a single packet, and the packets
+ * after it are sent again as the acks come in.
+ */
+static void
+utp_timer_cb(int fd, short type, void *arg)
+{
+    struct utp *u = arg;
+    int retries = u->state == UTP_SYN_SENT ? UTP_SYNRETRIES : UTP_RETRIES;
+
+    if (u->state == UTP_DEAD) {
+        utp_free(u);
+        return;
+    }
+    if (u->seq_una == u->seq_next)
+        return;
+    if (++u->nretries > retries) {
+        utp_fail(u, u->state == UTP_SYN_SENT ? ECONNREFUSED : ETIMEDOUT);
+        return;
+    }
+    for (uint16_t seq = u->seq_una; seq != u->seq_next; seq++)
+        u->out[seq % UTP_RING]->counted = 0;
+    u->inflight = 0;
+    u->seq_next = u->seq_una;
+    u->cwnd = UTP_MINWND;
+    u->slow_start = 0;
+    u->rto = min(u->rto * 2, UTP_MAXRTO);
+    utp_flush(u);
+}
+
+static struct utp *
+utp_new(struct utp_sock *s, const struct sockaddr *sa, socklen_t salen,
+    uint16_t id_recv, uint16_t id_send)
+{
+    struct utp *u = calloc(1, sizeof(*u));
+    if (u == NULL)
+        return NULL;
+    u->s = s;
+    bcopy(sa, &u->addr, salen);
+    u->addrlen = salen;
+    u->id_recv = id_recv;
+    u->id_send = id_send;
+    u->cwnd = 2 * UTP_PKTSIZE;
+    u->peer_wnd = UTP_RCVBUF;
+    u->slow_start = 1;
+    u->rtt = -1;
+    u->rto = 1000;
+    BTPDQ_INIT(&u->rcvq);
+    evtimer_init(&u->timer, utp_timer_cb, u);
+    BTPDQ_INSERT_TAIL(&s->conns[id_recv % UTP_NBUCKETS], u, entry);
+    return u;
+}
+
+static void
+utp_free(struct utp *u)
+{
+    struct utp_sock *s = u->s;
+    struct utp_pkt *pkt;
+
+    BTPDQ_REMOVE(&s->conns[u->id_recv % UTP_NBUCKETS], u, entry);
+    if (u->queued)
+        BTPDQ_REMOVE(&s->readyq, u, rd_entry);
+    utp_acked(u);
+    evtimer_del(&u->timer);
+    for (uint16_t seq = u->seq_una; seq != u->seq_nr; seq++)
+        free(u->out[seq % UTP_RING]);
+    for (int i = 0; i < UTP_RING; i++)
+        free(u->in[i]);
+    while ((pkt = BTPDQ_FIRST(&u->rcvq)) != NULL) {
+        BTPDQ_REMOVE(&u->rcvq, pkt, entry);
+        free(pkt);
+    }
+    free(u);
+}
+
+struct utp *
+utp_connect(struct utp_sock *s, const struct sockaddr *sa, socklen_t salen)
+{
+    struct utp *u;
+    uint16_t id;
+
+    do
+        id = random();
+    while (utp_find(s, sa, id) != NULL);
+    if ((u = utp_new(s, sa, salen, id, id + 1)) == NULL)
+        return NULL;
+    u->state = UTP_SYN_SENT;
+    u->seq_nr = u->seq_next = u->seq_una = 1;
+    if (utp_queue(u, ST_SYN) == NULL) {
+        utp_free(u);
+        errno = ENOMEM;
+        return NULL;
+    }
+    utp_flush(u);
+    return u;
+}
+
+void
+utp_set_cb(struct utp *u, evloop_cb_t cb, void *arg)
+{
+    u->cb = cb;
+    u->arg = arg;
+    utp_notify(u);
+}
+
+void
+utp_enable(struct utp *u, uint16_t flags)
+{
+    u->flags |= flags;
+    utp_notify(u);
+}
+
+void
+utp_disable(struct utp *u, uint16_t flags)
+{
+    u->flags &= ~flags;
+}
+
+ssize_t
+utp_read(struct utp *u, void *buf, size_t len)
+{
+    struct utp_pkt *pkt;
+    size_t n = 0;
+
+    while (n < len && (pkt = BTPDQ_FIRST(&u->rcvq)) != NULL) {
+        size_t m = min(len - n, pkt->len - u->rcv_off);
+        bcopy(PKT_DATA(pkt) + u->rcv_off, (char *)buf + n, m);
+        n += m;
+        u->rcv_off += m;
+        if (u->rcv_off == pkt->len) {
+            BTPDQ_REMOVE(&u->rcvq, pkt, entry);
+            free(pkt);
+            u->rcv_off = 0;
+        }
+    }
+    u->rcv_bytes -= n;
+    if (n > 0) {
+        // Let a sender held back by the window know it has opened.
+        if (u->adv_wnd < UTP_RCVBUF / 4 && utp_wnd(u) >= UTP_RCVBUF / 2)
+            utp_send_state(u);
+        return n;
+    } else if (u->err != 0) {
+        errno = u->err;
+        return -1;
+    } else if (utp_eof(u))
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Copies what fits in the send buffer into packets, topping up the last
+ * one if it hasn't been sent yet, and sends what the window allows.
+ */
+ssize_t
+utp_writev(struct utp *u, const struct iovec *iov, int niov)
+{
+    struct utp_pkt *pkt;
+    size_t n = 0;
+
+    if (u->err != 0) {
+        errno = u->err;
+        return -1;
+    }
+    for (int i = 0; i < niov; i++) {
+        const char *buf = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            pkt = NULL;
+            if (u->seq_next != u->seq_nr) {
+                pkt = u->out[(uint16_t)(u->seq_nr - 1) % UTP_RING];
+                if (pkt->type != ST_DATA || pkt->nsent > 0
+                    || pkt->len == UTP_MSS)
+                    pkt = NULL;
+            }
+            if (pkt == NULL && (!utp_writable(u)
+                    || (pkt = utp_queue(u, ST_DATA)) == NULL))
+                goto out;
+            size_t m = min(left, UTP_MSS - pkt->len);
+            bcopy(buf, PKT_DATA(pkt) + pkt->len, m);
+            pkt->len += m;
+            buf += m;
+            left -= m;
+            n += m;
+        }
+    }
+out:
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    utp_flush(u);
+    return n;
+}
+
+int
+utp_peername(struct utp *u, struct sockaddr *sa, socklen_t *salen)
+{
+    bcopy(&u->addr, sa, min(*salen, u->addrlen));
+    *salen = u->addrlen;
+    return 0;
+}
+
+/*
+ * Sends a FIN after what has been written. The connection is freed once
+ * the FIN has been acked, or the peer stops answering.
+ */
+void
+utp_close(struct utp *u)
+{
+    struct utp_pkt *pkt;
+
+    if (u->queued) {
+        BTPDQ_REMOVE(&u->s->readyq, u, rd_entry);
+        u->queued = 0;
+    }
+    u->cb = NULL;
+    u->flags = 0;
+    u->closed = 1;
+    while ((pkt = BTPDQ_FIRST(&u->rcvq)) != NULL) {
+        BTPDQ_REMOVE(&u->rcvq, pkt, entry);
+        u->rcv_bytes -= pkt->len;
+        free(pkt);
+    }
+    u->rcv_bytes += u->rcv_off;
+    u->rcv_off = 0;
+    // It's freed from its timer, as the user may be in a callback.
+    if (u->err != 0 || u->state != UTP_CONNECTED
+        || utp_queue(u, ST_FIN) == NULL) {
+        u->state = UTP_DEAD;
+        utp_timer_set(u, 0);
+        return;
+    }
+    utp_flush(u);
+}
+
+static void
+utp_fwd_free(struct utp_fwd *f)
+{
+    BTPDQ_REMOVE(&f->s->fwds[f->id_recv % UTP_NBUCKETS], f, entry);
+    evtimer_del(&f->timer);
+    free(f);
+}
+
+static void
+utp_fwd_timer_cb(int fd, short type, void *arg)
+{
+    utp_fwd_free(arg);
+}
+
+/*
+ * Takes the connection off its sock, which forwards what comes for it to
+ * cb from now on. Fails only for lack of memory.
+ */
+int
+utp_move(struct utp *u, utp_fwd_cb_t cb, void *arg)
+{
+    struct utp_sock *s = u->s;
+    struct utp_fwd *f = calloc(1, sizeof(*f));
+    if (f == NULL)
+        return -1;
+    f->s = s;
+    bcopy(&u->addr, &f->addr, u->addrlen);
+    f->id_recv = u->id_recv;
+    f->id_send = u->id_send;
+    f->cb = cb;
+    f->arg = arg;
+    evtimer_init(&f->timer, utp_fwd_timer_cb, f);
+    evtimer_add(&f->timer, (& (struct timespec) { UTP_FWDIDLE, 0 }));
+    BTPDQ_INSERT_TAIL(&s->fwds[f->id_recv % UTP_NBUCKETS], f, entry);
+
+    if (u->need_ack)
+        utp_send_state(u);
+    if (u->queued) {
+        BTPDQ_REMOVE(&s->readyq, u, rd_entry);
+        u->queued = 0;
+    }
+    BTPDQ_REMOVE(&s->conns[u->id_recv % UTP_NBUCKETS], u, entry);
+    evtimer_del(&u->timer);
+    u->cb = NULL;
+    u->flags = 0;
+    u->s = NULL;
+    return 0;
+}
+
+void
+utp_adopt(struct utp_sock *s, struct utp *u)
+{
+    u->s = s;
+    BTPDQ_INSERT_TAIL(&s->conns[u->id_recv % UTP_NBUCKETS], u, entry);
+    evtimer_init(&u->timer, utp_timer_cb, u);
+    if (u->seq_una != u->seq_next)
+        utp_timer_set(u, u->rto);
+}
+
+static struct utp_sock *
+utp_sock_alloc(int sd, utp_accept_cb_t cb, void *arg)
+{
+    struct utp_sock *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+    s->sd = sd;
+    s->accept_cb = cb;
+    s->arg = arg;
+    for (int i = 0; i < UTP_NBUCKETS; i++) {
+        BTPDQ_INIT(&s->conns[i]);
+        BTPDQ_INIT(&s->fwds[i]);
+    }
+    BTPDQ_INIT(&s->readyq);
+    BTPDQ_INIT(&s->ackq);
+    evtimer_init(&s->ready_timer, utp_ready_cb, s);
+    evtimer_init(&s->ack_timer, utp_ack_cb, s);
+    return s;
+}
+
+struct utp_sock *
+utp_sock_fed(int sd)
+{
+    struct utp_sock *s = utp_sock_alloc(sd, NULL, NULL);
+    if (s != NULL)
+        s->fed = 1;
+    return s;
+}
+
+struct utp_sock *
+utp_sock_new(int sd, utp_accept_cb_t cb, void *arg)
+{
+    int size = UTP_SOCKBUF;
+    struct utp_sock *s = utp_sock_alloc(sd, cb, arg);
+    if (s == NULL)
+        return NULL;
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (fdev_new(&s->ev, sd, EV_READ, utp_sock_cb, s) != 0) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void
+utp_sock_free(struct utp_sock *s)
+{
+    struct utp *u;
+    struct utp_fwd *f;
+    for (int i = 0; i < UTP_NBUCKETS; i++) {
+        while ((u = BTPDQ_FIRST(&s->conns[i])) != NULL)
+            utp_free(u);
+        while ((f = BTPDQ_FIRST(&s->fwds[i])) != NULL)
+            utp_fwd_free(f);
+    }
+    evtimer_del(&s->ready_timer);
+    evtimer_del(&s->ack_timer);
+    if (!s->fed)
+        fdev_del(&s->ev);
+    free(s);
+}
@@ -0,0 +1,65 @@
+#ifndef BTPD_UTP_H
+#define BTPD_UTP_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "evloop.h"
+
+/*
+ * The micro transport protocol of BEP 29, a byte stream over UDP. Its
+ * congestion control, LEDBAT, aims to add no more than a target delay to
+ * the path and backs off as soon as other traffic makes the queues grow,
+ * so it gives way to that traffic instead of competing with it.
+ *
+ * A utp_sock holds a bound UDP socket and the connections made over it.
+ * A connection is used like a non blocking socket watched by an fdev. Its
+ * callback is called with EV_READ or EV_WRITE while it's readable or
+ * writable and that is enabled, and utp_read and utp_writev work like
+ * read and writev. A connection that failed is both readable and
+ * writable, and both then fail with the error.
+ *
+ * The callbacks are only called from the event loop, never from within
+ * the utp functions. After utp_close the connection mustn't be used, but
+ * it's kept until what was written has been delivered.
+ */
+
+struct utp_sock;
+struct utp;
+
+typedef void (*utp_accept_cb_t)(struct utp *u, void *arg);
+typedef void (*utp_fwd_cb_t)(const uint8_t *buf, size_t len,
+    const struct sockaddr *sa, socklen_t salen, void *arg);
+
+/*
+ * Connections from other hosts are given to cb, unless it's NULL. Returns
+ * NULL and sets errno on failure.
+ */
+struct utp_sock *utp_sock_new(int sd, utp_accept_cb_t cb, void *arg);
+void utp_sock_free(struct utp_sock *s);
+
+/*
+ * A connection can be moved to a utp_sock on another thread that sends on
+ * the same UDP socket, but isn't watching it. Such a sock is made with
+ * utp_sock_fed and given the connection with utp_adopt. The sock the
+ * connection leaves gives what it receives for it to cb, which must get
+ * it to utp_sock_input on the new sock. The connection mustn't be used in
+ * between, nor moved once it's been closed.
+ */
+struct utp_sock *utp_sock_fed(int sd);
+void utp_sock_input(struct utp_sock *s, const uint8_t *buf, size_t len,
+    const struct sockaddr *sa, socklen_t salen);
+int utp_move(struct utp *u, utp_fwd_cb_t cb, void *arg);
+void utp_adopt(struct utp_sock *s, struct utp *u);
+
+struct utp *utp_connect(struct utp_sock *s, const struct sockaddr *sa,
+    socklen_t salen);
+void utp_set_cb(struct utp *u, evloop_cb_t cb, void *arg);
+void utp_enable(struct utp *u, uint16_t flags);
+void utp_disable(struct utp *u, uint16_t flags);
+ssize_t utp_read(struct utp *u, void *buf, size_t len);
+ssize_t utp_writev(struct utp *u, const struct iovec *iov, int niov);
+int utp_peername(struct utp *u, struct sockaddr *sa, socklen_t *salen);
+void utp_close(struct utp *u);
+
+#endif